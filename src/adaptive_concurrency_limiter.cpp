@@ -0,0 +1,136 @@
+#include "adaptive_concurrency_limiter.h"
+#include <algorithm>
+#include <cmath>
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteLimiterLog(void* limiter_identifier) {
+    return Log() << "ConcurrencyLimiter(" << limiter_identifier << "): ";
+}
+
+
+AdaptiveConcurrencyLimiter::AdaptiveConcurrencyLimiter() :
+    eviction_time_(std::chrono::steady_clock::now()) {
+
+}
+
+
+AdaptiveConcurrencyLimiter::AdaptiveConcurrencyLimiter(const Options& options) :
+    options_(options),
+    eviction_time_(std::chrono::steady_clock::now()) {
+
+}
+
+
+std::size_t AdaptiveConcurrencyLimiter::GetLimit(const std::string& host) const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    double limit = options_.initial_limit;
+
+    auto iterator = host_states_.find(host);
+    if (iterator != host_states_.end()) {
+        limit = iterator->second.limit;
+    }
+
+    return static_cast<std::size_t>(std::max(limit, 1.0));
+}
+
+
+void AdaptiveConcurrencyLimiter::AddSample(const std::string& host,
+                                           std::chrono::steady_clock::time_point start_time,
+                                           std::chrono::microseconds latency,
+                                           bool is_failed,
+                                           std::size_t running_count) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto now = std::chrono::steady_clock::now();
+    RemoveIdleHosts(now);
+
+    auto iterator = host_states_.find(host);
+    if (iterator == host_states_.end()) {
+        HostState host_state;
+        host_state.limit = options_.initial_limit;
+        iterator = host_states_.insert(std::make_pair(host, host_state)).first;
+    }
+
+    HostState& host_state = iterator->second;
+    host_state.sample_time = now;
+    double old_limit = host_state.limit;
+
+    if (is_failed) {
+
+        //Connections running when the limit was cut likely fail for the same overload.
+        if (start_time < host_state.backoff_time) {
+            return;
+        }
+
+        host_state.limit = std::max(host_state.limit * options_.backoff_ratio, options_.min_limit);
+        host_state.backoff_time = now;
+        WriteLimiterLog(this) << "Limit of " << host << " backs off from " << old_limit << " to " << host_state.limit << '.';
+        return;
+    }
+
+    double sample_latency = static_cast<double>(latency.count());
+    if (sample_latency <= 0) {
+        return;
+    }
+
+    if (host_state.long_latency == 0) {
+        host_state.long_latency = sample_latency;
+    }
+    else {
+        double factor = 2.0 / (options_.long_window + 1);
+        host_state.long_latency = host_state.long_latency * (1 - factor) + sample_latency * factor;
+    }
+
+    //Decay the long-term latency if it is far above the recent latency, so that the limit can
+    //recover quickly after the upstream's latency drops, such as after scaling out.
+    if (host_state.long_latency > sample_latency * 2) {
+        host_state.long_latency *= 0.95;
+    }
+
+    //Don't grow the limit while it is far from being reached, since the latency says nothing
+    //about a higher concurrency then.
+    if (static_cast<double>(running_count) < host_state.limit / 2) {
+        return;
+    }
+
+    double gradient = options_.latency_tolerance * host_state.long_latency / sample_latency;
+    gradient = std::max(0.5, std::min(1.0, gradient));
+
+    //Allow a small queue, which grows with the limit, to probe for a higher concurrency.
+    double queue_size = std::sqrt(host_state.limit);
+    double new_limit = host_state.limit * gradient + queue_size;
+
+    new_limit = host_state.limit * (1 - options_.smoothing) + new_limit * options_.smoothing;
+    host_state.limit = std::max(options_.min_limit, std::min(options_.max_limit, new_limit));
+
+    WriteLimiterLog(this) << "Limit of " << host << " changes from " << old_limit << " to " << host_state.limit << '.';
+}
+
+
+void AdaptiveConcurrencyLimiter::RemoveIdleHosts(std::chrono::steady_clock::time_point now) {
+
+    //Scan at most once per idle duration, a host is dropped within twice the duration.
+    if (now - eviction_time_ < options_.idle_duration) {
+        return;
+    }
+    eviction_time_ = now;
+
+    auto iterator = host_states_.begin();
+    while (iterator != host_states_.end()) {
+
+        if (now - iterator->second.sample_time >= options_.idle_duration) {
+            WriteLimiterLog(this) << "State of " << iterator->first << " is dropped since it is idle.";
+            iterator = host_states_.erase(iterator);
+        }
+        else {
+            ++iterator;
+        }
+    }
+}
+
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace curlion {
+
+/**
+ AdaptiveConcurrencyLimiter tunes the limit of running connections to each host, from observed
+ latency and errors.
+
+ The limit of a host follows the gradient between its long-term latency and the latest latency:
+ while the latency keeps near the long-term level, the limit grows; once the latency rises because
+ of queueing in the upstream, the limit shrinks proportionally. In addition, the limit is cut
+ multiplicatively on failed connections, in the manner of AIMD. It is cut at most once per window:
+ failures of connections started before the last cut are ignored, so that a burst of concurrent
+ failures doesn't collapse the limit. The latency is measured from sending the request to
+ receiving the first byte of the response, excluding connection setup.
+
+ The state of a host without samples for a while is dropped, and the host starts over with the
+ initial limit.
+
+ Install the limiter to a ConnectionManager with ConnectionManager::SetConcurrencyLimiter. Use it
+ along with, or instead of, the static ConnectionManager::SetMaxRunningConnectionCountPerHost.
+
+ This class is thread safe, so a single limiter can be shared by multiple ConnectionManager
+ instances connecting to the same upstreams.
+ */
+class AdaptiveConcurrencyLimiter {
+public:
+    /**
+     Options of the limiter.
+     */
+    class Options {
+    public:
+        /**
+         The limit of a host before any connection to it finishes.
+         */
+        double initial_limit = 20;
+
+        /**
+         The lower bound of limits.
+         */
+        double min_limit = 1;
+
+        /**
+         The upper bound of limits.
+         */
+        double max_limit = 1000;
+
+        /**
+         How much the latency may rise above the long-term latency before the limit shrinks, as
+         a ratio. Must be at least 1.
+         */
+        double latency_tolerance = 1.5;
+
+        /**
+         How fast the limit moves toward the computed limit, between 0 and 1.
+         */
+        double smoothing = 0.2;
+
+        /**
+         The ratio the limit is multiplied by on a failed connection, between 0 and 1.
+         */
+        double backoff_ratio = 0.9;
+
+        /**
+         The number of samples the long-term latency is averaged over.
+         */
+        std::size_t long_window = 600;
+
+        /**
+         How long the state of a host is kept without samples.
+         */
+        std::chrono::milliseconds idle_duration{ 600000 };
+    };
+
+public:
+    /**
+     Construct the AdaptiveConcurrencyLimiter instance with default options.
+     */
+    AdaptiveConcurrencyLimiter();
+
+    /**
+     Construct the AdaptiveConcurrencyLimiter instance with specified options.
+     */
+    explicit AdaptiveConcurrencyLimiter(const Options& options);
+
+    /**
+     Get the current limit of running connections to a host.
+
+     @param host
+         The host, in HOST:PORT format.
+     */
+    std::size_t GetLimit(const std::string& host) const;
+
+    /**
+     Add a sample of a finished connection.
+
+     @param host
+         The host, in HOST:PORT format.
+
+     @param start_time
+         When the connection started. A failure of a connection started before the limit was
+         last cut is ignored, since that cut already accounts for the overload it saw.
+
+     @param latency
+         Time from sending the request to receiving the first byte of the response. Ignored if the
+         connection failed.
+
+     @param is_failed
+         Whether the connection failed, such as timed out, or responded with a status indicating
+         that the upstream is overloaded.
+
+     @param running_count
+         The number of running connections to the host when the connection finished, including
+         itself. The limit doesn't grow if it is far from being reached.
+
+     ConnectionManager calls this method when a connection finishes.
+     */
+    void AddSample(const std::string& host,
+                   std::chrono::steady_clock::time_point start_time,
+                   std::chrono::microseconds latency,
+                   bool is_failed,
+                   std::size_t running_count);
+
+private:
+    class HostState {
+    public:
+        double limit = 0;
+        double long_latency = 0;
+        std::chrono::steady_clock::time_point backoff_time;
+        std::chrono::steady_clock::time_point sample_time;
+    };
+
+private:
+    void RemoveIdleHosts(std::chrono::steady_clock::time_point now);
+
+private:
+    AdaptiveConcurrencyLimiter(const AdaptiveConcurrencyLimiter&) = delete;
+    AdaptiveConcurrencyLimiter& operator=(const AdaptiveConcurrencyLimiter&) = delete;
+
+private:
+    Options options_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, HostState> host_states_;
+    std::chrono::steady_clock::time_point eviction_time_;
+};
+
+}
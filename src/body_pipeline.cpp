@@ -0,0 +1,175 @@
+#include "body_pipeline.h"
+
+namespace curlion {
+
+//Passes the output of a stage to the next stage, or to the final sink after the last stage.
+//It lives on the stack during a write, so that passing a piece of body through stages allocates
+//nothing.
+class BodyPipeline::StageSink : public BodySink {
+public:
+    StageSink(BodyPipeline& pipeline, std::size_t index, BodySink& final_sink) :
+        pipeline_(pipeline),
+        index_(index),
+        final_sink_(final_sink) { }
+
+    bool Write(const char* data, std::size_t length) override {
+
+        if (index_ >= pipeline_.stages_.size()) {
+            return final_sink_.Write(data, length);
+        }
+
+        StageSink next(pipeline_, index_ + 1, final_sink_);
+        return pipeline_.stages_[index_]->Write(data, length, next);
+    }
+
+private:
+    BodyPipeline& pipeline_;
+    std::size_t index_;
+    BodySink& final_sink_;
+};
+
+
+void BodyPipeline::Reset() {
+
+    for (const auto& each_stage : stages_) {
+        each_stage->Reset();
+    }
+    is_ended_ = false;
+}
+
+
+bool BodyPipeline::Write(const char* data, std::size_t length, BodySink& sink) {
+
+    if (is_ended_) {
+        return false;
+    }
+
+    if (length == 0) {
+        return true;
+    }
+
+    StageSink first(*this, 0, sink);
+    return first.Write(data, length);
+}
+
+
+bool BodyPipeline::End(BodySink& sink) {
+
+    if (is_ended_) {
+        return false;
+    }
+    is_ended_ = true;
+
+    //A stage may write remaining output when it ends, which passes through the following stages
+    //before they end.
+    for (std::size_t index = 0; index < stages_.size(); ++index) {
+
+        StageSink next(*this, index + 1, sink);
+        if (! stages_[index]->End(next)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+HashStage::HashStage(Algorithm algorithm) : algorithm_(algorithm), crc32c_(0) {
+
+}
+
+
+std::string HashStage::GetHexDigest() const {
+
+    static const char kHexDigits[] = "0123456789abcdef";
+
+    std::string hex_digest;
+    hex_digest.reserve(digest_.length() * 2);
+    for (char each_byte : digest_) {
+        unsigned char byte = static_cast<unsigned char>(each_byte);
+        hex_digest.append(1, kHexDigits[byte >> 4]);
+        hex_digest.append(1, kHexDigits[byte & 0xF]);
+    }
+    return hex_digest;
+}
+
+
+bool HashStage::IsMatched() const {
+
+    if (expected_digest_.empty()) {
+        return true;
+    }
+    return digest_ == expected_digest_;
+}
+
+
+void HashStage::Reset() {
+
+    digest_.clear();
+    crc32c_ = 0;
+    sha256_.Reset();
+}
+
+
+bool HashStage::Write(const char* data, std::size_t length, BodySink& next) {
+
+    if (algorithm_ == Algorithm::Crc32c) {
+        crc32c_ = Crc32c(data, length, crc32c_);
+    }
+    else {
+        sha256_.Update(data, length);
+    }
+
+    return next.Write(data, length);
+}
+
+
+bool HashStage::End(BodySink&) {
+
+    if (algorithm_ == Algorithm::Crc32c) {
+        digest_.assign(4, '\0');
+        for (std::size_t index = 0; index < 4; ++index) {
+            digest_[index] = static_cast<char>(crc32c_ >> (24 - index * 8));
+        }
+    }
+    else {
+        digest_ = sha256_.Finish();
+    }
+
+    return IsMatched();
+}
+
+
+bool TeeStage::Write(const char* data, std::size_t length, BodySink& next) {
+
+    for (const auto& each_sink : sinks_) {
+        if (! each_sink(data, length)) {
+            return false;
+        }
+    }
+
+    return next.Write(data, length);
+}
+
+
+void TransformStage::Reset() {
+
+    if (reset_callback_ != nullptr) {
+        reset_callback_();
+    }
+}
+
+
+bool TransformStage::Write(const char* data, std::size_t length, BodySink& next) {
+    return write_callback_(data, length, next);
+}
+
+
+bool TransformStage::End(BodySink& next) {
+
+    if (end_callback_ != nullptr) {
+        return end_callback_(next);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "checksum.h"
+
+namespace curlion {
+
+/**
+ BodySink receives the output of a body stage.
+ */
+class BodySink {
+public:
+    /**
+     Destruct the BodySink instance.
+     */
+    virtual ~BodySink() { }
+
+    /**
+     Write a piece of body.
+
+     @return
+         Whether the write is succeeded. Return false to abort the transfer.
+     */
+    virtual bool Write(const char* data, std::size_t length) = 0;
+};
+
+/**
+ BodyStage processes a body piece by piece, as a stage of BodyPipeline.
+
+ A stage writes its output to the next sink, which is the next stage or the final destination of
+ the body. A stage which doesn't change the body should write the same pointer it receives, so
+ that the body is not copied.
+ */
+class BodyStage {
+public:
+    /**
+     Destruct the BodyStage instance.
+     */
+    virtual ~BodyStage() { }
+
+    /**
+     Reset the stage to process a new body.
+
+     This method is called when the connection starts or restarts. The default implementation does
+     nothing.
+     */
+    virtual void Reset() { }
+
+    /**
+     Process a piece of body.
+
+     @return
+         Whether the processing is succeeded. Return false to abort the transfer.
+     */
+    virtual bool Write(const char* data, std::size_t length, BodySink& next) = 0;
+
+    /**
+     Called after the whole body is written, to write any remaining output.
+
+     @return
+         Whether the body is processed successfully. Return false to fail the transfer.
+
+     The default implementation returns true.
+     */
+    virtual bool End(BodySink&) {
+        return true;
+    }
+};
+
+/**
+ BodyPipeline is a chain of body stages, through which a body streams while it is transferred.
+
+ Use Connection::SetResponseBodyPipeline and Connection::SetRequestBodyPipeline to attach a
+ pipeline to a connection. Each piece of body is passed through all stages by one call, without
+ being buffered between stages.
+
+ A pipeline and its stages hold the states of one body, so they should not be attached to
+ connections running at the same time.
+ */
+class BodyPipeline {
+public:
+    /**
+     Construct the BodyPipeline instance.
+     */
+    BodyPipeline() : is_ended_(false) { }
+
+    /**
+     Add a stage to the end of the pipeline.
+     */
+    void AddStage(const std::shared_ptr<BodyStage>& stage) {
+        if (stage != nullptr) {
+            stages_.push_back(stage);
+        }
+    }
+
+    /**
+     Get the stages.
+     */
+    const std::vector<std::shared_ptr<BodyStage>>& GetStages() const {
+        return stages_;
+    }
+
+    /**
+     Reset all stages to process a new body.
+     */
+    void Reset();
+
+    /**
+     Pass a piece of body through all stages, and write the output to sink.
+     */
+    bool Write(const char* data, std::size_t length, BodySink& sink);
+
+    /**
+     End all stages in order, and write their remaining output to sink.
+
+     Further writes fail until the pipeline is reset.
+     */
+    bool End(BodySink& sink);
+
+    /**
+     Get whether the pipeline is ended.
+     */
+    bool IsEnded() const {
+        return is_ended_;
+    }
+
+private:
+    class StageSink;
+
+private:
+    BodyPipeline(const BodyPipeline&) = delete;
+    BodyPipeline& operator=(const BodyPipeline&) = delete;
+
+private:
+    std::vector<std::shared_ptr<BodyStage>> stages_;
+    bool is_ended_;
+};
+
+/**
+ HashStage computes the digest of a body while passing it through, and optionally verifies the
+ digest against an expected one.
+ */
+class HashStage : public BodyStage {
+public:
+    /**
+     Hash algorithm.
+     */
+    enum class Algorithm {
+
+        /**
+         CRC-32C, the digest is 4 bytes in big endian order, as used in x-goog-hash and
+         x-amz-checksum-crc32c headers.
+         */
+        Crc32c,
+
+        /**
+         SHA-256, the digest is 32 bytes.
+         */
+        Sha256,
+    };
+
+public:
+    /**
+     Construct the HashStage instance.
+     */
+    explicit HashStage(Algorithm algorithm);
+
+    /**
+     Get the algorithm.
+     */
+    Algorithm GetAlgorithm() const {
+        return algorithm_;
+    }
+
+    /**
+     Set the expected digest in raw bytes.
+
+     If the expected digest is not empty, End fails when the digest of the body doesn't match it,
+     so that the transfer fails with CURLE_WRITE_ERROR. The default is empty.
+     */
+    void SetExpectedDigest(const std::string& digest) {
+        expected_digest_ = digest;
+    }
+
+    /**
+     Get the expected digest.
+     */
+    const std::string& GetExpectedDigest() const {
+        return expected_digest_;
+    }
+
+    /**
+     Get the digest in raw bytes.
+
+     Empty string is returned if the stage is not yet ended.
+     */
+    const std::string& GetDigest() const {
+        return digest_;
+    }
+
+    /**
+     Get the digest in lower case hexadecimal.
+     */
+    std::string GetHexDigest() const;
+
+    /**
+     Get whether the digest matches the expected digest.
+
+     Return true if there is no expected digest, and false if the stage is not yet ended.
+     */
+    bool IsMatched() const;
+
+    void Reset() override;
+    bool Write(const char* data, std::size_t length, BodySink& next) override;
+    bool End(BodySink& next) override;
+
+private:
+    Algorithm algorithm_;
+    std::string expected_digest_;
+    std::string digest_;
+    std::uint32_t crc32c_;
+    Sha256 sha256_;
+};
+
+/**
+ TeeStage passes a body through, and writes it to additional sinks at the same time, such as
+ writing a download to a file while parsing it.
+ */
+class TeeStage : public BodyStage {
+public:
+    /**
+     Callback prototype of additional sinks.
+
+     @param data
+         A piece of body.
+
+     @param length
+         Length of data.
+
+     @return
+         Whether the write is succeeded. Return false to abort the transfer.
+     */
+    typedef std::function<bool(const char* data, std::size_t length)> Sink;
+
+public:
+    /**
+     Add a sink. Sinks are written in the order they are added, before the next stage.
+     */
+    void AddSink(const Sink& sink) {
+        if (sink != nullptr) {
+            sinks_.push_back(sink);
+        }
+    }
+
+    bool Write(const char* data, std::size_t length, BodySink& next) override;
+
+private:
+    std::vector<Sink> sinks_;
+};
+
+/**
+ TransformStage transforms a body by callbacks.
+ */
+class TransformStage : public BodyStage {
+public:
+    /**
+     Callback prototype of transforming a piece of body.
+
+     @param data
+         A piece of body.
+
+     @param length
+         Length of data.
+
+     @param next
+         Sink to write the transformed body to.
+
+     @return
+         Whether the transform is succeeded. Return false to abort the transfer.
+     */
+    typedef std::function<bool(const char* data, std::size_t length, BodySink& next)> WriteCallback;
+
+    /**
+     Callback prototype of ending the body, to write any remaining output to next.
+     */
+    typedef std::function<bool(BodySink& next)> EndCallback;
+
+    /**
+     Callback prototype of resetting the transform to process a new body.
+     */
+    typedef std::function<void()> ResetCallback;
+
+public:
+    /**
+     Construct the TransformStage instance.
+
+     @param write_callback
+         The callback to transform each piece of body, must be callable.
+
+     @param end_callback
+         The callback to end the body, can be nullptr.
+
+     @param reset_callback
+         The callback to reset the transform, can be nullptr.
+     */
+    TransformStage(const WriteCallback& write_callback,
+                   const EndCallback& end_callback = nullptr,
+                   const ResetCallback& reset_callback = nullptr) :
+        write_callback_(write_callback),
+        end_callback_(end_callback),
+        reset_callback_(reset_callback) { }
+
+    void Reset() override;
+    bool Write(const char* data, std::size_t length, BodySink& next) override;
+    bool End(BodySink& next) override;
+
+private:
+    WriteCallback write_callback_;
+    EndCallback end_callback_;
+    ResetCallback reset_callback_;
+};
+
+}
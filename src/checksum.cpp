@@ -0,0 +1,417 @@
+#include "checksum.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CURLION_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CURLION_CRC32C_ARMV8 1
+#include <arm_acle.h>
+#endif
+
+namespace curlion {
+
+//Reflected polynomial of CRC-32C.
+static const std::uint32_t Crc32cPolynomial = 0x82F63B78;
+
+//Tables for slicing-by-8, table[n][byte] is the CRC of byte followed by n zero bytes.
+typedef std::uint32_t Crc32cTables[8][256];
+
+
+static const Crc32cTables& GetCrc32cTables() {
+
+    static Crc32cTables tables;
+    static bool is_initialized = [] {
+
+        for (std::uint32_t byte = 0; byte < 256; ++byte) {
+
+            std::uint32_t crc = byte;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ Crc32cPolynomial : crc >> 1;
+            }
+            tables[0][byte] = crc;
+        }
+
+        for (std::uint32_t byte = 0; byte < 256; ++byte) {
+            for (int slice = 1; slice < 8; ++slice) {
+                std::uint32_t previous_crc = tables[slice - 1][byte];
+                tables[slice][byte] = (previous_crc >> 8) ^ tables[0][previous_crc & 0xFF];
+            }
+        }
+        return true;
+    }();
+
+    (void)is_initialized;
+    return tables;
+}
+
+
+//Compute without the initial and final inversion, which are done by Crc32c.
+static std::uint32_t Crc32cByTables(const unsigned char* bytes, std::size_t length, std::uint32_t crc) {
+
+    const Crc32cTables& tables = GetCrc32cTables();
+
+    //Process 8 bytes at a time, byte by byte so that it doesn't depend on alignment or endianness.
+    while (length >= 8) {
+
+        std::uint32_t low = crc ^ (static_cast<std::uint32_t>(bytes[0]) |
+                                   static_cast<std::uint32_t>(bytes[1]) << 8 |
+                                   static_cast<std::uint32_t>(bytes[2]) << 16 |
+                                   static_cast<std::uint32_t>(bytes[3]) << 24);
+
+        crc = tables[7][low & 0xFF] ^
+              tables[6][(low >> 8) & 0xFF] ^
+              tables[5][(low >> 16) & 0xFF] ^
+              tables[4][low >> 24] ^
+              tables[3][bytes[4]] ^
+              tables[2][bytes[5]] ^
+              tables[1][bytes[6]] ^
+              tables[0][bytes[7]];
+
+        bytes += 8;
+        length -= 8;
+    }
+
+    while (length > 0) {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *bytes) & 0xFF];
+        ++bytes;
+        --length;
+    }
+
+    return crc;
+}
+
+
+#if CURLION_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static std::uint32_t Crc32cBySse42(const unsigned char* bytes, std::size_t length, std::uint32_t crc) {
+
+    std::uint64_t crc64 = crc;
+    while (length >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        length -= 8;
+    }
+
+    crc = static_cast<std::uint32_t>(crc64);
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *bytes);
+        ++bytes;
+        --length;
+    }
+    return crc;
+}
+
+#elif CURLION_CRC32C_ARMV8
+
+static std::uint32_t Crc32cByArmv8(const unsigned char* bytes, std::size_t length, std::uint32_t crc) {
+
+    while (length >= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        length -= 8;
+    }
+
+    while (length > 0) {
+        crc = __crc32cb(crc, *bytes);
+        ++bytes;
+        --length;
+    }
+    return crc;
+}
+
+#endif
+
+
+typedef std::uint32_t (*Crc32cFunction)(const unsigned char* bytes, std::size_t length, std::uint32_t crc);
+
+
+static Crc32cFunction GetCrc32cFunction() {
+
+#if CURLION_CRC32C_SSE42
+    static Crc32cFunction function = __builtin_cpu_supports("sse4.2") ? Crc32cBySse42 : Crc32cByTables;
+    return function;
+#elif CURLION_CRC32C_ARMV8
+    return Crc32cByArmv8;
+#else
+    return Crc32cByTables;
+#endif
+}
+
+
+std::uint32_t Crc32c(const void* data, std::size_t length, std::uint32_t crc) {
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    return ~GetCrc32cFunction()(bytes, length, ~crc);
+}
+
+
+static inline std::uint32_t RotateLeft(std::uint32_t value, int count) {
+    return (value << count) | (value >> (32 - count));
+}
+
+
+static inline std::uint32_t RotateRight(std::uint32_t value, int count) {
+    return (value >> count) | (value << (32 - count));
+}
+
+
+//Pad the data of a SHA-1 or SHA-256 computation with a 1 bit, zeros and the length in bits, to a
+//multiple of the block size.
+template<typename Hash>
+static void UpdatePadding(Hash& hash, std::uint64_t length, std::size_t buffer_length) {
+
+    std::uint64_t bit_length = length * 8;
+
+    unsigned char padding[128] = { 0x80 };
+    std::size_t padding_length = (buffer_length < 56 ? 56 : 120) - buffer_length;
+    for (int index = 0; index < 8; ++index) {
+        padding[padding_length + index] = static_cast<unsigned char>(bit_length >> (56 - index * 8));
+    }
+    hash.Update(padding, padding_length + 8);
+}
+
+
+Sha1::Sha1() {
+    Reset();
+}
+
+
+void Sha1::Reset() {
+
+    state_[0] = 0x67452301;
+    state_[1] = 0xEFCDAB89;
+    state_[2] = 0x98BADCFE;
+    state_[3] = 0x10325476;
+    state_[4] = 0xC3D2E1F0;
+    length_ = 0;
+    buffer_length_ = 0;
+}
+
+
+void Sha1::Update(const void* data, std::size_t length) {
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    length_ += length;
+
+    if (buffer_length_ > 0) {
+
+        std::size_t copy_length = std::min(length, sizeof(buffer_) - buffer_length_);
+        std::memcpy(buffer_ + buffer_length_, bytes, copy_length);
+        buffer_length_ += copy_length;
+        bytes += copy_length;
+        length -= copy_length;
+
+        if (buffer_length_ < sizeof(buffer_)) {
+            return;
+        }
+
+        Transform(buffer_);
+        buffer_length_ = 0;
+    }
+
+    while (length >= sizeof(buffer_)) {
+        Transform(bytes);
+        bytes += sizeof(buffer_);
+        length -= sizeof(buffer_);
+    }
+
+    std::memcpy(buffer_, bytes, length);
+    buffer_length_ = length;
+}
+
+
+std::string Sha1::Finish() {
+
+    UpdatePadding(*this, length_, buffer_length_);
+
+    std::string digest(DigestLength, '\0');
+    for (std::size_t index = 0; index < DigestLength; ++index) {
+        digest[index] = static_cast<char>(state_[index / 4] >> (24 - (index % 4) * 8));
+    }
+    return digest;
+}
+
+
+void Sha1::Transform(const unsigned char* block) {
+
+    std::uint32_t words[80];
+    for (int index = 0; index < 16; ++index) {
+        words[index] = static_cast<std::uint32_t>(block[index * 4]) << 24 |
+                       static_cast<std::uint32_t>(block[index * 4 + 1]) << 16 |
+                       static_cast<std::uint32_t>(block[index * 4 + 2]) << 8 |
+                       static_cast<std::uint32_t>(block[index * 4 + 3]);
+    }
+
+    for (int index = 16; index < 80; ++index) {
+        words[index] = RotateLeft(words[index - 3] ^ words[index - 8] ^ words[index - 14] ^ words[index - 16], 1);
+    }
+
+    std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+
+    for (int index = 0; index < 80; ++index) {
+
+        std::uint32_t function_value = 0;
+        std::uint32_t constant = 0;
+        if (index < 20) {
+            function_value = (b & c) | (~b & d);
+            constant = 0x5A827999;
+        }
+        else if (index < 40) {
+            function_value = b ^ c ^ d;
+            constant = 0x6ED9EBA1;
+        }
+        else if (index < 60) {
+            function_value = (b & c) | (b & d) | (c & d);
+            constant = 0x8F1BBCDC;
+        }
+        else {
+            function_value = b ^ c ^ d;
+            constant = 0xCA62C1D6;
+        }
+
+        std::uint32_t temp = RotateLeft(a, 5) + function_value + e + constant + words[index];
+        e = d;
+        d = c;
+        c = RotateLeft(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+}
+
+
+static const std::uint32_t Sha256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+Sha256::Sha256() {
+    Reset();
+}
+
+
+void Sha256::Reset() {
+
+    static const std::uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    std::memcpy(state_, initial_state, sizeof(state_));
+    length_ = 0;
+    buffer_length_ = 0;
+}
+
+
+void Sha256::Update(const void* data, std::size_t length) {
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    length_ += length;
+
+    if (buffer_length_ > 0) {
+
+        std::size_t copy_length = std::min(length, sizeof(buffer_) - buffer_length_);
+        std::memcpy(buffer_ + buffer_length_, bytes, copy_length);
+        buffer_length_ += copy_length;
+        bytes += copy_length;
+        length -= copy_length;
+
+        if (buffer_length_ < sizeof(buffer_)) {
+            return;
+        }
+
+        Transform(buffer_);
+        buffer_length_ = 0;
+    }
+
+    //Transform whole blocks in place, without copying them into the buffer.
+    while (length >= sizeof(buffer_)) {
+        Transform(bytes);
+        bytes += sizeof(buffer_);
+        length -= sizeof(buffer_);
+    }
+
+    std::memcpy(buffer_, bytes, length);
+    buffer_length_ = length;
+}
+
+
+std::string Sha256::Finish() {
+
+    UpdatePadding(*this, length_, buffer_length_);
+
+    std::string digest(DigestLength, '\0');
+    for (std::size_t index = 0; index < DigestLength; ++index) {
+        digest[index] = static_cast<char>(state_[index / 4] >> (24 - (index % 4) * 8));
+    }
+    return digest;
+}
+
+
+void Sha256::Transform(const unsigned char* block) {
+
+    std::uint32_t words[64];
+    for (int index = 0; index < 16; ++index) {
+        words[index] = static_cast<std::uint32_t>(block[index * 4]) << 24 |
+                       static_cast<std::uint32_t>(block[index * 4 + 1]) << 16 |
+                       static_cast<std::uint32_t>(block[index * 4 + 2]) << 8 |
+                       static_cast<std::uint32_t>(block[index * 4 + 3]);
+    }
+
+    for (int index = 16; index < 64; ++index) {
+        std::uint32_t s0 = RotateRight(words[index - 15], 7) ^ RotateRight(words[index - 15], 18) ^ (words[index - 15] >> 3);
+        std::uint32_t s1 = RotateRight(words[index - 2], 17) ^ RotateRight(words[index - 2], 19) ^ (words[index - 2] >> 10);
+        words[index] = words[index - 16] + s0 + words[index - 7] + s1;
+    }
+
+    std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    std::uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+
+    for (int index = 0; index < 64; ++index) {
+
+        std::uint32_t s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+        std::uint32_t choice = (e & f) ^ (~e & g);
+        std::uint32_t temp1 = h + s1 + choice + Sha256RoundConstants[index] + words[index];
+        std::uint32_t s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+        std::uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        std::uint32_t temp2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+}
+
+}
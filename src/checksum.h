@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace curlion {
+
+/**
+ Compute the CRC-32C (Castagnoli) checksum of data, as used by iSCSI, SCTP and object storage
+ services to verify uploaded parts.
+
+ The CRC32 instructions of SSE 4.2 are used if the CPU supports them, and those of ARMv8 if the
+ target enables them, otherwise the checksum is computed by tables.
+
+ @param data
+     The data to compute.
+
+ @param length
+     The length of data.
+
+ @param crc
+     The checksum of preceding data, to compute the checksum of data in pieces. Use 0 for the
+     first piece.
+
+ @return
+     The checksum of the preceding data followed by data.
+ */
+std::uint32_t Crc32c(const void* data, std::size_t length, std::uint32_t crc = 0);
+
+/**
+ Sha1 computes the SHA-1 digest of data in pieces.
+
+ SHA-1 is not secure against collisions, use it only where a protocol requires it, such as the
+ WebSocket handshake.
+ */
+class Sha1 {
+public:
+    /**
+     Length of a digest in bytes.
+     */
+    static const std::size_t DigestLength = 20;
+
+public:
+    /**
+     Construct the Sha1 instance.
+     */
+    Sha1();
+
+    /**
+     Reset to compute a new digest.
+     */
+    void Reset();
+
+    /**
+     Add a piece of data.
+     */
+    void Update(const void* data, std::size_t length);
+
+    /**
+     Finish the computation.
+
+     @return
+         The digest in DigestLength bytes. Call Reset before adding data again.
+     */
+    std::string Finish();
+
+private:
+    void Transform(const unsigned char* block);
+
+private:
+    std::uint32_t state_[5];
+    std::uint64_t length_;
+    unsigned char buffer_[64];
+    std::size_t buffer_length_;
+};
+
+/**
+ Sha256 computes the SHA-256 digest of data in pieces.
+ */
+class Sha256 {
+public:
+    /**
+     Length of a digest in bytes.
+     */
+    static const std::size_t DigestLength = 32;
+
+public:
+    /**
+     Construct the Sha256 instance.
+     */
+    Sha256();
+
+    /**
+     Reset to compute a new digest.
+     */
+    void Reset();
+
+    /**
+     Add a piece of data.
+     */
+    void Update(const void* data, std::size_t length);
+
+    /**
+     Finish the computation.
+
+     @return
+         The digest in DigestLength bytes. Call Reset before adding data again.
+     */
+    std::string Finish();
+
+private:
+    void Transform(const unsigned char* block);
+
+private:
+    std::uint32_t state_[8];
+    std::uint64_t length_;
+    unsigned char buffer_[64];
+    std::size_t buffer_length_;
+};
+
+}
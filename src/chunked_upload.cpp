@@ -0,0 +1,591 @@
+#include "chunked_upload.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "connection.h"
+#include "connection_manager.h"
+#include "log.h"
+#include "timer.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteUploadLog(void* upload_identifier) {
+    return Log() << "ChunkedUpload(" << upload_identifier << "): ";
+}
+
+
+static bool IsConnectionSucceeded(const std::shared_ptr<Connection>& connection) {
+
+    if (connection->GetResult() != CURLE_OK) {
+        return false;
+    }
+
+    //Response code is 0 for protocols other than HTTP.
+    long response_code = connection->GetResponseCode();
+    return (response_code == 0) || ((response_code >= 200) && (response_code < 300));
+}
+
+
+ChunkedUpload::ChunkedUpload(ConnectionManager& connection_manager,
+                             int file_descriptor,
+                             const std::shared_ptr<Timer>& timer) :
+    connection_manager_(connection_manager),
+    file_descriptor_(file_descriptor),
+    timer_(timer),
+    part_size_(8 * 1024 * 1024),
+    max_concurrent_part_count_(4),
+    max_retry_count_(3),
+    retry_delay_(1000),
+    max_retry_delay_(30000),
+    is_running_(false),
+    file_length_(0),
+    next_part_index_(0),
+    running_part_count_(0),
+    uploaded_part_count_(0),
+    complete_retry_count_(0),
+    is_timer_running_(false),
+    random_engine_(std::random_device()()),
+    result_(CURL_LAST),
+    response_code_(0) {
+
+}
+
+
+ChunkedUpload::~ChunkedUpload() {
+
+    StopTimer();
+}
+
+
+std::error_condition ChunkedUpload::Start() {
+
+    if (is_running_) {
+        return std::make_error_condition(std::errc::operation_in_progress);
+    }
+
+    if (part_connection_callback_ == nullptr) {
+        return std::make_error_condition(std::errc::invalid_argument);
+    }
+
+    struct stat file_status;
+    if (fstat(file_descriptor_, &file_status) != 0) {
+        return std::error_condition(errno, std::generic_category());
+    }
+
+    file_length_ = static_cast<curl_off_t>(file_status.st_size);
+
+    //An empty file is still uploaded as a single empty part.
+    std::size_t part_count = static_cast<std::size_t>(std::max<curl_off_t>((file_length_ + part_size_ - 1) / part_size_, 1));
+
+    WriteUploadLog(this) << "Start uploading " << file_length_ << " bytes in " << part_count << " parts.";
+
+    parts_.assign(part_count, Part());
+    part_states_.assign(part_count, PartState());
+    for (std::size_t index = 0; index < part_count; ++index) {
+        Part& part = parts_[index];
+        part.index = index;
+        part.offset = static_cast<curl_off_t>(index) * part_size_;
+        part.length = std::min(part_size_, file_length_ - part.offset);
+    }
+
+    next_part_index_ = 0;
+    running_part_count_ = 0;
+    uploaded_part_count_ = 0;
+    complete_connection_.reset();
+    complete_retry_count_ = 0;
+    scheduled_retries_.clear();
+    result_ = CURL_LAST;
+    response_code_ = 0;
+    error_.clear();
+
+    is_running_ = true;
+    self_ = shared_from_this();
+
+    StartParts();
+    return std::error_condition();
+}
+
+
+void ChunkedUpload::Abort() {
+
+    WriteUploadLog(this) << "Abort.";
+    Finish(CURLE_ABORTED_BY_CALLBACK, "Upload is aborted");
+}
+
+
+curl_off_t ChunkedUpload::GetUploadedLength() const {
+
+    curl_off_t length = 0;
+    for (const auto& each_part : parts_) {
+        if (each_part.connection != nullptr) {
+            length += each_part.length;
+        }
+    }
+    return length;
+}
+
+
+void ChunkedUpload::StartParts() {
+
+    while (is_running_ &&
+           (running_part_count_ + scheduled_retries_.size() < max_concurrent_part_count_) &&
+           (next_part_index_ < parts_.size())) {
+
+        if (! StartPart(next_part_index_++)) {
+            return;
+        }
+    }
+}
+
+
+bool ChunkedUpload::StartPart(std::size_t index) {
+
+    PartState& state = part_states_[index];
+    Part& part = parts_[index];
+
+    if (! state.is_checksum_computed) {
+        if (! ComputeChecksum(index)) {
+            Finish(CURLE_READ_ERROR, "Failed to read part " + std::to_string(index));
+            return false;
+        }
+        state.is_checksum_computed = true;
+    }
+
+    state.position = 0;
+
+    auto connection = part_connection_callback_(part);
+    if (! is_running_) {
+        return false;
+    }
+
+    if (connection == nullptr) {
+        Finish(CURLE_FAILED_INIT, "Failed to create connection of part " + std::to_string(index));
+        return false;
+    }
+
+    WriteUploadLog(this) << "Start part " << index << " with connection(" << connection.get() << ").";
+
+    connection->SetReadBodyCallback([this, index](const std::shared_ptr<Connection>& connection,
+                                                  char* body,
+                                                  std::size_t expected_length,
+                                                  std::size_t& actual_length) {
+        return ReadPart(index, connection, body, expected_length, actual_length);
+    });
+
+    connection->SetSeekBodyCallback([this, index](const std::shared_ptr<Connection>& connection,
+                                                  Connection::SeekOrigin origin,
+                                                  curl_off_t offset) {
+
+        curl_off_t position = offset;
+        if (origin == Connection::SeekOrigin::Current) {
+            position += part_states_[index].position;
+        }
+        else if (origin == Connection::SeekOrigin::End) {
+            position += parts_[index].length;
+        }
+        return SeekPart(index, connection, position);
+    });
+
+    connection->SetFinishedCallback([this, index](const std::shared_ptr<Connection>& connection) {
+
+        //Keep alive since the upload may finish and release itself.
+        auto self = shared_from_this();
+        PartFinished(index, connection);
+    });
+
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_INFILESIZE_LARGE, part.length);
+
+    state.connection = connection;
+    running_part_count_++;
+
+    auto error = connection_manager_.StartConnection(connection);
+    if (error) {
+
+        WriteUploadLog(this) << "Start part " << index << " failed: " << error.message() << '.';
+
+        if (state.connection == connection) {
+            state.connection.reset();
+            running_part_count_--;
+        }
+        Finish(CURLE_FAILED_INIT, "Start part " + std::to_string(index) + " failed: " + error.message());
+        return false;
+    }
+
+    return is_running_;
+}
+
+
+bool ChunkedUpload::ComputeChecksum(std::size_t index) {
+
+    Part& part = parts_[index];
+
+    std::vector<char> buffer(static_cast<std::size_t>(std::min<curl_off_t>(part.length, 64 * 1024)));
+    std::uint32_t checksum = 0;
+    curl_off_t position = 0;
+
+    while (position < part.length) {
+
+        std::size_t length = static_cast<std::size_t>(std::min<curl_off_t>(part.length - position, buffer.size()));
+        ssize_t read_length = pread(file_descriptor_, buffer.data(), length, part.offset + position);
+        if (read_length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            WriteUploadLog(this) << "pread part " << index << " failed with errno: " << errno << '.';
+            return false;
+        }
+
+        //The file is truncated.
+        if (read_length == 0) {
+            WriteUploadLog(this) << "Part " << index << " is beyond the end of the file.";
+            return false;
+        }
+
+        checksum = Crc32c(buffer.data(), static_cast<std::size_t>(read_length), checksum);
+        position += read_length;
+    }
+
+    part.checksum = checksum;
+    return true;
+}
+
+
+bool ChunkedUpload::ReadPart(std::size_t index,
+                             const std::shared_ptr<Connection>& connection,
+                             char* body,
+                             std::size_t expected_length,
+                             std::size_t& actual_length) {
+
+    PartState& state = part_states_[index];
+    if (! is_running_ || (state.connection != connection)) {
+        return false;
+    }
+
+    curl_off_t remaining_length = parts_[index].length - state.position;
+    std::size_t length = static_cast<std::size_t>(std::min<curl_off_t>(remaining_length, expected_length));
+
+    actual_length = 0;
+    if (length == 0) {
+        return true;
+    }
+
+    ssize_t read_length = 0;
+    do {
+        read_length = pread(file_descriptor_, body, length, parts_[index].offset + state.position);
+    }
+    while ((read_length < 0) && (errno == EINTR));
+
+    //Retrying doesn't help if the file is truncated or can't be read, fail the upload.
+    if (read_length <= 0) {
+        WriteUploadLog(this) << "Read part " << index << " at " << state.position << " failed with errno: " << errno << '.';
+        result_ = CURLE_READ_ERROR;
+        error_ = "Failed to read part " + std::to_string(index);
+        return false;
+    }
+
+    actual_length = static_cast<std::size_t>(read_length);
+    state.position += read_length;
+    return true;
+}
+
+
+bool ChunkedUpload::SeekPart(std::size_t index, const std::shared_ptr<Connection>& connection, curl_off_t position) {
+
+    PartState& state = part_states_[index];
+    if (! is_running_ || (state.connection != connection)) {
+        return false;
+    }
+
+    if ((position < 0) || (position > parts_[index].length)) {
+        return false;
+    }
+
+    state.position = position;
+    return true;
+}
+
+
+void ChunkedUpload::PartFinished(std::size_t index, const std::shared_ptr<Connection>& connection) {
+
+    PartState& state = part_states_[index];
+    if (! is_running_ || (state.connection != connection)) {
+        return;
+    }
+
+    state.connection.reset();
+    running_part_count_--;
+
+    //A failure found while reading.
+    if (result_ != CURL_LAST) {
+        Finish(result_, error_);
+        return;
+    }
+
+    if (IsConnectionSucceeded(connection)) {
+
+        WriteUploadLog(this) << "Part " << index << " is uploaded.";
+
+        parts_[index].connection = connection;
+        uploaded_part_count_++;
+
+        if (uploaded_part_count_ == parts_.size()) {
+            StartComplete();
+        }
+        else {
+            StartParts();
+        }
+        return;
+    }
+
+    WriteUploadLog(this) << "Part " << index << " failed with result " << connection->GetResult()
+        << ", response code " << connection->GetResponseCode() << '.';
+
+    if (CanRetry(connection) && (state.retry_count < max_retry_count_)) {
+        state.retry_count++;
+        ScheduleRetry(index, GetRetryDelay(connection, state.retry_count));
+        return;
+    }
+
+    FinishWithFailure(connection, "Part " + std::to_string(index));
+}
+
+
+bool ChunkedUpload::CanRetry(const std::shared_ptr<Connection>& connection) const {
+
+    if (connection->GetResult() != CURLE_OK) {
+        return true;
+    }
+
+    long response_code = connection->GetResponseCode();
+    return (response_code == 429) || (response_code >= 500);
+}
+
+
+long ChunkedUpload::GetRetryDelay(const std::shared_ptr<Connection>& connection, std::size_t retry_count) {
+
+    if (timer_ == nullptr) {
+        return 0;
+    }
+
+    long delay = retry_delay_;
+    for (std::size_t count = 1; (count < retry_count) && (delay < max_retry_delay_); ++count) {
+        delay *= 2;
+    }
+    delay = std::min(delay, max_retry_delay_);
+
+    //Take off a random part, so that parts failed together don't retry together.
+    if (delay > 1) {
+        delay -= static_cast<long>(random_engine_() % static_cast<unsigned long>(delay / 2 + 1));
+    }
+
+    //In seconds, parsed by libcurl from either form of the header.
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(connection->GetHandle(), CURLINFO_RETRY_AFTER, &retry_after);
+    if ((retry_after > 0) && (retry_after * 1000 > delay)) {
+        delay = static_cast<long>(retry_after * 1000);
+    }
+
+    return delay;
+}
+
+
+void ChunkedUpload::ScheduleRetry(std::size_t index, long delay) {
+
+    WriteUploadLog(this) << (index == parts_.size() ? std::string("Complete request") : "Part " + std::to_string(index))
+        << " is retried after " << delay << " ms.";
+
+    if (delay == 0) {
+        Retry(index);
+        return;
+    }
+
+    auto time = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+    scheduled_retries_.insert(std::make_pair(time, index));
+    StartRetryTimer();
+}
+
+
+void ChunkedUpload::Retry(std::size_t index) {
+
+    if (index == parts_.size()) {
+        StartComplete();
+    }
+    else {
+        StartPart(index);
+    }
+}
+
+
+void ChunkedUpload::StartRetryTimer() {
+
+    StopTimer();
+
+    if (scheduled_retries_.empty()) {
+        return;
+    }
+
+    //Round up, so that the earliest retry is due once the timer triggers.
+    long timeout_ms = 0;
+    auto now = std::chrono::steady_clock::now();
+    auto time = scheduled_retries_.begin()->first;
+    if (time > now) {
+        auto timeout = time - now + std::chrono::milliseconds(1) - std::chrono::steady_clock::duration(1);
+        timeout_ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
+    }
+
+    is_timer_running_ = true;
+
+    std::weak_ptr<ChunkedUpload> weak_self = shared_from_this();
+    timer_->Start(timeout_ms, [weak_self]() {
+
+        auto self = weak_self.lock();
+        if ((self == nullptr) || ! self->is_running_) {
+            return;
+        }
+
+        self->is_timer_running_ = false;
+        self->RetryTimerTriggered();
+    });
+}
+
+
+void ChunkedUpload::StopTimer() {
+
+    if (is_timer_running_) {
+        timer_->Stop();
+        is_timer_running_ = false;
+    }
+}
+
+
+void ChunkedUpload::RetryTimerTriggered() {
+
+    auto now = std::chrono::steady_clock::now();
+
+    while (is_running_ && ! scheduled_retries_.empty() && (scheduled_retries_.begin()->first <= now)) {
+
+        std::size_t index = scheduled_retries_.begin()->second;
+        scheduled_retries_.erase(scheduled_retries_.begin());
+        Retry(index);
+    }
+
+    if (is_running_) {
+        StartRetryTimer();
+    }
+}
+
+
+void ChunkedUpload::StartComplete() {
+
+    if (complete_connection_callback_ == nullptr) {
+        Finish(CURLE_OK, std::string());
+        return;
+    }
+
+    auto connection = complete_connection_callback_(parts_);
+    if (! is_running_) {
+        return;
+    }
+
+    if (connection == nullptr) {
+        Finish(CURLE_OK, std::string());
+        return;
+    }
+
+    WriteUploadLog(this) << "Start complete request with connection(" << connection.get() << ").";
+
+    connection->SetFinishedCallback([this](const std::shared_ptr<Connection>& connection) {
+
+        //Keep alive since the upload may finish and release itself.
+        auto self = shared_from_this();
+        CompleteFinished(connection);
+    });
+
+    complete_connection_ = connection;
+
+    auto error = connection_manager_.StartConnection(connection);
+    if (error) {
+        Finish(CURLE_FAILED_INIT, "Start complete request failed: " + error.message());
+    }
+}
+
+
+void ChunkedUpload::CompleteFinished(const std::shared_ptr<Connection>& connection) {
+
+    if (! is_running_ || (complete_connection_ != connection)) {
+        return;
+    }
+
+    if (IsConnectionSucceeded(connection)) {
+        response_code_ = connection->GetResponseCode();
+        Finish(CURLE_OK, std::string());
+        return;
+    }
+
+    WriteUploadLog(this) << "Complete request failed with result " << connection->GetResult()
+        << ", response code " << connection->GetResponseCode() << '.';
+
+    if (CanRetry(connection) && (complete_retry_count_ < max_retry_count_)) {
+        complete_retry_count_++;
+        ScheduleRetry(parts_.size(), GetRetryDelay(connection, complete_retry_count_));
+        return;
+    }
+
+    FinishWithFailure(connection, "Complete request");
+}
+
+
+void ChunkedUpload::FinishWithFailure(const std::shared_ptr<Connection>& connection, const std::string& name) {
+
+    response_code_ = connection->GetResponseCode();
+
+    CURLcode result = connection->GetResult();
+    std::string error = connection->GetError();
+
+    if (result == CURLE_OK) {
+        result = CURLE_HTTP_RETURNED_ERROR;
+        error = "Server responds " + std::to_string(response_code_);
+    }
+
+    Finish(result, name + " failed: " + error);
+}
+
+
+void ChunkedUpload::Finish(CURLcode result, const std::string& error) {
+
+    if (! is_running_) {
+        return;
+    }
+
+    is_running_ = false;
+
+    StopTimer();
+    scheduled_retries_.clear();
+
+    for (auto& each_state : part_states_) {
+        if (each_state.connection != nullptr) {
+            connection_manager_.AbortConnection(each_state.connection);
+            each_state.connection.reset();
+        }
+    }
+    running_part_count_ = 0;
+
+    if ((complete_connection_ != nullptr) && complete_connection_->IsRunning()) {
+        connection_manager_.AbortConnection(complete_connection_);
+    }
+
+    result_ = result;
+    error_ = error;
+
+    WriteUploadLog(this) << "Finished with result " << result_ << '.';
+
+    auto self = std::move(self_);
+    if (finished_callback_ != nullptr) {
+        finished_callback_(self);
+    }
+}
+
+}
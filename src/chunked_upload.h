@@ -0,0 +1,356 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <curl/curl.h>
+
+namespace curlion {
+
+class Connection;
+class ConnectionManager;
+class Timer;
+
+/**
+ ChunkedUpload uploads a large file as multiple parts over concurrent connections, such as a
+ multipart upload of an object storage service.
+
+ The file is split into parts of a fixed size, the last part may be shorter. Each part is
+ uploaded with a connection created by the part connection callback, which sets the URL and
+ headers specific to the part, such as the part number. The body of the part is read from the
+ file by the upload, and is sent with PUT.
+
+ Each part is read from the file with pread while it is uploaded, so only the running parts are
+ read, and the file is never loaded entirely. The CRC-32C checksum of a part is computed before
+ its connection is created, so that it can be sent in a header for the server to verify. The
+ file must not be modified during the upload. If it is truncated, the upload fails with
+ CURLE_READ_ERROR.
+
+ A part is retried with a new connection if its transfer fails, or the server responds 429 or
+ 5xx, for a limited number of times. Other failures fail the whole upload. Retries are delayed by
+ exponential backoff with jitter, or by the Retry-After header of the response if it asks for
+ longer. The delay is measured by a Timer, the same interface used by ConnectionManager. It must
+ be a separate instance from the one of the manager. A part waiting for retry takes its slot of
+ concurrent parts.
+
+ Once all parts are uploaded, the complete connection callback is called to create the request
+ that completes the upload, for example by committing the parts with their ETags. The upload
+ finishes when that connection finishes.
+
+ The upload must be created with std::make_shared. It is retained while running.
+ */
+class ChunkedUpload : public std::enable_shared_from_this<ChunkedUpload> {
+public:
+    /**
+     Part of the file.
+     */
+    class Part {
+    public:
+        /**
+         Zero-based index of the part.
+         */
+        std::size_t index = 0;
+
+        /**
+         Offset of the part in the file.
+         */
+        curl_off_t offset = 0;
+
+        /**
+         Length of the part.
+         */
+        curl_off_t length = 0;
+
+        /**
+         CRC-32C checksum of the part.
+         */
+        std::uint32_t checksum = 0;
+
+        /**
+         The connection which uploaded the part successfully, to get its response such as the
+         ETag header. It is null until the part is uploaded.
+         */
+        std::shared_ptr<Connection> connection;
+    };
+
+    /**
+     Callback prototype for creating the connection to upload a part.
+
+     @param part
+         The part to upload. Its connection is null.
+
+     @return
+         A new connection which is not running, with URL and headers of the part. Options for the
+         request body are overridden by the upload. Return null to fail the upload.
+     */
+    typedef std::function<std::shared_ptr<Connection>(const Part& part)> PartConnectionCallback;
+
+    /**
+     Callback prototype for creating the connection to complete the upload.
+
+     @param parts
+         All parts, which are uploaded.
+
+     @return
+         A new connection which is not running. Return null if no request is needed, then the
+         upload finishes successfully.
+     */
+    typedef std::function<std::shared_ptr<Connection>(const std::vector<Part>& parts)> CompleteConnectionCallback;
+
+    /**
+     Callback prototype for upload finished.
+
+     @param upload
+         The ChunkedUpload instance.
+     */
+    typedef std::function<void(const std::shared_ptr<ChunkedUpload>& upload)> FinishedCallback;
+
+public:
+    /**
+     Construct the ChunkedUpload instance.
+
+     @param connection_manager
+         The manager to run connections, must outlive the upload.
+
+     @param file_descriptor
+         The file descriptor to upload, opened for reading. It is read with pread regardless of
+         the file position, and is not closed by the upload.
+
+     @param timer
+         The timer for the delay of retries. It can be nullptr, in which case failed requests are
+         retried immediately.
+     */
+    ChunkedUpload(ConnectionManager& connection_manager,
+                  int file_descriptor,
+                  const std::shared_ptr<Timer>& timer);
+
+    /**
+     Destruct the ChunkedUpload instance.
+     */
+    ~ChunkedUpload();
+
+    /**
+     Set the size of a part.
+
+     Services usually have a minimum size of a part except the last one, and a maximum number of
+     parts.
+
+     The default is 8 MiB.
+     */
+    void SetPartSize(curl_off_t size) {
+        part_size_ = size <= 0 ? 1 : size;
+    }
+
+    /**
+     Set the maximum number of parts uploaded concurrently.
+
+     The default is 4.
+     */
+    void SetMaxConcurrentPartCount(std::size_t count) {
+        max_concurrent_part_count_ = count == 0 ? 1 : count;
+    }
+
+    /**
+     Set how many times a failed part or complete request is retried.
+
+     The default is 3.
+     */
+    void SetMaxRetryCount(std::size_t count) {
+        max_retry_count_ = count;
+    }
+
+    /**
+     Set the delay before the first retry of a request. It requires a timer.
+
+     The delay doubles for each following retry of the same request, up to the maximum retry
+     delay, and a random part of up to half of it is taken off, so that failed parts don't retry
+     all at once.
+
+     The default is 1000.
+     */
+    void SetRetryDelayInMilliseconds(long milliseconds) {
+        retry_delay_ = milliseconds < 0 ? 0 : milliseconds;
+    }
+
+    /**
+     Set the maximum delay of retries computed by backoff. A longer Retry-After of the server is
+     still honored.
+
+     The default is 30000.
+     */
+    void SetMaxRetryDelayInMilliseconds(long milliseconds) {
+        max_retry_delay_ = milliseconds < 0 ? 0 : milliseconds;
+    }
+
+    /**
+     Set the callback to create the connection of each part. It must be set before starting.
+     */
+    void SetPartConnectionCallback(const PartConnectionCallback& callback) {
+        part_connection_callback_ = callback;
+    }
+
+    /**
+     Set the callback to create the connection to complete the upload.
+
+     If the callback is not set, the upload finishes once all parts are uploaded.
+     */
+    void SetCompleteConnectionCallback(const CompleteConnectionCallback& callback) {
+        complete_connection_callback_ = callback;
+    }
+
+    /**
+     Set the callback which is called when the upload finishes.
+     */
+    void SetFinishedCallback(const FinishedCallback& callback) {
+        finished_callback_ = callback;
+    }
+
+    /**
+     Start the upload.
+
+     @return
+         Return an error if the file can't be read, or there is no part connection callback. The
+         finished callback is not called in such case. Other failures, including those of
+         starting parts, are reported by the finished callback.
+     */
+    std::error_condition Start();
+
+    /**
+     Abort the upload.
+
+     Running connections are aborted. The finished callback is called with result
+     CURLE_ABORTED_BY_CALLBACK.
+     */
+    void Abort();
+
+    /**
+     Get whether the upload is running.
+     */
+    bool IsRunning() const {
+        return is_running_;
+    }
+
+    /**
+     Get the result code.
+
+     CURLE_OK means all parts are uploaded and the upload is completed. CURLE_HTTP_RETURNED_ERROR
+     is returned if the server responds an error, see GetResponseCode.
+     */
+    CURLcode GetResult() const {
+        return result_;
+    }
+
+    /**
+     Get the error message of a failed upload.
+     */
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    /**
+     Get the response code of the connection which fails the upload, or completes it.
+     */
+    long GetResponseCode() const {
+        return response_code_;
+    }
+
+    /**
+     Get the parts of the file.
+     */
+    const std::vector<Part>& GetParts() const {
+        return parts_;
+    }
+
+    /**
+     Get the connection which completes the upload, or null if there is none.
+     */
+    const std::shared_ptr<Connection>& GetCompleteConnection() const {
+        return complete_connection_;
+    }
+
+    /**
+     Get the length of the file.
+     */
+    curl_off_t GetFileLength() const {
+        return file_length_;
+    }
+
+    /**
+     Get the total length of uploaded parts.
+     */
+    curl_off_t GetUploadedLength() const;
+
+private:
+    class PartState {
+    public:
+        std::shared_ptr<Connection> connection;
+        std::size_t retry_count = 0;
+        bool is_checksum_computed = false;
+        curl_off_t position = 0;
+    };
+
+    void StartParts();
+    bool StartPart(std::size_t index);
+    bool ComputeChecksum(std::size_t index);
+    bool ReadPart(std::size_t index, const std::shared_ptr<Connection>& connection, char* body, std::size_t expected_length, std::size_t& actual_length);
+    bool SeekPart(std::size_t index, const std::shared_ptr<Connection>& connection, curl_off_t position);
+    void PartFinished(std::size_t index, const std::shared_ptr<Connection>& connection);
+    bool CanRetry(const std::shared_ptr<Connection>& connection) const;
+    long GetRetryDelay(const std::shared_ptr<Connection>& connection, std::size_t retry_count);
+    void ScheduleRetry(std::size_t index, long delay);
+    void Retry(std::size_t index);
+    void StartRetryTimer();
+    void StopTimer();
+    void RetryTimerTriggered();
+    void StartComplete();
+    void CompleteFinished(const std::shared_ptr<Connection>& connection);
+    void FinishWithFailure(const std::shared_ptr<Connection>& connection, const std::string& name);
+    void Finish(CURLcode result, const std::string& error);
+
+private:
+    ChunkedUpload(const ChunkedUpload&) = delete;
+    ChunkedUpload& operator=(const ChunkedUpload&) = delete;
+
+private:
+    ConnectionManager& connection_manager_;
+    int file_descriptor_;
+    std::shared_ptr<Timer> timer_;
+
+    curl_off_t part_size_;
+    std::size_t max_concurrent_part_count_;
+    std::size_t max_retry_count_;
+    long retry_delay_;
+    long max_retry_delay_;
+    PartConnectionCallback part_connection_callback_;
+    CompleteConnectionCallback complete_connection_callback_;
+    FinishedCallback finished_callback_;
+
+    bool is_running_;
+    std::shared_ptr<ChunkedUpload> self_;
+    curl_off_t file_length_;
+    std::vector<Part> parts_;
+    std::vector<PartState> part_states_;
+    std::size_t next_part_index_;
+    std::size_t running_part_count_;
+    std::size_t uploaded_part_count_;
+    std::shared_ptr<Connection> complete_connection_;
+    std::size_t complete_retry_count_;
+
+    //Indexes of parts waiting for retry by time, the complete request uses the index of the part
+    //count.
+    std::multimap<std::chrono::steady_clock::time_point, std::size_t> scheduled_retries_;
+    bool is_timer_running_;
+    std::minstd_rand random_engine_;
+
+    CURLcode result_;
+    long response_code_;
+    std::string error_;
+};
+
+}
@@ -0,0 +1,172 @@
+#include "circuit_breaker.h"
+#include <algorithm>
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteBreakerLog(void* breaker_identifier) {
+    return Log() << "CircuitBreaker(" << breaker_identifier << "): ";
+}
+
+
+CircuitBreaker::CircuitBreaker() {
+
+}
+
+
+CircuitBreaker::CircuitBreaker(const Options& options) : options_(options) {
+
+}
+
+
+CircuitBreaker::State CircuitBreaker::GetState(const std::string& host) const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto iterator = circuits_.find(host);
+    if (iterator == circuits_.end()) {
+        return State::Closed;
+    }
+
+    return GetState(iterator->second, std::chrono::steady_clock::now());
+}
+
+
+CircuitBreaker::State CircuitBreaker::GetState(const Circuit& circuit, std::chrono::steady_clock::time_point now) const {
+
+    //An open circuit becomes half-open once the open duration elapses.
+    if ((circuit.state == State::Open) && (now >= circuit.open_time + options_.open_duration)) {
+        return State::HalfOpen;
+    }
+    return circuit.state;
+}
+
+
+bool CircuitBreaker::Allow(const std::string& host) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto iterator = circuits_.find(host);
+    if (iterator == circuits_.end()) {
+        return true;
+    }
+
+    Circuit& circuit = iterator->second;
+    auto now = std::chrono::steady_clock::now();
+
+    State state = GetState(circuit, now);
+    if (state == State::Closed) {
+        return true;
+    }
+
+    if (state == State::Open) {
+        return false;
+    }
+
+    if (circuit.state == State::Open) {
+        WriteBreakerLog(this) << "Circuit of " << host << " is half-open.";
+        circuit.state = State::HalfOpen;
+        circuit.probing_count = 0;
+        circuit.succeeded_probe_count = 0;
+    }
+
+    //Probes never reported, such as aborted ones, are given up after the open duration, so that
+    //the circuit doesn't stay half-open forever.
+    if ((circuit.probing_count > 0) && (now >= circuit.probe_time + options_.open_duration)) {
+        circuit.probing_count = 0;
+    }
+
+    if (circuit.succeeded_probe_count + circuit.probing_count >= options_.probe_count) {
+        return false;
+    }
+
+    circuit.probing_count++;
+    circuit.probe_time = now;
+    return true;
+}
+
+
+void CircuitBreaker::AddResult(const std::string& host, bool is_failed) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto now = std::chrono::steady_clock::now();
+    Circuit& circuit = circuits_[host];
+
+    if (circuit.state == State::Open) {
+        //Results of connections started before the circuit opened.
+        return;
+    }
+
+    if (circuit.state == State::HalfOpen) {
+
+        if (circuit.probing_count > 0) {
+            circuit.probing_count--;
+        }
+
+        if (is_failed) {
+            Open(host, circuit, now);
+            return;
+        }
+
+        circuit.succeeded_probe_count++;
+        if (circuit.succeeded_probe_count >= options_.probe_count) {
+            WriteBreakerLog(this) << "Circuit of " << host << " is closed.";
+            circuits_.erase(host);
+        }
+        return;
+    }
+
+    //Closed. Record the result in the bucket of current time.
+    if (circuit.buckets.empty()) {
+        circuit.buckets.resize(std::max<std::size_t>(options_.bucket_count, 1));
+    }
+
+    auto bucket_duration = options_.window_duration / circuit.buckets.size();
+    if (bucket_duration.count() <= 0) {
+        bucket_duration = std::chrono::milliseconds(1);
+    }
+
+    std::int64_t bucket_index = now.time_since_epoch() / bucket_duration;
+    Bucket& bucket = circuit.buckets[bucket_index % circuit.buckets.size()];
+    if (bucket.index != bucket_index) {
+        bucket = Bucket();
+        bucket.index = bucket_index;
+    }
+
+    bucket.total_count++;
+    if (is_failed) {
+        bucket.failure_count++;
+    }
+
+    //Only buckets within the window count.
+    std::size_t total_count = 0;
+    std::size_t failure_count = 0;
+    for (const auto& each_bucket : circuit.buckets) {
+        if ((each_bucket.index >= 0) &&
+            (bucket_index - each_bucket.index < static_cast<std::int64_t>(circuit.buckets.size()))) {
+            total_count += each_bucket.total_count;
+            failure_count += each_bucket.failure_count;
+        }
+    }
+
+    if ((total_count >= options_.minimum_count) &&
+        (failure_count >= options_.failure_ratio_threshold * total_count) &&
+        (failure_count > 0)) {
+        Open(host, circuit, now);
+    }
+}
+
+
+void CircuitBreaker::Open(const std::string& host, Circuit& circuit, std::chrono::steady_clock::time_point now) {
+
+    WriteBreakerLog(this) << "Circuit of " << host << " is open.";
+
+    circuit.state = State::Open;
+    circuit.open_time = now;
+    circuit.probing_count = 0;
+    circuit.succeeded_probe_count = 0;
+    circuit.buckets.clear();
+}
+
+}
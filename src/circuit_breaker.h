@@ -0,0 +1,159 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace curlion {
+
+/**
+ CircuitBreaker stops connecting to hosts which keep failing, so that connections to them fail
+ immediately instead of waiting for timeouts.
+
+ Each host has its own circuit, which is in one of the states:
+ - Closed: connections are allowed. Results of connections are recorded in a rolling window. Once
+   the failure ratio in the window reaches the threshold, the circuit opens.
+ - Open: connections are rejected, until the open duration elapses, then the circuit is half-open.
+ - HalfOpen: a limited number of probing connections are allowed, while others are rejected. If
+   all of the probes succeed, the circuit closes; if any of them fails, the circuit opens again.
+
+ Install the breaker to a ConnectionManager with ConnectionManager::SetCircuitBreaker.
+
+ This class is thread safe, so a single breaker can be shared by multiple ConnectionManager
+ instances connecting to the same upstreams.
+ */
+class CircuitBreaker {
+public:
+    /**
+     State of a circuit.
+     */
+    enum class State {
+
+        /**
+         Connections are allowed.
+         */
+        Closed,
+
+        /**
+         Connections are rejected.
+         */
+        Open,
+
+        /**
+         Limited probing connections are allowed.
+         */
+        HalfOpen,
+    };
+
+    /**
+     Options of the breaker.
+     */
+    class Options {
+    public:
+        /**
+         The failure ratio in the window at which the circuit opens, between 0 and 1.
+         */
+        double failure_ratio_threshold = 0.5;
+
+        /**
+         The minimum number of connections in the window before the circuit can open.
+         */
+        std::size_t minimum_count = 20;
+
+        /**
+         Duration of the rolling window.
+         */
+        std::chrono::milliseconds window_duration{ 10000 };
+
+        /**
+         The number of buckets the window is divided into. The window rolls by one bucket at a time.
+         */
+        std::size_t bucket_count = 10;
+
+        /**
+         How long the circuit stays open before probing.
+         */
+        std::chrono::milliseconds open_duration{ 5000 };
+
+        /**
+         The number of probing connections allowed while the circuit is half-open.
+         */
+        std::size_t probe_count = 1;
+    };
+
+public:
+    /**
+     Construct the CircuitBreaker instance with default options.
+     */
+    CircuitBreaker();
+
+    /**
+     Construct the CircuitBreaker instance with specified options.
+     */
+    explicit CircuitBreaker(const Options& options);
+
+    /**
+     Get the state of the circuit of a host.
+
+     @param host
+         The host, in HOST:PORT format.
+     */
+    State GetState(const std::string& host) const;
+
+    /**
+     Ask whether a connection to a host is allowed to start.
+
+     @param host
+         The host, in HOST:PORT format.
+
+     @return
+         Whether the connection is allowed. While the circuit is half-open, an allowed connection
+         is counted as a probe, its result must be reported with AddResult.
+
+     ConnectionManager calls this method when a connection is about to start.
+     */
+    bool Allow(const std::string& host);
+
+    /**
+     Report the result of a connection allowed by Allow.
+
+     ConnectionManager calls this method when a connection finishes.
+     */
+    void AddResult(const std::string& host, bool is_failed);
+
+private:
+    class Bucket {
+    public:
+        std::int64_t index = -1;
+        std::size_t total_count = 0;
+        std::size_t failure_count = 0;
+    };
+
+    class Circuit {
+    public:
+        State state = State::Closed;
+        std::vector<Bucket> buckets;
+        std::chrono::steady_clock::time_point open_time;
+        std::chrono::steady_clock::time_point probe_time;
+        std::size_t probing_count = 0;
+        std::size_t succeeded_probe_count = 0;
+    };
+
+    State GetState(const Circuit& circuit, std::chrono::steady_clock::time_point now) const;
+    void Open(const std::string& host, Circuit& circuit, std::chrono::steady_clock::time_point now);
+
+private:
+    CircuitBreaker(const CircuitBreaker&) = delete;
+    CircuitBreaker& operator=(const CircuitBreaker&) = delete;
+
+private:
+    Options options_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Circuit> circuits_;
+};
+
+}
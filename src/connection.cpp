@@ -1,6 +1,12 @@
 #include "connection.h"
+#include <cstring>
+#include "body_pipeline.h"
+#include "dns_cache.h"
+#include "load_balancer.h"
+#include "share_group.h"
 #include "socket_factory.h"
 #include "log.h"
+#include "url.h"
 
 #ifdef WIN32
 #undef min
@@ -13,23 +19,118 @@ static inline LoggerProxy WriteConnectionLog(void* connection_identifier) {
 }
     
     
+//Writes the output of the response body pipeline to the destination of the connection.
+class Connection::ResponseBodySink : public BodySink {
+public:
+    explicit ResponseBodySink(Connection& connection) : connection_(connection) { }
+    
+    bool Write(const char* data, std::size_t length) override {
+        return connection_.WriteBodyOutput(data, length);
+    }
+    
+private:
+    Connection& connection_;
+};
+
+
 Connection::Connection() :
     is_running_(false),
-    dns_resolve_items_(nullptr),
+    is_kept_connected_(false),
+    load_balancer_port_(0),
+    is_connect_only_(false),
+    is_receiving_body_(true),
     request_body_read_length_(0),
-    result_(CURL_LAST) {
+    priority_(Priority::Normal),
+    deadline_(std::chrono::steady_clock::time_point::max()),
+    request_pipeline_output_position_(0),
+    result_(CURL_LAST),
+    is_rejected_by_circuit_breaker_(false),
+    decoded_body_length_(0),
+    read_body_length_(0) {
     
     handle_ = curl_easy_init();
     SetInitialOptions();
 }
 
 
-Connection::~Connection() {
+Connection::Connection(const Connection& prototype) :
+    std::enable_shared_from_this<Connection>(),
+    is_running_(false),
+    is_kept_connected_(false),
+    url_(prototype.url_),
+    dns_resolve_items_(prototype.dns_resolve_items_),
+    dns_cache_(prototype.dns_cache_),
+    dns_cache_items_(prototype.dns_cache_items_),
+    load_balancer_(prototype.load_balancer_),
+    load_balancer_items_(prototype.load_balancer_items_),
+    load_balancer_port_(0),
+    is_connect_only_(prototype.is_connect_only_),
+    is_receiving_body_(prototype.is_receiving_body_),
+    request_body_(prototype.request_body_),
+    request_body_read_length_(0),
+    priority_(prototype.priority_),
+    deadline_(prototype.deadline_),
+    tenant_(prototype.tenant_),
+    read_body_callback_(prototype.read_body_callback_),
+    seek_body_callback_(prototype.seek_body_callback_),
+    write_header_callback_(prototype.write_header_callback_),
+    write_body_callback_(prototype.write_body_callback_),
+    request_pipeline_output_position_(0),
+    progress_callback_(prototype.progress_callback_),
+    debug_callback_(prototype.debug_callback_),
+    finished_callback_(prototype.finished_callback_),
+    result_(CURL_LAST),
+    is_rejected_by_circuit_breaker_(false),
+    decoded_body_length_(0),
+    read_body_length_(0) {
+    
+    //Pointers to option resources, such as DNS resolve items, are copied by curl_easy_duphandle,
+    //they keep valid since the resources are shared.
+    handle_ = curl_easy_duphandle(prototype.handle_);
+    if (handle_ == nullptr) {
+        WriteConnectionLog(this) << "curl_easy_duphandle failed.";
+        return;
+    }
     
-    ReleaseDnsResolveItems();
+    //Callback data still points to the prototype, reset them to this connection.
+    SetInitialOptions();
+    
+    if (debug_callback_ != nullptr) {
+        curl_easy_setopt(handle_, CURLOPT_DEBUGDATA, this);
+    }
+    
+    //The share group is set again to make sure this connection is attached to it.
+    SetShareGroup(prototype.share_group_);
+    
+    //Socket callbacks are bound to the ConnectionManager which the prototype was started with,
+    //they would be set again once this connection is started.
+    curl_easy_setopt(handle_, CURLOPT_OPENSOCKETFUNCTION, nullptr);
+    curl_easy_setopt(handle_, CURLOPT_OPENSOCKETDATA, nullptr);
+    curl_easy_setopt(handle_, CURLOPT_CLOSESOCKETFUNCTION, nullptr);
+    curl_easy_setopt(handle_, CURLOPT_CLOSESOCKETDATA, nullptr);
+}
+
+
+Connection::~Connection() {
+    ReleaseLoadBalancerEndpoint(false);
     curl_easy_cleanup(handle_);
 }
 
+
+std::shared_ptr<Connection> Connection::Clone() const {
+    
+    if (is_running_) {
+        return nullptr;
+    }
+    
+    std::shared_ptr<Connection> connection(new Connection(*this));
+    if (connection->GetHandle() == nullptr) {
+        return nullptr;
+    }
+    
+    return connection;
+}
+
     
 void Connection::SetInitialOptions() {
     
@@ -50,8 +151,12 @@ void Connection::SetInitialOptions() {
 void Connection::Start() {
     
     if (! is_running_) {
-        WillStart();
-        CURLcode result = curl_easy_perform(handle_);
+        
+        CURLcode result = CURLE_OK;
+        if (WillStart()) {
+            WillPerform();
+            result = curl_easy_perform(handle_);
+        }
         DidFinish(result);
     }
 }
@@ -70,14 +175,26 @@ void Connection::ResetOptions() {
 void Connection::ResetOptionResources() {
     
     ReleaseDnsResolveItems();
-    
+    ReleaseLoadBalancerEndpoint(false);
+    load_balancer_.reset();
+    load_balancer_items_.reset();
+    SetShareGroup(nullptr);
+    
+    url_.clear();
+    is_connect_only_ = false;
+    is_receiving_body_ = true;
     request_body_.clear();
     request_body_read_length_ = 0;
+    priority_ = Priority::Normal;
+    deadline_ = std::chrono::steady_clock::time_point::max();
+    tenant_.clear();
     
     read_body_callback_ = nullptr;
     seek_body_callback_ = nullptr;
     write_header_callback_ = nullptr;
     write_body_callback_ = nullptr;
+    request_body_pipeline_.reset();
+    response_body_pipeline_.reset();
     progress_callback_ = nullptr;
     debug_callback_ = nullptr;
     finished_callback_ = nullptr;
@@ -85,11 +202,9 @@ void Connection::ResetOptionResources() {
 
     
 void Connection::ReleaseDnsResolveItems() {
-    
-    if (dns_resolve_items_ != nullptr) {
-        curl_slist_free_all(dns_resolve_items_);
-        dns_resolve_items_ = nullptr;
-    }
+    dns_resolve_items_.reset();
+    dns_cache_.reset();
+    dns_cache_items_.reset();
 }
     
 
@@ -99,7 +214,8 @@ void Connection::SetVerbose(bool verbose) {
 
 
 void Connection::SetUrl(const std::string& url) {
-    curl_easy_setopt(handle_, CURLOPT_URL, url.c_str());
+    url_ = url;
+    curl_easy_setopt(handle_, CURLOPT_URL, url_.c_str());
 }
 
 
@@ -115,13 +231,15 @@ void Connection::SetProxyAccount(const std::string& username, const std::string&
 
 
 void Connection::SetConnectOnly(bool connect_only) {
-    curl_easy_setopt(handle_, CURLOPT_CONNECT_ONLY, connect_only);
+    curl_easy_setopt(handle_, CURLOPT_CONNECT_ONLY, connect_only ? 1L : 0L);
+    is_connect_only_ = connect_only;
 }
     
     
 void Connection::SetDnsResolveItems(const std::multimap<std::string, std::string>& resolve_items) {
     
-    ReleaseDnsResolveItems();
+    //Build a new list rather than modifying the current one, which may be shared with clones.
+    curl_slist* dns_resolve_items = nullptr;
     
     for (const auto& each_pair : resolve_items) {
       
@@ -135,10 +253,20 @@ void Connection::SetDnsResolveItems(const std::multimap<std::string, std::string
             item_string.append(1, ':');
             item_string.append(each_pair.second);
         }
-        dns_resolve_items_ = curl_slist_append(dns_resolve_items_, item_string.c_str());
+        dns_resolve_items = curl_slist_append(dns_resolve_items, item_string.c_str());
     }
     
-    curl_easy_setopt(handle_, CURLOPT_RESOLVE, dns_resolve_items_);
+    dns_resolve_items_.reset(dns_resolve_items, curl_slist_free_all);
+    curl_easy_setopt(handle_, CURLOPT_RESOLVE, dns_resolve_items_.get());
+}
+
+
+void Connection::SetShareGroup(const std::shared_ptr<ShareGroup>& share_group) {
+    
+    //Detach from the current group before releasing it.
+    CURLSH* share_handle = share_group == nullptr ? nullptr : share_group->GetHandle();
+    curl_easy_setopt(handle_, CURLOPT_SHARE, share_handle);
+    share_group_ = share_group;
 }
 
     
@@ -156,6 +284,7 @@ void Connection::SetCertificateFilePath(const std::string& file_path) {
 }
 
 void Connection::SetReceiveBody(bool receive_body) {
+    is_receiving_body_ = receive_body;
     curl_easy_setopt(handle_, CURLOPT_NOBODY, ! receive_body);
 }
 
@@ -190,10 +319,97 @@ void Connection::SetDebugCallback(const DebugCallback& callback) {
     }
 }
 
-void Connection::WillStart() {
+bool Connection::WillStart() {
     
     is_running_ = true;
     ResetResponseStates();
+    
+    bool need_transfer = WillTransfer();
+    if (! need_transfer) {
+        WriteConnectionLog(this) << "Finish without transfer.";
+        return false;
+    }
+    return true;
+}
+
+
+void Connection::WillPerform() {
+    
+    //Applied right before the handle is performed rather than when the connection starts, so 
+    //that a connection queued by the manager neither holds an endpoint nor uses stale addresses.
+    if ((dns_cache_ != nullptr) && (dns_resolve_items_ == nullptr)) {
+        ApplyDnsCache();
+    }
+    
+    if ((load_balancer_ != nullptr) || (load_balancer_items_ != nullptr)) {
+        ApplyLoadBalancer();
+    }
+}
+
+
+void Connection::ApplyDnsCache() {
+    
+    std::shared_ptr<const curl_slist> dns_cache_items;
+    
+    std::string host;
+    long port = 0;
+    if (GetUrlHostAndPort(url_, host, port)) {
+        dns_cache_items = dns_cache_->Find(host, port);
+    }
+    
+    //Items are applied once each time they are set, set them again even if they are not changed,
+    //in case libcurl's DNS cache has dropped them.
+    dns_cache_items_ = dns_cache_items;
+    curl_easy_setopt(handle_, CURLOPT_RESOLVE, dns_cache_items_.get());
+    
+    WriteConnectionLog(this) << "DNS cache " << (dns_cache_items_ != nullptr ? "hit" : "miss") << '.';
+}
+
+
+void Connection::ApplyLoadBalancer() {
+    
+    //An endpoint is still held if the previous transfer was aborted.
+    ReleaseLoadBalancerEndpoint(false);
+    
+    std::shared_ptr<const curl_slist> load_balancer_items;
+    
+    if (load_balancer_ != nullptr) {
+        
+        std::string host;
+        long port = 0;
+        if (GetUrlHostAndPort(url_, host, port)) {
+            
+            std::string endpoint;
+            load_balancer_items = load_balancer_->Pick(host, port, endpoint);
+            if (load_balancer_items != nullptr) {
+                load_balancer_host_ = host;
+                load_balancer_port_ = port;
+                load_balancer_endpoint_ = endpoint;
+                WriteConnectionLog(this) << "Load balancer picks endpoint " << endpoint << '.';
+            }
+        }
+    }
+    
+    load_balancer_items_ = load_balancer_items;
+    curl_easy_setopt(handle_, CURLOPT_CONNECT_TO, load_balancer_items_.get());
+}
+
+
+void Connection::ReleaseLoadBalancerEndpoint(bool is_failed) {
+    
+    if (load_balancer_endpoint_.empty()) {
+        return;
+    }
+    
+    if (load_balancer_ != nullptr) {
+        load_balancer_->Release(load_balancer_host_, load_balancer_port_, load_balancer_endpoint_, is_failed);
+    }
+    load_balancer_endpoint_.clear();
+}
+
+
+bool Connection::WillTransfer() {
+    return true;
 }
 
 
@@ -202,21 +418,113 @@ void Connection::ResetResponseStates() {
     std::memset(error_buffer_, 0, sizeof(error_buffer_));
     request_body_read_length_ = 0;
     result_ = CURL_LAST;
+    is_rejected_by_circuit_breaker_ = false;
     response_header_.clear();
     response_body_.clear();
+    decoded_body_length_ = 0;
+    read_body_length_ = 0;
+    
+    request_pipeline_output_.clear();
+    request_pipeline_output_position_ = 0;
+    if (request_body_pipeline_ != nullptr) {
+        request_body_pipeline_->Reset();
+    }
+    if (response_body_pipeline_ != nullptr) {
+        response_body_pipeline_->Reset();
+    }
 }
 
 
 void Connection::DidFinish(CURLcode result) {
     
     is_running_ = false;
-    result_ = result;
+    
+    if (! load_balancer_endpoint_.empty()) {
+        ReleaseLoadBalancerEndpoint(IsEndpointFailed(result));
+    }
+    
+    result_ = WillFinish(result);
     
     if (finished_callback_) {
         finished_callback_(this->shared_from_this());
     }
 }
 
+
+void Connection::DidFinish(CURLcode result, const char* error) {
+    
+    //Used when the connection finishes without being performed, so the error buffer is not 
+    //touched by libcurl, and the endpoint is not to blame.
+    std::strncpy(error_buffer_, error, sizeof(error_buffer_) - 1);
+    ReleaseLoadBalancerEndpoint(false);
+    DidFinish(result);
+}
+
+
+void Connection::DidAbort() {
+    
+    is_running_ = false;
+    ReleaseLoadBalancerEndpoint(false);
+}
+
+
+bool Connection::IsEndpointFailed(CURLcode result) const {
+    
+    //Errors raised by callbacks or options of the caller, such as CURLE_WRITE_ERROR and 
+    //CURLE_ABORTED_BY_CALLBACK, say nothing about the endpoint.
+    switch (result) {
+        case CURLE_OK:
+            break;
+            
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_PEER_FAILED_VERIFICATION:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_HTTP3:
+        case CURLE_QUIC_CONNECT_ERROR:
+            return true;
+            
+        default:
+            return false;
+    }
+    
+    //Other protocols, such as FTP, use 5xx codes for permanent failures of the request.
+    const char* scheme = nullptr;
+    curl_easy_getinfo(handle_, CURLINFO_SCHEME, &scheme);
+    if ((scheme == nullptr) || (! curl_strequal(scheme, "http") && ! curl_strequal(scheme, "https"))) {
+        return false;
+    }
+    
+    long response_code = GetResponseCode();
+    return (response_code >= 500) && (response_code < 600);
+}
+
+
+CURLcode Connection::WillFinish(CURLcode result) {
+    
+    if ((result == CURLE_OK) && (response_body_pipeline_ != nullptr)) {
+        
+        ResponseBodySink sink(*this);
+        if (! response_body_pipeline_->End(sink)) {
+            
+            WriteConnectionLog(this) << "End response body pipeline failed.";
+            
+            static const char kError[] = "Response body pipeline failed to end";
+            std::strncpy(error_buffer_, kError, sizeof(error_buffer_) - 1);
+            result = CURLE_WRITE_ERROR;
+        }
+    }
+    
+    return result;
+}
+
     
 long Connection::GetResponseCode() const {
     
@@ -224,6 +532,22 @@ long Connection::GetResponseCode() const {
     curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &response_code);
     return response_code;
 }
+
+
+curl_off_t Connection::GetReceivedBodyLength() const {
+    
+    curl_off_t length = 0;
+    curl_easy_getinfo(handle_, CURLINFO_SIZE_DOWNLOAD_T, &length);
+    return length;
+}
+
+
+curl_off_t Connection::GetSentBodyLength() const {
+    
+    curl_off_t length = 0;
+    curl_easy_getinfo(handle_, CURLINFO_SIZE_UPLOAD_T, &length);
+    return length;
+}
     
 
 bool Connection::ReadBody(char* body, std::size_t expected_length, std::size_t& actual_length) {
@@ -232,6 +556,28 @@ bool Connection::ReadBody(char* body, std::size_t expected_length, std::size_t&
     
     bool is_succeeded = false;
     
+    if (request_body_pipeline_ != nullptr) {
+        is_succeeded = ReadPipelineBody(body, expected_length, actual_length);
+    }
+    else {
+        is_succeeded = ReadSourceBody(body, expected_length, actual_length);
+    }
+    
+    if (is_succeeded) {
+        WriteConnectionLog(this) << "Read body done with size " << actual_length << '.';
+    }
+    else {
+        WriteConnectionLog(this) << "Read body failed.";
+    }
+    
+    return is_succeeded;
+}
+
+
+bool Connection::ReadSourceBody(char* body, std::size_t expected_length, std::size_t& actual_length) {
+    
+    bool is_succeeded = false;
+    
     if (read_body_callback_) {
         is_succeeded = read_body_callback_(this->shared_from_this(), body, expected_length, actual_length);
     }
@@ -247,16 +593,111 @@ bool Connection::ReadBody(char* body, std::size_t expected_length, std::size_t&
     }
     
     if (is_succeeded) {
-        WriteConnectionLog(this) << "Read body done with size " << actual_length << '.';
-    }
-    else {
-        WriteConnectionLog(this) << "Read body failed.";
+        read_body_length_ += actual_length;
     }
     
     return is_succeeded;
 }
 
 
+//Collects the output of the request body pipeline. Output which is the body just read into the 
+//buffer is sent in place, other output is copied to the pending output of the connection.
+class Connection::RequestBodySink : public BodySink {
+public:
+    RequestBodySink(Connection& connection, char* buffer, std::size_t capacity) :
+        connection_(connection),
+        buffer_(buffer),
+        capacity_(capacity),
+        in_place_length_(0) { }
+    
+    bool Write(const char* data, std::size_t length) override {
+        
+        if (length == 0) {
+            return true;
+        }
+        
+        bool is_in_place = 
+            (data == buffer_) &&
+            (length <= capacity_) &&
+            (in_place_length_ == 0) &&
+            connection_.request_pipeline_output_.empty();
+        
+        if (is_in_place) {
+            in_place_length_ = length;
+        }
+        else {
+            connection_.request_pipeline_output_.append(data, length);
+        }
+        return true;
+    }
+    
+    std::size_t GetInPlaceLength() const {
+        return in_place_length_;
+    }
+    
+private:
+    Connection& connection_;
+    char* buffer_;
+    std::size_t capacity_;
+    std::size_t in_place_length_;
+};
+
+
+bool Connection::ReadPipelineBody(char* body, std::size_t expected_length, std::size_t& actual_length) {
+    
+    while (true) {
+        
+        //Output left by previous reads is sent first.
+        std::size_t pending_length = request_pipeline_output_.length() - request_pipeline_output_position_;
+        if (pending_length > 0) {
+            
+            actual_length = std::min(pending_length, expected_length);
+            std::memcpy(body, request_pipeline_output_.data() + request_pipeline_output_position_, actual_length);
+            request_pipeline_output_position_ += actual_length;
+            
+            if (request_pipeline_output_position_ == request_pipeline_output_.length()) {
+                request_pipeline_output_.clear();
+                request_pipeline_output_position_ = 0;
+            }
+            return true;
+        }
+        
+        if (request_body_pipeline_->IsEnded()) {
+            actual_length = 0;
+            return true;
+        }
+        
+        //The body is read into the buffer of libcurl directly, stages which pass it through 
+        //don't copy it.
+        std::size_t read_length = 0;
+        if (! ReadSourceBody(body, expected_length, read_length)) {
+            return false;
+        }
+        
+        RequestBodySink sink(*this, body, expected_length);
+        
+        bool is_succeeded = false;
+        if (read_length == 0) {
+            is_succeeded = request_body_pipeline_->End(sink);
+        }
+        else {
+            is_succeeded = request_body_pipeline_->Write(body, read_length, sink);
+        }
+        
+        if (! is_succeeded) {
+            return false;
+        }
+        
+        if (sink.GetInPlaceLength() > 0) {
+            actual_length = sink.GetInPlaceLength();
+            return true;
+        }
+        
+        //Stages may hold the body, keep reading until there is output or the body ends.
+    }
+}
+
+
 bool Connection::SeekBody(SeekOrigin origin, curl_off_t offset) {
  
     WriteConnectionLog(this)
@@ -267,6 +708,34 @@ bool Connection::SeekBody(SeekOrigin origin, curl_off_t offset) {
 
     bool is_succeeded = false;
     
+    if (request_body_pipeline_ != nullptr) {
+        
+        //The output of stages can't be located in the source, so only rewinding is supported, 
+        //which passes the body through the stages again.
+        if ((origin == SeekOrigin::Begin) && (offset == 0)) {
+            
+            is_succeeded = SeekSourceBody(origin, offset);
+            if (is_succeeded) {
+                request_pipeline_output_.clear();
+                request_pipeline_output_position_ = 0;
+                request_body_pipeline_->Reset();
+            }
+        }
+    }
+    else {
+        is_succeeded = SeekSourceBody(origin, offset);
+    }
+    
+    WriteConnectionLog(this) << "Seek body " << (is_succeeded ? "done" : "failed") << '.';
+    
+    return is_succeeded;
+}
+
+
+bool Connection::SeekSourceBody(SeekOrigin origin, curl_off_t offset) {
+    
+    bool is_succeeded = false;
+    
     if (read_body_callback_) {
         
         if (seek_body_callback_) {
@@ -297,8 +766,6 @@ bool Connection::SeekBody(SeekOrigin origin, curl_off_t offset) {
         }
     }
     
-    WriteConnectionLog(this) << "Seek body " << (is_succeeded ? "done" : "failed") << '.';
-    
     return is_succeeded;
 }
 
@@ -329,18 +796,33 @@ bool Connection::WriteBody(const char* body, std::size_t length) {
 
     bool is_succeeded = false;
 
-    if (write_body_callback_) {
-        is_succeeded = write_body_callback_(this->shared_from_this(), body, length);
+    if (response_body_pipeline_ != nullptr) {
+        ResponseBodySink sink(*this);
+        is_succeeded = response_body_pipeline_->Write(body, length, sink);
     }
     else {
-        response_body_.append(body, length);
-        is_succeeded = true;
+        is_succeeded = WriteBodyOutput(body, length);
+    }
+    
+    if (is_succeeded) {
+        decoded_body_length_ += length;
     }
     
     WriteConnectionLog(this) << "Write body " << (is_succeeded ? "done" : "failed") << '.';
 
     return is_succeeded;
 }
+
+
+bool Connection::WriteBodyOutput(const char* body, std::size_t length) {
+    
+    if (write_body_callback_) {
+        return write_body_callback_(this->shared_from_this(), body, length);
+    }
+    
+    response_body_.append(body, length);
+    return true;
+}
     
     
 bool Connection::Progress(curl_off_t total_download,
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
@@ -8,6 +9,11 @@
 
 namespace curlion {
 
+class BodyPipeline;
+class DnsCache;
+class LoadBalancer;
+class ShareGroup;
+
 /**
  Connection used to send request to remote peer and receive its response.
  It supports variety of network protocols, such as SMTP, IMAP and HTTP etc.
@@ -231,6 +237,27 @@ public:
              std::size_t size)
     > DebugCallback;
     
+    /**
+     Priority class used to schedule connections queued by ConnectionManager.
+     */
+    enum class Priority {
+        
+        /**
+         For background traffic, such as bulk prefetching.
+         */
+        Low,
+        
+        /**
+         The default priority.
+         */
+        Normal,
+        
+        /**
+         For latency-sensitive traffic, such as interactive requests.
+         */
+        High,
+    };
+    
     /**
      Callback prototype for connection finished.
      
@@ -252,6 +279,24 @@ public:
      */
     virtual ~Connection();
     
+    /**
+     Create a new connection with the same options as this connection.
+     
+     The underlying easy handle is duplicated with curl_easy_duphandle, so all options set to
+     this connection are copied in one call, without setting them one by one. Callbacks and the 
+     request body are copied as well, while option resources such as DNS resolve items are shared 
+     between the connections instead of being rebuilt. Response states are not copied.
+     
+     This is useful to prepare a prototype connection with common options, and clone it for each 
+     request.
+     
+     @return
+         The new connection, or nullptr if this connection is running or duplication fails.
+     
+     Derived classes override this method to create an instance of their own type.
+     */
+    virtual std::shared_ptr<Connection> Clone() const;
+    
     /**
      Start the connection in blocking manner.
      
@@ -280,6 +325,13 @@ public:
      */
     void SetUrl(const std::string& url);
     
+    /**
+     Get the URL set by SetUrl.
+     */
+    const std::string& GetUrl() const {
+        return url_;
+    }
+    
     /**
      Set the proxy used in connection.
      */
@@ -293,10 +345,22 @@ public:
     /**
      Set whether to connect to server only, don't tranfer any data.
      
+     When started by ConnectionManager, a connect-only connection which finishes successfully is 
+     kept connected, so that data can be transferred with curl_easy_send and curl_easy_recv. It 
+     is disconnected by ConnectionManager::AbortConnection, or when it is started again or 
+     destructed.
+     
      The default is false.
      */
     void SetConnectOnly(bool connect_only);
     
+    /**
+     Get whether to connect to server only.
+     */
+    bool IsConnectOnly() const {
+        return is_connect_only_;
+    }
+    
     /**
      Set custom host name to IP address resolve items to DNS cache.
      
@@ -313,6 +377,55 @@ public:
      */
     void SetDnsResolveItems(const std::multimap<std::string, std::string>& resolve_items);
     
+    /**
+     Set the DNS cache used to resolve the host of the URL.
+     
+     When the connection is handed to libcurl, after being queued by the manager if it is, 
+     addresses of the host are looked up from the cache, and fed to libcurl as CURLOPT_RESOLVE 
+     items if found. Otherwise libcurl resolves the host itself, while
+     the cache resolves it in background for later connections.
+     
+     The cache is not used if any resolve item is set by SetDnsResolveItems.
+     
+     Use DnsCache::GetDefault to share the process-wide cache. Set nullptr to stop using the cache.
+     */
+    void SetDnsCache(const std::shared_ptr<DnsCache>& dns_cache) {
+        dns_cache_ = dns_cache;
+    }
+    
+    /**
+     Set the load balancer which picks an endpoint to connect to for the host of the URL.
+     
+     When the connection is handed to libcurl, after being queued by the manager if it is, an 
+     endpoint is picked and applied as a CURLOPT_CONNECT_TO item, so the URL, the Host header 
+     and the TLS server name keep the original host. The endpoint is released when the connection 
+     finishes, and counted as failed if the connection fails to connect, to set up TLS or to send 
+     or receive data, times out, or gets a 5xx HTTP response. Errors caused by the caller, such as 
+     a transfer aborted by a callback, are not counted.
+     
+     Set nullptr to stop using the balancer.
+     */
+    void SetLoadBalancer(const std::shared_ptr<LoadBalancer>& load_balancer) {
+        load_balancer_ = load_balancer;
+    }
+    
+    /**
+     Set the share group, to share DNS cache, TLS sessions and optionally alive connections with 
+     other connections in the group.
+     
+     The connection retains the group. Set nullptr to leave the group.
+     
+     This option is equal to set CURLOPT_SHARE option to libcurl.
+     */
+    void SetShareGroup(const std::shared_ptr<ShareGroup>& share_group);
+    
+    /**
+     Get the share group set by SetShareGroup.
+     */
+    const std::shared_ptr<ShareGroup>& GetShareGroup() const {
+        return share_group_;
+    }
+    
     /**
      Set whether to verify the peer's SSL certificate.
      
@@ -351,6 +464,21 @@ public:
      */
     void SetReceiveBody(bool receive_body);
     
+    /**
+     Get whether to receive response body.
+     */
+    bool IsReceivingBody() const {
+        return is_receiving_body_;
+    }
+    
+    /**
+     Get whether the request has a body, either set by SetRequestBody or read by the read body 
+     callback.
+     */
+    bool HasRequestBody() const {
+        return (! request_body_.empty()) || (read_body_callback_ != nullptr);
+    }
+    
     /**
      Set whether to enable the progress meter.
      
@@ -397,6 +525,67 @@ public:
      */
     void SetTimeoutInMilliseconds(long milliseconds);
     
+    /**
+     Set the priority class.
+     
+     When the connection is queued by ConnectionManager, connections of higher priority classes 
+     are started first. See ConnectionManager::StartConnection for details.
+     
+     The default is Priority::Normal.
+     */
+    void SetPriority(Priority priority) {
+        priority_ = priority;
+    }
+    
+    /**
+     Get the priority class.
+     */
+    Priority GetPriority() const {
+        return priority_;
+    }
+    
+    /**
+     Set the tenant the connection belongs to.
+     
+     ConnectionManager shares running slots fairly among tenants, see 
+     ConnectionManager::SetTenantOptions. 
+     
+     The default is an empty string, which is a tenant as well.
+     */
+    void SetTenant(const std::string& tenant) {
+        tenant_ = tenant;
+    }
+    
+    /**
+     Get the tenant.
+     */
+    const std::string& GetTenant() const {
+        return tenant_;
+    }
+    
+    /**
+     Set the deadline by which the connection must be started.
+     
+     When the connection is queued by ConnectionManager, connections with earlier deadlines in 
+     the same priority class are started first. If the deadline passes before the connection 
+     starts, it is dropped and finishes with CURLE_OPERATION_TIMEDOUT.
+     
+     The deadline doesn't limit the transfer once it is started, use SetTimeoutInMilliseconds for
+     that.
+     
+     The default is time_point::max(), which means no deadline.
+     */
+    void SetDeadline(std::chrono::steady_clock::time_point deadline) {
+        deadline_ = deadline;
+    }
+    
+    /**
+     Get the deadline.
+     */
+    std::chrono::steady_clock::time_point GetDeadline() const {
+        return deadline_;
+    }
+    
     /**
      Set callback for reading request body.
      
@@ -434,6 +623,51 @@ public:
         write_body_callback_ = callback;
     }
     
+    /**
+     Set the pipeline which the request body streams through before it is sent.
+     
+     The body read from the request body or the read body callback is passed through the stages 
+     of the pipeline, and their output is sent instead. For HTTP, the output is compressed if 
+     a request content encoding is set. If the stages change the length of the body, the length 
+     must not be set in advance, so that the body is sent chunked.
+     
+     The pipeline is reset whenever the connection starts, and its stages are ended after the 
+     whole body is read. The default is nullptr, and cloned connections don't inherit it.
+     */
+    void SetRequestBodyPipeline(const std::shared_ptr<BodyPipeline>& pipeline) {
+        request_body_pipeline_ = pipeline;
+    }
+    
+    /**
+     Get the request body pipeline.
+     */
+    const std::shared_ptr<BodyPipeline>& GetRequestBodyPipeline() const {
+        return request_body_pipeline_;
+    }
+    
+    /**
+     Set the pipeline which the response body streams through before it is written.
+     
+     The body received, after being decompressed, is passed through the stages of the pipeline, 
+     and their output is written to the write body callback or the string returned by 
+     GetResponseBody.
+     
+     The pipeline is reset whenever the connection starts, and its stages are ended when the 
+     transfer succeeds. If a stage fails to end, such as a HashStage whose digest doesn't match, 
+     the connection finishes with CURLE_WRITE_ERROR. The default is nullptr, and cloned 
+     connections don't inherit it.
+     */
+    void SetResponseBodyPipeline(const std::shared_ptr<BodyPipeline>& pipeline) {
+        response_body_pipeline_ = pipeline;
+    }
+    
+    /**
+     Get the response body pipeline.
+     */
+    const std::shared_ptr<BodyPipeline>& GetResponseBodyPipeline() const {
+        return response_body_pipeline_;
+    }
+    
     /**
      Set callback for progress meter.
      */
@@ -483,7 +717,30 @@ public:
      
      The return value is undefined if the connection is not yet finished.
      */
-    long GetResponseCode() const;
+    virtual long GetResponseCode() const;
+    
+    /**
+     Get whether a finished connection is failed by the endpoint it connects to, rather than by
+     the caller.
+     
+     It is true if the connection fails to connect, to set up TLS or to send or receive data, 
+     times out, or gets a 5xx response over HTTP.
+     
+     @param result
+         The result the connection finishes with.
+     */
+    bool IsEndpointFailed(CURLcode result) const;
+    
+    /**
+     Get whether the connection is rejected by the circuit breaker of ConnectionManager, see
+     ConnectionManager::SetCircuitBreaker.
+     
+     A rejected connection finishes with CURLE_COULDNT_CONNECT without connecting, or fails to 
+     start.
+     */
+    bool IsRejectedByCircuitBreaker() const {
+        return is_rejected_by_circuit_breaker_;
+    }
     
     /**
      Get response header.
@@ -505,6 +762,44 @@ public:
         return response_body_;
     }
     
+    /**
+     Get the number of response body bytes received from the network.
+     
+     For a compressed response, this is the compressed length, see also GetDecodedBodyLength.
+     */
+    curl_off_t GetReceivedBodyLength() const;
+    
+    /**
+     Get the number of response body bytes written, after being decompressed.
+     */
+    curl_off_t GetDecodedBodyLength() const {
+        return decoded_body_length_;
+    }
+    
+    /**
+     Get the number of request body bytes sent to the network.
+     
+     For a compressed request, this is the compressed length, see also GetReadBodyLength.
+     */
+    curl_off_t GetSentBodyLength() const;
+    
+    /**
+     Get the number of request body bytes read from the request body or the read body callback,
+     before being compressed.
+     
+     Bytes read again after the body is rewound are counted again.
+     */
+    curl_off_t GetReadBodyLength() const {
+        return read_body_length_;
+    }
+    
+    /**
+     Get whether the connection is running.
+     */
+    bool IsRunning() const {
+        return is_running_;
+    }
+    
     /**
      Get the underlying easy handle.
      */
@@ -514,10 +809,21 @@ public:
     
 //Methods be called from ConnectionManager.
 private:
-    void WillStart();
+    bool WillStart();
+    void WillPerform();
     void DidFinish(CURLcode result);
+    void DidFinish(CURLcode result, const char* error);
+    void DidAbort();
     
 protected:
+    /**
+     Construct the Connection instance by duplicating a prototype.
+     
+     This constructor is used by Clone. Derived classes must call it in their own duplicating 
+     constructor. Note that the underlying handle would be nullptr if the duplication fails.
+     */
+    Connection(const Connection& prototype);
+    
     /**
      Reset response states to default.
      
@@ -540,6 +846,71 @@ protected:
      */
     virtual void ResetOptionResources();
     
+    /**
+     Called when the connection is about to transfer.
+     
+     This method is called after response states are reset. Derived classes can override this 
+     method to satisfy the connection without a transfer, by returning false. In such case, the 
+     connection finishes immediately with CURLE_OK, and the underlying handle is never performed.
+     
+     The default implementation returns true.
+     */
+    virtual bool WillTransfer();
+    
+    /**
+     Called when the connection is about to finish.
+     
+     @param result
+         The result of the transfer, or CURLE_OK if WillTransfer returned false.
+     
+     @return
+         The result reported by GetResult.
+     
+     This method is called before the finished callback. Derived classes can override this method
+     to complete their work, and they must call the same method of base class.
+     */
+    virtual CURLcode WillFinish(CURLcode result);
+    
+    /**
+     Write response header.
+     
+     The header is passed to the write header callback if it is callable; otherwise it is appended
+     to the string returned by GetResponseHeader.
+     
+     Derived classes can override this method to inspect the header, and they must call the same
+     method of base class.
+     */
+    virtual bool WriteHeader(const char* header, std::size_t length);
+    
+    /**
+     Write response body.
+     
+     The body is passed to the write body callback if it is callable; otherwise it is appended
+     to the string returned by GetResponseBody.
+     
+     Derived classes can override this method to inspect the body, and they must call the same
+     method of base class.
+     */
+    virtual bool WriteBody(const char* body, std::size_t length);
+    
+    /**
+     Read request body.
+     
+     The body is read from the read body callback if it is callable; otherwise it is read from
+     the request body.
+     
+     Derived classes can override this method to transform the body, such as compressing it, 
+     and read the original body with the same method of base class.
+     */
+    virtual bool ReadBody(char* body, std::size_t expected_length, std::size_t& actual_length);
+    
+    /**
+     Seek request body.
+     
+     Derived classes which override ReadBody should override this method as well.
+     */
+    virtual bool SeekBody(SeekOrigin origin, curl_off_t offset);
+    
 private:
     static size_t CurlReadBodyCallback(char* buffer, size_t size, size_t nitems, void* instream);
     static int CurlSeekBodyCallback(void* userp, curl_off_t offset, int origin);
@@ -556,13 +927,19 @@ private:
                                  size_t size,
                                  void* userptr);
   
+    class RequestBodySink;
+    class ResponseBodySink;
+    
     void SetInitialOptions();
+    bool ReadSourceBody(char* body, std::size_t expected_length, std::size_t& actual_length);
+    bool ReadPipelineBody(char* body, std::size_t expected_length, std::size_t& actual_length);
+    bool SeekSourceBody(SeekOrigin origin, curl_off_t offset);
+    bool WriteBodyOutput(const char* body, std::size_t length);
     void ReleaseDnsResolveItems();
+    void ApplyDnsCache();
+    void ApplyLoadBalancer();
+    void ReleaseLoadBalancerEndpoint(bool is_failed);
     
-    bool ReadBody(char* body, std::size_t expected_length, std::size_t& actual_length);
-    bool SeekBody(SeekOrigin origin, curl_off_t offset);
-    bool WriteHeader(const char* header, std::size_t length);
-    bool WriteBody(const char* body, std::size_t length);
     bool Progress(curl_off_t total_download,
                   curl_off_t current_download,
                   curl_off_t total_upload,
@@ -570,29 +947,54 @@ private:
     void Debug(DebugDataType data_type, const char* data, std::size_t size);
     
 private:
-    Connection(const Connection&) = delete;
     Connection& operator=(const Connection&) = delete;
 
 private:
     CURL* handle_;
     bool is_running_;
     
-    curl_slist* dns_resolve_items_;
+    //Whether the handle is kept in the multi handle of ConnectionManager after finished, see
+    //SetConnectOnly.
+    bool is_kept_connected_;
+    
+    std::string url_;
+    std::shared_ptr<curl_slist> dns_resolve_items_;
+    std::shared_ptr<DnsCache> dns_cache_;
+    std::shared_ptr<const curl_slist> dns_cache_items_;
+    std::shared_ptr<LoadBalancer> load_balancer_;
+    std::shared_ptr<const curl_slist> load_balancer_items_;
+    std::string load_balancer_host_;
+    long load_balancer_port_;
+    std::string load_balancer_endpoint_;
+    std::shared_ptr<ShareGroup> share_group_;
+    bool is_connect_only_;
+    bool is_receiving_body_;
     std::string request_body_;
     std::size_t request_body_read_length_;
+    Priority priority_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::string tenant_;
     ReadBodyCallback read_body_callback_;
     SeekBodyCallback seek_body_callback_;
     WriteHeaderCallback write_header_callback_;
     WriteBodyCallback write_body_callback_;
+    std::shared_ptr<BodyPipeline> request_body_pipeline_;
+    std::string request_pipeline_output_;
+    std::size_t request_pipeline_output_position_;
+    std::shared_ptr<BodyPipeline> response_body_pipeline_;
     ProgressCallback progress_callback_;
     DebugCallback debug_callback_;
     FinishedCallback finished_callback_;
     CURLcode result_;
+    bool is_rejected_by_circuit_breaker_;
     char error_buffer_[CURL_ERROR_SIZE]{};
     std::string response_header_;
     std::string response_body_;
+    curl_off_t decoded_body_length_;
+    curl_off_t read_body_length_;
     
     friend class ConnectionManager;
+    friend class ConnectionPool;
 };
 
 }
@@ -1,16 +1,36 @@
 #include "connection_manager.h"
+#include <algorithm>
+#include "adaptive_concurrency_limiter.h"
+#include "circuit_breaker.h"
 #include "connection.h"
 #include "error.h"
 #include "log.h"
 #include "socket_factory.h"
 #include "socket_watcher.h"
 #include "timer.h"
+#include "url.h"
 
 namespace curlion {
     
 static inline LoggerProxy WriteManagerLog(void* manager_idenditifier) {
     return Log() << "Manager(" << manager_idenditifier << "): ";
 }
+
+
+static std::error_condition MakeCircuitBreakerOpenError() {
+    return std::error_condition(static_cast<int>(CurlionError::CircuitBreakerOpen), CurlionErrorCategory());
+}
+
+
+static bool IsConnectionFailed(const std::shared_ptr<Connection>& connection, CURLcode result) {
+    
+    if (connection->IsEndpointFailed(result)) {
+        return true;
+    }
+    
+    //The host is not failing but overloaded.
+    return (result == CURLE_OK) && (connection->GetResponseCode() == 429);
+}
     
 
 ConnectionManager::ConnectionManager(const std::shared_ptr<SocketFactory>& socket_factory,
@@ -18,7 +38,13 @@ ConnectionManager::ConnectionManager(const std::shared_ptr<SocketFactory>& socke
                                      const std::shared_ptr<Timer>& timer) :
     socket_factory_(socket_factory),
     socket_watcher_(socket_watcher),
-    timer_(timer) {
+    timer_(timer),
+    is_curl_timer_set_(false),
+    max_running_count_(0),
+    max_running_count_per_host_(0),
+    starvation_timeout_(10000),
+    virtual_time_(0),
+    next_pending_sequence_(0) {
     
     multi_handle_ = curl_multi_init();
     curl_multi_setopt(multi_handle_, CURLMOPT_TIMERFUNCTION, CurlTimerCallback);
@@ -40,12 +66,14 @@ std::error_condition ConnectionManager::StartConnection(const std::shared_ptr<Co
     
     CURL* easy_handle = connection->GetHandle();
     
-    auto iterator = running_connections_.find(easy_handle);
-    if (iterator != running_connections_.end()) {
+    if ((running_connections_.find(easy_handle) != running_connections_.end()) ||
+        (pending_connections_.find(easy_handle) != pending_connections_.end())) {
         WriteManagerLog(this) << "Try to start an already running connection(" << connection.get() << "). Ignored.";
         return error;
     }
     
+    ReleaseConnectedConnection(connection);
+    
     WriteManagerLog(this) << "Start a connection(" << connection.get() << ").";
     
     if (socket_factory_ != nullptr) {
@@ -59,17 +87,62 @@ std::error_condition ConnectionManager::StartConnection(const std::shared_ptr<Co
         curl_easy_setopt(easy_handle, CURLOPT_CLOSESOCKETFUNCTION, nullptr);
     }
     
-    connection->WillStart();
+    if ((share_group_ != nullptr) && (connection->GetShareGroup() == nullptr)) {
+        connection->SetShareGroup(share_group_);
+    }
+    
+    std::string host = GetHostKey(connection);
     
-    iterator = running_connections_.insert(std::make_pair(easy_handle, connection)).first;
+    //Fail fast without queueing while the circuit is open. It is checked before WillStart, which 
+    //looks up the response cache and sets up the request, since DidAbort doesn't undo that.
+    if ((circuit_breaker_ != nullptr) &&
+        ! host.empty() &&
+        (circuit_breaker_->GetState(host) == CircuitBreaker::State::Open)) {
+        WriteManagerLog(this) << "Connection(" << connection.get() << ") is rejected since the circuit of " << host << " is open.";
+        connection->DidAbort();
+        connection->is_rejected_by_circuit_breaker_ = true;
+        return MakeCircuitBreakerOpenError();
+    }
     
-    CURLMcode result = curl_multi_add_handle(multi_handle_, easy_handle);
-    if (result != CURLM_OK) {
-        WriteManagerLog(this) << "curl_multi_add_handle failed with result: " << result << '.';
-        running_connections_.erase(iterator);
-        error.assign(result, CurlMultiErrorCategory());
+    if (! connection->WillStart()) {
+        WriteManagerLog(this) << "Connection(" << connection.get() << ") is finished without transfer.";
+        connection->DidFinish(CURLE_OK);
+        return error;
+    }
+    
+    auto now = std::chrono::steady_clock::now();
+    if (connection->GetDeadline() <= now) {
+        WriteManagerLog(this) << "Connection(" << connection.get() << ") is dropped since its deadline has passed.";
+        connection->DidFinish(CURLE_OPERATION_TIMEDOUT, "Deadline passed before the connection started");
+        return error;
+    }
+    
+    //Connections of the same tenant queued earlier for the same host go first. Connections of
+    //other tenants, if any, are queued because they can't be started.
+    bool has_pending_connections = false;
+    auto tenant_iterator = tenant_states_.find(connection->GetTenant());
+    if (tenant_iterator != tenant_states_.end()) {
+        const auto& pending_queues = tenant_iterator->second.pending_queues;
+        has_pending_connections = pending_queues.find(host) != pending_queues.end();
     }
     
+    if (! has_pending_connections && CanStartConnection(connection->GetTenant(), host)) {
+        
+        error = AddConnection(connection, host);
+        if (error == MakeCircuitBreakerOpenError()) {
+            //Rejected by a half-open circuit after WillStart, finish it the same way as a queued 
+            //one so that the request set up by WillStart is restored.
+            FinishRejectedConnection(connection);
+            return std::error_condition();
+        }
+        if (error) {
+            connection->DidAbort();
+        }
+        return error;
+    }
+    
+    QueueConnection(connection, host);
+    DropExpiredConnections(now);
     return error;
 }
 
@@ -80,6 +153,21 @@ std::error_condition ConnectionManager::AbortConnection(const std::shared_ptr<Co
     
     CURL* easy_handle = connection->GetHandle();
     
+    if (pending_connections_.find(easy_handle) != pending_connections_.end()) {
+        
+        WriteManagerLog(this) << "Abort a pending connection(" << easy_handle << ").";
+        
+        DequeueConnection(easy_handle);
+        ReleaseTenantState(connection->GetTenant());
+        connection->DidAbort();
+        DropExpiredConnections(std::chrono::steady_clock::now());
+        return error;
+    }
+    
+    if (ReleaseConnectedConnection(connection)) {
+        return error;
+    }
+    
     auto iterator = running_connections_.find(easy_handle);
     if (iterator == running_connections_.end()) {
         WriteManagerLog(this) << "Try to abort a not running connection(" << easy_handle << "). Ignored.";
@@ -88,7 +176,8 @@ std::error_condition ConnectionManager::AbortConnection(const std::shared_ptr<Co
     
     WriteManagerLog(this) << "Abort a connection(" << easy_handle << ").";
     
-    running_connections_.erase(iterator);
+    RemoveConnection(easy_handle);
+    connection->DidAbort();
     
     CURLMcode result = curl_multi_remove_handle(multi_handle_, easy_handle);
     if (result != CURLM_OK) {
@@ -96,6 +185,634 @@ std::error_condition ConnectionManager::AbortConnection(const std::shared_ptr<Co
         error.assign(result, CurlMultiErrorCategory());
     }
     
+    StartPendingConnections();
+    return error;
+}
+
+
+void ConnectionManager::SetMultiplexing(bool multiplexing) {
+    curl_multi_setopt(multi_handle_, CURLMOPT_PIPELINING, multiplexing ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+}
+
+
+void ConnectionManager::SetMaxConcurrentStreamCount(long count) {
+    curl_multi_setopt(multi_handle_, CURLMOPT_MAX_CONCURRENT_STREAMS, count);
+}
+
+
+void ConnectionManager::SetMaxRunningConnectionCount(std::size_t count) {
+    
+    max_running_count_ = count;
+    StartPendingConnections();
+}
+
+
+void ConnectionManager::SetMaxRunningConnectionCountPerHost(std::size_t count) {
+    
+    max_running_count_per_host_ = count;
+    StartPendingConnections();
+}
+
+
+void ConnectionManager::SetConcurrencyLimiter(const std::shared_ptr<AdaptiveConcurrencyLimiter>& limiter) {
+    
+    concurrency_limiter_ = limiter;
+    StartPendingConnections();
+}
+
+
+void ConnectionManager::SetCircuitBreaker(const std::shared_ptr<CircuitBreaker>& breaker) {
+    
+    circuit_breaker_ = breaker;
+}
+
+
+void ConnectionManager::SetTenantOptions(const std::string& tenant, const TenantOptions& options) {
+    
+    if (options.weight <= 0) {
+        WriteManagerLog(this) << "Invalid weight " << options.weight << " for tenant " << tenant << ". Ignored.";
+        return;
+    }
+    
+    tenant_options_[tenant] = options;
+    StartPendingConnections();
+}
+
+
+std::size_t ConnectionManager::GetPendingConnectionCount(const std::string& tenant) const {
+    
+    auto iterator = tenant_states_.find(tenant);
+    if (iterator == tenant_states_.end()) {
+        return 0;
+    }
+    return iterator->second.pending_count;
+}
+
+
+const ConnectionManager::TenantOptions& ConnectionManager::GetTenantOptions(const std::string& tenant) const {
+    
+    static const TenantOptions default_options;
+    
+    auto iterator = tenant_options_.find(tenant);
+    if (iterator == tenant_options_.end()) {
+        return default_options;
+    }
+    return iterator->second;
+}
+
+
+ConnectionManager::TenantState& ConnectionManager::GetTenantState(const std::string& tenant) {
+    
+    auto iterator = tenant_states_.find(tenant);
+    if (iterator != tenant_states_.end()) {
+        return iterator->second;
+    }
+    
+    //A tenant becoming active starts from the current virtual time, rather than making use of 
+    //the time it was idle.
+    TenantState& tenant_state = tenant_states_[tenant];
+    tenant_state.virtual_time = virtual_time_;
+    return tenant_state;
+}
+
+
+void ConnectionManager::ReleaseTenantState(const std::string& tenant) {
+    
+    auto iterator = tenant_states_.find(tenant);
+    if (iterator == tenant_states_.end()) {
+        return;
+    }
+    
+    const TenantState& tenant_state = iterator->second;
+    if ((tenant_state.running_count == 0) && (tenant_state.pending_count == 0)) {
+        tenant_states_.erase(iterator);
+    }
+}
+
+
+std::string ConnectionManager::GetHostKey(const std::shared_ptr<Connection>& connection) const {
+    
+    //Connections whose host can't be determined share an empty host, which is not limited.
+    std::string host;
+    
+    if ((max_running_count_per_host_ != 0) ||
+        (concurrency_limiter_ != nullptr) ||
+        (circuit_breaker_ != nullptr)) {
+        
+        long port = 0;
+        if (GetUrlHostAndPort(connection->GetUrl(), host, port)) {
+            host.append(1, ':');
+            host.append(std::to_string(port));
+        }
+    }
+    
+    return host;
+}
+
+
+bool ConnectionManager::CanStartConnection(const std::string& tenant, const std::string& host) const {
+    
+    if ((max_running_count_ != 0) && (running_connections_.size() >= max_running_count_)) {
+        return false;
+    }
+    
+    if (! host.empty()) {
+        
+        std::size_t max_running_count_per_host = max_running_count_per_host_;
+        if (concurrency_limiter_ != nullptr) {
+            
+            std::size_t limit = concurrency_limiter_->GetLimit(host);
+            if ((max_running_count_per_host == 0) || (limit < max_running_count_per_host)) {
+                max_running_count_per_host = limit;
+            }
+        }
+        
+        if (max_running_count_per_host != 0) {
+            
+            auto iterator = host_running_counts_.find(host);
+            if ((iterator != host_running_counts_.end()) && (iterator->second >= max_running_count_per_host)) {
+                return false;
+            }
+        }
+    }
+    
+    std::size_t max_running_count_per_tenant = GetTenantOptions(tenant).max_running_count;
+    if (max_running_count_per_tenant != 0) {
+        
+        auto iterator = tenant_states_.find(tenant);
+        if ((iterator != tenant_states_.end()) && (iterator->second.running_count >= max_running_count_per_tenant)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+
+void ConnectionManager::AddLimiterSample(const std::shared_ptr<Connection>& connection,
+                                         const std::string& host,
+                                         std::chrono::steady_clock::time_point start_time,
+                                         CURLcode result) {
+    
+    if ((concurrency_limiter_ == nullptr) || host.empty()) {
+        return;
+    }
+    
+    //Time to the first byte after the request is sent, excluding connection setup.
+    curl_off_t pretransfer_time = 0;
+    curl_off_t start_transfer_time = 0;
+    CURL* easy_handle = connection->GetHandle();
+    curl_easy_getinfo(easy_handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_time);
+    curl_easy_getinfo(easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer_time);
+    
+    std::size_t running_count = 0;
+    auto iterator = host_running_counts_.find(host);
+    if (iterator != host_running_counts_.end()) {
+        running_count = iterator->second;
+    }
+    
+    concurrency_limiter_->AddSample(host,
+                                    start_time,
+                                    std::chrono::microseconds(start_transfer_time - pretransfer_time),
+                                    IsConnectionFailed(connection, result),
+                                    running_count);
+}
+
+
+std::error_condition ConnectionManager::AddConnection(const std::shared_ptr<Connection>& connection,
+                                                      const std::string& host) {
+    
+    std::error_condition error;
+    
+    //A half-open circuit admits limited probes, checked right before the connection starts.
+    if ((circuit_breaker_ != nullptr) && ! host.empty() && ! circuit_breaker_->Allow(host)) {
+        WriteManagerLog(this) << "Connection(" << connection.get() << ") is rejected by the circuit of " << host << '.';
+        return MakeCircuitBreakerOpenError();
+    }
+    
+    connection->WillPerform();
+    
+    CURL* easy_handle = connection->GetHandle();
+    const std::string& tenant = connection->GetTenant();
+    
+    //Charge the estimated cost now, so that a burst of one tenant doesn't take all slots before
+    //any of its connections finishes. The estimation is corrected when the connection finishes.
+    TenantState& tenant_state = GetTenantState(tenant);
+    virtual_time_ = std::max(virtual_time_, tenant_state.virtual_time);
+    tenant_state.virtual_time += tenant_state.average_cost / GetTenantOptions(tenant).weight;
+    tenant_state.running_count++;
+    
+    RunningConnection running_connection;
+    running_connection.connection = connection;
+    running_connection.tenant = tenant;
+    running_connection.host = host;
+    running_connection.charged_cost = tenant_state.average_cost;
+    running_connection.start_time = std::chrono::steady_clock::now();
+    running_connections_.insert(std::make_pair(easy_handle, running_connection));
+    host_running_counts_[host]++;
+    
+    CURLMcode result = curl_multi_add_handle(multi_handle_, easy_handle);
+    if (result != CURLM_OK) {
+        WriteManagerLog(this) << "curl_multi_add_handle failed with result: " << result << '.';
+        RemoveConnection(easy_handle);
+        error.assign(result, CurlMultiErrorCategory());
+    }
+    
+    return error;
+}
+
+
+void ConnectionManager::RemoveConnection(CURL* easy_handle) {
+    
+    auto iterator = running_connections_.find(easy_handle);
+    if (iterator == running_connections_.end()) {
+        return;
+    }
+    
+    const RunningConnection& running_connection = iterator->second;
+    
+    auto host_iterator = host_running_counts_.find(running_connection.host);
+    if (host_iterator != host_running_counts_.end()) {
+        if (--host_iterator->second == 0) {
+            host_running_counts_.erase(host_iterator);
+        }
+    }
+    
+    auto tenant_iterator = tenant_states_.find(running_connection.tenant);
+    if (tenant_iterator != tenant_states_.end()) {
+        
+        curl_off_t download_size = 0;
+        curl_off_t upload_size = 0;
+        curl_easy_getinfo(easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &download_size);
+        curl_easy_getinfo(easy_handle, CURLINFO_SIZE_UPLOAD_T, &upload_size);
+        
+        //At least 1 byte is charged, so that connections without body still take shares.
+        double cost = std::max(static_cast<double>(download_size + upload_size), 1.0);
+        
+        TenantState& tenant_state = tenant_iterator->second;
+        tenant_state.virtual_time += (cost - running_connection.charged_cost) / GetTenantOptions(running_connection.tenant).weight;
+        tenant_state.average_cost = tenant_state.average_cost * 0.8 + cost * 0.2;
+        tenant_state.running_count--;
+        
+        ReleaseTenantState(running_connection.tenant);
+    }
+    
+    running_connections_.erase(iterator);
+}
+
+
+void ConnectionManager::QueueConnection(const std::shared_ptr<Connection>& connection, const std::string& host) {
+    
+    PendingConnection pending_connection;
+    pending_connection.connection = connection;
+    pending_connection.key.priority = static_cast<int>(connection->GetPriority());
+    pending_connection.key.deadline = connection->GetDeadline();
+    pending_connection.key.sequence = next_pending_sequence_++;
+    pending_connection.queued_time = std::chrono::steady_clock::now();
+    
+    TenantState& tenant_state = GetTenantState(connection->GetTenant());
+    tenant_state.pending_count++;
+    
+    PendingQueue& pending_queue = tenant_state.pending_queues[host];
+    pending_queue.pending_keys.insert(pending_connection.key);
+    pending_queue.pending_connections.insert(std::make_pair(pending_connection.key.sequence, pending_connection));
+    
+    PendingLocation location;
+    location.tenant = connection->GetTenant();
+    location.host = host;
+    location.sequence = pending_connection.key.sequence;
+    pending_connections_.insert(std::make_pair(connection->GetHandle(), location));
+    
+    WriteManagerLog(this)
+        << "Connection(" << connection.get() << ") is queued, "
+        << pending_connections_.size() << " connection(s) pending.";
+    
+    if (pending_connection.key.deadline != std::chrono::steady_clock::time_point::max()) {
+        pending_deadlines_.insert(pending_connection.key.deadline);
+        ArmTimer();
+    }
+}
+
+
+std::shared_ptr<Connection> ConnectionManager::DequeueConnection(CURL* easy_handle) {
+    
+    auto location_iterator = pending_connections_.find(easy_handle);
+    if (location_iterator == pending_connections_.end()) {
+        return nullptr;
+    }
+    
+    PendingLocation location = location_iterator->second;
+    pending_connections_.erase(location_iterator);
+    
+    auto tenant_iterator = tenant_states_.find(location.tenant);
+    if (tenant_iterator == tenant_states_.end()) {
+        return nullptr;
+    }
+    
+    TenantState& tenant_state = tenant_iterator->second;
+    
+    auto queue_iterator = tenant_state.pending_queues.find(location.host);
+    if (queue_iterator == tenant_state.pending_queues.end()) {
+        return nullptr;
+    }
+    
+    PendingQueue& pending_queue = queue_iterator->second;
+    
+    std::shared_ptr<Connection> connection;
+    
+    auto iterator = pending_queue.pending_connections.find(location.sequence);
+    if (iterator != pending_queue.pending_connections.end()) {
+        connection = iterator->second.connection;
+        
+        auto deadline_iterator = pending_deadlines_.find(iterator->second.key.deadline);
+        if (deadline_iterator != pending_deadlines_.end()) {
+            pending_deadlines_.erase(deadline_iterator);
+        }
+        
+        pending_queue.pending_keys.erase(iterator->second.key);
+        pending_queue.pending_connections.erase(iterator);
+        tenant_state.pending_count--;
+    }
+    
+    if (pending_queue.pending_connections.empty()) {
+        tenant_state.pending_queues.erase(queue_iterator);
+    }
+    
+    //The tenant state is not released here, since the connection may be started at once.
+    return connection;
+}
+
+
+bool ConnectionManager::SelectPendingConnection(std::chrono::steady_clock::time_point now, CURL*& easy_handle) const {
+    
+    //Weighted fair queuing: pick the tenant with the least virtual time among tenants having
+    //connections can be started.
+    const TenantState* selected_tenant_state = nullptr;
+    
+    for (const auto& each_pair : tenant_states_) {
+        
+        const TenantState& tenant_state = each_pair.second;
+        if ((selected_tenant_state != nullptr) &&
+            (tenant_state.virtual_time >= selected_tenant_state->virtual_time)) {
+            continue;
+        }
+        
+        CURL* candidate_handle = nullptr;
+        if (SelectPendingConnection(each_pair.first, tenant_state, now, candidate_handle)) {
+            selected_tenant_state = &tenant_state;
+            easy_handle = candidate_handle;
+        }
+    }
+    
+    return selected_tenant_state != nullptr;
+}
+
+
+bool ConnectionManager::SelectPendingConnection(const std::string& tenant,
+                                                const TenantState& tenant_state,
+                                                std::chrono::steady_clock::time_point now,
+                                                CURL*& easy_handle) const {
+    
+    const PendingConnection* selected_connection = nullptr;
+    bool is_selected_starving = false;
+    
+    for (const auto& each_pair : tenant_state.pending_queues) {
+        
+        const PendingQueue& pending_queue = each_pair.second;
+        if (! CanStartConnection(tenant, each_pair.first)) {
+            continue;
+        }
+        
+        //The earliest queued connection of the queue is the only one may be starving.
+        const PendingConnection* candidate = &pending_queue.pending_connections.begin()->second;
+        bool is_starving =
+            (starvation_timeout_.count() > 0) &&
+            (candidate->queued_time + starvation_timeout_ <= now);
+        
+        if (! is_starving) {
+            candidate = &pending_queue.pending_connections.find(pending_queue.pending_keys.begin()->sequence)->second;
+        }
+        
+        bool is_better = false;
+        if (selected_connection == nullptr) {
+            is_better = true;
+        }
+        else if (is_starving != is_selected_starving) {
+            is_better = is_starving;
+        }
+        else if (is_starving) {
+            is_better = candidate->key.sequence < selected_connection->key.sequence;
+        }
+        else {
+            is_better = candidate->key < selected_connection->key;
+        }
+        
+        if (is_better) {
+            selected_connection = candidate;
+            is_selected_starving = is_starving;
+        }
+    }
+    
+    if (selected_connection == nullptr) {
+        return false;
+    }
+    
+    easy_handle = selected_connection->connection->GetHandle();
+    return true;
+}
+
+
+void ConnectionManager::DropExpiredConnections(std::chrono::steady_clock::time_point now) {
+    
+    std::vector<CURL*> expired_handles;
+    
+    for (const auto& each_tenant_pair : tenant_states_) {
+        for (const auto& each_queue_pair : each_tenant_pair.second.pending_queues) {
+            
+            const PendingQueue& pending_queue = each_queue_pair.second;
+            
+            //Keys are ordered by deadline in each priority class, so only the leading keys of 
+            //each class need to be checked.
+            auto iterator = pending_queue.pending_keys.begin();
+            while (iterator != pending_queue.pending_keys.end()) {
+                
+                if (iterator->deadline <= now) {
+                    const auto& pending_connection = pending_queue.pending_connections.find(iterator->sequence)->second;
+                    expired_handles.push_back(pending_connection.connection->GetHandle());
+                    ++iterator;
+                    continue;
+                }
+                
+                PendingKey next_class_key;
+                next_class_key.priority = iterator->priority - 1;
+                next_class_key.deadline = std::chrono::steady_clock::time_point::min();
+                iterator = pending_queue.pending_keys.lower_bound(next_class_key);
+            }
+        }
+    }
+    
+    for (CURL* each_handle : expired_handles) {
+        
+        //The connection may have been aborted by the finished callback of another connection.
+        auto connection = DequeueConnection(each_handle);
+        if (connection == nullptr) {
+            continue;
+        }
+        ReleaseTenantState(connection->GetTenant());
+        
+        WriteManagerLog(this) << "Pending connection(" << connection.get() << ") is dropped since its deadline has passed.";
+        connection->DidFinish(CURLE_OPERATION_TIMEDOUT, "Deadline passed before the connection started");
+    }
+}
+
+
+void ConnectionManager::StartPendingConnections() {
+    
+    auto now = std::chrono::steady_clock::now();
+    DropExpiredConnections(now);
+    
+    while (! pending_connections_.empty()) {
+        
+        if ((max_running_count_ != 0) && (running_connections_.size() >= max_running_count_)) {
+            break;
+        }
+        
+        CURL* easy_handle = nullptr;
+        if (! SelectPendingConnection(now, easy_handle)) {
+            break;
+        }
+        
+        std::string host = pending_connections_.find(easy_handle)->second.host;
+        auto connection = DequeueConnection(easy_handle);
+        
+        WriteManagerLog(this) << "Start a pending connection(" << connection.get() << ").";
+        
+        auto error = AddConnection(connection, host);
+        if (error) {
+            ReleaseTenantState(connection->GetTenant());
+            if (error == MakeCircuitBreakerOpenError()) {
+                FinishRejectedConnection(connection);
+            }
+            else {
+                connection->DidFinish(CURLE_FAILED_INIT);
+            }
+        }
+    }
+}
+
+
+
+void ConnectionManager::FinishRejectedConnection(const std::shared_ptr<Connection>& connection) {
+    
+    WriteManagerLog(this) << "Connection(" << connection.get() << ") is rejected by the circuit breaker.";
+    connection->is_rejected_by_circuit_breaker_ = true;
+    connection->DidFinish(CURLE_COULDNT_CONNECT, "Circuit breaker of the host is open");
+}
+
+
+class ConnectionManager::PreconnectState {
+public:
+    PreconnectState(std::size_t count, const PreconnectCallback& callback) :
+        remaining_count_(count),
+        connected_count_(0),
+        callback_(callback) {
+        
+    }
+    
+    void ConnectionFinished(bool is_connected) {
+        
+        if (is_connected) {
+            ++connected_count_;
+        }
+        
+        --remaining_count_;
+        if ((remaining_count_ == 0) && (callback_ != nullptr)) {
+            callback_(connected_count_);
+        }
+    }
+    
+private:
+    std::size_t remaining_count_;
+    std::size_t connected_count_;
+    PreconnectCallback callback_;
+};
+
+
+std::error_condition ConnectionManager::Preconnect(const std::string& url,
+                                                   std::size_t count,
+                                                   const PreconnectCallback& callback) {
+    
+    if (count == 0) {
+        if (callback != nullptr) {
+            callback(0);
+        }
+        return std::error_condition();
+    }
+    
+    auto state = std::make_shared<PreconnectState>(count, callback);
+    return StartPreconnections(url, count, state);
+}
+
+
+std::error_condition ConnectionManager::Preconnect(const std::vector<std::pair<std::string, std::size_t>>& warmup_list,
+                                                   const PreconnectCallback& callback) {
+    
+    std::size_t total_count = 0;
+    for (const auto& each_pair : warmup_list) {
+        total_count += each_pair.second;
+    }
+    
+    if (total_count == 0) {
+        if (callback != nullptr) {
+            callback(0);
+        }
+        return std::error_condition();
+    }
+    
+    auto state = std::make_shared<PreconnectState>(total_count, callback);
+    
+    std::error_condition error;
+    for (const auto& each_pair : warmup_list) {
+        
+        auto each_error = StartPreconnections(each_pair.first, each_pair.second, state);
+        if (each_error && ! error) {
+            error = each_error;
+        }
+    }
+    
+    return error;
+}
+
+
+std::error_condition ConnectionManager::StartPreconnections(const std::string& url,
+                                                            std::size_t count,
+                                                            const std::shared_ptr<PreconnectState>& state) {
+    
+    WriteManagerLog(this) << "Preconnect " << count << " connection(s) to " << url << '.';
+    
+    std::error_condition error;
+    
+    for (std::size_t index = 0; index < count; ++index) {
+        
+        auto connection = std::make_shared<Connection>();
+        connection->SetUrl(url);
+        connection->SetReceiveBody(false);
+        connection->SetFinishedCallback([state](const std::shared_ptr<Connection>& connection) {
+            state->ConnectionFinished(connection->GetResult() == CURLE_OK);
+        });
+        
+        auto start_error = StartConnection(connection);
+        if (start_error) {
+            
+            WriteManagerLog(this) << "Start preconnection to " << url << " failed.";
+            
+            if (! error) {
+                error = start_error;
+            }
+            state->ConnectionFinished(false);
+        }
+    }
+    
     return error;
 }
 
@@ -142,11 +859,40 @@ void ConnectionManager::SetTimer(long timeout_ms) {
     
     WriteManagerLog(this) << "Set timer for " << timeout_ms << " milliseconds.";
     
+    is_curl_timer_set_ = timeout_ms >= 0;
+    if (is_curl_timer_set_) {
+        curl_timer_time_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    }
+    
+    ArmTimer();
+}
+
+
+void ConnectionManager::ArmTimer() {
+    
     timer_->Stop();
     
-    if (timeout_ms >= 0) {
-        timer_->Start(timeout_ms, std::bind(&ConnectionManager::TimerTriggered, this));
+    auto time = std::chrono::steady_clock::time_point::max();
+    if (is_curl_timer_set_) {
+        time = curl_timer_time_;
+    }
+    if (! pending_deadlines_.empty()) {
+        time = std::min(time, *pending_deadlines_.begin());
+    }
+    
+    if (time == std::chrono::steady_clock::time_point::max()) {
+        return;
+    }
+    
+    //Round up, so that the timer doesn't trigger before the time.
+    long timeout_ms = 0;
+    auto now = std::chrono::steady_clock::now();
+    if (time > now) {
+        auto timeout = time - now + std::chrono::milliseconds(1) - std::chrono::steady_clock::duration(1);
+        timeout_ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count());
     }
+    
+    timer_->Start(timeout_ms, std::bind(&ConnectionManager::TimerTriggered, this));
 }
 
 
@@ -154,9 +900,23 @@ void ConnectionManager::TimerTriggered() {
     
     WriteManagerLog(this) << "Timer triggered.";
     
-    int running_count = 0;
-    curl_multi_socket_action(multi_handle_, CURL_SOCKET_TIMEOUT, 0, &running_count);
-    CheckFinishedConnections();
+    auto now = std::chrono::steady_clock::now();
+    
+    if (is_curl_timer_set_ && (curl_timer_time_ <= now)) {
+        
+        //libcurl sets a new timer during the action if it needs one.
+        is_curl_timer_set_ = false;
+        
+        int running_count = 0;
+        curl_multi_socket_action(multi_handle_, CURL_SOCKET_TIMEOUT, 0, &running_count);
+        CheckFinishedConnections();
+    }
+    
+    if ((! pending_deadlines_.empty()) && (*pending_deadlines_.begin() <= now)) {
+        DropExpiredConnections(now);
+    }
+    
+    ArmTimer();
 }
 
 
@@ -228,24 +988,89 @@ void ConnectionManager::CheckFinishedConnections() {
         
         if (msg->msg == CURLMSG_DONE) {
             
-            curl_multi_remove_handle(multi_handle_, msg->easy_handle);
+            CURL* easy_handle = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            
+            auto iterator = running_connections_.find(easy_handle);
+            
+            bool is_kept_connected = 
+                (result == CURLE_OK) &&
+                (iterator != running_connections_.end()) &&
+                iterator->second.connection->IsConnectOnly();
+            
+            if (is_kept_connected) {
+                RemoveDestructedConnectedConnections();
+                connected_connections_[easy_handle] = iterator->second.connection;
+                iterator->second.connection->is_kept_connected_ = true;
+            }
+            else {
+                curl_multi_remove_handle(multi_handle_, easy_handle);
+            }
             
-            auto iterator = running_connections_.find(msg->easy_handle);
             if (iterator != running_connections_.end()) {
                 
-                auto connection = iterator->second;
-                running_connections_.erase(iterator);
+                auto connection = iterator->second.connection;
+                AddLimiterSample(connection, iterator->second.host, iterator->second.start_time, result);
+                if ((circuit_breaker_ != nullptr) && ! iterator->second.host.empty()) {
+                    circuit_breaker_->AddResult(iterator->second.host, IsConnectionFailed(connection, result));
+                }
+                RemoveConnection(easy_handle);
                 
                 WriteManagerLog(this)
-                    << "Connection(" << connection.get() << ") is finished with result " << msg->data.result << '.';
+                    << "Connection(" << connection.get() << ") is finished with result " << result << '.';
                 
-                connection->DidFinish(msg->data.result);
+                //Hand over the slot before the finished callback, which may start new connections.
+                StartPendingConnections();
+                connection->DidFinish(result);
             }
         }
     }
 }
 
     
+bool ConnectionManager::ReleaseConnectedConnection(const std::shared_ptr<Connection>& connection) {
+    
+    RemoveDestructedConnectedConnections();
+    
+    auto iterator = connected_connections_.find(connection->GetHandle());
+    if (iterator == connected_connections_.end()) {
+        return false;
+    }
+    
+    //The handle may belong to a new connection if the kept one is destructed.
+    bool is_same_connection = iterator->second.lock() == connection;
+    connected_connections_.erase(iterator);
+    
+    if (! is_same_connection) {
+        return false;
+    }
+    
+    WriteManagerLog(this) << "Disconnect a connect-only connection(" << connection.get() << ").";
+    
+    curl_multi_remove_handle(multi_handle_, connection->GetHandle());
+    connection->is_kept_connected_ = false;
+    return true;
+}
+
+
+void ConnectionManager::RemoveDestructedConnectedConnections() {
+    
+    //A kept connection destructed without being aborted has its handle removed from the multi
+    //handle by curl_easy_cleanup, so only the entry is left, whose handle must not be touched.
+    //ConnectionPool destroys such connections instead of recycling them for the same reason.
+    for (auto iterator = connected_connections_.begin(); iterator != connected_connections_.end(); ) {
+        
+        if (iterator->second.expired()) {
+            WriteManagerLog(this) << "Remove a destructed connect-only connection(" << iterator->first << ").";
+            iterator = connected_connections_.erase(iterator);
+        }
+        else {
+            ++iterator;
+        }
+    }
+}
+
+
 curl_socket_t ConnectionManager::CurlOpenSocketCallback(void* clientp,
                                                         curlsocktype socket_type,
                                                         curl_sockaddr* address) {
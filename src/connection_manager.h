@@ -1,13 +1,23 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
+#include <set>
+#include <string>
 #include <system_error>
+#include <utility>
+#include <vector>
 #include <curl/curl.h>
 
 namespace curlion {
 
+class AdaptiveConcurrencyLimiter;
+class CircuitBreaker;
 class Connection;
+class ShareGroup;
 class SocketFactory;
 class SocketWatcher;
 class Timer;
@@ -24,6 +34,35 @@ class Timer;
  This is a encapsulation against libcurl's multi handle.
  */
 class ConnectionManager {
+public:
+    /**
+     Callback prototype for preconnection finished.
+     
+     @param connected_count
+         The number of connections established successfully.
+     */
+    typedef std::function<void(std::size_t connected_count)> PreconnectCallback;
+    
+    /**
+     Options of a tenant, see SetTenantOptions.
+     */
+    class TenantOptions {
+    public:
+        /**
+         Share of the tenant, relative to other tenants. Must be greater than 0.
+         
+         The default is 1.
+         */
+        double weight = 1;
+        
+        /**
+         The maximum number of connections of the tenant running at the same time, 0 for no limit.
+         
+         The default is 0.
+         */
+        std::size_t max_running_count = 0;
+    };
+    
 public:
     /**
      Construct the ConnectionManager instance.
@@ -50,6 +89,24 @@ public:
      
      This method will retain the connection, until it is finished or aborted.
      
+     If the number of running connections reaches the limits, see SetMaxRunningConnectionCount
+     and SetMaxRunningConnectionCountPerHost, the connection is queued, and is started once a
+     running connection finishes. A queued connection is considered running by 
+     Connection::IsRunning.
+     
+     Queued connections of different tenants, see Connection::SetTenant, are started by weighted 
+     fair queuing, see SetTenantOptions. Queued connections of the same tenant are started in
+     this order:
+     1. Connections queued longer than the starvation timeout, see SetStarvationTimeout, in the 
+        order they are queued.
+     2. Connections of higher priority classes, see Connection::SetPriority.
+     3. Connections with earlier deadlines, see Connection::SetDeadline.
+     4. Connections queued earlier.
+     
+     Connections whose deadline has passed are dropped rather than started, they finish with 
+     CURLE_OPERATION_TIMEDOUT. The timer of the manager is armed for the earliest deadline of 
+     queued connections, so they are dropped in time even if no other connection finishes.
+     
      It is OK to call this method with the same Connection instance multiple times.
      Nothing changed if the connection is running; Otherwise it will be restarted.
      */
@@ -72,9 +129,202 @@ public:
      
      If this method fails, the connection is in an unknown condition, it should be 
      abondaned and never be reused again.
+     
+     For a connect-only connection which is kept connected after it finishes, see 
+     Connection::SetConnectOnly, this method disconnects it.
      */
     std::error_condition AbortConnection(const std::shared_ptr<Connection>& connection);
     
+    /**
+     Set the maximum number of connections running at the same time.
+     
+     Connections exceed the limit are queued. Set 0 to remove the limit. Raising the limit starts
+     queued connections immediately.
+     
+     The default is 0.
+     */
+    void SetMaxRunningConnectionCount(std::size_t count);
+    
+    /**
+     Set the maximum number of connections to the same host running at the same time.
+     
+     Hosts are distinguished by host name and port of URLs. Unlike CURLMOPT_MAX_HOST_CONNECTIONS,
+     which limits the number of sockets, this limit applies to connections, before any handle is 
+     added to libcurl. Set 0 to remove the limit.
+     
+     The limit applies to connections started after it is set. The default is 0.
+     */
+    void SetMaxRunningConnectionCountPerHost(std::size_t count);
+    
+    /**
+     Set how long a connection can be queued before it is started ahead of higher priority 
+     connections.
+     
+     This prevents low priority connections from starving under sustained high priority traffic.
+     Set 0 to disable the protection.
+     
+     The default is 10 seconds.
+     */
+    void SetStarvationTimeout(std::chrono::milliseconds timeout) {
+        starvation_timeout_ = timeout;
+    }
+    
+    /**
+     Set the limiter which tunes the limit of running connections to each host automatically.
+     
+     The limiter's limit of a host applies in addition to SetMaxRunningConnectionCountPerHost.
+     Each finished connection is reported to the limiter as a sample. A connection is considered 
+     failed if the host fails it, the same way as counted by Connection::SetLoadBalancer, or if 
+     it responds with status 429. Errors caused by the caller, such as an aborted transfer, 
+     are not failures.
+     
+     The limiter applies to connections started after it is set. Set nullptr to remove it.
+     */
+    void SetConcurrencyLimiter(const std::shared_ptr<AdaptiveConcurrencyLimiter>& limiter);
+    
+    /**
+     Set the circuit breaker which stops connecting to failing hosts.
+     
+     While the circuit of a host is open, StartConnection fails immediately with 
+     CurlionError::CircuitBreakerOpen, without touching libcurl or the response cache. A 
+     connection rejected by a half-open circuit, or a queued connection whose circuit opens 
+     before it starts, finishes with CURLE_COULDNT_CONNECT. In all these cases, 
+     Connection::IsRejectedByCircuitBreaker returns true, to tell them from real connect failures. 
+     Each finished connection is reported to the breaker, judged the same way as for 
+     SetConcurrencyLimiter.
+     
+     Set nullptr to remove it.
+     */
+    void SetCircuitBreaker(const std::shared_ptr<CircuitBreaker>& breaker);
+    
+    /**
+     Set options of a tenant.
+     
+     Running slots are shared among tenants with queued connections by weighted fair queuing,
+     in proportion to their weights. The share is measured in bytes transferred, so a tenant
+     transferring large responses gets fewer connections started than a tenant transferring 
+     small ones with the same weight. A tenant flooding the manager only delays its own 
+     connections.
+     
+     Tenants without options set use the default options.
+     */
+    void SetTenantOptions(const std::string& tenant, const TenantOptions& options);
+    
+    /**
+     Get the number of connections running in libcurl.
+     */
+    std::size_t GetRunningConnectionCount() const {
+        return running_connections_.size();
+    }
+    
+    /**
+     Get the number of connections queued to start.
+     */
+    std::size_t GetPendingConnectionCount() const {
+        return pending_connections_.size();
+    }
+    
+    /**
+     Get the number of connections of a tenant queued to start.
+     */
+    std::size_t GetPendingConnectionCount(const std::string& tenant) const;
+    
+    /**
+     Open connections to a host ahead of demand.
+     
+     @param url
+         The URL to connect to. Only its scheme, host and port matter for which connections are
+         opened.
+     
+     @param count
+         The number of connections to open.
+     
+     @param callback
+         Callback to be called once all connections are finished, can be nullptr. It may be
+         called before this method returns if no connection can be started.
+     
+     @return
+         Return an error if any connection fails to start.
+     
+     Each connection completes TCP and TLS handshakes, then sends a request without receiving
+     body, such as a HEAD request for HTTP, and is left alive in the connection cache. Later 
+     connections to the same host reuse them without handshakes. libcurl never reuses connections
+     made with CURLOPT_CONNECT_ONLY, so a request has to be sent.
+     
+     Alive connections are kept in this manager's connection cache, or in the share group's if
+     it shares connections, see SetShareGroup.
+     */
+    std::error_condition Preconnect(const std::string& url,
+                                    std::size_t count,
+                                    const PreconnectCallback& callback = nullptr);
+    
+    /**
+     Open connections to multiple hosts ahead of demand.
+     
+     @param warmup_list
+         Each element is a pair of URL and the number of connections to open, see Preconnect 
+         above.
+     
+     @param callback
+         Callback to be called once all connections to all hosts are finished, can be nullptr.
+     
+     @return
+         Return an error if any connection fails to start.
+     
+     Call this method with a list of known hot hosts on startup, so that the first requests
+     don't pay full connection setup.
+     */
+    std::error_condition Preconnect(const std::vector<std::pair<std::string, std::size_t>>& warmup_list,
+                                    const PreconnectCallback& callback = nullptr);
+    
+    /**
+     Set the share group for connections started by this manager.
+     
+     The group is attached to each started connection which has no share group set by 
+     Connection::SetShareGroup. Set the same group to multiple managers, so that they share
+     DNS cache and TLS sessions. A group sharing alive connections must not be set to multiple
+     managers, see ShareGroup.
+     
+     The group is attached when a connection starts, changing the group doesn't affect running
+     connections. Once attached, the connection keeps the group until it is changed explicitly.
+     */
+    void SetShareGroup(const std::shared_ptr<ShareGroup>& share_group) {
+        share_group_ = share_group;
+    }
+    
+    /**
+     Set whether to multiplex transfers onto HTTP/2 connections.
+     
+     When enabled, requests to the same host share a single HTTP/2 connection as separate 
+     streams, instead of each taking a connection. Use HttpConnection::SetWaitForMultiplexing 
+     to make requests started together wait for the first connection rather than opening their
+     own.
+     
+     This option is equal to set CURLMOPT_PIPELINING option to libcurl. The default is true.
+     */
+    void SetMultiplexing(bool multiplexing);
+    
+    /**
+     Set the maximum number of concurrent streams on a single HTTP/2 connection.
+     
+     The limit applies in addition to the one advertised by the server. Transfers beyond the 
+     limit open new connections.
+     
+     This option is equal to set CURLMOPT_MAX_CONCURRENT_STREAMS option to libcurl. The default 
+     is 100.
+     */
+    void SetMaxConcurrentStreamCount(long count);
+    
+    /**
+     Get the socket watcher.
+     
+     It can be used to watch sockets of connect-only connections which are kept connected, which 
+     are no longer watched by this manager.
+     */
+    const std::shared_ptr<SocketWatcher>& GetSocketWatcher() const {
+        return socket_watcher_;
+    }
+    
     /**
      Get the underlying multi handle.
      */
@@ -96,12 +346,44 @@ private:
     bool CloseSocket(curl_socket_t socket);
     
     void SetTimer(long timeout_ms);
+    void ArmTimer();
     void TimerTriggered();
     
     void WatchSocket(curl_socket_t socket, int action, void* socket_pointer);
     void SocketEventTriggered(curl_socket_t socket, bool can_write);
     
     void CheckFinishedConnections();
+    bool ReleaseConnectedConnection(const std::shared_ptr<Connection>& connection);
+    void RemoveDestructedConnectedConnections();
+    
+    class PendingKey;
+    class TenantState;
+    std::string GetHostKey(const std::shared_ptr<Connection>& connection) const;
+    bool CanStartConnection(const std::string& tenant, const std::string& host) const;
+    void AddLimiterSample(const std::shared_ptr<Connection>& connection,
+                          const std::string& host,
+                          std::chrono::steady_clock::time_point start_time,
+                          CURLcode result);
+    const TenantOptions& GetTenantOptions(const std::string& tenant) const;
+    TenantState& GetTenantState(const std::string& tenant);
+    void ReleaseTenantState(const std::string& tenant);
+    std::error_condition AddConnection(const std::shared_ptr<Connection>& connection, const std::string& host);
+    void RemoveConnection(CURL* easy_handle);
+    void QueueConnection(const std::shared_ptr<Connection>& connection, const std::string& host);
+    std::shared_ptr<Connection> DequeueConnection(CURL* easy_handle);
+    bool SelectPendingConnection(std::chrono::steady_clock::time_point now, CURL*& easy_handle) const;
+    bool SelectPendingConnection(const std::string& tenant,
+                                 const TenantState& tenant_state,
+                                 std::chrono::steady_clock::time_point now,
+                                 CURL*& easy_handle) const;
+    void DropExpiredConnections(std::chrono::steady_clock::time_point now);
+    void StartPendingConnections();
+    void FinishRejectedConnection(const std::shared_ptr<Connection>& connection);
+    
+    class PreconnectState;
+    std::error_condition StartPreconnections(const std::string& url,
+                                             std::size_t count,
+                                             const std::shared_ptr<PreconnectState>& state);
     
 private:
     ConnectionManager(const ConnectionManager&) = delete;
@@ -111,9 +393,103 @@ private:
     std::shared_ptr<SocketFactory> socket_factory_;
     std::shared_ptr<SocketWatcher> socket_watcher_;
     std::shared_ptr<Timer> timer_;
+    std::shared_ptr<ShareGroup> share_group_;
     
     CURLM* multi_handle_;
-    std::map<CURL*, std::shared_ptr<Connection>> running_connections_;
+    
+    //The timer is shared by libcurl and deadlines of queued connections, it is armed for the 
+    //earlier one.
+    bool is_curl_timer_set_;
+    std::chrono::steady_clock::time_point curl_timer_time_;
+    
+    class RunningConnection {
+    public:
+        std::shared_ptr<Connection> connection;
+        std::string tenant;
+        std::string host;
+        double charged_cost = 0;
+        std::chrono::steady_clock::time_point start_time;
+    };
+    std::map<CURL*, RunningConnection> running_connections_;
+    
+    //Finished connect-only connections, whose handles are kept in the multi handle, since libcurl
+    //closes their connections once the handles are removed.
+    std::map<CURL*, std::weak_ptr<Connection>> connected_connections_;
+    
+    //Determines the order of queued connections in a tenant, except for starving ones.
+    class PendingKey {
+    public:
+        int priority = 0;
+        std::chrono::steady_clock::time_point deadline;
+        std::uint64_t sequence = 0;
+        
+        bool operator<(const PendingKey& other) const {
+            
+            if (priority != other.priority) {
+                return priority > other.priority;
+            }
+            if (deadline != other.deadline) {
+                return deadline < other.deadline;
+            }
+            return sequence < other.sequence;
+        }
+    };
+    
+    class PendingConnection {
+    public:
+        std::shared_ptr<Connection> connection;
+        PendingKey key;
+        std::chrono::steady_clock::time_point queued_time;
+    };
+    
+    //Queued connections of a tenant to a host.
+    class PendingQueue {
+    public:
+        //Keyed by sequence, in the order they are queued.
+        std::map<std::uint64_t, PendingConnection> pending_connections;
+        std::set<PendingKey> pending_keys;
+    };
+    
+    class TenantState {
+    public:
+        std::size_t running_count = 0;
+        std::size_t pending_count = 0;
+        
+        //Bytes transferred divided by weight, the tenant with the least virtual time goes first.
+        double virtual_time = 0;
+        
+        //Estimated bytes a connection transfers, charged when it starts.
+        double average_cost = 1;
+        
+        //Keyed by host.
+        std::map<std::string, PendingQueue> pending_queues;
+    };
+    
+    class PendingLocation {
+    public:
+        std::string tenant;
+        std::string host;
+        std::uint64_t sequence = 0;
+    };
+    
+    std::size_t max_running_count_;
+    std::size_t max_running_count_per_host_;
+    std::chrono::milliseconds starvation_timeout_;
+    std::shared_ptr<AdaptiveConcurrencyLimiter> concurrency_limiter_;
+    std::shared_ptr<CircuitBreaker> circuit_breaker_;
+    
+    //Running connection count of each host.
+    std::map<std::string, std::size_t> host_running_counts_;
+    
+    std::map<std::string, TenantOptions> tenant_options_;
+    std::map<std::string, TenantState> tenant_states_;
+    double virtual_time_;
+    
+    std::map<CURL*, PendingLocation> pending_connections_;
+    std::uint64_t next_pending_sequence_;
+    
+    //Deadlines of queued connections which have one.
+    std::multiset<std::chrono::steady_clock::time_point> pending_deadlines_;
 };
 
 }
@@ -0,0 +1,148 @@
+#include "connection_pool.h"
+#include <deque>
+#include <mutex>
+#include "connection.h"
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WritePoolLog(void* pool_identifier) {
+    return Log() << "Pool(" << pool_identifier << "): ";
+}
+
+
+class ConnectionPool::State {
+public:
+    class IdleConnection {
+    public:
+        std::unique_ptr<Connection> connection;
+        std::chrono::steady_clock::time_point idle_time;
+    };
+
+public:
+    Creator creator;
+    std::size_t max_idle_count = 16;
+
+    std::mutex mutex;
+    std::deque<IdleConnection> idle_connections;
+};
+
+
+ConnectionPool::ConnectionPool(const Creator& creator) : state_(std::make_shared<State>()) {
+    state_->creator = creator;
+}
+
+
+ConnectionPool::~ConnectionPool() {
+
+}
+
+
+std::shared_ptr<Connection> ConnectionPool::Acquire() {
+
+    std::unique_ptr<Connection> connection;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+
+        //The most recently idle connection is taken first, since it is most likely to have
+        //alive connections in its cache.
+        if (! state_->idle_connections.empty()) {
+            connection = std::move(state_->idle_connections.back().connection);
+            state_->idle_connections.pop_back();
+        }
+    }
+
+    if (connection != nullptr) {
+        WritePoolLog(this) << "Reuse connection(" << connection.get() << ").";
+    }
+    else {
+
+        connection.reset(state_->creator ? state_->creator() : new Connection());
+
+        WritePoolLog(this) << "Create connection(" << connection.get() << ").";
+    }
+
+    std::weak_ptr<State> weak_state = state_;
+    return std::shared_ptr<Connection>(connection.release(), [weak_state](Connection* connection) {
+        Recycle(weak_state, connection);
+    });
+}
+
+
+void ConnectionPool::SetMaxIdleCount(std::size_t count) {
+
+    std::deque<State::IdleConnection> excess_connections;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+
+        state_->max_idle_count = count;
+
+        //The least recently idle connections are dropped first.
+        while (state_->idle_connections.size() > count) {
+            excess_connections.push_back(std::move(state_->idle_connections.front()));
+            state_->idle_connections.pop_front();
+        }
+    }
+
+    //Connections are destroyed outside the lock.
+}
+
+
+void ConnectionPool::TrimIdleConnections(std::chrono::steady_clock::duration max_idle_duration) {
+
+    auto now = std::chrono::steady_clock::now();
+
+    std::deque<State::IdleConnection> expired_connections;
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+
+        auto& idle_connections = state_->idle_connections;
+        while ((! idle_connections.empty()) && (now - idle_connections.front().idle_time > max_idle_duration)) {
+            expired_connections.push_back(std::move(idle_connections.front()));
+            idle_connections.pop_front();
+        }
+    }
+
+    WritePoolLog(this) << "Trim " << expired_connections.size() << " idle connections.";
+}
+
+
+std::size_t ConnectionPool::GetIdleCount() const {
+
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->idle_connections.size();
+}
+
+
+void ConnectionPool::Recycle(const std::weak_ptr<State>& weak_state, Connection* connection) {
+
+    std::unique_ptr<Connection> connection_holder(connection);
+
+    auto state = weak_state.lock();
+    if (state == nullptr) {
+        return;
+    }
+
+    //A connection which is still considered running is in an unknown condition, see
+    //ConnectionManager::AbortConnection. A kept connect-only connection is still added to the
+    //multi handle, destroying it is the only way to remove the handle from there.
+    if (connection->is_running_ || connection->is_kept_connected_) {
+        return;
+    }
+
+    connection->ResetOptions();
+    connection->ResetResponseStates();
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+
+    if (state->idle_connections.size() >= state->max_idle_count) {
+        return;
+    }
+
+    State::IdleConnection idle_connection;
+    idle_connection.connection = std::move(connection_holder);
+    idle_connection.idle_time = std::chrono::steady_clock::now();
+    state->idle_connections.push_back(std::move(idle_connection));
+}
+
+}
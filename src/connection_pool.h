@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+namespace curlion {
+
+class Connection;
+
+/**
+ ConnectionPool recycles connections to avoid creating and destroying easy handles repeatedly.
+
+ Call Acquire to get a connection. When the last reference to the connection is released, for
+ example after it is finished by ConnectionManager, the connection is reset and returned to the
+ pool automatically, instead of being destroyed. Resetting a connection keeps libcurl's caches
+ in the easy handle, such as alive connections and DNS cache. A connection still running, or
+ a connect-only connection still kept connected, is destroyed instead.
+
+ All options of a recycled connection are reset to default, including callbacks. Use SetUrl and
+ other setter methods to set options again after acquiring.
+
+ This class is thread safe.
+ */
+class ConnectionPool {
+public:
+    /**
+     Callback prototype for creating a new connection.
+
+     The connection must be created by new operator.
+     */
+    typedef std::function<Connection*()> Creator;
+
+public:
+    /**
+     Construct the ConnectionPool instance.
+
+     @param creator
+         Callback to create a new connection when there is no idle connection. If it is not
+         callable, an instance of Connection is created. Use this parameter to pool derived
+         connections, such as HttpConnection.
+     */
+    explicit ConnectionPool(const Creator& creator = nullptr);
+
+    /**
+     Destruct the ConnectionPool instance.
+
+     Idle connections are destroyed. Connections in use are destroyed once they are released.
+     */
+    ~ConnectionPool();
+
+    /**
+     Get a connection from the pool.
+
+     An idle connection is returned if there is one; otherwise a new connection is created.
+     */
+    std::shared_ptr<Connection> Acquire();
+
+    /**
+     Set the maximum number of idle connections.
+
+     Connections released while the pool is full are destroyed. Excess idle connections are
+     destroyed immediately if the count is lowered.
+
+     The default is 16.
+     */
+    void SetMaxIdleCount(std::size_t count);
+
+    /**
+     Destroy connections which have been idle longer than specified duration.
+
+     Call this method periodically to release resources held by idle connections.
+     */
+    void TrimIdleConnections(std::chrono::steady_clock::duration max_idle_duration);
+
+    /**
+     Get the number of idle connections.
+     */
+    std::size_t GetIdleCount() const;
+
+private:
+    class State;
+
+    static void Recycle(const std::weak_ptr<State>& state, Connection* connection);
+
+private:
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+private:
+    std::shared_ptr<State> state_;
+};
+
+}
@@ -0,0 +1,197 @@
+#include "content_encoder.h"
+#include <algorithm>
+#include <climits>
+
+#if CURLION_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#if CURLION_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace curlion {
+
+#if CURLION_ENABLE_ZLIB
+
+class GzipEncoder : public ContentEncoder {
+public:
+    GzipEncoder() : is_initialized_(false) {
+        stream_ = z_stream();
+    }
+
+    ~GzipEncoder() {
+        if (is_initialized_) {
+            deflateEnd(&stream_);
+        }
+    }
+
+    bool Initialize(int level) {
+
+        //Adding 16 to the window bits writes a gzip header and trailer instead of a zlib wrapper.
+        int result = deflateInit2(&stream_, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        is_initialized_ = result == Z_OK;
+        return is_initialized_;
+    }
+
+    bool Reset() override {
+        return deflateReset(&stream_) == Z_OK;
+    }
+
+    bool Encode(const char* input,
+                std::size_t input_length,
+                std::size_t& consumed_length,
+                bool is_input_end,
+                char* output,
+                std::size_t output_capacity,
+                std::size_t& produced_length,
+                bool& is_finished) override {
+
+        //zlib counts in uInt, larger buffers are handled in multiple calls.
+        uInt available_input = static_cast<uInt>(std::min<std::size_t>(input_length, UINT_MAX));
+        uInt available_output = static_cast<uInt>(std::min<std::size_t>(output_capacity, UINT_MAX));
+        bool is_last_input = is_input_end && (available_input == input_length);
+
+        stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+        stream_.avail_in = available_input;
+        stream_.next_out = reinterpret_cast<Bytef*>(output);
+        stream_.avail_out = available_output;
+
+        int result = deflate(&stream_, is_last_input ? Z_FINISH : Z_NO_FLUSH);
+
+        consumed_length = available_input - stream_.avail_in;
+        produced_length = available_output - stream_.avail_out;
+        is_finished = result == Z_STREAM_END;
+
+        //Z_BUF_ERROR only means no progress is possible with the given buffers.
+        return (result == Z_OK) || (result == Z_STREAM_END) || (result == Z_BUF_ERROR);
+    }
+
+private:
+    z_stream stream_;
+    bool is_initialized_;
+};
+
+#endif
+
+
+#if CURLION_ENABLE_ZSTD
+
+class ZstdEncoder : public ContentEncoder {
+public:
+    ZstdEncoder() : context_(ZSTD_createCCtx()) {
+
+    }
+
+    ~ZstdEncoder() {
+        ZSTD_freeCCtx(context_);
+    }
+
+    bool Initialize(int level) {
+
+        if (context_ == nullptr) {
+            return false;
+        }
+
+        //Level 0 means the default level of zstd.
+        std::size_t result = ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level < 0 ? 0 : level);
+        return ! ZSTD_isError(result);
+    }
+
+    bool Reset() override {
+        return ! ZSTD_isError(ZSTD_CCtx_reset(context_, ZSTD_reset_session_only));
+    }
+
+    bool Encode(const char* input,
+                std::size_t input_length,
+                std::size_t& consumed_length,
+                bool is_input_end,
+                char* output,
+                std::size_t output_capacity,
+                std::size_t& produced_length,
+                bool& is_finished) override {
+
+        ZSTD_inBuffer input_buffer = { input, input_length, 0 };
+        ZSTD_outBuffer output_buffer = { output, output_capacity, 0 };
+
+        std::size_t result = ZSTD_compressStream2(context_,
+                                                  &output_buffer,
+                                                  &input_buffer,
+                                                  is_input_end ? ZSTD_e_end : ZSTD_e_continue);
+
+        consumed_length = input_buffer.pos;
+        produced_length = output_buffer.pos;
+
+        if (ZSTD_isError(result)) {
+            is_finished = false;
+            return false;
+        }
+
+        //With ZSTD_e_end, the result is the number of bytes remaining to flush.
+        is_finished = is_input_end && (input_buffer.pos == input_length) && (result == 0);
+        return true;
+    }
+
+private:
+    ZSTD_CCtx* context_;
+};
+
+#endif
+
+
+bool ContentEncoder::IsSupported(ContentEncoding encoding) {
+
+    switch (encoding) {
+        case ContentEncoding::Identity:
+            return true;
+        case ContentEncoding::Gzip:
+            return CURLION_ENABLE_ZLIB != 0;
+        case ContentEncoding::Zstd:
+            return CURLION_ENABLE_ZSTD != 0;
+        default:
+            return false;
+    }
+}
+
+
+const char* ContentEncoder::GetName(ContentEncoding encoding) {
+
+    switch (encoding) {
+        case ContentEncoding::Gzip:
+            return "gzip";
+        case ContentEncoding::Zstd:
+            return "zstd";
+        default:
+            return "identity";
+    }
+}
+
+
+std::unique_ptr<ContentEncoder> ContentEncoder::Create(ContentEncoding encoding, int level) {
+
+#if CURLION_ENABLE_ZLIB
+    if (encoding == ContentEncoding::Gzip) {
+        std::unique_ptr<GzipEncoder> encoder(new GzipEncoder());
+        if (! encoder->Initialize(level < 0 ? Z_DEFAULT_COMPRESSION : level)) {
+            return nullptr;
+        }
+        return std::move(encoder);
+    }
+#endif
+
+#if CURLION_ENABLE_ZSTD
+    if (encoding == ContentEncoding::Zstd) {
+        std::unique_ptr<ZstdEncoder> encoder(new ZstdEncoder());
+        if (! encoder->Initialize(level)) {
+            return nullptr;
+        }
+        return std::move(encoder);
+    }
+#endif
+
+    (void)encoding;
+    (void)level;
+    return nullptr;
+}
+
+}
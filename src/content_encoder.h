@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+/**
+ CURLION_ENABLE_ZLIB and CURLION_ENABLE_ZSTD macros control whether ContentEncoder supports gzip
+ and zstd encodings. Enable them by adding CURLION_ENABLE_ZLIB=1 or CURLION_ENABLE_ZSTD=1 macro to
+ the project, and link the project with zlib or libzstd.
+ */
+#ifndef CURLION_ENABLE_ZLIB
+#define CURLION_ENABLE_ZLIB 0
+#endif
+
+#ifndef CURLION_ENABLE_ZSTD
+#define CURLION_ENABLE_ZSTD 0
+#endif
+
+namespace curlion {
+
+/**
+ Content encoding of a body.
+ */
+enum class ContentEncoding {
+
+    /**
+     No encoding.
+     */
+    Identity,
+
+    /**
+     gzip, requires CURLION_ENABLE_ZLIB.
+     */
+    Gzip,
+
+    /**
+     zstd, requires CURLION_ENABLE_ZSTD.
+     */
+    Zstd,
+};
+
+/**
+ ContentEncoder compresses a body in a streaming way.
+
+ The body is passed to Encode piece by piece, and the encoded data is produced into output
+ buffers of any size, so that a body is compressed while it is sent, without being held in
+ memory entirely.
+ */
+class ContentEncoder {
+public:
+    /**
+     Get whether an encoding is supported.
+     */
+    static bool IsSupported(ContentEncoding encoding);
+
+    /**
+     Get the name of an encoding used in Content-Encoding header, such as "gzip".
+     */
+    static const char* GetName(ContentEncoding encoding);
+
+    /**
+     Create an encoder.
+
+     @param encoding
+         The encoding, must not be ContentEncoding::Identity.
+
+     @param level
+         Compression level of the encoding, or -1 to use the default level.
+
+     @return
+         Return nullptr if the encoding is not supported, or the encoder fails to initialize.
+     */
+    static std::unique_ptr<ContentEncoder> Create(ContentEncoding encoding, int level);
+
+public:
+    /**
+     Destruct the ContentEncoder instance.
+     */
+    virtual ~ContentEncoder() { }
+
+    /**
+     Reset the encoder to encode a new body.
+
+     @return
+         Whether the reset is succeeded.
+     */
+    virtual bool Reset() = 0;
+
+    /**
+     Encode a piece of the body.
+
+     @param input
+         The piece of the body.
+
+     @param input_length
+         Length of input.
+
+     @param consumed_length
+         Return the number of bytes of input consumed. The rest must be passed again.
+
+     @param is_input_end
+         Whether input is the last piece of the body.
+
+     @param output
+         Buffer to fill encoded data.
+
+     @param output_capacity
+         Size of output.
+
+     @param produced_length
+         Return the number of bytes filled into output.
+
+     @param is_finished
+         Return whether all encoded data is produced, which is only possible after the last
+         piece is consumed.
+
+     @return
+         Whether the encoding is succeeded.
+     */
+    virtual bool Encode(const char* input,
+                        std::size_t input_length,
+                        std::size_t& consumed_length,
+                        bool is_input_end,
+                        char* output,
+                        std::size_t output_capacity,
+                        std::size_t& produced_length,
+                        bool& is_finished) = 0;
+};
+
+}
@@ -1,11 +1,29 @@
 #pragma once
 
+#include "adaptive_concurrency_limiter.h"
+#include "body_pipeline.h"
+#include "checksum.h"
+#include "chunked_upload.h"
+#include "circuit_breaker.h"
 #include "connection.h"
 #include "connection_manager.h"
+#include "connection_pool.h"
+#include "content_encoder.h"
+#include "dns_cache.h"
 #include "error.h"
+#include "event_stream.h"
 #include "http_connection.h"
+#include "http_disk_cache.h"
 #include "http_form.h"
+#include "http_header_set.h"
+#include "http_response_cache.h"
+#include "load_balancer.h"
 #include "log.h"
+#include "posix_socket_factory.h"
+#include "resumable_download.h"
+#include "segmented_download.h"
+#include "share_group.h"
 #include "socket_factory.h"
 #include "socket_watcher.h"
 #include "timer.h"
+#include "websocket.h"
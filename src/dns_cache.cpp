@@ -0,0 +1,291 @@
+#include "dns_cache.h"
+#include <cstdlib>
+#include <set>
+#include "log.h"
+
+#ifdef WIN32
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+namespace curlion {
+
+static inline LoggerProxy WriteDnsCacheLog(void* cache_identifier) {
+    return Log() << "DnsCache(" << cache_identifier << "): ";
+}
+
+
+static bool IsAddressLiteral(const std::string& host) {
+
+    if (host.empty() || (host.front() == '[')) {
+        return true;
+    }
+
+    return host.find_first_not_of("0123456789.") == std::string::npos;
+}
+
+
+const std::shared_ptr<DnsCache>& DnsCache::GetDefault() {
+
+    static std::shared_ptr<DnsCache> default_cache = std::make_shared<DnsCache>();
+    return default_cache;
+}
+
+
+DnsCache::DnsCache() :
+    time_to_live_(60),
+    refresh_ahead_(10),
+    is_stopped_(false) {
+
+    thread_ = std::thread(&DnsCache::Run, this);
+}
+
+
+DnsCache::~DnsCache() {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_stopped_ = true;
+    }
+    condition_.notify_one();
+
+    thread_.join();
+}
+
+
+void DnsCache::SetTimeToLive(std::chrono::seconds time_to_live) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    time_to_live_ = time_to_live;
+}
+
+
+void DnsCache::SetRefreshAhead(std::chrono::seconds refresh_ahead) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh_ahead_ = refresh_ahead;
+}
+
+
+std::shared_ptr<const curl_slist> DnsCache::Find(const std::string& host, long port) {
+
+    //libcurl doesn't resolve address literals.
+    if (IsAddressLiteral(host)) {
+        return nullptr;
+    }
+
+    std::string key = host + ':' + std::to_string(port);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto now = std::chrono::steady_clock::now();
+    Entry& entry = entries_[key];
+
+    if ((entry.resolve_items == nullptr) || (now >= entry.expire_time)) {
+        WriteDnsCacheLog(this) << "Miss " << key << '.';
+        ScheduleResolution(key, entry);
+        return nullptr;
+    }
+
+    if (now + refresh_ahead_ >= entry.expire_time) {
+        WriteDnsCacheLog(this) << "Refresh hot entry " << key << '.';
+        ScheduleResolution(key, entry);
+    }
+
+    return entry.resolve_items;
+}
+
+
+void DnsCache::Prefetch(const std::string& host, long port) {
+
+    if (IsAddressLiteral(host)) {
+        return;
+    }
+
+    std::string key = host + ':' + std::to_string(port);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Entry& entry = entries_[key];
+    if ((entry.resolve_items == nullptr) || (std::chrono::steady_clock::now() >= entry.expire_time)) {
+        ScheduleResolution(key, entry);
+    }
+}
+
+
+void DnsCache::Clear() {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    //Entries being resolved are kept, the resolution thread updates them later.
+    for (auto iterator = entries_.begin(); iterator != entries_.end(); ) {
+        if (iterator->second.is_resolving) {
+            iterator->second.resolve_items.reset();
+            ++iterator;
+        }
+        else {
+            iterator = entries_.erase(iterator);
+        }
+    }
+}
+
+
+std::size_t DnsCache::GetCount() const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+
+void DnsCache::ScheduleResolution(const std::string& key, Entry& entry) {
+
+    if (entry.is_resolving) {
+        return;
+    }
+
+    entry.is_resolving = true;
+    pending_keys_.push_back(key);
+    condition_.notify_one();
+}
+
+
+void DnsCache::Run() {
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+
+        condition_.wait(lock, [this]() {
+            return is_stopped_ || ! pending_keys_.empty();
+        });
+
+        if (is_stopped_) {
+            break;
+        }
+
+        std::string key = pending_keys_.front();
+        pending_keys_.pop_front();
+
+        lock.unlock();
+        std::shared_ptr<const curl_slist> resolve_items = Resolve(key);
+        lock.lock();
+
+        auto now = std::chrono::steady_clock::now();
+
+        auto iterator = entries_.find(key);
+        if (iterator != entries_.end()) {
+
+            Entry& entry = iterator->second;
+            entry.is_resolving = false;
+
+            if (resolve_items != nullptr) {
+                entry.resolve_items = resolve_items;
+                entry.expire_time = now + time_to_live_;
+            }
+            else if (entry.resolve_items == nullptr) {
+                //Nothing to serve, let the next lookup try again.
+                entries_.erase(iterator);
+            }
+            //Otherwise keep serving the previous addresses until they expire.
+        }
+
+        RemoveExpiredEntries(now);
+    }
+}
+
+
+std::shared_ptr<const curl_slist> DnsCache::Resolve(const std::string& key) const {
+
+    std::size_t colon_index = key.rfind(':');
+    std::string host = key.substr(0, colon_index);
+    std::string port = key.substr(colon_index + 1);
+
+    WriteDnsCacheLog((void*)this) << "Resolve " << key << '.';
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* address_infos = nullptr;
+    int result = getaddrinfo(host.c_str(), port.c_str(), &hints, &address_infos);
+    if (result != 0) {
+        WriteDnsCacheLog((void*)this) << "getaddrinfo failed for " << key << " with result: " << result << '.';
+        return nullptr;
+    }
+
+    //Format: +HOST:PORT:ADDRESS[,ADDRESS]... The leading plus sign makes the item time out in
+    //libcurl's DNS cache, rather than stay there permanently.
+    std::string item;
+    item.append(1, '+');
+    item.append(key);
+    item.append(1, ':');
+
+    std::set<std::string> addresses;
+    for (addrinfo* each_info = address_infos; each_info != nullptr; each_info = each_info->ai_next) {
+
+        char address[NI_MAXHOST] = { 0 };
+        result = getnameinfo(each_info->ai_addr,
+                             static_cast<socklen_t>(each_info->ai_addrlen),
+                             address,
+                             sizeof(address),
+                             nullptr,
+                             0,
+                             NI_NUMERICHOST);
+        if (result != 0) {
+            continue;
+        }
+
+        //Keep the order returned by getaddrinfo, which is sorted by preference.
+        if (! addresses.insert(address).second) {
+            continue;
+        }
+
+        if (addresses.size() > 1) {
+            item.append(1, ',');
+        }
+
+        if (each_info->ai_family == AF_INET6) {
+            item.append(1, '[');
+            item.append(address);
+            item.append(1, ']');
+        }
+        else {
+            item.append(address);
+        }
+    }
+
+    freeaddrinfo(address_infos);
+
+    if (addresses.empty()) {
+        return nullptr;
+    }
+
+    WriteDnsCacheLog((void*)this) << "Resolved " << item << '.';
+
+    curl_slist* resolve_items = curl_slist_append(nullptr, item.c_str());
+    if (resolve_items == nullptr) {
+        return nullptr;
+    }
+
+    return std::shared_ptr<const curl_slist>(resolve_items, curl_slist_free_all);
+}
+
+
+void DnsCache::RemoveExpiredEntries(std::chrono::steady_clock::time_point now) {
+
+    for (auto iterator = entries_.begin(); iterator != entries_.end(); ) {
+
+        const Entry& entry = iterator->second;
+        if (! entry.is_resolving && (entry.resolve_items != nullptr) && (now >= entry.expire_time)) {
+            iterator = entries_.erase(iterator);
+        }
+        else {
+            ++iterator;
+        }
+    }
+}
+
+}
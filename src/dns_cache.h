@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <curl/curl.h>
+
+namespace curlion {
+
+/**
+ DnsCache resolves host names asynchronously and caches the results for connections.
+
+ Host names are resolved in a background thread, so a connection never waits for a lookup made by
+ the cache. Connections attached with Connection::SetDnsCache look up their host when they start.
+ On a hit, the cached addresses are fed to libcurl as CURLOPT_RESOLVE items. The items are built
+ once per resolution and shared by all connections. On a miss, the connection falls back to
+ libcurl's own resolver, and the host is resolved in background for later connections.
+
+ Cached addresses expire after the time to live. Entries which are looked up during the last part
+ of their lifetime are considered hot, and are refreshed in background before they expire, so
+ that connections to hot hosts never see a miss.
+
+ Use GetDefault to get the process-wide instance.
+
+ This class is thread safe.
+ */
+class DnsCache {
+public:
+    /**
+     Get the process-wide DnsCache instance.
+     */
+    static const std::shared_ptr<DnsCache>& GetDefault();
+
+public:
+    /**
+     Construct the DnsCache instance.
+     */
+    DnsCache();
+
+    /**
+     Destruct the DnsCache instance.
+
+     The background thread is waited to finish the resolution in progress.
+     */
+    ~DnsCache();
+
+    /**
+     Set how long resolved addresses are cached.
+
+     The system resolver doesn't report record TTLs, so a fixed time to live is applied to all
+     entries. Changing it affects entries resolved afterwards.
+
+     The default is 60 seconds.
+     */
+    void SetTimeToLive(std::chrono::seconds time_to_live);
+
+    /**
+     Set how long before expiration a hot entry is refreshed.
+
+     The default is 10 seconds.
+     */
+    void SetRefreshAhead(std::chrono::seconds refresh_ahead);
+
+    /**
+     Look up cached addresses of a host.
+
+     @param host
+         The host name.
+
+     @param port
+         The port.
+
+     @return
+         The CURLOPT_RESOLVE items for the host and port, or nullptr if the addresses are not cached
+         yet. The items must not be modified.
+
+     This method never blocks on resolution. The host is scheduled to be resolved in background if
+     it is missed or about to expire.
+     */
+    std::shared_ptr<const curl_slist> Find(const std::string& host, long port);
+
+    /**
+     Resolve a host in background, so that later connections hit the cache.
+     */
+    void Prefetch(const std::string& host, long port);
+
+    /**
+     Remove all cached entries.
+     */
+    void Clear();
+
+    /**
+     Get the number of cached entries.
+     */
+    std::size_t GetCount() const;
+
+private:
+    class Entry {
+    public:
+        std::shared_ptr<const curl_slist> resolve_items;
+        std::chrono::steady_clock::time_point expire_time;
+        bool is_resolving = false;
+    };
+
+    void ScheduleResolution(const std::string& key, Entry& entry);
+    void Run();
+    std::shared_ptr<const curl_slist> Resolve(const std::string& key) const;
+    void RemoveExpiredEntries(std::chrono::steady_clock::time_point now);
+
+private:
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable condition_;
+    std::chrono::seconds time_to_live_;
+    std::chrono::seconds refresh_ahead_;
+    std::map<std::string, Entry> entries_;
+    std::deque<std::string> pending_keys_;
+    bool is_stopped_;
+    std::thread thread_;
+};
+
+}
@@ -40,5 +40,41 @@ inline const std::error_category& CurlFormErrorCategory() {
     return category;
 }
 
+
+/**
+ Errors reported by curlion itself, rather than by libcurl.
+ */
+enum class CurlionError {
+    
+    /**
+     The connection is rejected since the circuit breaker of its host is open.
+     */
+    CircuitBreakerOpen = 1,
+};
+    
+
+inline const std::error_category& CurlionErrorCategory() {
+    
+    class CurlionErrorCategory : public std::error_category {
+    public:
+        const char* name() const noexcept override {
+            return "curlion";
+        }
+        
+        std::string message(int condition) const override {
+            
+            switch (static_cast<CurlionError>(condition)) {
+                case CurlionError::CircuitBreakerOpen:
+                    return "Circuit breaker is open";
+                default:
+                    return std::string();
+            }
+        }
+    };
+    
+    static CurlionErrorCategory category;
+    return category;
+}
+
     
 }
@@ -0,0 +1,531 @@
+#include "event_stream.h"
+#include <cstdlib>
+#include <cstring>
+#include "connection_manager.h"
+#include "http_connection.h"
+#include "log.h"
+#include "timer.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteStreamLog(void* stream_identifier) {
+    return Log() << "EventStream(" << stream_identifier << "): ";
+}
+
+
+static bool IsField(const char* field, std::size_t field_length, const char* name) {
+    return (std::strlen(name) == field_length) && (std::memcmp(field, name, field_length) == 0);
+}
+
+
+EventStream::EventStream(ConnectionManager& connection_manager,
+                         const std::shared_ptr<HttpConnection>& prototype,
+                         const std::shared_ptr<Timer>& timer) :
+    connection_manager_(connection_manager),
+    prototype_(prototype),
+    timer_(timer),
+    format_(Format::ServerSentEvents),
+    idle_timeout_(0),
+    reconnect_delay_(3000),
+    max_reconnect_count_(3),
+    max_line_length_(1024 * 1024),
+    is_running_(false),
+    is_timer_running_(false),
+    reconnect_count_(0),
+    total_reconnect_count_(0),
+    is_response_verified_(false),
+    is_first_line_(true),
+    is_last_character_cr_(false),
+    result_(CURL_LAST),
+    response_code_(0) {
+
+}
+
+
+EventStream::~EventStream() {
+    StopTimer();
+}
+
+
+std::error_condition EventStream::Start() {
+
+    if (is_running_) {
+        return std::make_error_condition(std::errc::operation_in_progress);
+    }
+
+    if (prototype_->IsRunning()) {
+        return std::make_error_condition(std::errc::device_or_resource_busy);
+    }
+
+    reconnect_count_ = 0;
+    total_reconnect_count_ = 0;
+    result_ = CURL_LAST;
+    response_code_ = 0;
+    error_.clear();
+
+    WriteStreamLog(this) << "Start.";
+
+    is_running_ = true;
+    self_ = shared_from_this();
+
+    auto error = StartTransfer();
+    if (error) {
+        is_running_ = false;
+        self_.reset();
+    }
+    return error;
+}
+
+
+void EventStream::Abort() {
+
+    if (! is_running_) {
+        return;
+    }
+
+    WriteStreamLog(this) << "Abort.";
+    Finish(CURLE_ABORTED_BY_CALLBACK, "Stream is aborted");
+}
+
+
+std::error_condition EventStream::StartTransfer() {
+
+    auto connection = std::static_pointer_cast<HttpConnection>(prototype_->Clone());
+    if (connection == nullptr) {
+        WriteStreamLog(this) << "Clone connection failed.";
+        return std::make_error_condition(std::errc::not_enough_memory);
+    }
+
+    is_response_verified_ = false;
+    is_first_line_ = true;
+    is_last_character_cr_ = false;
+    line_buffer_.clear();
+    event_type_.clear();
+    event_data_.clear();
+
+    if ((format_ == Format::ServerSentEvents) && ! last_event_id_.empty()) {
+        connection->AddRequestHeader("Last-Event-ID", last_event_id_);
+    }
+
+    connection->SetWriteBodyCallback([this](const std::shared_ptr<Connection>& connection,
+                                            const char* body,
+                                            std::size_t length) {
+        return WriteBody(std::static_pointer_cast<HttpConnection>(connection), body, length);
+    });
+
+    connection->SetFinishedCallback([this](const std::shared_ptr<Connection>& connection) {
+
+        //Keep alive since the stream may finish and release itself.
+        auto self = shared_from_this();
+        TransferFinished(std::static_pointer_cast<HttpConnection>(connection));
+    });
+
+    connection_ = connection;
+
+    auto error = connection_manager_.StartConnection(connection);
+    if (error) {
+        WriteStreamLog(this) << "Start connection failed: " << error.message() << '.';
+        if (connection_ == connection) {
+            connection_.reset();
+        }
+        return error;
+    }
+
+    last_received_time_ = std::chrono::steady_clock::now();
+    if ((timer_ != nullptr) && (idle_timeout_.count() > 0)) {
+        StartTimer(static_cast<long>(idle_timeout_.count()), std::bind(&EventStream::IdleTimerTriggered, this));
+    }
+    return error;
+}
+
+
+bool EventStream::WriteBody(const std::shared_ptr<HttpConnection>& connection,
+                            const char* body,
+                            std::size_t length) {
+
+    if (! is_running_ || (connection != connection_)) {
+        return false;
+    }
+
+    last_received_time_ = std::chrono::steady_clock::now();
+
+    if (! is_response_verified_) {
+        response_code_ = connection->GetResponseCode();
+        is_response_verified_ = true;
+    }
+
+    //Bodies of error responses are not events, they are dropped.
+    if (response_code_ != 200) {
+        return true;
+    }
+
+    const char* begin = body;
+    const char* end = body + length;
+
+    //The LF of a CR LF pair split between pieces.
+    if (is_last_character_cr_ && (begin < end)) {
+        if (*begin == '\n') {
+            ++begin;
+        }
+        is_last_character_cr_ = false;
+    }
+
+    while (begin < end) {
+
+        //Lines end with LF for both formats, and with CR or CR LF for Server-Sent Events.
+        const char* line_end = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        if (format_ == Format::ServerSentEvents) {
+            const char* cr = static_cast<const char*>(std::memchr(begin, '\r', (line_end == nullptr ? end : line_end) - begin));
+            if (cr != nullptr) {
+                line_end = cr;
+            }
+        }
+
+        std::size_t segment_length = (line_end == nullptr ? end : line_end) - begin;
+        if (line_buffer_.length() + segment_length > max_line_length_) {
+            WriteStreamLog(this) << "Line exceeds the maximum length.";
+            result_ = CURLE_FILESIZE_EXCEEDED;
+            error_ = "Line exceeds the maximum length";
+            return false;
+        }
+
+        //Keep the incomplete line until the rest is received.
+        if (line_end == nullptr) {
+            line_buffer_.append(begin, segment_length);
+            break;
+        }
+
+        bool is_succeeded = false;
+
+        //Lines within a piece are parsed in place, only lines split between pieces are copied.
+        if (line_buffer_.empty()) {
+            is_succeeded = ParseLine(begin, segment_length);
+        }
+        else {
+            line_buffer_.append(begin, segment_length);
+            is_succeeded = ParseLine(line_buffer_.data(), line_buffer_.length());
+            line_buffer_.clear();
+        }
+
+        if (! is_succeeded) {
+            return false;
+        }
+
+        begin = line_end + 1;
+
+        if (*line_end == '\r') {
+            if (begin == end) {
+                is_last_character_cr_ = true;
+            }
+            else if (*begin == '\n') {
+                ++begin;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool EventStream::ParseLine(const char* line, std::size_t length) {
+
+    //Skip the UTF-8 byte order mark at the beginning of the stream.
+    if (is_first_line_) {
+        is_first_line_ = false;
+        if ((length >= 3) && (std::memcmp(line, "\xEF\xBB\xBF", 3) == 0)) {
+            line += 3;
+            length -= 3;
+        }
+    }
+
+    if (format_ == Format::ServerSentEvents) {
+        return ParseEventLine(line, length);
+    }
+
+    if ((length > 0) && (line[length - 1] == '\r')) {
+        --length;
+    }
+
+    if (length == 0) {
+        return true;
+    }
+
+    return DispatchEvent("", 0, line, length, "", 0);
+}
+
+
+bool EventStream::ParseEventLine(const char* line, std::size_t length) {
+
+    //An empty line dispatches the event.
+    if (length == 0) {
+
+        if (event_data_.empty()) {
+            event_type_.clear();
+            return true;
+        }
+
+        //Remove the LF appended after the last data field.
+        event_data_.erase(event_data_.length() - 1);
+
+        static const char kDefaultType[] = "message";
+        bool is_succeeded = DispatchEvent(event_type_.empty() ? kDefaultType : event_type_.data(),
+                                          event_type_.empty() ? sizeof(kDefaultType) - 1 : event_type_.length(),
+                                          event_data_.data(),
+                                          event_data_.length(),
+                                          last_event_id_.data(),
+                                          last_event_id_.length());
+
+        event_type_.clear();
+        event_data_.clear();
+        return is_succeeded;
+    }
+
+    //A comment, usually sent to keep the stream alive.
+    if (line[0] == ':') {
+        return true;
+    }
+
+    const char* colon = static_cast<const char*>(std::memchr(line, ':', length));
+    std::size_t field_length = (colon == nullptr) ? length : colon - line;
+    const char* value = (colon == nullptr) ? line + length : colon + 1;
+    std::size_t value_length = line + length - value;
+
+    if ((value_length > 0) && (*value == ' ')) {
+        ++value;
+        --value_length;
+    }
+
+    if (IsField(line, field_length, "data")) {
+
+        if (event_data_.length() + value_length + 1 > max_line_length_) {
+            WriteStreamLog(this) << "Event data exceeds the maximum length.";
+            result_ = CURLE_FILESIZE_EXCEEDED;
+            error_ = "Event data exceeds the maximum length";
+            return false;
+        }
+
+        event_data_.append(value, value_length);
+        event_data_.append(1, '\n');
+    }
+    else if (IsField(line, field_length, "event")) {
+        event_type_.assign(value, value_length);
+    }
+    else if (IsField(line, field_length, "id")) {
+
+        //IDs containing NUL are ignored.
+        if (std::memchr(value, '\0', value_length) == nullptr) {
+            last_event_id_.assign(value, value_length);
+        }
+    }
+    else if (IsField(line, field_length, "retry")) {
+
+        std::string delay(value, value_length);
+        if (! delay.empty() && (delay.find_first_not_of("0123456789") == std::string::npos)) {
+            reconnect_delay_ = std::strtol(delay.c_str(), nullptr, 10);
+        }
+    }
+
+    return true;
+}
+
+
+bool EventStream::DispatchEvent(const char* type,
+                                std::size_t type_length,
+                                const char* data,
+                                std::size_t data_length,
+                                const char* id,
+                                std::size_t id_length) {
+
+    //The stream is healthy once an event is received.
+    reconnect_count_ = 0;
+
+    if (event_callback_ == nullptr) {
+        return true;
+    }
+
+    Event event;
+    event.type = type;
+    event.type_length = type_length;
+    event.data = data;
+    event.data_length = data_length;
+    event.id = id;
+    event.id_length = id_length;
+
+    if (! event_callback_(shared_from_this(), event)) {
+        WriteStreamLog(this) << "Closed by the event callback.";
+        result_ = CURLE_OK;
+        error_.clear();
+        return false;
+    }
+    return true;
+}
+
+
+void EventStream::TransferFinished(const std::shared_ptr<HttpConnection>& connection) {
+
+    if (! is_running_ || (connection != connection_)) {
+        return;
+    }
+
+    connection_.reset();
+    StopTimer();
+
+    //Closed by the event callback, or a failure found while parsing.
+    if (result_ != CURL_LAST) {
+        Finish(result_, error_);
+        return;
+    }
+
+    CURLcode result = connection->GetResult();
+    response_code_ = connection->GetResponseCode();
+
+    if (result != CURLE_OK) {
+
+        std::string error = connection->GetError();
+        if (error.empty()) {
+            error = "Transfer failed";
+        }
+        Reconnect(result, error);
+        return;
+    }
+
+    if (response_code_ == 200) {
+
+        if (format_ == Format::LineDelimited) {
+
+            //The last line may not end with a line break.
+            if (! line_buffer_.empty()) {
+                std::string line;
+                line.swap(line_buffer_);
+                ParseLine(line.data(), line.length());
+            }
+
+            Finish(CURLE_OK, std::string());
+            return;
+        }
+
+        Reconnect(CURLE_GOT_NOTHING, "Stream is closed by the server");
+        return;
+    }
+
+    //Server-Sent Events are stopped by the server with 204.
+    if (response_code_ == 204) {
+        Finish(CURLE_OK, std::string());
+        return;
+    }
+
+    std::string error = "Server responds " + std::to_string(response_code_);
+    if ((response_code_ == 429) || (response_code_ >= 500)) {
+        Reconnect(CURLE_HTTP_RETURNED_ERROR, error);
+    }
+    else {
+        Finish(CURLE_HTTP_RETURNED_ERROR, error);
+    }
+}
+
+
+void EventStream::Reconnect(CURLcode result, const std::string& error) {
+
+    if (reconnect_count_ >= max_reconnect_count_) {
+        Finish(result, error);
+        return;
+    }
+
+    ++reconnect_count_;
+    ++total_reconnect_count_;
+
+    long delay = (timer_ == nullptr) ? 0 : reconnect_delay_;
+    WriteStreamLog(this) << error << ", reconnect after " << delay << " ms.";
+
+    auto start_transfer = [this, result, error]() {
+        if (StartTransfer()) {
+            Finish(result, error);
+        }
+    };
+
+    if (delay == 0) {
+        start_transfer();
+    }
+    else {
+        StartTimer(delay, start_transfer);
+    }
+}
+
+
+void EventStream::StartTimer(long timeout_ms, const std::function<void()>& callback) {
+
+    StopTimer();
+    is_timer_running_ = true;
+
+    std::weak_ptr<EventStream> weak_self = shared_from_this();
+    timer_->Start(timeout_ms, [weak_self, callback]() {
+
+        auto self = weak_self.lock();
+        if ((self == nullptr) || ! self->is_running_) {
+            return;
+        }
+
+        self->is_timer_running_ = false;
+        callback();
+    });
+}
+
+
+void EventStream::StopTimer() {
+
+    if (is_timer_running_) {
+        timer_->Stop();
+        is_timer_running_ = false;
+    }
+}
+
+
+void EventStream::IdleTimerTriggered() {
+
+    if (connection_ == nullptr) {
+        return;
+    }
+
+    auto idle_duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - last_received_time_);
+
+    //Something is received since the timer started, wait for the rest of the timeout.
+    if (idle_duration < idle_timeout_) {
+        StartTimer(static_cast<long>((idle_timeout_ - idle_duration).count()),
+                   std::bind(&EventStream::IdleTimerTriggered, this));
+        return;
+    }
+
+    connection_manager_.AbortConnection(connection_);
+    connection_.reset();
+
+    Reconnect(CURLE_OPERATION_TIMEDOUT, "Stream is idle for " + std::to_string(idle_duration.count()) + " ms");
+}
+
+
+void EventStream::Finish(CURLcode result, const std::string& error) {
+
+    if (! is_running_) {
+        return;
+    }
+
+    is_running_ = false;
+    StopTimer();
+
+    if (connection_ != nullptr) {
+        connection_manager_.AbortConnection(connection_);
+        connection_.reset();
+    }
+
+    result_ = result;
+    error_ = error;
+
+    WriteStreamLog(this) << "Finished with result " << result_ << '.';
+
+    auto self = std::move(self_);
+    if (finished_callback_ != nullptr) {
+        finished_callback_(self);
+    }
+}
+
+}
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <curl/curl.h>
+
+namespace curlion {
+
+class ConnectionManager;
+class HttpConnection;
+class Timer;
+
+/**
+ EventStream consumes a long-lived streaming response, such as Server-Sent Events
+ (text/event-stream) or newline delimited JSON, and delivers each event as soon as it is received.
+
+ The response is parsed incrementally as it arrives, events split across pieces of body are
+ reassembled, and nothing else of the body is kept, so a stream can last indefinitely without
+ growing memory.
+
+ For Server-Sent Events, the stream reconnects when the server closes it or the transfer fails,
+ after the reconnect delay, which the server can change with the retry field. The ID of the last
+ event is sent in Last-Event-ID header, so that the server can resume from it. A 204 response
+ finishes the stream. For newline delimited JSON, the stream finishes when the response ends, and
+ only reconnects when the transfer fails.
+
+ If an idle timeout is set, a stream which receives nothing for that long is considered broken,
+ and reconnects. The timeout and the reconnect delay are measured by a Timer, the same interface
+ used by ConnectionManager. It must be a separate instance from the one of the manager.
+
+ Each transfer is made with a connection cloned from a prototype, so it inherits options such as
+ URL, request headers, such as Accept, and share group. The write body and finished callbacks of
+ the prototype are not used. The prototype shouldn't set a total timeout, which would break the
+ stream periodically.
+
+ The stream must be created with std::make_shared. It is retained while running.
+ */
+class EventStream : public std::enable_shared_from_this<EventStream> {
+public:
+    /**
+     Format of the stream.
+     */
+    enum class Format {
+
+        /**
+         Server-Sent Events, text/event-stream.
+         */
+        ServerSentEvents,
+
+        /**
+         One event per line, such as newline delimited JSON. Empty lines are skipped.
+         */
+        LineDelimited,
+    };
+
+    /**
+     An event received.
+
+     The fields point into buffers of the stream, which are only valid during the event callback.
+     They are not null terminated.
+     */
+    class Event {
+    public:
+        /**
+         Type of the event, which is "message" if it is not specified by the event field.
+
+         Always empty for Format::LineDelimited.
+         */
+        const char* type = nullptr;
+        std::size_t type_length = 0;
+
+        /**
+         Data of the event. For Server-Sent Events, multiple data fields are joined by line feeds.
+         For Format::LineDelimited, this is the line without the line break.
+         */
+        const char* data = nullptr;
+        std::size_t data_length = 0;
+
+        /**
+         The last event ID, set by the id field of this or a previous event.
+
+         Always empty for Format::LineDelimited.
+         */
+        const char* id = nullptr;
+        std::size_t id_length = 0;
+    };
+
+    /**
+     Callback prototype for an event received.
+
+     @param stream
+         The EventStream instance.
+
+     @param event
+         The event.
+
+     @return
+         Whether to continue. Return false to close the stream, which finishes with CURLE_OK.
+     */
+    typedef std::function<bool(const std::shared_ptr<EventStream>& stream, const Event& event)> EventCallback;
+
+    /**
+     Callback prototype for stream finished.
+
+     @param stream
+         The EventStream instance.
+     */
+    typedef std::function<void(const std::shared_ptr<EventStream>& stream)> FinishedCallback;
+
+public:
+    /**
+     Construct the EventStream instance.
+
+     @param connection_manager
+         The manager to run connections, must outlive the stream.
+
+     @param prototype
+         The connection to clone for each transfer. It must not be running when the stream
+         starts.
+
+     @param timer
+         The timer for the idle timeout and the reconnect delay. It can be nullptr, in which case
+         there is no idle timeout, and the stream reconnects immediately.
+     */
+    EventStream(ConnectionManager& connection_manager,
+                const std::shared_ptr<HttpConnection>& prototype,
+                const std::shared_ptr<Timer>& timer);
+
+    /**
+     Destruct the EventStream instance.
+     */
+    ~EventStream();
+
+    /**
+     Set the format of the stream.
+
+     The default is Format::ServerSentEvents.
+     */
+    void SetFormat(Format format) {
+        format_ = format;
+    }
+
+    /**
+     Set the callback which is called for each event.
+     */
+    void SetEventCallback(const EventCallback& callback) {
+        event_callback_ = callback;
+    }
+
+    /**
+     Set the callback which is called when the stream finishes.
+     */
+    void SetFinishedCallback(const FinishedCallback& callback) {
+        finished_callback_ = callback;
+    }
+
+    /**
+     Set how long the stream can receive nothing before it reconnects. It requires a timer.
+
+     Servers of long-lived streams usually send comments or empty lines periodically to keep the
+     stream alive, the timeout should be longer than that period.
+
+     The default is 0, means no idle timeout.
+     */
+    void SetIdleTimeoutInMilliseconds(long milliseconds) {
+        idle_timeout_ = std::chrono::milliseconds(milliseconds < 0 ? 0 : milliseconds);
+    }
+
+    /**
+     Set how long to wait before reconnecting. It requires a timer.
+
+     For Server-Sent Events, it is replaced by the retry field sent by the server.
+
+     The default is 3000.
+     */
+    void SetReconnectDelayInMilliseconds(long milliseconds) {
+        reconnect_delay_ = milliseconds < 0 ? 0 : milliseconds;
+    }
+
+    /**
+     Set how many times the stream reconnects in a row, without receiving an event, before it
+     fails.
+
+     Only transfer failures, idle timeouts, 429 and 5xx responses, and streams closed by the
+     server are reconnected. Other HTTP errors fail the stream immediately.
+
+     The default is 3.
+     */
+    void SetMaxReconnectCount(std::size_t count) {
+        max_reconnect_count_ = count;
+    }
+
+    /**
+     Set the maximum length of a line, and of the data of an event. A stream exceeding it fails
+     with CURLE_FILESIZE_EXCEEDED.
+
+     The default is 1 MiB.
+     */
+    void SetMaxLineLength(std::size_t length) {
+        max_line_length_ = length;
+    }
+
+    /**
+     Set the last event ID sent in Last-Event-ID header when the stream starts, such as one saved
+     by a previous stream.
+
+     The default is empty, means no Last-Event-ID header.
+     */
+    void SetLastEventId(const std::string& id) {
+        last_event_id_ = id;
+    }
+
+    /**
+     Get the last event ID received.
+     */
+    const std::string& GetLastEventId() const {
+        return last_event_id_;
+    }
+
+    /**
+     Start the stream.
+
+     @return
+         Return an error if the connection fails to start. The finished callback is not called in
+         such case.
+     */
+    std::error_condition Start();
+
+    /**
+     Abort the stream.
+
+     The finished callback is called with result CURLE_ABORTED_BY_CALLBACK. Don't call it in the
+     event callback, return false from the callback instead.
+     */
+    void Abort();
+
+    /**
+     Get whether the stream is running.
+     */
+    bool IsRunning() const {
+        return is_running_;
+    }
+
+    /**
+     Get the result code.
+
+     CURLE_OK means the stream is closed by the event callback, or ended by the server.
+     CURLE_HTTP_RETURNED_ERROR is returned if the server doesn't respond 200, see
+     GetResponseCode.
+     */
+    CURLcode GetResult() const {
+        return result_;
+    }
+
+    /**
+     Get the error message of a failed stream.
+     */
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    /**
+     Get the response code of the last transfer.
+     */
+    long GetResponseCode() const {
+        return response_code_;
+    }
+
+    /**
+     Get the total number of reconnections since the stream started.
+     */
+    std::size_t GetTotalReconnectCount() const {
+        return total_reconnect_count_;
+    }
+
+private:
+    std::error_condition StartTransfer();
+    bool WriteBody(const std::shared_ptr<HttpConnection>& connection, const char* body, std::size_t length);
+    bool ParseLine(const char* line, std::size_t length);
+    bool ParseEventLine(const char* line, std::size_t length);
+    bool DispatchEvent(const char* type,
+                       std::size_t type_length,
+                       const char* data,
+                       std::size_t data_length,
+                       const char* id,
+                       std::size_t id_length);
+    void TransferFinished(const std::shared_ptr<HttpConnection>& connection);
+    void Reconnect(CURLcode result, const std::string& error);
+    void StartTimer(long timeout_ms, const std::function<void()>& callback);
+    void StopTimer();
+    void IdleTimerTriggered();
+    void Finish(CURLcode result, const std::string& error);
+
+private:
+    EventStream(const EventStream&) = delete;
+    EventStream& operator=(const EventStream&) = delete;
+
+private:
+    ConnectionManager& connection_manager_;
+    std::shared_ptr<HttpConnection> prototype_;
+    std::shared_ptr<Timer> timer_;
+
+    Format format_;
+    std::chrono::milliseconds idle_timeout_;
+    long reconnect_delay_;
+    std::size_t max_reconnect_count_;
+    std::size_t max_line_length_;
+    EventCallback event_callback_;
+    FinishedCallback finished_callback_;
+
+    bool is_running_;
+    std::shared_ptr<EventStream> self_;
+    std::shared_ptr<HttpConnection> connection_;
+    bool is_timer_running_;
+    std::chrono::steady_clock::time_point last_received_time_;
+    std::size_t reconnect_count_;
+    std::size_t total_reconnect_count_;
+
+    //Parsing states of the current response.
+    bool is_response_verified_;
+    bool is_first_line_;
+    bool is_last_character_cr_;
+    std::string line_buffer_;
+    std::string event_type_;
+    std::string event_data_;
+    std::string last_event_id_;
+
+    CURLcode result_;
+    long response_code_;
+    std::string error_;
+};
+
+}
@@ -1,4 +1,5 @@
 #include "http_connection.h"
+#include <cstring>
 #include <vector>
 #include "http_form.h"
 
@@ -9,55 +10,207 @@ static std::vector<std::string> SplitString(const std::string& string, const std
 
 
 HttpConnection::HttpConnection() :
-    request_headers_(nullptr),
+    applied_request_headers_(nullptr),
+    use_post_(false),
+    request_content_encoding_(ContentEncoding::Identity),
+    request_compression_level_(-1),
+    request_encoder_input_position_(0),
+    is_request_encoder_input_end_(false),
+    is_request_encoder_finished_(false),
+    is_request_body_encoded_(false),
+    content_encoding_header_node_(),
+    always_revalidate_(false),
+    is_served_from_cache_(false),
+    is_revalidating_(false),
+    is_storing_response_(false),
+    conditional_header_nodes_(),
     has_parsed_response_headers_(false) {
     
 }
 
 
+HttpConnection::HttpConnection(const HttpConnection& prototype) :
+    Connection(prototype),
+    request_headers_(prototype.request_headers_),
+    request_header_set_(prototype.request_header_set_),
+    applied_request_headers_(nullptr),
+    form_(prototype.form_),
+    use_post_(prototype.use_post_),
+    method_(prototype.method_),
+    request_content_encoding_(prototype.request_content_encoding_),
+    request_compression_level_(prototype.request_compression_level_),
+    request_encoder_input_position_(0),
+    is_request_encoder_input_end_(false),
+    is_request_encoder_finished_(false),
+    is_request_body_encoded_(false),
+    content_encoding_header_(prototype.content_encoding_header_),
+    content_encoding_header_node_(),
+    response_cache_(prototype.response_cache_),
+    always_revalidate_(prototype.always_revalidate_),
+    is_served_from_cache_(false),
+    is_revalidating_(false),
+    is_storing_response_(false),
+    conditional_header_nodes_(),
+    has_parsed_response_headers_(false) {
+    
+    //Encoders hold the state of a body, each connection has its own one.
+    if (request_content_encoding_ != ContentEncoding::Identity) {
+        request_encoder_ = ContentEncoder::Create(request_content_encoding_, request_compression_level_);
+    }
+    
+    //The duplicated handle may point to merged headers of the prototype, merge them again.
+    ApplyRequestHeaders();
+    
+    //The stream dependency is a node in the depended stream's tree, which is not duplicated.
+    curl_easy_setopt(GetHandle(), CURLOPT_STREAM_DEPENDS, nullptr);
+    
+    //The duplicated form shares reading positions with the prototype, build a new one.
+    if (form_ != nullptr) {
+        ApplyRequestForm();
+    }
+}
+
+
 HttpConnection::~HttpConnection() {
-    ReleaseRequestHeaders();
+
+}
+
+
+std::shared_ptr<Connection> HttpConnection::Clone() const {
+    
+    if (IsRunning()) {
+        return nullptr;
+    }
+    
+    std::shared_ptr<Connection> connection(new HttpConnection(*this));
+    if (connection->GetHandle() == nullptr) {
+        return nullptr;
+    }
+    
+    return connection;
 }
 
 
 void HttpConnection::SetUsePost(bool use_post) {
+    use_post_ = use_post;
     curl_easy_setopt(GetHandle(), CURLOPT_POST, use_post);
 }
 
 
+void HttpConnection::SetMethod(const std::string& method) {
+    method_ = method;
+    curl_easy_setopt(GetHandle(), CURLOPT_CUSTOMREQUEST, method_.empty() ? nullptr : method_.c_str());
+}
+
+
 void HttpConnection::SetRequestHeaders(const std::multimap<std::string, std::string>& headers) {
     
-    ReleaseRequestHeaders();
+    //Build a new list rather than modifying the current one, which may be shared with clones.
+    curl_slist* request_headers = nullptr;
     
     for (auto& each_header : headers) {
         
         std::string each_header_line = MakeHttpHeaderLine(each_header.first, each_header.second);
-        request_headers_ = curl_slist_append(request_headers_, each_header_line.c_str());
+        request_headers = curl_slist_append(request_headers, each_header_line.c_str());
     }
     
-    curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, request_headers_);
+    request_headers_.reset(request_headers, curl_slist_free_all);
+    ApplyRequestHeaders();
 }
 
 
 void HttpConnection::AddRequestHeader(const std::string& field, const std::string& value) {
+    
+    curl_slist* request_headers = request_headers_.get();
+    
+    //Copy the list on write if it is shared with clones.
+    if (request_headers_.use_count() > 1) {
+        
+        request_headers = nullptr;
+        for (curl_slist* each_node = request_headers_.get(); each_node != nullptr; each_node = each_node->next) {
+            request_headers = curl_slist_append(request_headers, each_node->data);
+        }
+    }
 
     std::string header_line = MakeHttpHeaderLine(field, value);
-    request_headers_ = curl_slist_append(request_headers_, header_line.c_str());
+    request_headers = curl_slist_append(request_headers, header_line.c_str());
+    
+    if (request_headers != request_headers_.get()) {
+        request_headers_.reset(request_headers, curl_slist_free_all);
+    }
     
-    curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, request_headers_);
+    ApplyRequestHeaders();
+}
+
+
+void HttpConnection::SetRequestHeaderSet(const std::shared_ptr<const HttpHeaderSet>& header_set) {
+    
+    request_header_set_ = header_set;
+    ApplyRequestHeaders();
+}
+
+
+void HttpConnection::ApplyRequestHeaders() {
+    
+    merged_request_header_nodes_.clear();
+    
+    if ((request_header_set_ == nullptr) || (request_header_set_->GetCount() == 0)) {
+        applied_request_headers_ = request_headers_.get();
+    }
+    else if (request_headers_ == nullptr) {
+        applied_request_headers_ = const_cast<curl_slist*>(request_header_set_->GetHandle());
+    }
+    else {
+        
+        //Merge nodes of both lists into a new list, the header lines are not copied.
+        for (curl_slist* each_node = request_headers_.get(); each_node != nullptr; each_node = each_node->next) {
+            merged_request_header_nodes_.push_back(*each_node);
+        }
+        
+        std::size_t override_count = merged_request_header_nodes_.size();
+        for (const curl_slist* each_node = request_header_set_->GetHandle(); each_node != nullptr; each_node = each_node->next) {
+            
+            bool is_overridden = false;
+            for (std::size_t index = 0; index < override_count; ++index) {
+                if (HttpHeaderSet::IsSameField(merged_request_header_nodes_[index].data, each_node->data)) {
+                    is_overridden = true;
+                    break;
+                }
+            }
+            
+            if (! is_overridden) {
+                merged_request_header_nodes_.push_back(*each_node);
+            }
+        }
+        
+        for (std::size_t index = 0; index < merged_request_header_nodes_.size(); ++index) {
+            bool is_last = (index + 1 == merged_request_header_nodes_.size());
+            merged_request_header_nodes_[index].next = is_last ? nullptr : &merged_request_header_nodes_[index + 1];
+        }
+        
+        applied_request_headers_ = &merged_request_header_nodes_.front();
+    }
+    
+    curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, applied_request_headers_);
 }
 
     
 void HttpConnection::SetRequestForm(const std::shared_ptr<HttpForm>& form) {
     
     form_ = form;
+    ApplyRequestForm();
+}
+
+
+void HttpConnection::ApplyRequestForm() {
     
-    curl_httppost* handle = nullptr;
+    //Each connection builds its own handle from the form, which holds positions of reading.
+    form_handle_.reset();
     if (form_ != nullptr) {
-        handle = form_->GetHandle();
+        form_handle_ = form_->CreateHandle(GetHandle());
     }
-
-    curl_easy_setopt(GetHandle(), CURLOPT_HTTPPOST, handle);
+    
+    curl_easy_setopt(GetHandle(), CURLOPT_MIMEPOST, form_handle_.get());
 }
 
     
@@ -71,6 +224,179 @@ void HttpConnection::SetMaxAutoRedirectCount(long count) {
 }
 
 
+void HttpConnection::SetHttpVersion(HttpVersion version) {
+    
+    long curl_version = CURL_HTTP_VERSION_NONE;
+    switch (version) {
+        case HttpVersion::Http1_0:
+            curl_version = CURL_HTTP_VERSION_1_0;
+            break;
+        case HttpVersion::Http1_1:
+            curl_version = CURL_HTTP_VERSION_1_1;
+            break;
+        case HttpVersion::Http2:
+            curl_version = CURL_HTTP_VERSION_2_0;
+            break;
+        case HttpVersion::Http2OverTls:
+            curl_version = CURL_HTTP_VERSION_2TLS;
+            break;
+        case HttpVersion::Http2PriorKnowledge:
+            curl_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+            break;
+        case HttpVersion::Http3:
+            curl_version = IsHttp3Supported() ? CURL_HTTP_VERSION_3 : CURL_HTTP_VERSION_2_0;
+            break;
+        case HttpVersion::Http3Only:
+#if LIBCURL_VERSION_NUM >= 0x075800
+            curl_version = CURL_HTTP_VERSION_3ONLY;
+#else
+            //Versions before 7.88.0 don't fall back with CURL_HTTP_VERSION_3.
+            curl_version = CURL_HTTP_VERSION_3;
+#endif
+            break;
+        default:
+            break;
+    }
+    
+    curl_easy_setopt(GetHandle(), CURLOPT_HTTP_VERSION, curl_version);
+}
+
+
+bool HttpConnection::IsHttp3Supported() {
+    
+    const curl_version_info_data* version_info = curl_version_info(CURLVERSION_NOW);
+    return (version_info->features & CURL_VERSION_HTTP3) != 0;
+}
+
+
+void HttpConnection::SetAltSvcCacheFilePath(const std::string& file_path) {
+    
+    if (file_path.empty()) {
+        curl_easy_setopt(GetHandle(), CURLOPT_ALTSVC_CTRL, 0L);
+        curl_easy_setopt(GetHandle(), CURLOPT_ALTSVC, nullptr);
+        return;
+    }
+    
+    long control = CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3;
+    curl_easy_setopt(GetHandle(), CURLOPT_ALTSVC_CTRL, control);
+    curl_easy_setopt(GetHandle(), CURLOPT_ALTSVC, file_path.c_str());
+}
+
+
+void HttpConnection::SetAcceptEncoding(bool is_enabled, const std::string& encodings) {
+    curl_easy_setopt(GetHandle(), CURLOPT_ACCEPT_ENCODING, is_enabled ? encodings.c_str() : nullptr);
+}
+
+
+std::string HttpConnection::GetSupportedAcceptEncodings() {
+    
+    const curl_version_info_data* version_info = curl_version_info(CURLVERSION_NOW);
+    
+    std::string encodings;
+    auto append_encoding = [&encodings](const char* encoding) {
+        if (! encodings.empty()) {
+            encodings.append(", ");
+        }
+        encodings.append(encoding);
+    };
+    
+    if (version_info->features & CURL_VERSION_LIBZ) {
+        append_encoding("deflate");
+        append_encoding("gzip");
+    }
+    
+    if (version_info->features & CURL_VERSION_BROTLI) {
+        append_encoding("br");
+    }
+    
+#ifdef CURL_VERSION_ZSTD
+    if (version_info->features & CURL_VERSION_ZSTD) {
+        append_encoding("zstd");
+    }
+#endif
+    
+    return encodings;
+}
+
+
+std::error_condition HttpConnection::SetRequestContentEncoding(ContentEncoding encoding, int level) {
+    
+    if (! ContentEncoder::IsSupported(encoding)) {
+        return std::make_error_condition(std::errc::not_supported);
+    }
+    
+    std::unique_ptr<ContentEncoder> encoder;
+    if (encoding != ContentEncoding::Identity) {
+        encoder = ContentEncoder::Create(encoding, level);
+        if (encoder == nullptr) {
+            return std::make_error_condition(std::errc::not_enough_memory);
+        }
+    }
+    
+    request_content_encoding_ = encoding;
+    request_compression_level_ = level;
+    request_encoder_ = std::move(encoder);
+    
+    content_encoding_header_.clear();
+    if (encoding != ContentEncoding::Identity) {
+        content_encoding_header_ = MakeHttpHeaderLine("Content-Encoding", ContentEncoder::GetName(encoding));
+    }
+    
+    return std::error_condition();
+}
+
+
+void HttpConnection::SetWaitForMultiplexing(bool wait) {
+    curl_easy_setopt(GetHandle(), CURLOPT_PIPEWAIT, wait ? 1L : 0L);
+}
+
+
+void HttpConnection::SetStreamWeight(long weight) {
+    curl_easy_setopt(GetHandle(), CURLOPT_STREAM_WEIGHT, weight);
+}
+
+
+void HttpConnection::SetStreamDependency(const std::shared_ptr<HttpConnection>& connection, bool is_exclusive) {
+    
+    CURL* depended_handle = connection == nullptr ? nullptr : connection->GetHandle();
+    CURLoption option = is_exclusive ? CURLOPT_STREAM_DEPENDS_E : CURLOPT_STREAM_DEPENDS;
+    curl_easy_setopt(GetHandle(), option, depended_handle);
+    
+    //Held weakly, libcurl detaches the dependency when the depended handle is cleaned up.
+    stream_dependency_ = connection;
+}
+
+
+HttpConnection::HttpVersion HttpConnection::GetHttpVersion() const {
+    
+    long curl_version = CURL_HTTP_VERSION_NONE;
+    curl_easy_getinfo(GetHandle(), CURLINFO_HTTP_VERSION, &curl_version);
+    
+    switch (curl_version) {
+        case CURL_HTTP_VERSION_1_0:
+            return HttpVersion::Http1_0;
+        case CURL_HTTP_VERSION_1_1:
+            return HttpVersion::Http1_1;
+        case CURL_HTTP_VERSION_2_0:
+            return HttpVersion::Http2;
+        case CURL_HTTP_VERSION_3:
+            return HttpVersion::Http3;
+        default:
+            return HttpVersion::Default;
+    }
+}
+
+
+long HttpConnection::GetResponseCode() const {
+    
+    if (is_served_from_cache_) {
+        return cached_entry_->status_code;
+    }
+    
+    return Connection::GetResponseCode();
+}
+
+
 const std::multimap<std::string, std::string>& HttpConnection::GetResponseHeaders() const {
     
     if (! has_parsed_response_headers_) {
@@ -105,6 +431,20 @@ void HttpConnection::ResetResponseStates() {
     
     has_parsed_response_headers_ = false;
     response_headers_.clear();
+    
+    //Remove the conditional or Content-Encoding headers of the previous transfer here rather
+    //than when it finishes, since an aborted transfer doesn't finish.
+    if (is_revalidating_ || is_request_body_encoded_) {
+        curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, applied_request_headers_);
+    }
+    is_request_body_encoded_ = false;
+    
+    cached_entry_.reset();
+    is_served_from_cache_ = false;
+    is_revalidating_ = false;
+    is_storing_response_ = false;
+    storing_header_.clear();
+    storing_body_.clear();
 }
     
     
@@ -114,15 +454,326 @@ void HttpConnection::ResetOptionResources() {
     
     ReleaseRequestHeaders();
     form_.reset();
+    form_handle_.reset();
+    use_post_ = false;
+    method_.clear();
+    stream_dependency_.reset();
+    
+    request_content_encoding_ = ContentEncoding::Identity;
+    request_compression_level_ = -1;
+    request_encoder_.reset();
+    request_encoder_input_.clear();
+    content_encoding_header_.clear();
+    
+    response_cache_.reset();
+    always_revalidate_ = false;
 }
+
+
+bool HttpConnection::WillTransfer() {
+    
+    if (! Connection::WillTransfer()) {
+        return false;
+    }
     
+    //A form is sent by libcurl without reading the body, so it can't be compressed.
+    is_request_body_encoded_ =
+        (request_content_encoding_ != ContentEncoding::Identity) && (form_ == nullptr) && HasRequestBody();
     
-void HttpConnection::ReleaseRequestHeaders() {
+    if (is_request_body_encoded_) {
+        
+        //Prepend the Content-Encoding header to the request headers, without touching the latter.
+        content_encoding_header_node_.data = &content_encoding_header_[0];
+        content_encoding_header_node_.next = applied_request_headers_;
+        curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, &content_encoding_header_node_);
+        
+        //The compressed length is unknown, send the body with chunked transfer encoding.
+        curl_easy_setopt(GetHandle(), CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(-1));
+        curl_easy_setopt(GetHandle(), CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(-1));
+        ResetRequestEncoder();
+    }
+    
+    if ((response_cache_ == nullptr) || ! IsCacheableRequest()) {
+        return true;
+    }
+    
+    cached_entry_ = response_cache_->Find(GetUrl());
+    
+    if ((cached_entry_ != nullptr) && (! always_revalidate_)) {
+        
+        auto freshness = cached_entry_->GetFreshness(std::chrono::system_clock::now());
+        
+        if (freshness == HttpResponseCache::Freshness::Fresh) {
+            is_served_from_cache_ = true;
+            return false;
+        }
+        
+        if ((freshness == HttpResponseCache::Freshness::StaleWhileRevalidate) &&
+            response_cache_->CanRevalidateInBackground()) {
+            
+            is_served_from_cache_ = true;
+            response_cache_->RequestRevalidation(GetUrl());
+            return false;
+        }
+    }
+    
+    if (cached_entry_ != nullptr) {
+        
+        if (cached_entry_->etag.empty() && cached_entry_->last_modified.empty()) {
+            cached_entry_.reset();
+        }
+        else {
+            ApplyConditionalHeaders();
+        }
+    }
+    
+    is_storing_response_ = true;
+    return true;
+}
+
+
+CURLcode HttpConnection::WillFinish(CURLcode result) {
+    
+    if (is_served_from_cache_) {
+        result = WriteCachedResponse(true);
+    }
+    else if ((result == CURLE_OK) && is_storing_response_) {
+        result = StoreResponse();
+    }
+    
+    return Connection::WillFinish(result);
+}
+
+
+bool HttpConnection::WriteHeader(const char* header, std::size_t length) {
+    
+    if (is_storing_response_) {
+        
+        //Only the last response is stored if there are multiple responses, such as redirections.
+        static const char kStatusLinePrefix[] = "HTTP/";
+        static const std::size_t kStatusLinePrefixLength = sizeof(kStatusLinePrefix) - 1;
+        if ((length >= kStatusLinePrefixLength) &&
+            (std::strncmp(header, kStatusLinePrefix, kStatusLinePrefixLength) == 0)) {
+            storing_header_.clear();
+            storing_body_.clear();
+        }
+        
+        storing_header_.append(header, length);
+    }
+    
+    return Connection::WriteHeader(header, length);
+}
+
+
+bool HttpConnection::WriteBody(const char* body, std::size_t length) {
+    
+    if (is_storing_response_) {
+        
+        //Give up storing a body that could never fit in the cache. The stored response is 
+        //outdated by this one, so it is not served any more.
+        if (storing_body_.length() + length > response_cache_->GetCapacity()) {
+            is_storing_response_ = false;
+            std::string().swap(storing_body_);
+            response_cache_->Remove(GetUrl());
+        }
+        else {
+            storing_body_.append(body, length);
+        }
+    }
+    
+    return Connection::WriteBody(body, length);
+}
+
+
+bool HttpConnection::ReadBody(char* body, std::size_t expected_length, std::size_t& actual_length) {
+    
+    if (! is_request_body_encoded_) {
+        return Connection::ReadBody(body, expected_length, actual_length);
+    }
+    
+    if (request_encoder_ == nullptr) {
+        return false;
+    }
     
-    if (request_headers_ != nullptr) {
-        curl_slist_free_all(request_headers_);
-        request_headers_ = nullptr;
+    //Returning no data means the end of body, so keep encoding until some data is produced.
+    actual_length = 0;
+    while ((actual_length == 0) && ! is_request_encoder_finished_) {
+        
+        if ((request_encoder_input_position_ == request_encoder_input_.length()) && ! is_request_encoder_input_end_) {
+            
+            const std::size_t input_capacity = 16 * 1024;
+            request_encoder_input_.resize(input_capacity);
+            
+            std::size_t input_length = 0;
+            if (! Connection::ReadBody(&request_encoder_input_[0], input_capacity, input_length)) {
+                return false;
+            }
+            
+            request_encoder_input_.resize(input_length);
+            request_encoder_input_position_ = 0;
+            is_request_encoder_input_end_ = input_length == 0;
+        }
+        
+        std::size_t consumed_length = 0;
+        bool is_succeeded = request_encoder_->Encode(request_encoder_input_.data() + request_encoder_input_position_,
+                                                     request_encoder_input_.length() - request_encoder_input_position_,
+                                                     consumed_length,
+                                                     is_request_encoder_input_end_,
+                                                     body,
+                                                     expected_length,
+                                                     actual_length,
+                                                     is_request_encoder_finished_);
+        if (! is_succeeded) {
+            return false;
+        }
+        
+        request_encoder_input_position_ += consumed_length;
     }
+    
+    return true;
+}
+
+
+bool HttpConnection::SeekBody(SeekOrigin origin, curl_off_t offset) {
+    
+    if (! is_request_body_encoded_) {
+        return Connection::SeekBody(origin, offset);
+    }
+    
+    //Compressed data can only be rewound by compressing the body again from the beginning.
+    if ((origin != SeekOrigin::Begin) || (offset != 0) || (request_encoder_ == nullptr)) {
+        return false;
+    }
+    
+    if (! Connection::SeekBody(origin, offset)) {
+        return false;
+    }
+    
+    return ResetRequestEncoder();
+}
+
+
+bool HttpConnection::ResetRequestEncoder() {
+    
+    request_encoder_input_.clear();
+    request_encoder_input_position_ = 0;
+    is_request_encoder_input_end_ = false;
+    is_request_encoder_finished_ = false;
+    
+    return (request_encoder_ != nullptr) && request_encoder_->Reset();
+}
+
+
+bool HttpConnection::IsCacheableRequest() const {
+    
+    //Only responses of GET requests are cached.
+    if (use_post_ || (form_ != nullptr) || HasRequestBody() || ! IsReceivingBody()) {
+        return false;
+    }
+    
+    return method_.empty() || (method_ == "GET");
+}
+
+
+void HttpConnection::ApplyConditionalHeaders() {
+    
+    curl_slist* headers = applied_request_headers_;
+    std::size_t header_count = 0;
+    
+    if (! cached_entry_->etag.empty()) {
+        conditional_headers_[header_count] = MakeHttpHeaderLine("If-None-Match", cached_entry_->etag);
+        ++header_count;
+    }
+    
+    if (! cached_entry_->last_modified.empty()) {
+        conditional_headers_[header_count] = MakeHttpHeaderLine("If-Modified-Since", cached_entry_->last_modified);
+        ++header_count;
+    }
+    
+    //Prepend conditional headers to the request headers, without touching the latter.
+    for (std::size_t index = 0; index < header_count; ++index) {
+        conditional_header_nodes_[index].data = &conditional_headers_[index][0];
+        conditional_header_nodes_[index].next = headers;
+        headers = &conditional_header_nodes_[index];
+    }
+    
+    curl_easy_setopt(GetHandle(), CURLOPT_HTTPHEADER, headers);
+    is_revalidating_ = true;
+}
+
+
+CURLcode HttpConnection::StoreResponse() {
+    
+    is_storing_response_ = false;
+    
+    long status_code = Connection::GetResponseCode();
+    
+    if ((status_code == 304) && (cached_entry_ != nullptr)) {
+        
+        auto entry = HttpResponseCache::CreateRevalidatedEntry(cached_entry_, storing_header_);
+        if (entry != nullptr) {
+            response_cache_->Store(GetUrl(), entry);
+        }
+        else {
+            response_cache_->Remove(GetUrl());
+        }
+        
+        is_served_from_cache_ = true;
+        return WriteCachedResponse(false);
+    }
+    
+    auto body = std::make_shared<const std::string>(std::move(storing_body_));
+    auto entry = HttpResponseCache::CreateEntry(status_code, storing_header_, body);
+    if (entry != nullptr) {
+        response_cache_->Store(GetUrl(), entry);
+    }
+    else {
+        //The latest response can't be stored, don't serve the outdated one any more.
+        response_cache_->Remove(GetUrl());
+    }
+    
+    return CURLE_OK;
+}
+
+
+CURLcode HttpConnection::WriteCachedResponse(bool include_header) {
+    
+    if (include_header) {
+        
+        //Write header line by line, as the same as libcurl does.
+        const std::string& header = cached_entry_->header;
+        std::size_t begin_index = 0;
+        while (begin_index < header.length()) {
+            
+            std::size_t end_index = header.find('\n', begin_index);
+            end_index = (end_index == std::string::npos) ? header.length() : end_index + 1;
+            
+            if (! WriteHeader(header.data() + begin_index, end_index - begin_index)) {
+                return CURLE_WRITE_ERROR;
+            }
+            
+            begin_index = end_index;
+        }
+    }
+    
+    const auto& body = cached_entry_->body;
+    if ((body != nullptr) && (! body->empty())) {
+        
+        if (! WriteBody(body->data(), body->length())) {
+            return CURLE_WRITE_ERROR;
+        }
+    }
+    
+    return CURLE_OK;
+}
+    
+    
+void HttpConnection::ReleaseRequestHeaders() {
+    
+    request_headers_.reset();
+    request_header_set_.reset();
+    merged_request_header_nodes_.clear();
+    applied_request_headers_ = nullptr;
 }
 
 
@@ -2,7 +2,12 @@
 
 #include <map>
 #include <string>
+#include <system_error>
+#include <vector>
 #include "connection.h"
+#include "content_encoder.h"
+#include "http_header_set.h"
+#include "http_response_cache.h"
 
 namespace curlion {
 
@@ -14,6 +19,60 @@ class HttpForm;
  This class dervies from Connection, adds some setter and getter methods speicfic to HTTP.
  */
 class HttpConnection : public Connection {
+public:
+    /**
+     HTTP protocol version.
+     */
+    enum class HttpVersion {
+        
+        /**
+         Let libcurl decide the version.
+         */
+        Default,
+        
+        /**
+         HTTP/1.0.
+         */
+        Http1_0,
+        
+        /**
+         HTTP/1.1.
+         */
+        Http1_1,
+        
+        /**
+         Try HTTP/2, fall back to HTTP/1.1 if it can't be negotiated.
+         */
+        Http2,
+        
+        /**
+         Try HTTP/2 over TLS only, use HTTP/1.1 for plain text.
+         */
+        Http2OverTls,
+        
+        /**
+         Use HTTP/2 without upgrade, for plain text servers known to support it, also known as h2c
+         with prior knowledge.
+         */
+        Http2PriorKnowledge,
+        
+        /**
+         Try HTTP/3 over QUIC, racing HTTP/2 and HTTP/1.1 over TCP, and use whichever connects 
+         first. Falls back to Http2 if libcurl is built without HTTP/3 support.
+         */
+        Http3,
+        
+        /**
+         Use HTTP/3 over QUIC only, fail if it can't be used.
+         */
+        Http3Only,
+    };
+    
+    /**
+     Get whether libcurl is built with HTTP/3 support.
+     */
+    static bool IsHttp3Supported();
+    
 public:
     /**
      Construct the HttpConnection instance.
@@ -25,6 +84,14 @@ public:
      */
     ~HttpConnection();
     
+    /**
+     Create a new HttpConnection with the same options as this connection.
+     
+     Request headers, request form and response cache are shared with the new connection. 
+     See also Connection::Clone.
+     */
+    std::shared_ptr<Connection> Clone() const override;
+    
     /**
      Set whether to use HTTP POST method.
      
@@ -32,10 +99,22 @@ public:
      */
     void SetUsePost(bool use_post);
     
+    /**
+     Set the HTTP request method, such as PUT or DELETE, which replaces GET or POST in the request 
+     line.
+     
+     Set the method with this method rather than setting CURLOPT_CUSTOMREQUEST on the handle, so 
+     that the response cache can tell the request is not a GET request.
+     
+     The default is empty, means using GET or POST according to SetUsePost.
+     */
+    void SetMethod(const std::string& method);
+    
     /**
      Set HTTP request headers.
      
-     The new headers would replace all headers previously set.
+     The new headers would replace all headers previously set, except those in the header set 
+     set by SetRequestHeaderSet.
      */
     void SetRequestHeaders(const std::multimap<std::string, std::string>& headers);
     
@@ -44,9 +123,23 @@ public:
      */
     void AddRequestHeader(const std::string& field, const std::string& value);
     
+    /**
+     Set a shared set of HTTP request headers.
+     
+     Headers in the set are sent without being copied. Headers set by SetRequestHeaders and 
+     AddRequestHeader are layered on top of the set: a header with the same field as one in 
+     the set overrides it, and a header with empty value removes it.
+     
+     The default is nullptr.
+     */
+    void SetRequestHeaderSet(const std::shared_ptr<const HttpHeaderSet>& header_set);
+    
     /**
      Set a request form for HTTP POST.
      
+     The form is sent with its own curl_mime handle built from the form, so the same form can
+     be set to multiple connections, including clones of this connection.
+     
      The default is nullptr.
      */
     void SetRequestForm(const std::shared_ptr<HttpForm>& form);
@@ -69,6 +162,163 @@ public:
      */
     void SetMaxAutoRedirectCount(long count);
     
+    /**
+     Set the HTTP version to use.
+     
+     The version is a preference, the actual version is negotiated with the server. Use 
+     GetHttpVersion to get the version used.
+     
+     The default is HttpVersion::Default.
+     */
+    void SetHttpVersion(HttpVersion version);
+    
+    /**
+     Set whether to wait for an existing connection to multiplex onto, rather than opening a new 
+     one.
+     
+     When enabled, a request to a host which is being connected waits for the connection to find 
+     out whether it supports multiplexing, instead of connecting in parallel. This trades a 
+     little latency for far fewer connections. See also ConnectionManager::SetMultiplexing.
+     
+     The default is false.
+     */
+    void SetWaitForMultiplexing(bool wait);
+    
+    /**
+     Set the file to persist the Alt-Svc cache.
+     
+     Alternative services advertised by servers with the Alt-Svc header, such as HTTP/3 
+     endpoints, are cached in the file and used by later connections, even across restarts, so 
+     that they can connect with HTTP/3 directly instead of discovering it over HTTP/2 first. The
+     file is read when the connection starts and written when it is destroyed, use the same file
+     for all connections to the same servers.
+     
+     Set an empty path to disable the Alt-Svc cache.
+     
+     The default is empty.
+     */
+    void SetAltSvcCacheFilePath(const std::string& file_path);
+    
+    /**
+     Set whether to request compressed responses, and decompress them transparently.
+     
+     When enabled, the Accept-Encoding header is sent, and a response with Content-Encoding is
+     decompressed before being written. Use GetReceivedBodyLength and GetDecodedBodyLength to get
+     the compressed and decompressed lengths of the response body.
+     
+     @param is_enabled
+         Whether to enable it.
+     
+     @param encodings
+         Comma-separated encodings to accept, such as "gzip, zstd". An empty string accepts all
+         encodings supported by libcurl, see GetSupportedAcceptEncodings.
+     
+     The default is disabled.
+     */
+    void SetAcceptEncoding(bool is_enabled, const std::string& encodings = std::string());
+    
+    /**
+     Get the encodings libcurl can decompress, such as "gzip, deflate, br, zstd".
+     */
+    static std::string GetSupportedAcceptEncodings();
+    
+    /**
+     Set the encoding to compress the request body with while it is sent.
+     
+     The request body, either set by SetRequestBody or read by the read body callback, is 
+     compressed on the fly, and a Content-Encoding header is sent. Since the compressed length is
+     unknown in advance, the body is sent with chunked transfer encoding, and the length set with
+     CURLOPT_INFILESIZE or CURLOPT_POSTFIELDSIZE is reset to unknown, set it again if compression
+     is disabled later. The server must support the encoding.
+     
+     Requests without a body, and forms set by SetRequestForm, are sent as is.
+     
+     Use GetReadBodyLength and GetSentBodyLength to get the uncompressed and compressed lengths of
+     the request body.
+     
+     @param encoding
+         The encoding, ContentEncoding::Identity disables compression.
+     
+     @param level
+         Compression level of the encoding, or -1 to use the default level.
+     
+     @return
+         Return std::errc::not_supported if the encoding is not enabled, see ContentEncoder.
+     
+     The default is ContentEncoding::Identity.
+     */
+    std::error_condition SetRequestContentEncoding(ContentEncoding encoding, int level = -1);
+    
+    /**
+     Set the HTTP/2 stream weight, from 1 to 256.
+     
+     Streams depending on the same stream share resources in proportion to their weights.
+     
+     The default is 16.
+     */
+    void SetStreamWeight(long weight);
+    
+    /**
+     Set the connection whose HTTP/2 stream this connection's stream depends on.
+     
+     The server is advised to send the depended stream before this one. If is_exclusive is true,
+     this stream becomes the only dependency of the depended stream, and other streams depending 
+     on it depend on this stream instead.
+     
+     The depended connection is not retained, so chains of dependencies don't keep each other 
+     alive. libcurl removes the dependency once the depended connection is destructed. It is not 
+     copied by Clone. Set nullptr to remove the dependency.
+     */
+    void SetStreamDependency(const std::shared_ptr<HttpConnection>& connection, bool is_exclusive);
+    
+    /**
+     Set a cache to store responses.
+     
+     When a cache is set, responses of GET requests are stored in the cache, and a fresh stored 
+     response would be used without any transfer. Requests using POST, a form, a method set by 
+     SetMethod, a request body or SetReceiveBody(false) bypass the cache. Responses with Vary 
+     header are not stored, since the cache is keyed by URL only. A stale stored response is 
+     revalidated with If-None-Match or If-Modified-Since header, and its body is reused if the 
+     server responds 304.
+     
+     When a connection is satisfied by the cache, it finishes synchronously within 
+     ConnectionManager::StartConnection, without touching the multi handle.
+     
+     The default is nullptr.
+     */
+    void SetResponseCache(const std::shared_ptr<HttpResponseCache>& cache) {
+        response_cache_ = cache;
+    }
+    
+    /**
+     Set whether to always revalidate the stored response with the server, even if it is fresh.
+     
+     This option is usually used by connections started in HttpResponseCache's revalidate callback.
+     
+     The default is false.
+     */
+    void SetAlwaysRevalidate(bool always_revalidate) {
+        always_revalidate_ = always_revalidate;
+    }
+    
+    /**
+     Get whether the response body is from the cache set by SetResponseCache.
+     
+     This method returns true if the connection is satisfied by the cache without any transfer, 
+     or the stored response is revalidated by a 304 response. For the latter case, 
+     GetResponseHeaders returns headers of the 304 response.
+     */
+    bool IsServedFromCache() const {
+        return is_served_from_cache_;
+    }
+    
+    /**
+     Get the last response code.
+     
+     If the response body is from cache, the status code of the stored response is returned.
+     */
+    long GetResponseCode() const override;
+    
     /**
      Get HTTP response headers.
      
@@ -77,17 +327,73 @@ public:
      */
     const std::multimap<std::string, std::string>& GetResponseHeaders() const;
     
+    /**
+     Get the HTTP version used by the last response.
+     
+     HttpVersion::Default is returned if there is no response.
+     */
+    HttpVersion GetHttpVersion() const;
+    
 protected:
+    /**
+     Construct the HttpConnection instance by duplicating a prototype.
+     */
+    HttpConnection(const HttpConnection& prototype);
+    
     void ResetResponseStates() override;
     void ResetOptionResources() override;
+    bool WillTransfer() override;
+    CURLcode WillFinish(CURLcode result) override;
+    bool WriteHeader(const char* header, std::size_t length) override;
+    bool WriteBody(const char* body, std::size_t length) override;
+    bool ReadBody(char* body, std::size_t expected_length, std::size_t& actual_length) override;
+    bool SeekBody(SeekOrigin origin, curl_off_t offset) override;
     
 private:
     void ParseResponseHeaders() const;
     void ReleaseRequestHeaders();
+    void ApplyRequestHeaders();
+    void ApplyRequestForm();
+    bool ResetRequestEncoder();
+    
+    bool IsCacheableRequest() const;
+    void ApplyConditionalHeaders();
+    CURLcode StoreResponse();
+    CURLcode WriteCachedResponse(bool include_header);
     
 private:
-    curl_slist* request_headers_;
+    std::shared_ptr<curl_slist> request_headers_;
+    std::shared_ptr<const HttpHeaderSet> request_header_set_;
+    std::vector<curl_slist> merged_request_header_nodes_;
+    curl_slist* applied_request_headers_;
     std::shared_ptr<HttpForm> form_;
+    std::shared_ptr<curl_mime> form_handle_;
+    bool use_post_;
+    std::string method_;
+    std::weak_ptr<HttpConnection> stream_dependency_;
+    
+    ContentEncoding request_content_encoding_;
+    int request_compression_level_;
+    std::unique_ptr<ContentEncoder> request_encoder_;
+    std::string request_encoder_input_;
+    std::size_t request_encoder_input_position_;
+    bool is_request_encoder_input_end_;
+    bool is_request_encoder_finished_;
+    bool is_request_body_encoded_;
+    std::string content_encoding_header_;
+    curl_slist content_encoding_header_node_;
+    
+    std::shared_ptr<HttpResponseCache> response_cache_;
+    bool always_revalidate_;
+    std::shared_ptr<const HttpResponseCache::Entry> cached_entry_;
+    bool is_served_from_cache_;
+    bool is_revalidating_;
+    bool is_storing_response_;
+    std::string storing_header_;
+    std::string storing_body_;
+    std::string conditional_headers_[2];
+    curl_slist conditional_header_nodes_[2];
+    
     mutable bool has_parsed_response_headers_;
     mutable std::multimap<std::string, std::string> response_headers_;
 };
@@ -0,0 +1,1121 @@
+#include "http_disk_cache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteDiskCacheLog(void* cache_identifier) {
+    return Log() << "HttpDiskCache(" << cache_identifier << "): ";
+}
+
+
+namespace {
+
+const std::uint32_t kRecordMagic = 0x4e4c5243;     //"CRLN"
+const std::uint32_t kRecordFlagRemoval = 1;
+const char* const kSegmentFileExtension = ".segment";
+
+/**
+ Layout of a record in segment files:
+ RecordHeader | url | header | etag | last_modified | body | padding to 8 bytes
+ */
+struct RecordHeader {
+    std::uint32_t magic;
+    std::uint32_t flags;
+    std::uint64_t key;
+    std::uint64_t sequence;
+    std::int64_t response_time;
+    std::int64_t freshness_lifetime;
+    std::int64_t stale_while_revalidate;
+    std::int64_t status_code;
+    std::uint32_t url_length;
+    std::uint32_t header_length;
+    std::uint32_t etag_length;
+    std::uint32_t last_modified_length;
+    std::uint64_t body_length;
+};
+
+std::uint64_t GetRecordLength(const RecordHeader& header) {
+
+    std::uint64_t length =
+        sizeof(RecordHeader) +
+        header.url_length +
+        header.header_length +
+        header.etag_length +
+        header.last_modified_length +
+        header.body_length;
+
+    return (length + 7) & ~static_cast<std::uint64_t>(7);
+}
+
+}
+
+
+class HttpDiskCache::Mapping {
+public:
+    Mapping(void* address, std::size_t length) : address(address), length(length) { }
+
+    ~Mapping() {
+        munmap(address, length);
+    }
+
+    const char* GetData() const {
+        return static_cast<const char*>(address);
+    }
+
+    void* const address;
+    const std::size_t length;
+};
+
+
+//A change queued for the writer thread. It keeps a copy of the entry, so that Find can serve it
+//before it is written.
+class HttpDiskCache::PendingRecord {
+public:
+    std::string url;
+    HttpResponseCache::Entry entry;
+    bool is_removal = false;
+};
+
+
+class HttpDiskCache::Record {
+public:
+    RecordHeader header{};
+    const char* url = nullptr;
+    const char* response_header = nullptr;
+    const char* etag = nullptr;
+    const char* last_modified = nullptr;
+    const char* body = nullptr;
+};
+
+
+static std::uint64_t HashUrl(const std::string& url);
+static bool ReadRecordHeader(const char* data, std::uint64_t available_length, RecordHeader& header);
+static std::error_condition LastError();
+
+
+HttpDiskCache::HttpDiskCache(std::uint64_t capacity, std::uint64_t segment_size) :
+    capacity_(capacity),
+    segment_size_(segment_size),
+    active_segment_id_(0),
+    next_segment_id_(1),
+    next_sequence_(1),
+    size_(0),
+    is_compacting_(false),
+    is_auto_compaction_enabled_(true),
+    pending_length_(0),
+    is_writing_(false),
+    is_writer_running_(false) {
+
+}
+
+
+HttpDiskCache::~HttpDiskCache() {
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        is_writer_running_ = false;
+    }
+    queue_condition_.notify_all();
+
+    if (writer_thread_.joinable()) {
+        writer_thread_.join();
+    }
+
+    if (compaction_thread_.joinable()) {
+        compaction_thread_.join();
+    }
+
+    for (auto& each_pair : segments_) {
+        close(each_pair.second.file);
+    }
+}
+
+
+std::error_condition HttpDiskCache::Open(const std::string& directory) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    WriteDiskCacheLog(this) << "Open directory " << directory << '.';
+
+    directory_ = directory;
+
+    DIR* dir = opendir(directory_.c_str());
+    if (dir == nullptr) {
+        return LastError();
+    }
+
+    std::vector<std::uint32_t> segment_ids;
+    while (dirent* entry = readdir(dir)) {
+
+        std::string name = entry->d_name;
+        std::size_t extension_length = std::strlen(kSegmentFileExtension);
+        if ((name.length() <= extension_length) ||
+            (name.compare(name.length() - extension_length, extension_length, kSegmentFileExtension) != 0)) {
+            continue;
+        }
+
+        char* end = nullptr;
+        unsigned long segment_id = std::strtoul(name.c_str(), &end, 16);
+        if ((end != name.c_str() + name.length() - extension_length) || (segment_id == 0)) {
+            continue;
+        }
+
+        segment_ids.push_back(static_cast<std::uint32_t>(segment_id));
+    }
+    closedir(dir);
+
+    std::sort(segment_ids.begin(), segment_ids.end());
+
+    //Sequences of removal records are kept during loading, so that a removal record takes effect
+    //no matter which segment it is in.
+    std::map<std::uint64_t, std::uint64_t> removals;
+    for (auto each_id : segment_ids) {
+
+        auto error = LoadSegment(each_id, removals);
+        if (error) {
+            WriteDiskCacheLog(this) << "Load segment " << each_id << " failed.";
+            return error;
+        }
+        next_segment_id_ = each_id + 1;
+    }
+
+    if ((! segments_.empty()) && (segments_.rbegin()->second.size < segment_size_)) {
+        active_segment_id_ = segments_.rbegin()->first;
+    }
+    else {
+        auto error = CreateActiveSegment();
+        if (error) {
+            return error;
+        }
+    }
+
+    //No other method runs before Open returns, queue_mutex_ is not needed.
+    is_writer_running_ = true;
+    writer_thread_ = std::thread(std::bind(&HttpDiskCache::RunWriter, this));
+    return std::error_condition();
+}
+
+
+std::error_condition HttpDiskCache::LoadSegment(std::uint32_t segment_id,
+                                                std::map<std::uint64_t, std::uint64_t>& removals) {
+
+    int file = open(GetSegmentPath(segment_id).c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    if (file == -1) {
+        return LastError();
+    }
+
+    struct stat file_stat{};
+    if (fstat(file, &file_stat) != 0) {
+        auto error = LastError();
+        close(file);
+        return error;
+    }
+
+    Segment& segment = segments_[segment_id];
+    segment.id = segment_id;
+    segment.file = file;
+    segment.size = static_cast<std::uint64_t>(file_stat.st_size);
+
+    auto mapping = MapSegment(segment);
+
+    std::uint64_t offset = 0;
+    while ((mapping != nullptr) && (offset < segment.size)) {
+
+        RecordHeader header{};
+        if (! ReadRecordHeader(mapping->GetData() + offset, segment.size - offset, header)) {
+            break;
+        }
+
+        Location location;
+        location.segment_id = segment_id;
+        location.offset = offset;
+        location.length = GetRecordLength(header);
+        location.sequence = header.sequence;
+
+        segment.min_sequence = std::min(segment.min_sequence, header.sequence);
+        next_sequence_ = std::max(next_sequence_, header.sequence + 1);
+
+        bool is_removal = (header.flags & kRecordFlagRemoval) != 0;
+
+        //Apply the record only if it is newer than what has been seen.
+        auto removal_iterator = removals.find(header.key);
+        auto index_iterator = index_.find(header.key);
+        bool is_newer =
+            ((removal_iterator == removals.end()) || (removal_iterator->second < header.sequence)) &&
+            ((index_iterator == index_.end()) || (index_iterator->second.sequence < header.sequence));
+
+        if (is_newer) {
+            UpdateIndex(header.key, location, is_removal);
+            if (is_removal) {
+                removals[header.key] = header.sequence;
+            }
+        }
+
+        offset += location.length;
+    }
+
+    //Discard a torn record at the tail, which is left by an interrupted write.
+    if (offset < segment.size) {
+
+        WriteDiskCacheLog(this) << "Truncate segment " << segment_id << " from " << segment.size << " to " << offset << '.';
+
+        if (ftruncate(file, static_cast<off_t>(offset)) != 0) {
+            return LastError();
+        }
+        segment.size = offset;
+        segment.mapping.reset();
+    }
+
+    size_ += segment.size;
+    return std::error_condition();
+}
+
+
+std::error_condition HttpDiskCache::CreateActiveSegment() {
+
+    std::uint32_t segment_id = next_segment_id_++;
+
+    int file = open(GetSegmentPath(segment_id).c_str(), O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file == -1) {
+        return LastError();
+    }
+
+    WriteDiskCacheLog(this) << "Create segment " << segment_id << '.';
+
+    Segment& segment = segments_[segment_id];
+    segment.id = segment_id;
+    segment.file = file;
+
+    active_segment_id_ = segment_id;
+    return std::error_condition();
+}
+
+
+std::shared_ptr<const HttpDiskCache::View> HttpDiskCache::Find(const std::string& url) {
+
+    //A queued change is newer than anything in segment files.
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+
+        auto iterator = pending_records_.find(url);
+        if (iterator != pending_records_.end()) {
+
+            const auto& pending_record = iterator->second;
+            if (pending_record->is_removal) {
+                return nullptr;
+            }
+
+            const HttpResponseCache::Entry& entry = pending_record->entry;
+
+            auto view = std::make_shared<View>();
+            view->status_code = entry.status_code;
+            view->response_time = entry.response_time;
+            view->freshness_lifetime = entry.freshness_lifetime;
+            view->stale_while_revalidate = entry.stale_while_revalidate;
+            view->header = entry.header.data();
+            view->header_length = entry.header.length();
+            view->etag = entry.etag.data();
+            view->etag_length = entry.etag.length();
+            view->last_modified = entry.last_modified.data();
+            view->last_modified_length = entry.last_modified.length();
+            if (entry.body != nullptr) {
+                view->body = entry.body->data();
+                view->body_length = entry.body->length();
+            }
+            view->mapping = pending_record;
+            return view;
+        }
+    }
+
+    std::uint64_t key = HashUrl(url);
+
+    std::shared_ptr<Mapping> mapping;
+    Location location;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto index_iterator = index_.find(key);
+        if (index_iterator == index_.end()) {
+            return nullptr;
+        }
+
+        location = index_iterator->second;
+
+        auto segment_iterator = segments_.find(location.segment_id);
+        if (segment_iterator == segments_.end()) {
+            return nullptr;
+        }
+
+        mapping = MapSegment(segment_iterator->second);
+    }
+
+    //Records are immutable once written, so they can be read without lock.
+    if ((mapping == nullptr) || (mapping->length < location.offset + location.length)) {
+        return nullptr;
+    }
+
+    const char* data = mapping->GetData() + location.offset;
+
+    RecordHeader header{};
+    if (! ReadRecordHeader(data, location.length, header)) {
+        return nullptr;
+    }
+
+    data += sizeof(RecordHeader);
+    if ((header.url_length != url.length()) || (std::memcmp(data, url.data(), url.length()) != 0)) {
+        WriteDiskCacheLog(this) << "Hash collision for " << url << '.';
+        return nullptr;
+    }
+    data += header.url_length;
+
+    auto view = std::make_shared<View>();
+    view->status_code = static_cast<long>(header.status_code);
+    view->response_time = std::chrono::system_clock::time_point(std::chrono::seconds(header.response_time));
+    view->freshness_lifetime = std::chrono::seconds(header.freshness_lifetime);
+    view->stale_while_revalidate = std::chrono::seconds(header.stale_while_revalidate);
+
+    view->header = data;
+    view->header_length = header.header_length;
+    data += header.header_length;
+
+    view->etag = data;
+    view->etag_length = header.etag_length;
+    data += header.etag_length;
+
+    view->last_modified = data;
+    view->last_modified_length = header.last_modified_length;
+    data += header.last_modified_length;
+
+    view->body = data;
+    view->body_length = static_cast<std::size_t>(header.body_length);
+
+    view->mapping = mapping;
+    return view;
+}
+
+
+std::shared_ptr<HttpResponseCache::Entry> HttpDiskCache::Load(const std::string& url) {
+
+    auto view = Find(url);
+    if (view == nullptr) {
+        return nullptr;
+    }
+
+    auto entry = std::make_shared<HttpResponseCache::Entry>();
+    entry->status_code = view->status_code;
+    entry->header.assign(view->header, view->header_length);
+    entry->body = std::make_shared<const std::string>(view->body, view->body_length);
+    entry->response_time = view->response_time;
+    entry->freshness_lifetime = view->freshness_lifetime;
+    entry->stale_while_revalidate = view->stale_while_revalidate;
+    entry->etag.assign(view->etag, view->etag_length);
+    entry->last_modified.assign(view->last_modified, view->last_modified_length);
+    return entry;
+}
+
+
+void HttpDiskCache::Save(const std::string& url, const HttpResponseCache::Entry& entry) {
+
+    auto pending_record = std::make_shared<PendingRecord>();
+    pending_record->url = url;
+    pending_record->entry = entry;
+
+    std::size_t length = url.length() + entry.header.length();
+    if (entry.body != nullptr) {
+        length += entry.body->length();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+
+        //The writer falls behind, remove the outdated response rather than queuing more data.
+        if (pending_length_ + length > segment_size_) {
+
+            WriteDiskCacheLog(this) << "Too much data is waiting to be written, remove " << url << " instead.";
+
+            pending_record->entry = HttpResponseCache::Entry();
+            pending_record->is_removal = true;
+            length = url.length();
+        }
+    }
+
+    Enqueue(pending_record, length);
+}
+
+
+void HttpDiskCache::Remove(const std::string& url) {
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+
+        if (pending_records_.find(url) == pending_records_.end()) {
+
+            std::lock_guard<std::mutex> index_lock(mutex_);
+            if (index_.find(HashUrl(url)) == index_.end()) {
+                return;
+            }
+        }
+    }
+
+    auto pending_record = std::make_shared<PendingRecord>();
+    pending_record->url = url;
+    pending_record->is_removal = true;
+    Enqueue(pending_record, url.length());
+}
+
+
+void HttpDiskCache::Clear() {
+
+    //Wait for the record being written, and discard queued ones.
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        queue_.clear();
+        pending_records_.clear();
+        pending_length_ = 0;
+    }
+    queue_condition_.notify_all();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    WriteDiskCacheLog(this) << "Clear.";
+
+    while (! segments_.empty()) {
+        DropSegment(segments_.begin()->first);
+    }
+
+    index_.clear();
+    CreateActiveSegment();
+}
+
+
+void HttpDiskCache::SetAutoCompaction(bool is_enabled) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_auto_compaction_enabled_ = is_enabled;
+}
+
+
+void HttpDiskCache::Flush() {
+
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    queue_condition_.wait(lock, [this]() {
+        return (queue_.empty() && ! is_writing_) || ! is_writer_running_;
+    });
+}
+
+
+void HttpDiskCache::Enqueue(const std::shared_ptr<const PendingRecord>& record, std::size_t length) {
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+
+        //Changes before Open or after destruction starts are dropped.
+        if (! is_writer_running_) {
+            return;
+        }
+
+        queue_.push_back(record);
+        pending_records_[record->url] = record;
+        pending_length_ += length;
+    }
+    queue_condition_.notify_all();
+}
+
+
+void HttpDiskCache::RunWriter() {
+
+    while (true) {
+
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_condition_.wait(lock, [this]() {
+                return ! queue_.empty() || ! is_writer_running_;
+            });
+
+            //Queued changes are written before the writer stops.
+            if (queue_.empty()) {
+                return;
+            }
+        }
+
+        bool should_compact = false;
+        {
+            std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+            std::shared_ptr<const PendingRecord> pending_record;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+
+                //Clear may have discarded the queue meanwhile.
+                if (queue_.empty()) {
+                    continue;
+                }
+
+                pending_record = queue_.front();
+                queue_.pop_front();
+                is_writing_ = true;
+            }
+
+            WriteRecord(*pending_record);
+
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+
+                //The record is in the index now, unless a newer change of the same URL is queued.
+                auto iterator = pending_records_.find(pending_record->url);
+                if ((iterator != pending_records_.end()) && (iterator->second == pending_record)) {
+                    pending_records_.erase(iterator);
+                }
+
+                std::size_t length = pending_record->url.length() + pending_record->entry.header.length();
+                if (pending_record->entry.body != nullptr) {
+                    length += pending_record->entry.body->length();
+                }
+                pending_length_ -= std::min<std::uint64_t>(pending_length_, length);
+                is_writing_ = false;
+            }
+            queue_condition_.notify_all();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            should_compact = is_auto_compaction_enabled_ && ! is_compacting_ && HasCompactableSegment();
+        }
+
+        if (should_compact) {
+            Compact();
+        }
+    }
+}
+
+
+void HttpDiskCache::WriteRecord(const PendingRecord& pending_record) {
+
+    const std::string& url = pending_record.url;
+    const HttpResponseCache::Entry& entry = pending_record.entry;
+
+    Record record;
+    record.header.magic = kRecordMagic;
+    record.header.key = HashUrl(url);
+    record.header.url_length = static_cast<std::uint32_t>(url.length());
+    record.url = url.data();
+
+    if (pending_record.is_removal) {
+        record.header.flags = kRecordFlagRemoval;
+    }
+    else {
+        record.header.response_time = std::chrono::duration_cast<std::chrono::seconds>(
+            entry.response_time.time_since_epoch()).count();
+        record.header.freshness_lifetime = entry.freshness_lifetime.count();
+        record.header.stale_while_revalidate = entry.stale_while_revalidate.count();
+        record.header.status_code = entry.status_code;
+        record.header.header_length = static_cast<std::uint32_t>(entry.header.length());
+        record.header.etag_length = static_cast<std::uint32_t>(entry.etag.length());
+        record.header.last_modified_length = static_cast<std::uint32_t>(entry.last_modified.length());
+        record.header.body_length = (entry.body != nullptr) ? entry.body->length() : 0;
+
+        record.response_header = entry.header.data();
+        record.etag = entry.etag.data();
+        record.last_modified = entry.last_modified.data();
+        record.body = (entry.body != nullptr) ? entry.body->data() : nullptr;
+    }
+
+    Location location;
+    if (AppendRecord(record, location)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (pending_record.is_removal) {
+        UpdateIndex(record.header.key, location, true);
+    }
+    else {
+        UpdateIndex(record.header.key, location, false);
+        EnforceCapacity();
+    }
+}
+
+
+std::uint64_t HttpDiskCache::GetSize() const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+
+std::error_condition HttpDiskCache::AppendRecord(const Record& record, Location& location) {
+
+    //Only the writer appends to the active segment, with write_mutex_ held. So the file and the
+    //size stay the same while writing without mutex_, readers only map the size committed.
+    RecordHeader header = record.header;
+    int file = -1;
+    std::uint32_t segment_id = 0;
+    std::uint64_t offset = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto segment_iterator = segments_.find(active_segment_id_);
+        if (segment_iterator == segments_.end()) {
+            return std::make_error_condition(std::errc::bad_file_descriptor);
+        }
+
+        file = segment_iterator->second.file;
+        segment_id = segment_iterator->second.id;
+        offset = segment_iterator->second.size;
+        header.sequence = next_sequence_++;
+    }
+
+    std::uint64_t record_length = GetRecordLength(header);
+    std::uint64_t data_length =
+        sizeof(RecordHeader) +
+        header.url_length +
+        header.header_length +
+        header.etag_length +
+        header.last_modified_length +
+        header.body_length;
+
+    static const char kPadding[8] = { 0 };
+
+    iovec vectors[] = {
+        { &header, sizeof(RecordHeader) },
+        { const_cast<char*>(record.url), header.url_length },
+        { const_cast<char*>(record.response_header), header.header_length },
+        { const_cast<char*>(record.etag), header.etag_length },
+        { const_cast<char*>(record.last_modified), header.last_modified_length },
+        { const_cast<char*>(record.body), static_cast<std::size_t>(header.body_length) },
+        { const_cast<char*>(kPadding), static_cast<std::size_t>(record_length - data_length) },
+    };
+
+    //Write all vectors, resuming from where a partial write stops.
+    iovec* vector = vectors;
+    int vector_count = sizeof(vectors) / sizeof(iovec);
+    while (vector_count > 0) {
+
+        ssize_t written_length = writev(file, vector, vector_count);
+        if (written_length < 0) {
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            auto error = LastError();
+            WriteDiskCacheLog(this) << "Write segment " << segment_id << " failed with errno " << errno << '.';
+
+            //Drop the possibly torn record.
+            if (ftruncate(file, static_cast<off_t>(offset)) != 0) {
+                WriteDiskCacheLog(this) << "Truncate segment " << segment_id << " failed.";
+            }
+            return error;
+        }
+
+        std::size_t remain_length = static_cast<std::size_t>(written_length);
+        while ((vector_count > 0) && (remain_length >= vector->iov_len)) {
+            remain_length -= vector->iov_len;
+            ++vector;
+            --vector_count;
+        }
+
+        if (vector_count > 0) {
+            vector->iov_base = static_cast<char*>(vector->iov_base) + remain_length;
+            vector->iov_len -= remain_length;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Segment& segment = segments_[segment_id];
+
+    location.segment_id = segment_id;
+    location.offset = offset;
+    location.length = record_length;
+    location.sequence = header.sequence;
+
+    segment.size += record_length;
+    segment.min_sequence = std::min(segment.min_sequence, header.sequence);
+    size_ += record_length;
+
+    if (segment.size >= segment_size_) {
+        CreateActiveSegment();
+    }
+
+    return std::error_condition();
+}
+
+
+std::shared_ptr<HttpDiskCache::Mapping> HttpDiskCache::MapSegment(Segment& segment) {
+
+    //Remap if the segment has grown since last mapping. Previous mapping is kept alive by views.
+    if ((segment.mapping != nullptr) && (segment.mapping->length >= segment.size)) {
+        return segment.mapping;
+    }
+
+    if (segment.size == 0) {
+        return nullptr;
+    }
+
+    std::size_t length = static_cast<std::size_t>(segment.size);
+    void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, segment.file, 0);
+    if (address == MAP_FAILED) {
+        WriteDiskCacheLog(this) << "Map segment " << segment.id << " failed with errno " << errno << '.';
+        return nullptr;
+    }
+
+    segment.mapping = std::make_shared<Mapping>(address, length);
+    return segment.mapping;
+}
+
+
+void HttpDiskCache::UpdateIndex(std::uint64_t key, const Location& location, bool is_removal) {
+
+    auto iterator = index_.find(key);
+    if (iterator != index_.end()) {
+
+        auto segment_iterator = segments_.find(iterator->second.segment_id);
+        if (segment_iterator != segments_.end()) {
+            segment_iterator->second.live_size -= iterator->second.length;
+        }
+
+        if (is_removal) {
+            index_.erase(iterator);
+        }
+        else {
+            iterator->second = location;
+        }
+    }
+    else if (! is_removal) {
+        index_.insert(std::make_pair(key, location));
+    }
+
+    if (! is_removal) {
+        segments_[location.segment_id].live_size += location.length;
+    }
+}
+
+
+void HttpDiskCache::DropSegment(std::uint32_t segment_id) {
+
+    auto iterator = segments_.find(segment_id);
+    if (iterator == segments_.end()) {
+        return;
+    }
+
+    WriteDiskCacheLog(this) << "Drop segment " << segment_id << '.';
+
+    for (auto index_iterator = index_.begin(); index_iterator != index_.end(); ) {
+
+        if (index_iterator->second.segment_id == segment_id) {
+            index_iterator = index_.erase(index_iterator);
+        }
+        else {
+            ++index_iterator;
+        }
+    }
+
+    size_ -= iterator->second.size;
+    close(iterator->second.file);
+    unlink(GetSegmentPath(segment_id).c_str());
+    segments_.erase(iterator);
+}
+
+
+void HttpDiskCache::EnforceCapacity() {
+
+    while ((size_ > capacity_) && (segments_.size() > 1)) {
+
+        std::uint32_t oldest_segment_id = segments_.begin()->first;
+        if (oldest_segment_id == active_segment_id_) {
+            break;
+        }
+
+        DropSegment(oldest_segment_id);
+    }
+}
+
+
+void HttpDiskCache::CompactInBackground() {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (is_compacting_) {
+        return;
+    }
+
+    if (compaction_thread_.joinable()) {
+        compaction_thread_.join();
+    }
+
+    is_compacting_ = true;
+    compaction_thread_ = std::thread([this]() {
+
+        CompactSegments();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_compacting_ = false;
+    });
+}
+
+
+bool HttpDiskCache::HasCompactableSegment() const {
+
+    for (const auto& each_pair : segments_) {
+        if (IsCompactable(each_pair.second)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool HttpDiskCache::IsCompactable(const Segment& segment) const {
+    return (segment.id != active_segment_id_) && (segment.live_size * 2 < segment.size);
+}
+
+
+void HttpDiskCache::Compact() {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (is_compacting_) {
+            return;
+        }
+        is_compacting_ = true;
+    }
+
+    CompactSegments();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_compacting_ = false;
+}
+
+
+void HttpDiskCache::CompactSegments() {
+
+    std::map<std::uint32_t, std::shared_ptr<Mapping>> candidates;
+    std::uint32_t output_segment_id = 0;
+    std::uint64_t min_other_sequence = std::numeric_limits<std::uint64_t>::max();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (auto& each_pair : segments_) {
+
+            Segment& segment = each_pair.second;
+            if (IsCompactable(segment)) {
+                candidates.insert(std::make_pair(segment.id, MapSegment(segment)));
+            }
+            else {
+                min_other_sequence = std::min(min_other_sequence, segment.min_sequence);
+            }
+        }
+
+        if (candidates.empty()) {
+            return;
+        }
+
+        output_segment_id = next_segment_id_++;
+    }
+
+    WriteDiskCacheLog(this) << "Compact " << candidates.size() << " segments into segment " << output_segment_id << '.';
+
+    std::string output_path = GetSegmentPath(output_segment_id);
+    int output_file = open(output_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (output_file == -1) {
+        WriteDiskCacheLog(this) << "Create segment " << output_segment_id << " failed with errno " << errno << '.';
+        return;
+    }
+
+    //Live records and necessary removal records are copied without lock, since records are
+    //immutable. The index is updated later, only for records which are not changed meanwhile.
+    std::uint64_t output_size = 0;
+    std::uint64_t output_min_sequence = std::numeric_limits<std::uint64_t>::max();
+    std::vector<MovedRecord> moved_records;
+    bool is_succeeded = true;
+
+    for (const auto& each_pair : candidates) {
+
+        const auto& mapping = each_pair.second;
+        if (mapping == nullptr) {
+            continue;
+        }
+
+        std::uint64_t offset = 0;
+        while (offset < mapping->length) {
+
+            const char* data = mapping->GetData() + offset;
+
+            RecordHeader header{};
+            if (! ReadRecordHeader(data, mapping->length - offset, header)) {
+                break;
+            }
+
+            Location location;
+            location.segment_id = each_pair.first;
+            location.offset = offset;
+            location.length = GetRecordLength(header);
+            location.sequence = header.sequence;
+            offset += location.length;
+
+            bool should_keep = false;
+            if ((header.flags & kRecordFlagRemoval) != 0) {
+                //A removal record is still needed if any remaining segment may contain older records.
+                should_keep = (min_other_sequence < header.sequence);
+            }
+            else {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto iterator = index_.find(header.key);
+                should_keep =
+                    (iterator != index_.end()) &&
+                    (iterator->second.segment_id == location.segment_id) &&
+                    (iterator->second.offset == location.offset);
+            }
+
+            if (! should_keep) {
+                continue;
+            }
+
+            std::size_t written_length = 0;
+            while (written_length < location.length) {
+
+                ssize_t length = write(output_file,
+                                       data + written_length,
+                                       static_cast<std::size_t>(location.length - written_length));
+                if (length < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    is_succeeded = false;
+                    break;
+                }
+                written_length += static_cast<std::size_t>(length);
+            }
+
+            if (! is_succeeded) {
+                break;
+            }
+
+            MovedRecord moved_record;
+            moved_record.key = header.key;
+            moved_record.from = location;
+            moved_record.to = location;
+            moved_record.to.segment_id = output_segment_id;
+            moved_record.to.offset = output_size;
+            moved_records.push_back(moved_record);
+
+            output_size += location.length;
+            output_min_sequence = std::min(output_min_sequence, header.sequence);
+        }
+
+        if (! is_succeeded) {
+            break;
+        }
+    }
+
+    int write_errno = errno;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    //Clear or EnforceCapacity may have dropped a candidate meanwhile, along with its records in
+    //the index. Records copied from it before that must not be published, since they would be
+    //indexed again when the segments are loaded next time. The remaining candidates are compacted
+    //by a later compaction.
+    bool is_candidate_dropped = std::any_of(candidates.begin(), candidates.end(),
+        [this](const std::pair<const std::uint32_t, std::shared_ptr<Mapping>>& each_pair) {
+            return segments_.find(each_pair.first) == segments_.end();
+        });
+
+    if (! is_succeeded || is_candidate_dropped) {
+        if (! is_succeeded) {
+            WriteDiskCacheLog(this) << "Write segment " << output_segment_id << " failed with errno " << write_errno << '.';
+        }
+        else {
+            WriteDiskCacheLog(this) << "Discard segment " << output_segment_id << " since its sources are dropped.";
+        }
+        close(output_file);
+        unlink(output_path.c_str());
+        return;
+    }
+
+    Segment& output_segment = segments_[output_segment_id];
+    output_segment.id = output_segment_id;
+    output_segment.file = output_file;
+    output_segment.size = output_size;
+    output_segment.min_sequence = output_min_sequence;
+    size_ += output_size;
+
+    for (const auto& each_record : moved_records) {
+
+        auto iterator = index_.find(each_record.key);
+        if ((iterator != index_.end()) &&
+            (iterator->second.segment_id == each_record.from.segment_id) &&
+            (iterator->second.offset == each_record.from.offset)) {
+
+            UpdateIndex(each_record.key, each_record.to, false);
+        }
+    }
+
+    for (const auto& each_pair : candidates) {
+        DropSegment(each_pair.first);
+    }
+
+    WriteDiskCacheLog(this) << "Compaction done, segment " << output_segment_id << " has size " << output_size << '.';
+}
+
+
+std::string HttpDiskCache::GetSegmentPath(std::uint32_t segment_id) const {
+
+    char name[32] = { 0 };
+    std::snprintf(name, sizeof(name), "%08x%s", segment_id, kSegmentFileExtension);
+
+    std::string path = directory_;
+    if ((! path.empty()) && (path.back() != '/')) {
+        path.append(1, '/');
+    }
+    path.append(name);
+    return path;
+}
+
+
+static std::uint64_t HashUrl(const std::string& url) {
+
+    //64-bit FNV-1a.
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char each_char : url) {
+        hash ^= each_char;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static bool ReadRecordHeader(const char* data, std::uint64_t available_length, RecordHeader& header) {
+
+    if (available_length < sizeof(RecordHeader)) {
+        return false;
+    }
+
+    std::memcpy(&header, data, sizeof(RecordHeader));
+
+    if (header.magic != kRecordMagic) {
+        return false;
+    }
+
+    return GetRecordLength(header) <= available_length;
+}
+
+
+static std::error_condition LastError() {
+    return std::system_category().default_error_condition(errno);
+}
+
+}
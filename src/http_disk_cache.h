@@ -0,0 +1,233 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "http_response_cache.h"
+
+namespace curlion {
+
+/**
+ HttpDiskCache is a persistent storage for HttpResponseCache, keeps responses across restarts.
+
+ Responses are appended to segment files in a directory. Segment files are memory-mapped for
+ reading, so a stored response can be read without copying, see Find method. An index keyed by
+ the hash of URL is rebuilt from segment files when the cache is opened.
+
+ Save and Remove only queue the change, which is written to segment files by a writer thread, so
+ that the thread finishing transfers never waits for disk I/O. Queued changes are visible to Find
+ and Load immediately. If the writer falls behind by more than a segment size, a save is turned
+ into a removal instead of being queued.
+
+ Replaced or removed responses leave garbage in segment files. A sealed segment consisting of mostly
+ garbage is rewritten by the writer thread automatically, see SetAutoCompaction. Compact or
+ CompactInBackground can also be called explicitly. When the total size of segment files exceeds
+ the capacity, the oldest segment is dropped as a whole.
+
+ Install the cache to a HttpResponseCache with HttpResponseCache::SetStorage.
+
+ This class is thread safe. It is available on POSIX systems only.
+ */
+class HttpDiskCache : public HttpResponseCache::Storage {
+public:
+    /**
+     View represents a stored response mapped in memory.
+
+     Pointers in the view keep valid as long as the view is alive, even if the response is
+     replaced, removed or moved by compaction.
+     */
+    class View {
+    public:
+        long status_code = 0;
+        std::chrono::system_clock::time_point response_time;
+        std::chrono::seconds freshness_lifetime{};
+        std::chrono::seconds stale_while_revalidate{};
+
+        const char* header = nullptr;
+        std::size_t header_length = 0;
+
+        const char* body = nullptr;
+        std::size_t body_length = 0;
+
+        const char* etag = nullptr;
+        std::size_t etag_length = 0;
+
+        const char* last_modified = nullptr;
+        std::size_t last_modified_length = 0;
+
+        /**
+         Keeps the mapped memory alive.
+         */
+        std::shared_ptr<const void> mapping;
+    };
+
+public:
+    /**
+     Construct the HttpDiskCache instance.
+
+     @param capacity
+         Maximum total size in bytes of segment files.
+
+     @param segment_size
+         Size in bytes at which a segment file is sealed and a new one is started.
+     */
+    HttpDiskCache(std::uint64_t capacity, std::uint64_t segment_size = 64 * 1024 * 1024);
+
+    /**
+     Destruct the HttpDiskCache instance.
+
+     Queued changes are written, and a running background compaction is waited to finish.
+     */
+    ~HttpDiskCache();
+
+    /**
+     Open a directory to store segment files.
+
+     @param directory
+         Path of the directory, must exist.
+
+     @return
+         Return an error on failure.
+
+     Existing segment files in the directory are loaded. This method must be called before any
+     other methods, and can be called only once.
+     */
+    std::error_condition Open(const std::string& directory);
+
+    /**
+     Find the stored response for a URL, without copying.
+
+     @return
+         The view of the stored response, or nullptr if not found.
+     */
+    std::shared_ptr<const View> Find(const std::string& url);
+
+    /**
+     Set whether to compact automatically, once a sealed segment contains garbage more than half
+     of its size. The compaction runs in the writer thread.
+
+     The default is true.
+     */
+    void SetAutoCompaction(bool is_enabled);
+
+    /**
+     Wait until all queued changes are written.
+     */
+    void Flush();
+
+    /**
+     Rewrite sealed segments which contain garbage more than half of their size.
+
+     Nothing happens if another compaction is running. The rewritten segment is discarded if
+     Clear or the capacity limit drops any of the sealed segments while rewriting.
+     */
+    void Compact();
+
+    /**
+     Run Compact in a background thread.
+
+     Nothing happens if a background compaction is running.
+     */
+    void CompactInBackground();
+
+    /**
+     Get total size in bytes of segment files.
+     */
+    std::uint64_t GetSize() const;
+
+    std::shared_ptr<HttpResponseCache::Entry> Load(const std::string& url) override;
+    void Save(const std::string& url, const HttpResponseCache::Entry& entry) override;
+    void Remove(const std::string& url) override;
+    void Clear() override;
+
+private:
+    class Mapping;
+
+    class Segment {
+    public:
+        std::uint32_t id = 0;
+        int file = -1;
+        std::uint64_t size = 0;
+        std::uint64_t live_size = 0;
+        std::uint64_t min_sequence = std::numeric_limits<std::uint64_t>::max();
+        std::shared_ptr<Mapping> mapping;
+    };
+
+    class Location {
+    public:
+        std::uint32_t segment_id = 0;
+        std::uint64_t offset = 0;
+        std::uint64_t length = 0;
+        std::uint64_t sequence = 0;
+    };
+
+    class MovedRecord {
+    public:
+        std::uint64_t key = 0;
+        Location from;
+        Location to;
+    };
+
+    class Record;
+    class PendingRecord;
+
+    std::error_condition LoadSegment(std::uint32_t segment_id, std::map<std::uint64_t, std::uint64_t>& removals);
+    std::error_condition CreateActiveSegment();
+    void Enqueue(const std::shared_ptr<const PendingRecord>& record, std::size_t length);
+    void RunWriter();
+    void WriteRecord(const PendingRecord& pending_record);
+    std::error_condition AppendRecord(const Record& record, Location& location);
+    bool HasCompactableSegment() const;
+    bool IsCompactable(const Segment& segment) const;
+    void CompactSegments();
+    std::shared_ptr<Mapping> MapSegment(Segment& segment);
+    void UpdateIndex(std::uint64_t key, const Location& location, bool is_removal);
+    void DropSegment(std::uint32_t segment_id);
+    void EnforceCapacity();
+    std::string GetSegmentPath(std::uint32_t segment_id) const;
+
+private:
+    HttpDiskCache(const HttpDiskCache&) = delete;
+    HttpDiskCache& operator=(const HttpDiskCache&) = delete;
+
+private:
+    std::uint64_t capacity_;
+    std::uint64_t segment_size_;
+    std::string directory_;
+
+    mutable std::mutex mutex_;
+    std::map<std::uint32_t, Segment> segments_;
+    std::uint32_t active_segment_id_;
+    std::uint32_t next_segment_id_;
+    std::uint64_t next_sequence_;
+    std::uint64_t size_;
+    std::map<std::uint64_t, Location> index_;
+
+    std::thread compaction_thread_;
+    bool is_compacting_;
+    bool is_auto_compaction_enabled_;
+
+    //Held by the writer while it writes a record, so that Clear doesn't race with it. Lock it
+    //before queue_mutex_, which is locked before mutex_.
+    std::mutex write_mutex_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_condition_;
+    std::deque<std::shared_ptr<const PendingRecord>> queue_;
+    std::map<std::string, std::shared_ptr<const PendingRecord>> pending_records_;
+    std::uint64_t pending_length_;
+    bool is_writing_;
+    bool is_writer_running_;
+    std::thread writer_thread_;
+};
+
+}
@@ -1,86 +1,370 @@
 #include "http_form.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace curlion {
 
-static std::vector<curl_forms> CreateOptions(const std::shared_ptr<HttpForm::Part>& part);
-    
-HttpForm::~HttpForm() {
-    
-    curl_formfree(handle_);
-}
-    
-    
-std::error_condition HttpForm::AddPart(const std::shared_ptr<Part>& part) {
-    
+class HttpForm::MappedFile {
+public:
+    static std::error_condition Map(const std::string& path, std::shared_ptr<MappedFile>& mapped_file);
+
+public:
+    ~MappedFile() {
+#ifndef WIN32
+        if (address != nullptr) {
+            munmap(address, length);
+        }
+#endif
+    }
+
+    void* address = nullptr;
+    std::size_t length = 0;
+};
+
+
+std::error_condition HttpForm::MappedFile::Map(const std::string& path, std::shared_ptr<MappedFile>& mapped_file) {
+
+#ifdef WIN32
+
+    //Not supported, the file is read by each connection as if it is not mapped.
+    (void)path;
+    mapped_file.reset();
+    return std::error_condition();
+
+#else
+
+    int file_descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_descriptor < 0) {
+        return std::error_condition(errno, std::generic_category());
+    }
+
     std::error_condition error;
-    
-    auto options = CreateOptions(part);
-    auto result = curl_formadd(&handle_, &handle_last_, CURLFORM_ARRAY, options.data(), CURLFORM_END);
-    
-    if (result == CURL_FORMADD_OK) {
-        parts_.push_back(part);
+    auto new_mapped_file = std::make_shared<MappedFile>();
+
+    struct stat file_status;
+    if (fstat(file_descriptor, &file_status) != 0) {
+        error.assign(errno, std::generic_category());
     }
-    else {
-        error.assign(result, CurlFormErrorCategory());
+    else if (file_status.st_size > 0) {
+
+        std::size_t length = static_cast<std::size_t>(file_status.st_size);
+        void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+        if (address == MAP_FAILED) {
+            error.assign(errno, std::generic_category());
+        }
+        else {
+            madvise(address, length, MADV_SEQUENTIAL);
+            new_mapped_file->address = address;
+            new_mapped_file->length = length;
+        }
+    }
+
+    //The mapping stays valid after the descriptor is closed.
+    close(file_descriptor);
+
+    if (! error) {
+        mapped_file = new_mapped_file;
     }
-    
     return error;
+
+#endif
+}
+
+
+//Reads content from a buffer, each connection has its own reader to track the position.
+class BufferReader {
+public:
+    BufferReader(const char* data, std::size_t length, const std::shared_ptr<const void>& owner) :
+        data(data),
+        length(length),
+        owner(owner),
+        position(0) { }
+
+    const char* data;
+    std::size_t length;
+    std::shared_ptr<const void> owner;
+    std::size_t position;
+};
+
+
+static std::size_t CurlReadBufferCallback(char* buffer, std::size_t size, std::size_t count, void* arg);
+static int CurlSeekBufferCallback(void* arg, curl_off_t offset, int origin);
+static std::size_t CurlReadPartCallback(char* buffer, std::size_t size, std::size_t count, void* arg);
+static int CurlSeekPartCallback(void* arg, curl_off_t offset, int origin);
+static bool IsContentFromFiles(const HttpForm::Part& part);
+static std::string GetFileName(const std::string& path);
+
+
+HttpForm::~HttpForm() {
+
 }
-    
-    
-static std::vector<curl_forms> CreateOptions(const std::shared_ptr<HttpForm::Part>& part) {
-    
-    std::vector<curl_forms> options;
-    
-    curl_forms name_option;
-    name_option.option = CURLFORM_PTRNAME;
-    name_option.value = part->name.c_str();
-    options.push_back(name_option);
-    
-    const auto& content = part->content;
-    if ((! content.empty()) || (part->files.empty())) {
-        
-        curl_forms content_option;
-        content_option.option = CURLFORM_PTRCONTENTS;
-        content_option.value = content.c_str();
-        options.push_back(content_option);
-        
-        curl_forms content_length_option;
-        content_length_option.option = CURLFORM_CONTENTSLENGTH;
-        content_length_option.value = reinterpret_cast<const char*>(content.length());
-        options.push_back(content_length_option);
+
+
+std::error_condition HttpForm::AddPart(const std::shared_ptr<Part>& part) {
+
+    if (part == nullptr) {
+        return std::make_error_condition(std::errc::invalid_argument);
     }
-    else {
-        
+
+    AddedPart added_part;
+    added_part.part = part;
+
+    if (IsContentFromFiles(*part)) {
+
         for (const auto& each_file : part->files) {
-            
-            curl_forms path_option;
-            path_option.option = CURLFORM_FILE;
-            path_option.value = each_file->path.c_str();
-            options.push_back(path_option);
-            
-            if (! each_file->name.empty()) {
-                curl_forms name_option;
-                name_option.option = CURLFORM_FILENAME;
-                name_option.value = each_file->name.c_str();
-                options.push_back((name_option));
+
+            std::shared_ptr<MappedFile> mapped_file;
+            if (each_file->is_mapped) {
+                auto error = MappedFile::Map(each_file->path, mapped_file);
+                if (error) {
+                    return error;
+                }
+            }
+            added_part.mapped_files.push_back(mapped_file);
+        }
+    }
+
+    parts_.push_back(added_part);
+    return std::error_condition();
+}
+
+
+std::shared_ptr<curl_mime> HttpForm::CreateHandle(CURL* easy_handle) const {
+
+    curl_mime* mime = curl_mime_init(easy_handle);
+    if (mime == nullptr) {
+        return nullptr;
+    }
+
+    //Readers are released after the handle is freed, since the handle refers to them.
+    auto readers = std::make_shared<std::vector<std::shared_ptr<void>>>();
+    std::shared_ptr<curl_mime> handle(mime, [readers](curl_mime* mime) {
+        curl_mime_free(mime);
+    });
+
+    for (const auto& each_part : parts_) {
+
+        curl_mimepart* mime_part = curl_mime_addpart(mime);
+        if (mime_part == nullptr) {
+            return nullptr;
+        }
+
+        CURLcode result = curl_mime_name(mime_part, each_part.part->name.c_str());
+        if (result == CURLE_OK) {
+            result = SetPartContent(easy_handle, mime_part, each_part, *readers);
+        }
+
+        if (result != CURLE_OK) {
+            return nullptr;
+        }
+    }
+
+    return handle;
+}
+
+
+CURLcode HttpForm::SetPartContent(CURL* easy_handle,
+                                  curl_mimepart* mime_part,
+                                  const AddedPart& added_part,
+                                  std::vector<std::shared_ptr<void>>& readers) const {
+
+    const Part& part = *added_part.part;
+
+    if (IsContentFromFiles(part)) {
+
+        //Multiple files are sent as subparts.
+        curl_mime* file_mime = nullptr;
+        if (part.files.size() > 1) {
+            file_mime = curl_mime_init(easy_handle);
+            if (file_mime == nullptr) {
+                return CURLE_OUT_OF_MEMORY;
+            }
+        }
+
+        CURLcode result = CURLE_OK;
+
+        for (std::size_t index = 0; index < part.files.size(); ++index) {
+
+            const File& file = *part.files[index];
+            const auto& mapped_file = added_part.mapped_files[index];
+
+            curl_mimepart* file_part = mime_part;
+            if (file_mime != nullptr) {
+                file_part = curl_mime_addpart(file_mime);
+                if (file_part == nullptr) {
+                    result = CURLE_OUT_OF_MEMORY;
+                    break;
+                }
+            }
+
+            if (mapped_file != nullptr) {
+
+                auto reader = std::make_shared<BufferReader>(static_cast<const char*>(mapped_file->address),
+                                                             mapped_file->length,
+                                                             mapped_file);
+                readers.push_back(reader);
+
+                result = curl_mime_data_cb(file_part,
+                                           static_cast<curl_off_t>(reader->length),
+                                           CurlReadBufferCallback,
+                                           CurlSeekBufferCallback,
+                                           nullptr,
+                                           reader.get());
+                if (result == CURLE_OK) {
+                    result = curl_mime_filename(file_part, (file.name.empty() ? GetFileName(file.path) : file.name).c_str());
+                }
+            }
+            else {
+
+                result = curl_mime_filedata(file_part, file.path.c_str());
+                if ((result == CURLE_OK) && ! file.name.empty()) {
+                    result = curl_mime_filename(file_part, file.name.c_str());
+                }
+            }
+
+            if ((result == CURLE_OK) && ! file.content_type.empty()) {
+                result = curl_mime_type(file_part, file.content_type.c_str());
+            }
+
+            if (result != CURLE_OK) {
+                break;
+            }
+        }
+
+        if (file_mime != nullptr) {
+            if (result == CURLE_OK) {
+                result = curl_mime_subparts(mime_part, file_mime);
             }
-            
-            if (! each_file->content_type.empty()) {
-                curl_forms content_type_option;
-                content_type_option.option = CURLFORM_CONTENTTYPE;
-                content_type_option.value = each_file->content_type.c_str();
-                options.push_back(content_type_option);
+            if (result != CURLE_OK) {
+                curl_mime_free(file_mime);
             }
         }
+        return result;
+    }
+
+    CURLcode result = CURLE_OK;
+
+    if (part.content.empty() && (part.data == nullptr) && (part.read_callback != nullptr)) {
+
+        //The part is kept alive by the form, which is retained by connections.
+        result = curl_mime_data_cb(mime_part,
+                                   part.read_length,
+                                   CurlReadPartCallback,
+                                   CurlSeekPartCallback,
+                                   nullptr,
+                                   const_cast<Part*>(&part));
+    }
+    else {
+
+        std::shared_ptr<BufferReader> reader;
+        if ((! part.content.empty()) || (part.data == nullptr)) {
+            reader = std::make_shared<BufferReader>(part.content.data(), part.content.length(), added_part.part);
+        }
+        else {
+            reader = std::make_shared<BufferReader>(part.data, part.data_length, part.data_owner);
+        }
+        readers.push_back(reader);
+
+        result = curl_mime_data_cb(mime_part,
+                                   static_cast<curl_off_t>(reader->length),
+                                   CurlReadBufferCallback,
+                                   CurlSeekBufferCallback,
+                                   nullptr,
+                                   reader.get());
+    }
+
+    if ((result == CURLE_OK) && ! part.file_name.empty()) {
+        result = curl_mime_filename(mime_part, part.file_name.c_str());
+    }
+
+    if ((result == CURLE_OK) && ! part.content_type.empty()) {
+        result = curl_mime_type(mime_part, part.content_type.c_str());
+    }
+
+    return result;
+}
+
+
+static std::size_t CurlReadBufferCallback(char* buffer, std::size_t size, std::size_t count, void* arg) {
+
+    BufferReader* reader = static_cast<BufferReader*>(arg);
+
+    std::size_t length = std::min(size * count, reader->length - reader->position);
+    if (length > 0) {
+        std::memcpy(buffer, reader->data + reader->position, length);
+        reader->position += length;
+    }
+    return length;
+}
+
+
+static int CurlSeekBufferCallback(void* arg, curl_off_t offset, int origin) {
+
+    BufferReader* reader = static_cast<BufferReader*>(arg);
+
+    curl_off_t position = offset;
+    if (origin == SEEK_CUR) {
+        position += reader->position;
+    }
+    else if (origin == SEEK_END) {
+        position += reader->length;
     }
-    
-    curl_forms end_option;
-    end_option.option = CURLFORM_END;
-    end_option.value = nullptr;
-    options.push_back(end_option);
 
-    return options;
+    if ((position < 0) || (position > static_cast<curl_off_t>(reader->length))) {
+        return CURL_SEEKFUNC_FAIL;
+    }
+
+    reader->position = static_cast<std::size_t>(position);
+    return CURL_SEEKFUNC_OK;
+}
+
+
+static std::size_t CurlReadPartCallback(char* buffer, std::size_t size, std::size_t count, void* arg) {
+
+    const HttpForm::Part* part = static_cast<const HttpForm::Part*>(arg);
+
+    std::size_t actual_length = 0;
+    bool is_succeeded = part->read_callback(buffer, size * count, actual_length);
+    if (! is_succeeded) {
+        return CURL_READFUNC_ABORT;
+    }
+    return std::min(actual_length, size * count);
+}
+
+
+static int CurlSeekPartCallback(void* arg, curl_off_t offset, int origin) {
+
+    const HttpForm::Part* part = static_cast<const HttpForm::Part*>(arg);
+
+    //Parts are only rewound to the beginning.
+    if ((part->seek_callback == nullptr) || (origin != SEEK_SET)) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    return part->seek_callback(offset) ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+}
+
+
+static bool IsContentFromFiles(const HttpForm::Part& part) {
+    return part.content.empty() && (part.data == nullptr) && (part.read_callback == nullptr) && ! part.files.empty();
+}
+
+
+static std::string GetFileName(const std::string& path) {
+
+    std::size_t slash_index = path.find_last_of('/');
+    if (slash_index == std::string::npos) {
+        return path;
+    }
+    return path.substr(slash_index + 1);
+}
+
 }
-    
-}
\ No newline at end of file
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <system_error>
 #include <vector>
 #include <curl/curl.h>
 #include "error.h"
@@ -10,11 +12,44 @@ namespace curlion {
 
 /**
  HttpForm used to build a multi-part form request content.
- 
- The instance of this class is used in HttpConnection::SetRequestForm method.
+
+ The instance of this class is used in HttpConnection::SetRequestForm method. A form can be
+ shared by multiple connections, each of them builds its own curl_mime handle from the form
+ with CreateHandle, so that they can send the form concurrently.
+
+ Contents of parts are not copied. A part's content is read from its source while the request
+ is sent, the source must stay unchanged until all connections using the form finish.
  */
 class HttpForm {
 public:
+    /**
+     Callback prototype for reading content of a part.
+
+     @param buffer
+         Buffer to fill content.
+
+     @param expected_length
+         Size of buffer.
+
+     @param actual_length
+         Return the number of bytes filled. 0 means the end of content.
+
+     @return
+         Whether the reading is succeeded. Return false to abort the request.
+     */
+    typedef std::function<bool(char* buffer, std::size_t expected_length, std::size_t& actual_length)> ReadCallback;
+
+    /**
+     Callback prototype for seeking content of a part.
+
+     @param offset
+         Offset from the beginning of content.
+
+     @return
+         Whether the seeking is succeeded.
+     */
+    typedef std::function<bool(curl_off_t offset)> SeekCallback;
+
     /**
      File represents information of a file in a part.
      */
@@ -24,37 +59,52 @@ public:
          Construct a empty file.
          */
         File() { }
-        
+
         /**
          Construct a file with specified path.
-         
+
          @param path
              Path of the file.
          */
         File(const std::string& path) : path(path) { }
-        
+
         /**
          Path of the file.
          */
         std::string path;
-        
+
         /**
          Name of the file.
-         
+
          If this field is empty, the name in path would be used.
          */
         std::string name;
-        
+
         /**
          Content type of the file.
-         
-         If this field is empty, the content type is determinated by the content of file.
+
+         If this field is empty, the content type is determinated by the extension of name.
          */
         std::string content_type;
+
+        /**
+         Whether to map the file into memory with mmap when the part is added.
+
+         A mapped file is opened only once, and is shared by all connections sending the form,
+         rather than being opened and read by each of them. The file must not be truncated
+         while it is mapped. It is not supported on Windows, where the file is read as if it is
+         not mapped.
+
+         The default is false.
+         */
+        bool is_mapped = false;
     };
-    
+
     /**
      Part represents information of a single part in a multi-part form.
+
+     The content of a part comes from one of the following sources, the first one set is used:
+     content, data, read_callback and files. A part without any source has empty content.
      */
     class Part {
     public:
@@ -62,69 +112,164 @@ public:
          Construct an empty part.
          */
         Part() { }
-        
+
         /**
          Construct a part with specified name and content.
-         
+
          @param name
              Name of the part.
-         
+
          @param content
              Content of the part.
          */
         Part(const std::string& name, const std::string& content) : name(name), content(content) { }
-        
+
+        /**
+         Construct a part with specified name and data in a buffer.
+
+         @param name
+             Name of the part.
+
+         @param data
+             Data of the part, which is not copied.
+
+         @param data_length
+             Length of data.
+
+         @param data_owner
+             The owner of data which keeps it alive, such as a shared_ptr to a container. Pass
+             nullptr to borrow data, which must outlive the form.
+         */
+        Part(const std::string& name,
+             const char* data,
+             std::size_t data_length,
+             const std::shared_ptr<const void>& data_owner = nullptr) :
+            name(name),
+            data(data),
+            data_length(data_length),
+            data_owner(data_owner) { }
+
         /**
          Name of the part.
          */
         std::string name;
-        
+
         /**
          Content of the part.
          */
         std::string content;
-        
+
+        /**
+         Data of the part in a buffer, which is not copied.
+         */
+        const char* data = nullptr;
+
+        /**
+         Length of data.
+         */
+        std::size_t data_length = 0;
+
+        /**
+         The owner of data which keeps it alive as long as the form, or nullptr if data is
+         borrowed.
+         */
+        std::shared_ptr<const void> data_owner;
+
+        /**
+         Callback for streaming content of the part.
+
+         The callback is called while the request is sent, so the content can be generated or
+         read from anywhere without being held in memory. It is shared by all connections sending
+         the form, so the form should be sent by one connection at a time.
+         */
+        ReadCallback read_callback;
+
+        /**
+         Callback for rewinding content read by read_callback, such as when the request is sent
+         again after a redirection.
+
+         If the callback is not set, the request fails if rewinding is needed.
+         */
+        SeekCallback seek_callback;
+
+        /**
+         Length of content read by read_callback, or -1 if the length is unknown.
+
+         A request with content of unknown length is sent with chunked transfer encoding.
+
+         The default is -1.
+         */
+        curl_off_t read_length = -1;
+
+        /**
+         File name of the part, other than files.
+
+         If this field is not empty, the part is sent as a file with this name.
+         */
+        std::string file_name;
+
+        /**
+         Content type of the part, other than files.
+         */
+        std::string content_type;
+
         /**
          Files in the part.
-         
-         Note that files and content can not coexist in a part, and content has a higher priority
-         than files. That is, if content is not empty, all files are ignored.
+
+         A part with multiple files is sent as a multipart/mixed part.
          */
         std::vector<std::shared_ptr<File>> files;
     };
-    
+
 public:
     /**
      Destruct the HttpForm instance.
      */
     ~HttpForm();
-    
+
     /**
      Add a part to the form.
-     
+
+     Mapped files of the part are mapped here.
+
      @param part
          The part is added, must not be nullptr.
-     
-     @return 
+
+     @return
          Return an error on failure.
      */
     std::error_condition AddPart(const std::shared_ptr<Part>& part);
-    
+
     /**
-     Get the handle of the form.
-     
+     Create a handle of the form for an easy handle.
+
+     @param easy_handle
+         The easy handle to send the form.
+
      @return
-         The curl_httppost* handle of the form.
+         The curl_mime* handle of the form, which is freed when the last reference is released.
+         Return nullptr on failure.
      */
-    curl_httppost* GetHandle() const {
-        return handle_;
-    }
-    
+    std::shared_ptr<curl_mime> CreateHandle(CURL* easy_handle) const;
+
 private:
-    curl_httppost* handle_ = nullptr;
-    curl_httppost* handle_last_ = nullptr;
-    
-    std::vector<std::shared_ptr<Part>> parts_;
+    class MappedFile;
+
+    class AddedPart {
+    public:
+        std::shared_ptr<Part> part;
+
+        //Mapped files in the same order as files of the part, nullptr for unmapped ones.
+        std::vector<std::shared_ptr<const MappedFile>> mapped_files;
+    };
+
+    CURLcode SetPartContent(CURL* easy_handle,
+                            curl_mimepart* mime_part,
+                            const AddedPart& added_part,
+                            std::vector<std::shared_ptr<void>>& readers) const;
+
+private:
+    std::vector<AddedPart> parts_;
 };
-    
-}
\ No newline at end of file
+
+}
@@ -0,0 +1,78 @@
+#include "http_header_set.h"
+#include <cctype>
+
+namespace curlion {
+
+static std::size_t GetFieldLength(const char* line);
+
+
+bool HttpHeaderSet::IsSameField(const char* line, const char* other_line) {
+
+    std::size_t length = GetFieldLength(line);
+    if (length != GetFieldLength(other_line)) {
+        return false;
+    }
+
+    for (std::size_t index = 0; index < length; ++index) {
+
+        if (std::tolower(static_cast<unsigned char>(line[index])) !=
+            std::tolower(static_cast<unsigned char>(other_line[index]))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+HttpHeaderSet::HttpHeaderSet(const std::multimap<std::string, std::string>& headers) {
+
+    //All lines are stored in a single buffer, separated by null characters.
+    std::size_t buffer_length = 0;
+    for (const auto& each_header : headers) {
+        buffer_length += each_header.first.length() + 2 + each_header.second.length() + 1;
+    }
+    lines_.reserve(buffer_length);
+
+    std::vector<std::size_t> line_offsets;
+    for (const auto& each_header : headers) {
+
+        line_offsets.push_back(lines_.length());
+
+        lines_.append(each_header.first);
+        lines_.append(": ");
+        lines_.append(each_header.second);
+        lines_.append(1, '\0');
+    }
+
+    //Nodes are linked after the buffer is complete, so that pointers to it keep valid.
+    nodes_.resize(line_offsets.size());
+    for (std::size_t index = 0; index < nodes_.size(); ++index) {
+
+        nodes_[index].data = &lines_[line_offsets[index]];
+        nodes_[index].next = (index + 1 < nodes_.size()) ? &nodes_[index + 1] : nullptr;
+    }
+}
+
+
+bool HttpHeaderSet::HasField(const char* line) const {
+
+    for (const auto& each_node : nodes_) {
+        if (IsSameField(each_node.data, line)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static std::size_t GetFieldLength(const char* line) {
+
+    std::size_t length = 0;
+    while ((line[length] != '\0') && (line[length] != ':') && (line[length] != ';')) {
+        ++length;
+    }
+    return length;
+}
+
+}
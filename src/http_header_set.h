@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+
+namespace curlion {
+
+/**
+ HttpHeaderSet is an immutable set of HTTP request headers.
+
+ Header lines are built once when the set is constructed. The set can be attached to any number
+ of HttpConnection instances with HttpConnection::SetRequestHeaderSet, without copying any header.
+ Hold the set with std::shared_ptr to share it.
+
+ This class is thread safe, since it is immutable.
+ */
+class HttpHeaderSet {
+public:
+    /**
+     Get whether two header lines have the same field.
+
+     Fields are the part before colon or semicolon, compared case-insensitively.
+     */
+    static bool IsSameField(const char* line, const char* other_line);
+
+public:
+    /**
+     Construct the HttpHeaderSet instance.
+
+     @param headers
+         Headers in the set. Each element is a pair of field and value.
+     */
+    explicit HttpHeaderSet(const std::multimap<std::string, std::string>& headers);
+
+    /**
+     Get whether the set contains a header with the same field as specified header line.
+     */
+    bool HasField(const char* line) const;
+
+    /**
+     Get the number of headers.
+     */
+    std::size_t GetCount() const {
+        return nodes_.size();
+    }
+
+    /**
+     Get the underlying header list.
+
+     The list must not be modified.
+     */
+    const curl_slist* GetHandle() const {
+        return nodes_.empty() ? nullptr : &nodes_.front();
+    }
+
+private:
+    HttpHeaderSet(const HttpHeaderSet&) = delete;
+    HttpHeaderSet& operator=(const HttpHeaderSet&) = delete;
+
+private:
+    std::string lines_;
+    std::vector<curl_slist> nodes_;
+};
+
+}
@@ -0,0 +1,523 @@
+#include "http_response_cache.h"
+#include <algorithm>
+#include <cctype>
+#include <vector>
+#include <curl/curl.h>
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteCacheLog(void* cache_identifier) {
+    return Log() << "HttpResponseCache(" << cache_identifier << "): ";
+}
+
+
+namespace {
+
+class ResponseHeader {
+public:
+    explicit ResponseHeader(const std::string& header);
+
+    const std::string* Find(const std::string& field) const;
+
+    const std::string& GetCacheControl() const {
+        return cache_control_;
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> fields_;
+    std::string cache_control_;
+};
+
+
+class CacheControl {
+public:
+    explicit CacheControl(const std::string& value);
+
+    bool Has(const std::string& directive) const;
+    bool GetSeconds(const std::string& directive, std::chrono::seconds& seconds) const;
+
+private:
+    std::map<std::string, std::string> directives_;
+};
+
+}
+
+static std::string ToLower(const std::string& string);
+static std::string Trim(const std::string& string);
+static bool IsCacheableStatusCode(long status_code);
+static bool ParseSeconds(const std::string& string, std::chrono::seconds& seconds);
+static bool ParseDate(const std::string& string, std::chrono::system_clock::time_point& time);
+static void UpdateFreshness(const ResponseHeader& header,
+                            std::chrono::system_clock::time_point now,
+                            HttpResponseCache::Entry& entry);
+
+
+HttpResponseCache::Freshness HttpResponseCache::Entry::GetFreshness(std::chrono::system_clock::time_point now) const {
+
+    auto age = now - response_time;
+
+    if (age < freshness_lifetime) {
+        return Freshness::Fresh;
+    }
+
+    if (age < freshness_lifetime + stale_while_revalidate) {
+        return Freshness::StaleWhileRevalidate;
+    }
+
+    return Freshness::Stale;
+}
+
+
+std::size_t HttpResponseCache::Entry::GetSize() const {
+
+    std::size_t size = sizeof(Entry) + header.size() + etag.size() + last_modified.size();
+    if (body != nullptr) {
+        size += body->size();
+    }
+    return size;
+}
+
+
+std::shared_ptr<HttpResponseCache::Entry> HttpResponseCache::CreateEntry(long status_code,
+                                                                         const std::string& header,
+                                                                         const std::shared_ptr<const std::string>& body) {
+
+    if (! IsCacheableStatusCode(status_code)) {
+        return nullptr;
+    }
+
+    ResponseHeader response_header(header);
+    CacheControl cache_control(response_header.GetCacheControl());
+    if (cache_control.Has("no-store")) {
+        return nullptr;
+    }
+
+    //Entries are keyed by URL only, a response selected by request headers can't be reused.
+    if (response_header.Find("vary") != nullptr) {
+        return nullptr;
+    }
+
+    auto entry = std::make_shared<Entry>();
+    entry->status_code = status_code;
+    entry->header = header;
+    entry->body = body;
+
+    const std::string* etag = response_header.Find("etag");
+    if (etag != nullptr) {
+        entry->etag = *etag;
+    }
+
+    const std::string* last_modified = response_header.Find("last-modified");
+    if (last_modified != nullptr) {
+        entry->last_modified = *last_modified;
+    }
+
+    UpdateFreshness(response_header, std::chrono::system_clock::now(), *entry);
+
+    //A response which is never fresh and can not be revalidated is useless.
+    bool can_revalidate = (! entry->etag.empty()) || (! entry->last_modified.empty());
+    if ((entry->freshness_lifetime.count() == 0) && (! can_revalidate)) {
+        return nullptr;
+    }
+
+    return entry;
+}
+
+
+std::shared_ptr<HttpResponseCache::Entry> HttpResponseCache::CreateRevalidatedEntry(const std::shared_ptr<const Entry>& entry,
+                                                                                    const std::string& header) {
+
+    ResponseHeader response_header(header);
+    CacheControl cache_control(response_header.GetCacheControl());
+    if (cache_control.Has("no-store")) {
+        return nullptr;
+    }
+
+    //Entries are keyed by URL only, a response selected by request headers can't be reused.
+    if (response_header.Find("vary") != nullptr) {
+        return nullptr;
+    }
+
+    auto new_entry = std::make_shared<Entry>(*entry);
+
+    const std::string* etag = response_header.Find("etag");
+    if (etag != nullptr) {
+        new_entry->etag = *etag;
+    }
+
+    const std::string* last_modified = response_header.Find("last-modified");
+    if (last_modified != nullptr) {
+        new_entry->last_modified = *last_modified;
+    }
+
+    //Freshness information in 304 response takes place of the stored one. The stored one is kept
+    //if the 304 response doesn't contain any.
+    if ((! response_header.GetCacheControl().empty()) || (response_header.Find("expires") != nullptr)) {
+        UpdateFreshness(response_header, std::chrono::system_clock::now(), *new_entry);
+    }
+    else {
+        new_entry->response_time = std::chrono::system_clock::now();
+    }
+
+    return new_entry;
+}
+
+
+HttpResponseCache::HttpResponseCache(std::size_t capacity) :
+    capacity_(capacity),
+    size_(0) {
+
+}
+
+
+std::shared_ptr<const HttpResponseCache::Entry> HttpResponseCache::Find(const std::string& url) {
+
+    auto iterator = entry_indexes_.find(url);
+    if (iterator != entry_indexes_.end()) {
+
+        WriteCacheLog(this) << "Hit " << url << '.';
+
+        entries_.splice(entries_.begin(), entries_, iterator->second);
+        return iterator->second->second;
+    }
+
+    if (storage_ != nullptr) {
+
+        std::shared_ptr<const Entry> entry = storage_->Load(url);
+        if (entry != nullptr) {
+
+            WriteCacheLog(this) << "Hit " << url << " in storage.";
+
+            Insert(url, entry);
+            return entry;
+        }
+    }
+
+    WriteCacheLog(this) << "Miss " << url << '.';
+    return nullptr;
+}
+
+
+void HttpResponseCache::Store(const std::string& url, const std::shared_ptr<const Entry>& entry) {
+
+    revalidating_urls_.erase(url);
+
+    Insert(url, entry);
+
+    if (storage_ != nullptr) {
+        storage_->Save(url, *entry);
+    }
+}
+
+
+void HttpResponseCache::Remove(const std::string& url) {
+
+    revalidating_urls_.erase(url);
+
+    Erase(url);
+
+    if (storage_ != nullptr) {
+        storage_->Remove(url);
+    }
+}
+
+
+void HttpResponseCache::Clear() {
+
+    entries_.clear();
+    entry_indexes_.clear();
+    revalidating_urls_.clear();
+    size_ = 0;
+
+    if (storage_ != nullptr) {
+        storage_->Clear();
+    }
+}
+
+
+void HttpResponseCache::Insert(const std::string& url, const std::shared_ptr<const Entry>& entry) {
+
+    Erase(url);
+
+    std::size_t entry_size = url.size() + entry->GetSize();
+    if (entry_size > capacity_) {
+        WriteCacheLog(this) << "Ignore " << url << " with size " << entry_size << ", exceeds capacity.";
+        return;
+    }
+
+    WriteCacheLog(this) << "Store " << url << " with size " << entry_size << '.';
+
+    entries_.push_front(std::make_pair(url, entry));
+    entry_indexes_.insert(std::make_pair(url, entries_.begin()));
+    size_ += entry_size;
+
+    Evict();
+}
+
+
+void HttpResponseCache::Erase(const std::string& url) {
+
+    auto iterator = entry_indexes_.find(url);
+    if (iterator == entry_indexes_.end()) {
+        return;
+    }
+
+    size_ -= url.size() + iterator->second->second->GetSize();
+    entries_.erase(iterator->second);
+    entry_indexes_.erase(iterator);
+}
+
+
+void HttpResponseCache::Evict() {
+
+    while ((size_ > capacity_) && (! entries_.empty())) {
+
+        const auto& last = entries_.back();
+
+        WriteCacheLog(this) << "Evict " << last.first << '.';
+
+        size_ -= last.first.size() + last.second->GetSize();
+        revalidating_urls_.erase(last.first);
+        entry_indexes_.erase(last.first);
+        entries_.pop_back();
+    }
+}
+
+
+void HttpResponseCache::RequestRevalidation(const std::string& url) {
+
+    if (revalidate_callback_ == nullptr) {
+        return;
+    }
+
+    bool is_inserted = revalidating_urls_.insert(url).second;
+    if (! is_inserted) {
+        return;
+    }
+
+    WriteCacheLog(this) << "Request revalidation for " << url << '.';
+    revalidate_callback_(url);
+}
+
+
+ResponseHeader::ResponseHeader(const std::string& header) {
+
+    std::size_t begin_index = 0;
+    while (begin_index < header.length()) {
+
+        std::size_t end_index = header.find('\n', begin_index);
+        if (end_index == std::string::npos) {
+            end_index = header.length();
+        }
+
+        std::string line = header.substr(begin_index, end_index - begin_index);
+        begin_index = end_index + 1;
+
+        std::size_t colon_index = line.find(':');
+        if (colon_index == std::string::npos) {
+            continue;
+        }
+
+        std::string field = ToLower(Trim(line.substr(0, colon_index)));
+        std::string value = Trim(line.substr(colon_index + 1));
+
+        //Multiple Cache-Control headers are combined to a single one.
+        if (field == "cache-control") {
+            if (! cache_control_.empty()) {
+                cache_control_.append(1, ',');
+            }
+            cache_control_.append(value);
+        }
+
+        fields_.push_back(std::make_pair(field, value));
+    }
+}
+
+
+const std::string* ResponseHeader::Find(const std::string& field) const {
+
+    for (const auto& each_field : fields_) {
+        if (each_field.first == field) {
+            return &each_field.second;
+        }
+    }
+    return nullptr;
+}
+
+
+CacheControl::CacheControl(const std::string& value) {
+
+    std::size_t begin_index = 0;
+    while (begin_index < value.length()) {
+
+        std::size_t end_index = value.find(',', begin_index);
+        if (end_index == std::string::npos) {
+            end_index = value.length();
+        }
+
+        std::string directive = Trim(value.substr(begin_index, end_index - begin_index));
+        begin_index = end_index + 1;
+
+        if (directive.empty()) {
+            continue;
+        }
+
+        std::string argument;
+        std::size_t equal_index = directive.find('=');
+        if (equal_index != std::string::npos) {
+            argument = Trim(directive.substr(equal_index + 1));
+            directive = Trim(directive.substr(0, equal_index));
+        }
+
+        if ((argument.length() >= 2) && (argument.front() == '"') && (argument.back() == '"')) {
+            argument = argument.substr(1, argument.length() - 2);
+        }
+
+        directives_.insert(std::make_pair(ToLower(directive), argument));
+    }
+}
+
+
+bool CacheControl::Has(const std::string& directive) const {
+    return directives_.find(directive) != directives_.end();
+}
+
+
+bool CacheControl::GetSeconds(const std::string& directive, std::chrono::seconds& seconds) const {
+
+    auto iterator = directives_.find(directive);
+    if (iterator == directives_.end()) {
+        return false;
+    }
+
+    return ParseSeconds(iterator->second, seconds);
+}
+
+
+static void UpdateFreshness(const ResponseHeader& header,
+                            std::chrono::system_clock::time_point now,
+                            HttpResponseCache::Entry& entry) {
+
+    CacheControl cache_control(header.GetCacheControl());
+
+    std::chrono::system_clock::time_point date = now;
+    const std::string* date_value = header.Find("date");
+    if (date_value != nullptr) {
+        ParseDate(*date_value, date);
+    }
+
+    std::chrono::seconds freshness_lifetime{};
+    if (! cache_control.GetSeconds("max-age", freshness_lifetime)) {
+
+        const std::string* expires_value = header.Find("expires");
+        std::chrono::system_clock::time_point expires;
+        if ((expires_value != nullptr) && ParseDate(*expires_value, expires) && (expires > date)) {
+            freshness_lifetime = std::chrono::duration_cast<std::chrono::seconds>(expires - date);
+        }
+    }
+
+    //no-cache requires revalidation on every use.
+    if (cache_control.Has("no-cache")) {
+        freshness_lifetime = std::chrono::seconds::zero();
+    }
+
+    std::chrono::seconds stale_while_revalidate{};
+    cache_control.GetSeconds("stale-while-revalidate", stale_while_revalidate);
+
+    //The response is considered generated at the time corrected by its age, see RFC 9111 4.2.3.
+    std::chrono::seconds age{};
+    const std::string* age_value = header.Find("age");
+    if (age_value != nullptr) {
+        ParseSeconds(*age_value, age);
+    }
+
+    auto apparent_age = std::max(now - date, std::chrono::system_clock::duration::zero());
+    auto corrected_age = std::max<std::chrono::system_clock::duration>(apparent_age, age);
+
+    entry.response_time = now - corrected_age;
+    entry.freshness_lifetime = freshness_lifetime;
+    entry.stale_while_revalidate = stale_while_revalidate;
+}
+
+
+static bool IsCacheableStatusCode(long status_code) {
+
+    //Status codes that are heuristically cacheable, see RFC 9110 15.1.
+    switch (status_code) {
+        case 200:
+        case 203:
+        case 204:
+        case 300:
+        case 301:
+        case 308:
+        case 404:
+        case 405:
+        case 410:
+        case 414:
+        case 501:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static bool ParseSeconds(const std::string& string, std::chrono::seconds& seconds) {
+
+    if (string.empty() || (! std::all_of(string.begin(), string.end(), ::isdigit))) {
+        return false;
+    }
+
+    //Larger values are taken as 2^31, as RFC 9111 section 1.2.2 requires, which also keeps the
+    //freshness lifetime from overflowing the durations of system_clock.
+    const long long max_seconds = 2147483648LL;
+
+    long long value = 0;
+    for (char each_character : string) {
+        value = value * 10 + (each_character - '0');
+        if (value >= max_seconds) {
+            value = max_seconds;
+            break;
+        }
+    }
+
+    seconds = std::chrono::seconds(value);
+    return true;
+}
+
+
+static bool ParseDate(const std::string& string, std::chrono::system_clock::time_point& time) {
+
+    time_t seconds = curl_getdate(string.c_str(), nullptr);
+    if (seconds == -1) {
+        return false;
+    }
+
+    time = std::chrono::system_clock::from_time_t(seconds);
+    return true;
+}
+
+
+static std::string ToLower(const std::string& string) {
+
+    std::string lower_string = string;
+    std::transform(lower_string.begin(), lower_string.end(), lower_string.begin(), ::tolower);
+    return lower_string;
+}
+
+
+static std::string Trim(const std::string& string) {
+
+    static const char* const kWhitespaces = " \t\r\n";
+
+    std::size_t begin_index = string.find_first_not_of(kWhitespaces);
+    if (begin_index == std::string::npos) {
+        return std::string();
+    }
+
+    std::size_t end_index = string.find_last_not_of(kWhitespaces);
+    return string.substr(begin_index, end_index - begin_index + 1);
+}
+
+}
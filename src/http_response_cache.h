@@ -0,0 +1,304 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+namespace curlion {
+
+/**
+ HttpResponseCache is an in-memory cache used by HttpConnection to store HTTP responses.
+
+ Responses are stored in LRU order, along with their headers. The least recently used responses
+ are evicted once the total size of stored responses exceeds the capacity.
+
+ Freshness of responses is determined by Cache-Control and Expires headers, according to RFC 9111.
+ Responses with Cache-Control: no-store are never stored. A stale response carrying ETag or
+ Last-Modified header would be revalidated with a conditional request, and a 304 response reuses
+ the stored body.
+
+ Install the cache to connections with HttpConnection::SetResponseCache. A single cache can be
+ shared by many connections.
+
+ This class is not thread safe.
+ */
+class HttpResponseCache {
+public:
+    /**
+     Freshness of a stored response.
+     */
+    enum class Freshness {
+
+        /**
+         The response is fresh and can be used without contacting the server.
+         */
+        Fresh,
+
+        /**
+         The response is stale, but it can still be used while it is being revalidated in background,
+         because of the stale-while-revalidate directive.
+         */
+        StaleWhileRevalidate,
+
+        /**
+         The response is stale and must be revalidated before use.
+         */
+        Stale,
+    };
+
+    /**
+     Entry represents a stored response.
+
+     Entries are immutable once stored. The body is shared among entries refreshed by 304 responses.
+     */
+    class Entry {
+    public:
+        /**
+         Get the freshness of the entry at specified time.
+         */
+        Freshness GetFreshness(std::chrono::system_clock::time_point now) const;
+
+        /**
+         Get the size in bytes that the entry consumes.
+         */
+        std::size_t GetSize() const;
+
+        /**
+         HTTP status code of the response.
+         */
+        long status_code = 0;
+
+        /**
+         Raw response header, including the status line.
+         */
+        std::string header;
+
+        /**
+         Response body.
+         */
+        std::shared_ptr<const std::string> body;
+
+        /**
+         The time when the response was generated by the server, corrected by Age header.
+         */
+        std::chrono::system_clock::time_point response_time;
+
+        /**
+         How long the response keeps fresh since response time.
+         */
+        std::chrono::seconds freshness_lifetime{};
+
+        /**
+         How long the response can be used while revalidating after it turns stale.
+         */
+        std::chrono::seconds stale_while_revalidate{};
+
+        /**
+         Value of ETag header. Empty if not present.
+         */
+        std::string etag;
+
+        /**
+         Value of Last-Modified header. Empty if not present.
+         */
+        std::string last_modified;
+    };
+
+    /**
+     Callback prototype for background revalidation.
+
+     @param url
+         The URL whose stored response should be revalidated.
+
+     This callback is called when a response is used because of stale-while-revalidate. It should
+     start a connection to the URL with the same cache installed and SetAlwaysRevalidate set to true.
+     The callback would not be called again for the same URL until the response is stored again.
+     */
+    typedef std::function<void(const std::string& url)> RevalidateCallback;
+
+    /**
+     Storage is an interface of a secondary tier under the in-memory cache, such as HttpDiskCache.
+
+     Responses missing in memory are loaded from the storage and kept in memory afterwards. Stored
+     responses are written through to the storage.
+     */
+    class Storage {
+    public:
+        Storage() { }
+        virtual ~Storage() { }
+
+        /**
+         Load the response for a URL.
+
+         Return nullptr if not found.
+         */
+        virtual std::shared_ptr<Entry> Load(const std::string& url) = 0;
+
+        /**
+         Save the response for a URL, replacing any existing one.
+         */
+        virtual void Save(const std::string& url, const Entry& entry) = 0;
+
+        /**
+         Remove the response for a URL.
+         */
+        virtual void Remove(const std::string& url) = 0;
+
+        /**
+         Remove all responses.
+         */
+        virtual void Clear() = 0;
+
+    private:
+        Storage(const Storage&) = delete;
+        Storage& operator=(const Storage&) = delete;
+    };
+
+public:
+    /**
+     Create an entry from a response.
+
+     @param status_code
+         HTTP status code of the response.
+
+     @param header
+         Raw response header of the response.
+
+     @param body
+         Response body.
+
+     @return
+         The created entry, or nullptr if the response is not allowed to store. Responses with
+         Vary header are not stored, since entries are keyed by URL only.
+     */
+    static std::shared_ptr<Entry> CreateEntry(long status_code,
+                                              const std::string& header,
+                                              const std::shared_ptr<const std::string>& body);
+
+    /**
+     Create an entry refreshed by a 304 response.
+
+     @param entry
+         The stored entry being revalidated.
+
+     @param header
+         Raw response header of the 304 response.
+
+     @return
+         The refreshed entry, shares the same body with the stored entry. nullptr is returned if
+         the response is not allowed to store any more.
+     */
+    static std::shared_ptr<Entry> CreateRevalidatedEntry(const std::shared_ptr<const Entry>& entry,
+                                                         const std::string& header);
+
+public:
+    /**
+     Construct the HttpResponseCache instance.
+
+     @param capacity
+         Maximum total size in bytes of stored responses.
+     */
+    explicit HttpResponseCache(std::size_t capacity);
+
+    /**
+     Set the secondary storage.
+
+     The default is nullptr.
+     */
+    void SetStorage(const std::shared_ptr<Storage>& storage) {
+        storage_ = storage;
+    }
+
+    /**
+     Find the stored response for a URL.
+
+     If the response is not in memory, it is loaded from the secondary storage if there is one.
+
+     @return
+         The stored entry, or nullptr if not found. The entry is marked as most recently used.
+     */
+    std::shared_ptr<const Entry> Find(const std::string& url);
+
+    /**
+     Store a response for a URL.
+
+     Any stored response with the same URL is replaced. The entry is not kept in memory if it is 
+     larger than the capacity, but it is still saved to the secondary storage.
+     */
+    void Store(const std::string& url, const std::shared_ptr<const Entry>& entry);
+
+    /**
+     Remove the stored response for a URL.
+     */
+    void Remove(const std::string& url);
+
+    /**
+     Remove all stored responses, including those in the secondary storage.
+     */
+    void Clear();
+
+    /**
+     Get total size in bytes of stored responses.
+     */
+    std::size_t GetSize() const {
+        return size_;
+    }
+
+    /**
+     Get the capacity set in constructor.
+     */
+    std::size_t GetCapacity() const {
+        return capacity_;
+    }
+
+    /**
+     Set callback for background revalidation.
+
+     If the callback is not callable, stale-while-revalidate directive is ignored, and stale
+     responses are always revalidated before use.
+     */
+    void SetRevalidateCallback(const RevalidateCallback& callback) {
+        revalidate_callback_ = callback;
+    }
+
+    /**
+     Get whether the stale-while-revalidate directive can be honored.
+     */
+    bool CanRevalidateInBackground() const {
+        return revalidate_callback_ != nullptr;
+    }
+
+    /**
+     Request a background revalidation for a URL.
+
+     This method is called by HttpConnection when a response is used because of
+     stale-while-revalidate.
+     */
+    void RequestRevalidation(const std::string& url);
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const Entry>>> EntryList;
+
+    void Insert(const std::string& url, const std::shared_ptr<const Entry>& entry);
+    void Erase(const std::string& url);
+    void Evict();
+
+private:
+    HttpResponseCache(const HttpResponseCache&) = delete;
+    HttpResponseCache& operator=(const HttpResponseCache&) = delete;
+
+private:
+    std::size_t capacity_;
+    std::size_t size_;
+    EntryList entries_;
+    std::map<std::string, EntryList::iterator> entry_indexes_;
+    std::set<std::string> revalidating_urls_;
+    RevalidateCallback revalidate_callback_;
+    std::shared_ptr<Storage> storage_;
+};
+
+}
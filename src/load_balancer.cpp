@@ -0,0 +1,247 @@
+#include "load_balancer.h"
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteBalancerLog(void* balancer_identifier) {
+    return Log() << "LoadBalancer(" << balancer_identifier << "): ";
+}
+
+
+static std::string FormatAddress(const std::string& address) {
+
+    //IPv6 addresses must be bracketed in CURLOPT_CONNECT_TO items.
+    if ((address.find(':') != std::string::npos) && (address.front() != '[')) {
+        return '[' + address + ']';
+    }
+    return address;
+}
+
+
+LoadBalancer::LoadBalancer() {
+
+}
+
+
+LoadBalancer::LoadBalancer(const Options& options) : options_(options) {
+
+}
+
+
+std::string LoadBalancer::MakeHostKey(const std::string& host, long port) {
+    return host + ':' + std::to_string(port);
+}
+
+
+void LoadBalancer::SetEndpoints(const std::string& host, long port, const std::vector<Endpoint>& endpoints) {
+
+    std::string host_key = MakeHostKey(host, port);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<EndpointState>& old_endpoint_states = hosts_[host_key];
+    std::vector<EndpointState> new_endpoint_states;
+
+    for (const auto& each_endpoint : endpoints) {
+
+        if (each_endpoint.address.empty() || (each_endpoint.weight <= 0)) {
+            WriteBalancerLog(this) << "Invalid endpoint " << each_endpoint.address << " of " << host_key << ". Ignored.";
+            continue;
+        }
+
+        long endpoint_port = each_endpoint.port != 0 ? each_endpoint.port : port;
+        std::string address = FormatAddress(each_endpoint.address);
+        std::string key = address + ':' + std::to_string(endpoint_port);
+
+        EndpointState endpoint_state;
+        for (const auto& each_state : old_endpoint_states) {
+            if (each_state.key == key) {
+                endpoint_state = each_state;
+                break;
+            }
+        }
+
+        if (endpoint_state.connect_to_items == nullptr) {
+            std::string item = host_key + ':' + key;
+            endpoint_state.connect_to_items.reset(curl_slist_append(nullptr, item.c_str()), curl_slist_free_all);
+        }
+
+        endpoint_state.endpoint = each_endpoint;
+        endpoint_state.key = key;
+        new_endpoint_states.push_back(endpoint_state);
+    }
+
+    if (new_endpoint_states.empty()) {
+        hosts_.erase(host_key);
+    }
+    else {
+        old_endpoint_states.swap(new_endpoint_states);
+    }
+}
+
+
+std::shared_ptr<const curl_slist> LoadBalancer::Pick(const std::string& host, long port, std::string& endpoint_key) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto iterator = hosts_.find(MakeHostKey(host, port));
+    if (iterator == hosts_.end()) {
+        return nullptr;
+    }
+
+    std::vector<EndpointState>& endpoints = iterator->second;
+    auto now = std::chrono::steady_clock::now();
+
+    std::vector<std::size_t> candidates;
+    for (std::size_t index = 0; index < endpoints.size(); ++index) {
+        if (endpoints[index].ejection_end_time <= now) {
+            candidates.push_back(index);
+        }
+    }
+
+    //Spread connections over all endpoints rather than fail them, if every endpoint is ejected.
+    if (candidates.empty()) {
+        for (std::size_t index = 0; index < endpoints.size(); ++index) {
+            candidates.push_back(index);
+        }
+    }
+
+    EndpointState& endpoint_state = endpoints[PickIndex(endpoints, candidates)];
+    endpoint_state.outstanding_count++;
+
+    endpoint_key = endpoint_state.key;
+    return endpoint_state.connect_to_items;
+}
+
+
+std::size_t LoadBalancer::PickIndex(std::vector<EndpointState>& endpoints, const std::vector<std::size_t>& candidates) {
+
+    auto load = [&endpoints](std::size_t index) {
+        return endpoints[index].outstanding_count / endpoints[index].endpoint.weight;
+    };
+
+    switch (options_.strategy) {
+
+        case Strategy::LeastOutstanding: {
+
+            //Start from a random candidate, so that ties don't always go to the first endpoint.
+            std::size_t offset = random_engine_() % candidates.size();
+            std::size_t picked_index = candidates[offset];
+
+            for (std::size_t count = 1; count < candidates.size(); ++count) {
+                std::size_t index = candidates[(offset + count) % candidates.size()];
+                if (load(index) < load(picked_index)) {
+                    picked_index = index;
+                }
+            }
+            return picked_index;
+        }
+
+        case Strategy::PowerOfTwoChoices: {
+
+            if (candidates.size() == 1) {
+                return candidates.front();
+            }
+
+            std::size_t first = random_engine_() % candidates.size();
+            std::size_t second = random_engine_() % (candidates.size() - 1);
+            if (second >= first) {
+                second++;
+            }
+
+            std::size_t first_index = candidates[first];
+            std::size_t second_index = candidates[second];
+            return load(second_index) < load(first_index) ? second_index : first_index;
+        }
+
+        case Strategy::WeightedRoundRobin:
+        default: {
+
+            //Smooth weighted round robin, which interleaves endpoints instead of picking the
+            //heaviest one in a row.
+            double total_weight = 0;
+            std::size_t picked_index = candidates.front();
+
+            for (std::size_t index : candidates) {
+
+                EndpointState& endpoint_state = endpoints[index];
+                endpoint_state.current_weight += endpoint_state.endpoint.weight;
+                total_weight += endpoint_state.endpoint.weight;
+
+                if (endpoint_state.current_weight > endpoints[picked_index].current_weight) {
+                    picked_index = index;
+                }
+            }
+
+            endpoints[picked_index].current_weight -= total_weight;
+            return picked_index;
+        }
+    }
+}
+
+
+void LoadBalancer::Release(const std::string& host, long port, const std::string& endpoint_key, bool is_failed) {
+
+    std::string host_key = MakeHostKey(host, port);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto iterator = hosts_.find(host_key);
+    if (iterator == hosts_.end()) {
+        return;
+    }
+
+    std::vector<EndpointState>& endpoints = iterator->second;
+
+    EndpointState* endpoint_state = nullptr;
+    for (auto& each_state : endpoints) {
+        if (each_state.key == endpoint_key) {
+            endpoint_state = &each_state;
+            break;
+        }
+    }
+
+    //The endpoint has been removed.
+    if (endpoint_state == nullptr) {
+        return;
+    }
+
+    if (endpoint_state->outstanding_count > 0) {
+        endpoint_state->outstanding_count--;
+    }
+
+    if (! is_failed) {
+        endpoint_state->failure_count = 0;
+        return;
+    }
+
+    endpoint_state->failure_count++;
+    if ((options_.ejection_failure_count == 0) || (endpoint_state->failure_count < options_.ejection_failure_count)) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (endpoint_state->ejection_end_time > now) {
+        return;
+    }
+
+    std::size_t ejected_count = 0;
+    for (const auto& each_state : endpoints) {
+        if (each_state.ejection_end_time > now) {
+            ejected_count++;
+        }
+    }
+
+    if (ejected_count + 1 > options_.max_ejection_ratio * endpoints.size()) {
+        WriteBalancerLog(this) << "Endpoint " << endpoint_key << " of " << host_key << " keeps failing, "
+            << "but too many endpoints are ejected.";
+        return;
+    }
+
+    WriteBalancerLog(this) << "Eject endpoint " << endpoint_key << " of " << host_key << '.';
+
+    endpoint_state->failure_count = 0;
+    endpoint_state->ejection_end_time = now + options_.ejection_duration;
+}
+
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+
+namespace curlion {
+
+/**
+ LoadBalancer spreads connections to a host across a set of endpoint addresses.
+
+ Endpoints of a host are set with SetEndpoints. Connections attached with
+ Connection::SetLoadBalancer pick an endpoint when they start, and connect to it through
+ CURLOPT_CONNECT_TO items, which are built once per endpoint and shared by all connections. The
+ URL is not changed, so the Host header and TLS server name still refer to the original host.
+ Hosts without endpoints are connected as usual.
+
+ Each endpoint counts its outstanding connections. An endpoint failing consecutively is ejected
+ for a while, during which it is not picked unless all endpoints are ejected.
+
+ This class is thread safe, so a single balancer can be shared by connections of multiple
+ ConnectionManager instances.
+ */
+class LoadBalancer {
+public:
+    /**
+     Strategy to pick an endpoint.
+     */
+    enum class Strategy {
+
+        /**
+         Pick the endpoint with the fewest outstanding connections relative to its weight.
+         */
+        LeastOutstanding,
+
+        /**
+         Pick two endpoints randomly, and use the one with fewer outstanding connections relative
+         to its weight.
+         */
+        PowerOfTwoChoices,
+
+        /**
+         Pick endpoints in turn, in proportion to their weights.
+         */
+        WeightedRoundRobin,
+    };
+
+    /**
+     An endpoint of a host.
+     */
+    class Endpoint {
+    public:
+        /**
+         The IP address or host name to connect to.
+         */
+        std::string address;
+
+        /**
+         The port to connect to. 0 means the port of the URL.
+         */
+        long port = 0;
+
+        /**
+         The weight of the endpoint, must be positive.
+         */
+        double weight = 1;
+    };
+
+    /**
+     Options of the balancer.
+     */
+    class Options {
+    public:
+        /**
+         The strategy to pick an endpoint.
+         */
+        Strategy strategy = Strategy::PowerOfTwoChoices;
+
+        /**
+         The number of consecutive failures after which an endpoint is ejected. 0 disables
+         ejection.
+         */
+        std::size_t ejection_failure_count = 5;
+
+        /**
+         How long an endpoint stays ejected.
+         */
+        std::chrono::milliseconds ejection_duration{ 30000 };
+
+        /**
+         The maximum ratio of endpoints of a host which can be ejected at the same time, between
+         0 and 1.
+         */
+        double max_ejection_ratio = 0.5;
+    };
+
+public:
+    /**
+     Construct the LoadBalancer instance with default options.
+     */
+    LoadBalancer();
+
+    /**
+     Construct the LoadBalancer instance with specified options.
+     */
+    explicit LoadBalancer(const Options& options);
+
+    /**
+     Set endpoints of a host.
+
+     @param host
+         The host name in URLs.
+
+     @param port
+         The port in URLs.
+
+     @param endpoints
+         The endpoints. Endpoints with non-positive weight are ignored. An empty list removes the
+         host.
+
+     States of endpoints which are kept, such as outstanding connections and ejection, are
+     preserved.
+     */
+    void SetEndpoints(const std::string& host, long port, const std::vector<Endpoint>& endpoints);
+
+    /**
+     Pick an endpoint for a connection.
+
+     @param host
+         The host name in the URL.
+
+     @param port
+         The port in the URL.
+
+     @param endpoint_key
+         Returns the key of the picked endpoint, which must be passed to Release.
+
+     @return
+         The CURLOPT_CONNECT_TO items pointing to the picked endpoint, or nullptr if the host has no
+         endpoint. The items must not be modified.
+
+     Connection calls this method when it starts.
+     */
+    std::shared_ptr<const curl_slist> Pick(const std::string& host, long port, std::string& endpoint_key);
+
+    /**
+     Release an endpoint picked by Pick.
+
+     @param is_failed
+         Whether the connection failed to reach the endpoint, or the endpoint responded with a
+         server error.
+
+     Connection calls this method when it finishes or aborts.
+     */
+    void Release(const std::string& host, long port, const std::string& endpoint_key, bool is_failed);
+
+private:
+    class EndpointState {
+    public:
+        Endpoint endpoint;
+        std::string key;
+        std::shared_ptr<const curl_slist> connect_to_items;
+        std::size_t outstanding_count = 0;
+        std::size_t failure_count = 0;
+        std::chrono::steady_clock::time_point ejection_end_time;
+        double current_weight = 0;
+    };
+
+    static std::string MakeHostKey(const std::string& host, long port);
+
+    std::size_t PickIndex(std::vector<EndpointState>& endpoints, const std::vector<std::size_t>& candidates);
+
+private:
+    LoadBalancer(const LoadBalancer&) = delete;
+    LoadBalancer& operator=(const LoadBalancer&) = delete;
+
+private:
+    Options options_;
+
+    std::mutex mutex_;
+    std::map<std::string, std::vector<EndpointState>> hosts_;
+    std::minstd_rand random_engine_;
+};
+
+}
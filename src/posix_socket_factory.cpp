@@ -0,0 +1,209 @@
+#include "posix_socket_factory.h"
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+
+//The tcp_info declared in netinet/tcp.h lacks byte counters.
+#ifdef __linux__
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+
+namespace curlion {
+
+static inline LoggerProxy WriteSocketFactoryLog(const void* factory_identifier) {
+    return Log() << "PosixSocketFactory(" << factory_identifier << "): ";
+}
+
+
+static void SetSocketOption(curl_socket_t socket, int level, int name, int value, const char* name_string) {
+
+    int result = setsockopt(socket, level, name, &value, sizeof(value));
+    if (result != 0) {
+        Log() << "Socket(" << socket << "): Set " << name_string << " to " << value << " failed with errno: " << errno << '.';
+    }
+}
+
+
+PosixSocketFactory::PosixSocketFactory() {
+
+}
+
+
+PosixSocketFactory::PosixSocketFactory(const Options& options) : options_(options) {
+
+}
+
+
+curl_socket_t PosixSocketFactory::Open(curlsocktype, const curl_sockaddr* address) {
+
+    int type = address->socktype;
+#ifdef SOCK_CLOEXEC
+    type |= SOCK_CLOEXEC;
+#endif
+
+    curl_socket_t socket = ::socket(address->family, type, address->protocol);
+    if (socket == CURL_SOCKET_BAD) {
+        WriteSocketFactoryLog(this) << "socket failed with errno: " << errno << '.';
+        return CURL_SOCKET_BAD;
+    }
+
+    ApplyOptions(socket, address);
+
+    bool is_tcp =
+        ((address->family == AF_INET) || (address->family == AF_INET6)) &&
+        (address->socktype == SOCK_STREAM);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (is_tcp) {
+        tcp_sockets_.insert(socket);
+    }
+    else {
+        other_sockets_.insert(socket);
+    }
+
+    return socket;
+}
+
+
+void PosixSocketFactory::ApplyOptions(curl_socket_t socket, const curl_sockaddr* address) const {
+
+    if (options_.receive_buffer_size > 0) {
+        SetSocketOption(socket, SOL_SOCKET, SO_RCVBUF, options_.receive_buffer_size, "SO_RCVBUF");
+    }
+
+    if (options_.send_buffer_size > 0) {
+        SetSocketOption(socket, SOL_SOCKET, SO_SNDBUF, options_.send_buffer_size, "SO_SNDBUF");
+    }
+
+#ifdef SO_BUSY_POLL
+    if (options_.busy_poll_microseconds > 0) {
+        SetSocketOption(socket, SOL_SOCKET, SO_BUSY_POLL, options_.busy_poll_microseconds, "SO_BUSY_POLL");
+    }
+#endif
+
+    if ((address->family != AF_INET) && (address->family != AF_INET6)) {
+        return;
+    }
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    //This option is of IPPROTO_IP level for IPv6 sockets as well.
+    if (options_.bind_address_no_port) {
+        SetSocketOption(socket, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 1, "IP_BIND_ADDRESS_NO_PORT");
+    }
+#endif
+
+    if (address->socktype != SOCK_STREAM) {
+        return;
+    }
+
+    if (options_.no_delay) {
+        SetSocketOption(socket, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+#ifdef TCP_QUICKACK
+    if (options_.quick_ack) {
+        SetSocketOption(socket, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    }
+#endif
+
+#ifdef TCP_FASTOPEN_CONNECT
+    if (options_.fast_open) {
+        SetSocketOption(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+    }
+#endif
+}
+
+
+bool PosixSocketFactory::Close(curl_socket_t socket) {
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto iterator = tcp_sockets_.find(socket);
+        if (iterator != tcp_sockets_.end()) {
+
+            Statistics statistics;
+            if (ReadStatistics(socket, statistics)) {
+                closed_statistics_.sent_bytes += statistics.sent_bytes;
+                closed_statistics_.received_bytes += statistics.received_bytes;
+            }
+            tcp_sockets_.erase(iterator);
+        }
+        else {
+            other_sockets_.erase(socket);
+        }
+    }
+
+    int result = close(socket);
+    if (result != 0) {
+        WriteSocketFactoryLog(this) << "close socket(" << socket << ") failed with errno: " << errno << '.';
+    }
+    return result == 0;
+}
+
+
+bool PosixSocketFactory::GetStatistics(curl_socket_t socket, Statistics& statistics) const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (tcp_sockets_.find(socket) == tcp_sockets_.end()) {
+        return false;
+    }
+
+    return ReadStatistics(socket, statistics);
+}
+
+
+PosixSocketFactory::Statistics PosixSocketFactory::GetTotalStatistics() const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Statistics total_statistics = closed_statistics_;
+
+    for (curl_socket_t each_socket : tcp_sockets_) {
+
+        Statistics statistics;
+        if (ReadStatistics(each_socket, statistics)) {
+            total_statistics.sent_bytes += statistics.sent_bytes;
+            total_statistics.received_bytes += statistics.received_bytes;
+        }
+    }
+
+    return total_statistics;
+}
+
+
+std::size_t PosixSocketFactory::GetOpenSocketCount() const {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tcp_sockets_.size() + other_sockets_.size();
+}
+
+
+bool PosixSocketFactory::ReadStatistics(curl_socket_t socket, Statistics& statistics) const {
+
+#ifdef __linux__
+
+    //Older kernels fill a shorter structure, the remaining counters keep zero.
+    tcp_info info{};
+    socklen_t length = sizeof(info);
+
+    int result = getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length);
+    if (result != 0) {
+        return false;
+    }
+
+    statistics.sent_bytes = info.tcpi_bytes_acked;
+    statistics.received_bytes = info.tcpi_bytes_received;
+    return true;
+
+#else
+    return false;
+#endif
+}
+
+}
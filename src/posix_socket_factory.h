@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include "socket_factory.h"
+
+namespace curlion {
+
+/**
+ PosixSocketFactory is a SocketFactory implementation with BSD sockets, which applies socket options
+ tuned for latency and outbound-heavy hosts.
+
+ IPv4, IPv6 and Unix domain sockets are supported, for both stream and datagram types. Socket
+ options are specified declaratively with Options. Options not supported by the platform are
+ ignored.
+
+ Byte counters of sockets are read from TCP_INFO, see GetStatistics and GetTotalStatistics.
+
+ This class is thread safe, so a single factory can be shared by multiple ConnectionManager
+ instances. It is available on POSIX systems only, some options are available on Linux only.
+ */
+class PosixSocketFactory : public SocketFactory {
+public:
+    /**
+     Options applied to each opened socket.
+     */
+    class Options {
+    public:
+        /**
+         Whether to disable Nagle's algorithm with TCP_NODELAY.
+
+         The default is true.
+         */
+        bool no_delay = true;
+
+        /**
+         Size of the receive buffer set with SO_RCVBUF, 0 for the system default.
+         */
+        int receive_buffer_size = 0;
+
+        /**
+         Size of the send buffer set with SO_SNDBUF, 0 for the system default.
+         */
+        int send_buffer_size = 0;
+
+        /**
+         Whether to send ACKs immediately with TCP_QUICKACK, Linux only.
+
+         Note that the kernel may turn quick ACK mode off later in the connection.
+         */
+        bool quick_ack = false;
+
+        /**
+         Whether to send data in SYN with TCP_FASTOPEN_CONNECT, Linux only.
+
+         Only takes effect on hosts connected before, whose Fast Open cookies are cached by the kernel.
+         */
+        bool fast_open = false;
+
+        /**
+         Microseconds to busy poll on receiving with SO_BUSY_POLL, 0 to disable, Linux only.
+         */
+        int busy_poll_microseconds = 0;
+
+        /**
+         Whether to defer port allocation until connecting with IP_BIND_ADDRESS_NO_PORT, Linux only.
+
+         This takes effect only when a local address is bound, such as by CURLOPT_INTERFACE. A source
+         port is allocated per destination instead of per local address, so that far more outbound
+         connections can share a local address.
+         */
+        bool bind_address_no_port = false;
+    };
+
+    /**
+     Byte counters of sockets.
+     */
+    class Statistics {
+    public:
+        /**
+         Bytes sent and acknowledged by the peer.
+         */
+        std::uint64_t sent_bytes = 0;
+
+        /**
+         Bytes received.
+         */
+        std::uint64_t received_bytes = 0;
+    };
+
+public:
+    /**
+     Construct the PosixSocketFactory instance with default options.
+     */
+    PosixSocketFactory();
+
+    /**
+     Construct the PosixSocketFactory instance with specified options.
+     */
+    explicit PosixSocketFactory(const Options& options);
+
+    curl_socket_t Open(curlsocktype socket_type, const curl_sockaddr* address) override;
+    bool Close(curl_socket_t socket) override;
+
+    /**
+     Get the options applied to sockets.
+     */
+    const Options& GetOptions() const {
+        return options_;
+    }
+
+    /**
+     Get byte counters of an open socket.
+
+     @return
+         Whether the counters are available. They are not available for sockets not opened by this
+         factory, non-TCP sockets, or on platforms other than Linux.
+     */
+    bool GetStatistics(curl_socket_t socket, Statistics& statistics) const;
+
+    /**
+     Get byte counters of all sockets opened by this factory, including closed ones.
+     */
+    Statistics GetTotalStatistics() const;
+
+    /**
+     Get the number of sockets currently open.
+     */
+    std::size_t GetOpenSocketCount() const;
+
+private:
+    void ApplyOptions(curl_socket_t socket, const curl_sockaddr* address) const;
+    bool ReadStatistics(curl_socket_t socket, Statistics& statistics) const;
+
+private:
+    Options options_;
+
+    mutable std::mutex mutex_;
+    std::set<curl_socket_t> tcp_sockets_;
+    std::set<curl_socket_t> other_sockets_;
+    Statistics closed_statistics_;
+};
+
+}
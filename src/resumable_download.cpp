@@ -0,0 +1,710 @@
+#include "resumable_download.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "connection_manager.h"
+#include "http_connection.h"
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteDownloadLog(void* download_identifier) {
+    return Log() << "ResumableDownload(" << download_identifier << "): ";
+}
+
+
+//Get the trimmed value of a header line if its field matches.
+static bool GetHeaderValue(const char* header, std::size_t length, const char* field, std::string& value) {
+
+    std::size_t field_length = std::strlen(field);
+    if ((length <= field_length) || (header[field_length] != ':') || (strncasecmp(header, field, field_length) != 0)) {
+        return false;
+    }
+
+    std::size_t begin = field_length + 1;
+    std::size_t end = length;
+    while ((begin < end) && (header[begin] == ' ' || header[begin] == '\t')) {
+        ++begin;
+    }
+    while ((end > begin) && (header[end - 1] == ' ' || header[end - 1] == '\t' || header[end - 1] == '\r' || header[end - 1] == '\n')) {
+        --end;
+    }
+
+    value.assign(header + begin, end - begin);
+    return true;
+}
+
+
+//Parse a Content-Range value, such as "bytes 0-99/1000" or "bytes */1000". Unknown parts are -1.
+static void ParseContentRange(const std::string& content_range, curl_off_t& first_position, curl_off_t& length) {
+
+    first_position = -1;
+    length = -1;
+
+    std::size_t space_index = content_range.find(' ');
+    std::size_t slash_index = content_range.find('/');
+    if ((space_index == std::string::npos) || (slash_index == std::string::npos)) {
+        return;
+    }
+
+    const char* first_position_string = content_range.c_str() + space_index + 1;
+    char* end = nullptr;
+    long long value = std::strtoll(first_position_string, &end, 10);
+    if ((end != first_position_string) && (*end == '-')) {
+        first_position = value;
+    }
+
+    const char* length_string = content_range.c_str() + slash_index + 1;
+    value = std::strtoll(length_string, &end, 10);
+    if (end != length_string) {
+        length = value;
+    }
+}
+
+
+static bool WriteFully(int file_descriptor, const char* data, std::size_t length, curl_off_t offset) {
+
+    while (length > 0) {
+
+        ssize_t written_length = pwrite(file_descriptor, data, length, offset);
+        if (written_length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        data += written_length;
+        length -= written_length;
+        offset += written_length;
+    }
+    return true;
+}
+
+
+ResumableDownload::ResumableDownload(ConnectionManager& connection_manager,
+                                     const std::shared_ptr<HttpConnection>& prototype,
+                                     const std::string& file_path) :
+    connection_manager_(connection_manager),
+    prototype_(prototype),
+    file_path_(file_path),
+    partial_file_path_(file_path + ".part"),
+    checkpoint_file_path_(file_path + ".checkpoint"),
+    checkpoint_interval_(8 * 1024 * 1024),
+    max_retry_count_(3),
+    is_running_(false),
+    file_descriptor_(-1),
+    retry_count_(0),
+    resumed_offset_(0),
+    offset_(0),
+    checkpoint_offset_(0),
+    content_length_(-1),
+    has_pending_checkpoint_(false),
+    is_pending_removal_(false),
+    is_checkpoint_writer_stopping_(false),
+    is_response_verified_(false),
+    result_(CURL_LAST),
+    response_code_(0) {
+
+}
+
+
+ResumableDownload::~ResumableDownload() {
+
+    StopCheckpointWriter();
+
+    if (file_descriptor_ >= 0) {
+        close(file_descriptor_);
+    }
+}
+
+
+std::error_condition ResumableDownload::Start() {
+
+    if (is_running_) {
+        return std::make_error_condition(std::errc::operation_in_progress);
+    }
+
+    if (prototype_->IsRunning()) {
+        return std::make_error_condition(std::errc::device_or_resource_busy);
+    }
+
+    file_descriptor_ = open(partial_file_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (file_descriptor_ < 0) {
+        int error_number = errno;
+        WriteDownloadLog(this) << "Open " << partial_file_path_ << " failed with errno: " << error_number << '.';
+        return std::error_condition(error_number, std::generic_category());
+    }
+
+    retry_count_ = 0;
+    result_ = CURL_LAST;
+    response_code_ = 0;
+    error_.clear();
+
+    bool is_resumable = LoadCheckpoint();
+
+    //The partial file may be shorter than the checkpoint if it was modified by others.
+    struct stat file_status;
+    if (is_resumable && ((fstat(file_descriptor_, &file_status) != 0) || (file_status.st_size < offset_))) {
+        is_resumable = false;
+    }
+
+    if (! is_resumable) {
+        offset_ = 0;
+        content_length_ = -1;
+        validator_.clear();
+        RemoveCheckpoint();
+    }
+
+    //Discard data written after the checkpoint, which may not be durable.
+    if (ftruncate(file_descriptor_, offset_) != 0) {
+        int error_number = errno;
+        WriteDownloadLog(this) << "ftruncate failed with errno: " << error_number << '.';
+        close(file_descriptor_);
+        file_descriptor_ = -1;
+        return std::error_condition(error_number, std::generic_category());
+    }
+
+    resumed_offset_ = offset_;
+    checkpoint_offset_ = offset_;
+
+    WriteDownloadLog(this) << "Start from offset " << offset_ << '.';
+
+    is_running_ = true;
+    self_ = shared_from_this();
+    StartCheckpointWriter();
+
+    auto error = StartTransfer();
+    if (error) {
+        is_running_ = false;
+        StopCheckpointWriter();
+        close(file_descriptor_);
+        file_descriptor_ = -1;
+        self_.reset();
+    }
+    return error;
+}
+
+
+void ResumableDownload::Abort() {
+
+    if (! is_running_) {
+        return;
+    }
+
+    WriteDownloadLog(this) << "Abort.";
+
+    if (connection_ != nullptr) {
+        connection_manager_.AbortConnection(connection_);
+        connection_.reset();
+    }
+
+    SaveCheckpoint();
+    Finish(CURLE_ABORTED_BY_CALLBACK, "Download is aborted");
+}
+
+
+bool ResumableDownload::LoadCheckpoint() {
+
+    int file = open(checkpoint_file_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        return false;
+    }
+
+    std::string content;
+    char buffer[1024];
+    while (true) {
+        ssize_t read_length = read(file, buffer, sizeof(buffer));
+        if (read_length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_length <= 0) {
+            break;
+        }
+        content.append(buffer, read_length);
+    }
+    close(file);
+
+    std::string url;
+    curl_off_t offset = -1;
+    curl_off_t content_length = -1;
+    std::string validator;
+
+    std::size_t line_begin = 0;
+    while (line_begin < content.size()) {
+
+        std::size_t line_end = content.find('\n', line_begin);
+        if (line_end == std::string::npos) {
+            line_end = content.size();
+        }
+
+        std::string line = content.substr(line_begin, line_end - line_begin);
+        line_begin = line_end + 1;
+
+        std::size_t space_index = line.find(' ');
+        if (space_index == std::string::npos) {
+            continue;
+        }
+
+        std::string key = line.substr(0, space_index);
+        std::string value = line.substr(space_index + 1);
+
+        if (key == "url") {
+            url = value;
+        }
+        else if (key == "offset") {
+            offset = std::strtoll(value.c_str(), nullptr, 10);
+        }
+        else if (key == "length") {
+            content_length = std::strtoll(value.c_str(), nullptr, 10);
+        }
+        else if (key == "validator") {
+            validator = value;
+        }
+    }
+
+    if ((url != prototype_->GetUrl()) || (offset < 0) || validator.empty()) {
+        WriteDownloadLog(this) << "Ignore checkpoint which doesn't match.";
+        return false;
+    }
+
+    offset_ = offset;
+    content_length_ = content_length;
+    validator_ = validator;
+    return true;
+}
+
+
+bool ResumableDownload::SaveCheckpoint() {
+
+    //Nothing can be resumed without a validator.
+    if (validator_.empty() || (file_descriptor_ < 0)) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        pending_checkpoint_.url = prototype_->GetUrl();
+        pending_checkpoint_.offset = offset_;
+        pending_checkpoint_.content_length = content_length_;
+        pending_checkpoint_.validator = validator_;
+        is_pending_removal_ = false;
+        has_pending_checkpoint_ = true;
+    }
+    checkpoint_condition_.notify_one();
+
+    checkpoint_offset_ = offset_;
+    return true;
+}
+
+
+void ResumableDownload::RemoveCheckpoint() {
+
+    //Without the writer, such as before the download starts, nothing else touches the file.
+    if (! checkpoint_thread_.joinable()) {
+        unlink(checkpoint_file_path_.c_str());
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        is_pending_removal_ = true;
+        has_pending_checkpoint_ = true;
+    }
+    checkpoint_condition_.notify_one();
+}
+
+
+void ResumableDownload::StartCheckpointWriter() {
+
+    is_checkpoint_writer_stopping_ = false;
+    checkpoint_thread_ = std::thread(std::bind(&ResumableDownload::RunCheckpointWriter, this));
+}
+
+
+void ResumableDownload::StopCheckpointWriter() {
+
+    if (! checkpoint_thread_.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+        is_checkpoint_writer_stopping_ = true;
+    }
+    checkpoint_condition_.notify_one();
+
+    //The pending checkpoint is written before the thread exits.
+    checkpoint_thread_.join();
+}
+
+
+void ResumableDownload::RunCheckpointWriter() {
+
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+
+    while (true) {
+
+        checkpoint_condition_.wait(lock, [this]() {
+            return has_pending_checkpoint_ || is_checkpoint_writer_stopping_;
+        });
+
+        if (! has_pending_checkpoint_) {
+            break;
+        }
+
+        bool is_removal = is_pending_removal_;
+        Checkpoint checkpoint = pending_checkpoint_;
+        has_pending_checkpoint_ = false;
+
+        lock.unlock();
+
+        if (is_removal) {
+            unlink(checkpoint_file_path_.c_str());
+        }
+        else {
+            WriteCheckpoint(checkpoint);
+        }
+
+        lock.lock();
+    }
+}
+
+
+bool ResumableDownload::WriteCheckpoint(const Checkpoint& checkpoint) {
+
+    //The descriptor is not closed until the writer stops.
+    if (fdatasync(file_descriptor_) != 0) {
+        WriteDownloadLog(this) << "fdatasync failed with errno: " << errno << '.';
+        return false;
+    }
+
+    std::string content;
+    content.append("url ").append(checkpoint.url).append(1, '\n');
+    content.append("offset ").append(std::to_string(checkpoint.offset)).append(1, '\n');
+    content.append("length ").append(std::to_string(checkpoint.content_length)).append(1, '\n');
+    content.append("validator ").append(checkpoint.validator).append(1, '\n');
+
+    //Write a temporary file and rename it, so that the checkpoint is never half written.
+    std::string temporary_path = checkpoint_file_path_ + ".tmp";
+    int file = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) {
+        WriteDownloadLog(this) << "Open " << temporary_path << " failed with errno: " << errno << '.';
+        return false;
+    }
+
+    bool is_succeeded = WriteFully(file, content.data(), content.size(), 0) && (fdatasync(file) == 0);
+    close(file);
+
+    if (! is_succeeded || (std::rename(temporary_path.c_str(), checkpoint_file_path_.c_str()) != 0)) {
+        WriteDownloadLog(this) << "Write checkpoint failed with errno: " << errno << '.';
+        unlink(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+std::error_condition ResumableDownload::StartTransfer() {
+
+    auto connection = std::static_pointer_cast<HttpConnection>(prototype_->Clone());
+    if (connection == nullptr) {
+        WriteDownloadLog(this) << "Clone connection failed.";
+        return std::make_error_condition(std::errc::not_enough_memory);
+    }
+
+    is_response_verified_ = false;
+    response_etag_.clear();
+    response_last_modified_.clear();
+    response_content_range_.clear();
+
+    //The range is ignored by the server if the resource no longer matches the validator.
+    if (offset_ > 0) {
+        std::string range = std::to_string(offset_) + '-';
+        curl_easy_setopt(connection->GetHandle(), CURLOPT_RANGE, range.c_str());
+        connection->AddRequestHeader("If-Range", validator_);
+    }
+    else {
+        curl_easy_setopt(connection->GetHandle(), CURLOPT_RANGE, nullptr);
+    }
+
+    connection->SetWriteHeaderCallback([this](const std::shared_ptr<Connection>&,
+                                              const char* header,
+                                              std::size_t length) {
+        return WriteHeader(header, length);
+    });
+
+    connection->SetWriteBodyCallback([this](const std::shared_ptr<Connection>& connection,
+                                            const char* body,
+                                            std::size_t length) {
+        return WriteBody(std::static_pointer_cast<HttpConnection>(connection), body, length);
+    });
+
+    connection->SetFinishedCallback([this](const std::shared_ptr<Connection>& connection) {
+
+        //Keep alive since the download may finish and release itself.
+        auto self = shared_from_this();
+        TransferFinished(std::static_pointer_cast<HttpConnection>(connection));
+    });
+
+    connection_ = connection;
+
+    auto error = connection_manager_.StartConnection(connection);
+    if (error) {
+        WriteDownloadLog(this) << "Start connection failed: " << error.message() << '.';
+        if (connection_ == connection) {
+            connection_.reset();
+        }
+    }
+    return error;
+}
+
+
+bool ResumableDownload::WriteHeader(const char* header, std::size_t length) {
+
+    //Headers of every response are received when redirected, keep those of the last one.
+    if ((length >= 5) && (std::strncmp(header, "HTTP/", 5) == 0)) {
+        response_etag_.clear();
+        response_last_modified_.clear();
+        response_content_range_.clear();
+        return true;
+    }
+
+    if (! GetHeaderValue(header, length, "ETag", response_etag_) &&
+        ! GetHeaderValue(header, length, "Last-Modified", response_last_modified_)) {
+        GetHeaderValue(header, length, "Content-Range", response_content_range_);
+    }
+    return true;
+}
+
+
+bool ResumableDownload::VerifyResponse(const std::shared_ptr<HttpConnection>& connection) {
+
+    response_code_ = connection->GetResponseCode();
+
+    curl_off_t first_position = -1;
+    curl_off_t length = -1;
+    ParseContentRange(response_content_range_, first_position, length);
+
+    if (response_code_ == 206) {
+
+        if (first_position != offset_) {
+            result_ = CURLE_RANGE_ERROR;
+            error_ = "Unexpected Content-Range: " + response_content_range_;
+            return false;
+        }
+        content_length_ = length;
+    }
+    else if (response_code_ == 200) {
+
+        //The resource has changed, or the server doesn't support ranges.
+        if (offset_ > 0) {
+            WriteDownloadLog(this) << "Resource is sent as a whole, restart from the beginning.";
+            if (! Restart()) {
+                return false;
+            }
+        }
+
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(connection->GetHandle(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+        content_length_ = content_length;
+    }
+    else if ((response_code_ == 416) && (offset_ > 0) && (length == offset_)) {
+
+        //Everything was downloaded before the checkpoint, but not completed.
+        content_length_ = length;
+    }
+    else {
+
+        //Including 416 for a shorter resource, start from scratch next time.
+        if (response_code_ == 416) {
+            Restart();
+        }
+
+        result_ = CURLE_HTTP_RETURNED_ERROR;
+        error_ = "Server responds " + std::to_string(response_code_);
+        return false;
+    }
+
+    //Prefer a strong ETag, weak ones can't be used with If-Range.
+    if (! response_etag_.empty() && (response_etag_.compare(0, 2, "W/") != 0)) {
+        validator_ = response_etag_;
+    }
+    else if (! response_last_modified_.empty()) {
+        validator_ = response_last_modified_;
+    }
+    else if (response_code_ == 200) {
+        validator_.clear();
+    }
+
+    is_response_verified_ = true;
+    return true;
+}
+
+
+bool ResumableDownload::Restart() {
+
+    offset_ = 0;
+    checkpoint_offset_ = 0;
+    content_length_ = -1;
+    validator_.clear();
+    RemoveCheckpoint();
+
+    if (ftruncate(file_descriptor_, 0) != 0) {
+        result_ = CURLE_WRITE_ERROR;
+        error_ = "Failed to truncate the partial file";
+        return false;
+    }
+    return true;
+}
+
+
+bool ResumableDownload::WriteBody(const std::shared_ptr<HttpConnection>& connection,
+                                  const char* body,
+                                  std::size_t length) {
+
+    if (! is_running_ || (connection != connection_)) {
+        return false;
+    }
+
+    if (! is_response_verified_ && ! VerifyResponse(connection)) {
+        return false;
+    }
+
+    //The body of a 416 for an already complete download is an error page, not file content.
+    //The download is completed once the transfer finishes.
+    if (response_code_ == 416) {
+        return true;
+    }
+
+    if (! WriteFully(file_descriptor_, body, length, offset_)) {
+        WriteDownloadLog(this) << "pwrite failed with errno: " << errno << '.';
+        result_ = CURLE_WRITE_ERROR;
+        error_ = "Failed to write the partial file";
+        return false;
+    }
+
+    offset_ += length;
+
+    if (offset_ - checkpoint_offset_ >= checkpoint_interval_) {
+        SaveCheckpoint();
+    }
+    return true;
+}
+
+
+void ResumableDownload::TransferFinished(const std::shared_ptr<HttpConnection>& connection) {
+
+    if (! is_running_ || (connection != connection_)) {
+        return;
+    }
+
+    connection_.reset();
+
+    //A failure found while writing.
+    if (result_ != CURL_LAST) {
+        SaveCheckpoint();
+        Finish(result_, error_);
+        return;
+    }
+
+    CURLcode result = connection->GetResult();
+
+    //No body was received, such as an empty or error response.
+    if ((result == CURLE_OK) && ! is_response_verified_ && ! VerifyResponse(connection)) {
+        Finish(result_, error_);
+        return;
+    }
+
+    if (result == CURLE_OK) {
+
+        if ((content_length_ < 0) || (offset_ == content_length_)) {
+            Complete();
+            return;
+        }
+        result = CURLE_PARTIAL_FILE;
+    }
+
+    WriteDownloadLog(this) << "Transfer failed with result " << result << " at offset " << offset_ << '.';
+
+    SaveCheckpoint();
+
+    if (retry_count_ < max_retry_count_) {
+
+        //Without a validator, the received part can't be trusted to match the rest.
+        if ((offset_ > 0) && validator_.empty() && ! Restart()) {
+            Finish(result_, error_);
+            return;
+        }
+
+        ++retry_count_;
+        auto error = StartTransfer();
+        if (! error) {
+            return;
+        }
+    }
+
+    std::string error = connection->GetError();
+    if (error.empty()) {
+        error = "Transfer is incomplete";
+    }
+    Finish(result, error);
+}
+
+
+void ResumableDownload::Complete() {
+
+    WriteDownloadLog(this) << "Complete with " << offset_ << " bytes.";
+
+    if (fdatasync(file_descriptor_) != 0) {
+        Finish(CURLE_WRITE_ERROR, "Failed to sync the partial file");
+        return;
+    }
+
+    if (std::rename(partial_file_path_.c_str(), file_path_.c_str()) != 0) {
+        WriteDownloadLog(this) << "rename failed with errno: " << errno << '.';
+        Finish(CURLE_WRITE_ERROR, "Failed to rename the partial file");
+        return;
+    }
+
+    RemoveCheckpoint();
+    Finish(CURLE_OK, std::string());
+}
+
+
+void ResumableDownload::Finish(CURLcode result, const std::string& error) {
+
+    if (! is_running_) {
+        return;
+    }
+
+    is_running_ = false;
+
+    if (connection_ != nullptr) {
+        connection_manager_.AbortConnection(connection_);
+        connection_.reset();
+    }
+
+    StopCheckpointWriter();
+
+    if (file_descriptor_ >= 0) {
+        close(file_descriptor_);
+        file_descriptor_ = -1;
+    }
+
+    result_ = result;
+    error_ = error;
+
+    WriteDownloadLog(this) << "Finished with result " << result_ << '.';
+
+    auto self = std::move(self_);
+    if (finished_callback_ != nullptr) {
+        finished_callback_(self);
+    }
+}
+
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <curl/curl.h>
+
+namespace curlion {
+
+class ConnectionManager;
+class HttpConnection;
+
+/**
+ ResumableDownload downloads a resource into a file, and resumes from where it stopped after a
+ network failure or a crash.
+
+ The resource is written into a partial file, FILE_PATH.part, while the progress is recorded in a
+ checkpoint file, FILE_PATH.checkpoint, every time a checkpoint interval of bytes is written, and
+ when the transfer fails or is aborted. A checkpoint holds the offset and the validator of the
+ resource, which is the strong ETag, or Last-Modified if there is no strong ETag. The partial
+ file is synced before the checkpoint is written, so the offset never exceeds durable data.
+
+ Syncing may block for long on a busy disk, so checkpoints are written by a thread of the
+ download rather than the thread running the manager. Only the latest checkpoint is written if
+ several are requested while one is being written. The download waits for the checkpoint being
+ written when it finishes, and syncs the partial file once more before renaming it.
+
+ When the download starts and a checkpoint for the same URL is found, it resumes from the
+ checkpoint's offset with Range and If-Range headers. If the resource has changed since, the
+ server responds with the whole new resource, which is written from the start. Resources
+ without a validator can't be resumed safely, and are always downloaded from the start.
+
+ Failed transfers are resumed immediately for a limited number of times. Once the whole resource
+ is downloaded, the partial file is renamed to FILE_PATH, and the checkpoint is removed.
+
+ Each transfer is made with a connection cloned from a prototype, so it inherits options such as
+ URL, request headers and share group. The write header, write body and finished callbacks of
+ the prototype are not used.
+
+ The download must be created with std::make_shared. It is retained while running.
+ */
+class ResumableDownload : public std::enable_shared_from_this<ResumableDownload> {
+public:
+    /**
+     Callback prototype for download finished.
+
+     @param download
+         The ResumableDownload instance.
+     */
+    typedef std::function<void(const std::shared_ptr<ResumableDownload>& download)> FinishedCallback;
+
+public:
+    /**
+     Construct the ResumableDownload instance.
+
+     @param connection_manager
+         The manager to run connections, must outlive the download.
+
+     @param prototype
+         The connection to clone for each transfer. It must not be running when the download
+         starts.
+
+     @param file_path
+         The path of the downloaded file.
+     */
+    ResumableDownload(ConnectionManager& connection_manager,
+                      const std::shared_ptr<HttpConnection>& prototype,
+                      const std::string& file_path);
+
+    /**
+     Destruct the ResumableDownload instance.
+     */
+    ~ResumableDownload();
+
+    /**
+     Set how many bytes are written between checkpoints.
+
+     The default is 8 MiB.
+     */
+    void SetCheckpointInterval(curl_off_t interval) {
+        checkpoint_interval_ = interval <= 0 ? 1 : interval;
+    }
+
+    /**
+     Set how many times a failed transfer is resumed before the download fails.
+
+     Only transfer failures, such as connection resets and timeouts, are resumed. HTTP errors
+     and file errors fail the download immediately.
+
+     The default is 3.
+     */
+    void SetMaxRetryCount(std::size_t count) {
+        max_retry_count_ = count;
+    }
+
+    /**
+     Set the callback which is called when the download finishes.
+     */
+    void SetFinishedCallback(const FinishedCallback& callback) {
+        finished_callback_ = callback;
+    }
+
+    /**
+     Start the download, resuming from the checkpoint if there is one.
+
+     @return
+         Return an error if the partial file can't be opened, or the connection fails to start.
+         The finished callback is not called in such case.
+     */
+    std::error_condition Start();
+
+    /**
+     Abort the download.
+
+     The progress is recorded in the checkpoint, so that a later Start resumes from it. The
+     finished callback is called with result CURLE_ABORTED_BY_CALLBACK.
+     */
+    void Abort();
+
+    /**
+     Get whether the download is running.
+     */
+    bool IsRunning() const {
+        return is_running_;
+    }
+
+    /**
+     Get the result code.
+
+     CURLE_OK means the whole resource is downloaded. CURLE_HTTP_RETURNED_ERROR is returned if the
+     server doesn't respond 200 or 206, see GetResponseCode.
+     */
+    CURLcode GetResult() const {
+        return result_;
+    }
+
+    /**
+     Get the error message of a failed download.
+     */
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    /**
+     Get the response code of the last transfer.
+     */
+    long GetResponseCode() const {
+        return response_code_;
+    }
+
+    /**
+     Get the offset the download resumed from when it started, or 0 if it started from scratch.
+     */
+    curl_off_t GetResumedOffset() const {
+        return resumed_offset_;
+    }
+
+    /**
+     Get the number of bytes written to the file so far.
+     */
+    curl_off_t GetDownloadedLength() const {
+        return offset_;
+    }
+
+    /**
+     Get the total length of the resource, or -1 if it is not known yet.
+     */
+    curl_off_t GetContentLength() const {
+        return content_length_;
+    }
+
+private:
+    class Checkpoint {
+    public:
+        std::string url;
+        curl_off_t offset = 0;
+        curl_off_t content_length = -1;
+        std::string validator;
+    };
+
+    bool LoadCheckpoint();
+    bool SaveCheckpoint();
+    void RemoveCheckpoint();
+    void StartCheckpointWriter();
+    void StopCheckpointWriter();
+    void RunCheckpointWriter();
+    bool WriteCheckpoint(const Checkpoint& checkpoint);
+    std::error_condition StartTransfer();
+    bool WriteHeader(const char* header, std::size_t length);
+    bool WriteBody(const std::shared_ptr<HttpConnection>& connection, const char* body, std::size_t length);
+    bool VerifyResponse(const std::shared_ptr<HttpConnection>& connection);
+    bool Restart();
+    void TransferFinished(const std::shared_ptr<HttpConnection>& connection);
+    void Complete();
+    void Finish(CURLcode result, const std::string& error);
+
+private:
+    ResumableDownload(const ResumableDownload&) = delete;
+    ResumableDownload& operator=(const ResumableDownload&) = delete;
+
+private:
+    ConnectionManager& connection_manager_;
+    std::shared_ptr<HttpConnection> prototype_;
+    std::string file_path_;
+    std::string partial_file_path_;
+    std::string checkpoint_file_path_;
+
+    curl_off_t checkpoint_interval_;
+    std::size_t max_retry_count_;
+    FinishedCallback finished_callback_;
+
+    bool is_running_;
+    std::shared_ptr<ResumableDownload> self_;
+    std::shared_ptr<HttpConnection> connection_;
+    int file_descriptor_;
+    std::size_t retry_count_;
+
+    curl_off_t resumed_offset_;
+    curl_off_t offset_;
+    curl_off_t checkpoint_offset_;
+    curl_off_t content_length_;
+    std::string validator_;
+
+    //The checkpoint file should become pending_checkpoint_, or be removed if 
+    //is_pending_removal_ is true, once has_pending_checkpoint_ is true.
+    std::thread checkpoint_thread_;
+    std::mutex checkpoint_mutex_;
+    std::condition_variable checkpoint_condition_;
+    bool has_pending_checkpoint_;
+    bool is_pending_removal_;
+    Checkpoint pending_checkpoint_;
+    bool is_checkpoint_writer_stopping_;
+
+    //Headers of the current response.
+    bool is_response_verified_;
+    std::string response_etag_;
+    std::string response_last_modified_;
+    std::string response_content_range_;
+
+    CURLcode result_;
+    long response_code_;
+    std::string error_;
+};
+
+}
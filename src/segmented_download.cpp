@@ -0,0 +1,662 @@
+#include "segmented_download.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "connection_manager.h"
+#include "http_connection.h"
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteDownloadLog(void* download_identifier) {
+    return Log() << "SegmentedDownload(" << download_identifier << "): ";
+}
+
+
+static bool HasPrefixIgnoringCase(const char* string, std::size_t length, const char* prefix) {
+
+    std::size_t prefix_length = std::strlen(prefix);
+    if (length < prefix_length) {
+        return false;
+    }
+    return strncasecmp(string, prefix, prefix_length) == 0;
+}
+
+
+//Get the trimmed value of a header line if its field matches.
+static bool GetHeaderValue(const char* header, std::size_t length, const char* field, std::string& value) {
+
+    std::size_t field_length = std::strlen(field);
+    if ((length <= field_length) || (header[field_length] != ':') || (strncasecmp(header, field, field_length) != 0)) {
+        return false;
+    }
+
+    std::size_t begin = field_length + 1;
+    std::size_t end = length;
+    while ((begin < end) && (header[begin] == ' ' || header[begin] == '\t')) {
+        ++begin;
+    }
+    while ((end > begin) && (header[end - 1] == ' ' || header[end - 1] == '\t' || header[end - 1] == '\r' || header[end - 1] == '\n')) {
+        --end;
+    }
+
+    value.assign(header + begin, end - begin);
+    return true;
+}
+
+
+//Prefer a strong ETag, weak ones can't be used with If-Range.
+static std::string GetValidator(const std::string& etag, const std::string& last_modified) {
+
+    if (! etag.empty() && (etag.compare(0, 2, "W/") != 0)) {
+        return etag;
+    }
+    return last_modified;
+}
+
+
+//Parse a Content-Range value, such as "bytes 0-99/1000" or "bytes */1000". Unknown parts are -1.
+static void ParseContentRange(const std::string& content_range, curl_off_t& first_position, curl_off_t& length) {
+
+    first_position = -1;
+    length = -1;
+
+    std::size_t space_index = content_range.find(' ');
+    std::size_t slash_index = content_range.find('/');
+    if ((space_index == std::string::npos) || (slash_index == std::string::npos)) {
+        return;
+    }
+
+    const char* first_position_string = content_range.c_str() + space_index + 1;
+    char* end = nullptr;
+    long long value = std::strtoll(first_position_string, &end, 10);
+    if ((end != first_position_string) && (*end == '-')) {
+        first_position = value;
+    }
+
+    const char* length_string = content_range.c_str() + slash_index + 1;
+    value = std::strtoll(length_string, &end, 10);
+    if ((end != length_string) && (value >= 0)) {
+        length = value;
+    }
+}
+
+
+SegmentedDownload::SegmentedDownload(ConnectionManager& connection_manager,
+                                     const std::shared_ptr<HttpConnection>& prototype) :
+    connection_manager_(connection_manager),
+    prototype_(prototype),
+    segment_count_(4),
+    min_segment_size_(1024 * 1024),
+    max_retry_count_(2),
+    file_descriptor_(-1),
+    is_running_(false),
+    is_probed_(false),
+    is_range_supported_(false),
+    content_length_(-1),
+    result_(CURL_LAST),
+    response_code_(0) {
+
+}
+
+
+SegmentedDownload::~SegmentedDownload() {
+
+}
+
+
+std::error_condition SegmentedDownload::Start() {
+
+    if (is_running_) {
+        return std::make_error_condition(std::errc::operation_in_progress);
+    }
+
+    if (prototype_->IsRunning()) {
+        return std::make_error_condition(std::errc::device_or_resource_busy);
+    }
+
+    WriteDownloadLog(this) << "Start.";
+
+    segments_.clear();
+    is_probed_ = false;
+    is_range_supported_ = false;
+    content_length_ = -1;
+    body_.clear();
+    validator_.clear();
+    result_ = CURL_LAST;
+    response_code_ = 0;
+    error_.clear();
+
+    //The probe requests the first segment.
+    Segment probe_segment;
+    probe_segment.end = min_segment_size_;
+    segments_.push_back(probe_segment);
+
+    is_running_ = true;
+    self_ = shared_from_this();
+
+    auto error = StartSegment(0);
+    if (error) {
+        is_running_ = false;
+        self_.reset();
+    }
+    return error;
+}
+
+
+void SegmentedDownload::Abort() {
+
+    WriteDownloadLog(this) << "Abort.";
+    Finish(CURLE_ABORTED_BY_CALLBACK, "Download is aborted");
+}
+
+
+curl_off_t SegmentedDownload::GetDownloadedLength() const {
+
+    curl_off_t length = 0;
+    for (const auto& each_segment : segments_) {
+        length += each_segment.position - each_segment.begin;
+    }
+    return length;
+}
+
+
+std::error_condition SegmentedDownload::StartSegment(std::size_t index) {
+
+    //Without range support, the resource can only be transferred from the start.
+    if (is_probed_ && ! is_range_supported_) {
+        segments_[index].position = 0;
+    }
+
+    auto connection = CreateConnection(index);
+    if (connection == nullptr) {
+        return std::make_error_condition(std::errc::not_enough_memory);
+    }
+
+    segments_[index].connection = connection;
+    segments_[index].is_verified = false;
+    segments_[index].content_range.clear();
+    segments_[index].etag.clear();
+    segments_[index].last_modified.clear();
+
+    auto error = connection_manager_.StartConnection(connection);
+    if (error) {
+        WriteDownloadLog(this) << "Start segment " << index << " failed: " << error.message() << '.';
+        if (segments_[index].connection == connection) {
+            segments_[index].connection.reset();
+        }
+    }
+    return error;
+}
+
+
+std::shared_ptr<Connection> SegmentedDownload::CreateConnection(std::size_t index) {
+
+    auto connection = std::static_pointer_cast<HttpConnection>(prototype_->Clone());
+    if (connection == nullptr) {
+        WriteDownloadLog(this) << "Clone connection failed.";
+        return nullptr;
+    }
+
+    const Segment& segment = segments_[index];
+
+    std::string range;
+    if (! is_probed_ || is_range_supported_) {
+        range = std::to_string(segment.position) + '-';
+        if (segment.end >= 0) {
+            range.append(std::to_string(segment.end - 1));
+        }
+    }
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_RANGE, range.empty() ? nullptr : range.c_str());
+
+    //The range is ignored by the server if the resource no longer matches the probe.
+    if (! range.empty() && ! validator_.empty()) {
+        connection->AddRequestHeader("If-Range", validator_);
+    }
+
+    WriteDownloadLog(this) << "Segment " << index << " requests range " << (range.empty() ? "all" : range) << '.';
+
+    connection->SetWriteHeaderCallback([this, index](const std::shared_ptr<Connection>& connection,
+                                                     const char* header,
+                                                     std::size_t length) {
+        return WriteHeader(index, connection, header, length);
+    });
+
+    connection->SetWriteBodyCallback([this, index](const std::shared_ptr<Connection>& connection,
+                                                   const char* body,
+                                                   std::size_t length) {
+        return WriteSegment(index, connection, body, length);
+    });
+
+    connection->SetFinishedCallback([this, index](const std::shared_ptr<Connection>& connection) {
+
+        //Keep alive since the download may finish and release itself.
+        auto self = shared_from_this();
+        SegmentFinished(index, connection);
+    });
+
+    return connection;
+}
+
+
+bool SegmentedDownload::WriteHeader(std::size_t index,
+                                    const std::shared_ptr<Connection>& connection,
+                                    const char* header,
+                                    std::size_t length) {
+
+    if (! is_running_ || (segments_[index].connection != connection)) {
+        return false;
+    }
+
+    Segment& segment = segments_[index];
+
+    //Headers of every response are received when redirected, keep those of the last one.
+    if (HasPrefixIgnoringCase(header, length, "HTTP/")) {
+        segment.content_range.clear();
+        segment.etag.clear();
+        segment.last_modified.clear();
+    }
+    else if (! GetHeaderValue(header, length, "Content-Range", segment.content_range) &&
+             ! GetHeaderValue(header, length, "ETag", segment.etag)) {
+        GetHeaderValue(header, length, "Last-Modified", segment.last_modified);
+    }
+    return true;
+}
+
+
+bool SegmentedDownload::VerifyProbe(const std::shared_ptr<Connection>& connection) {
+
+    response_code_ = connection->GetResponseCode();
+    Segment& segment = segments_.front();
+
+    if (response_code_ == 200) {
+
+        WriteDownloadLog(this) << "Server doesn't support range requests, download in single connection.";
+
+        curl_off_t content_length = -1;
+        curl_easy_getinfo(connection->GetHandle(), CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+
+        is_range_supported_ = false;
+        segment.end = -1;
+        content_length_ = content_length;
+    }
+    else if ((response_code_ == 206) || (response_code_ == 416)) {
+
+        curl_off_t first_position = -1;
+        curl_off_t content_length = -1;
+        ParseContentRange(segment.content_range, first_position, content_length);
+
+        //A 416 response is expected only for an empty resource.
+        bool is_valid = 
+            (response_code_ == 206) ? 
+            ((content_length >= 0) && (first_position == segment.position)) :
+            (content_length == 0);
+
+        if (! is_valid) {
+            result_ = CURLE_RANGE_ERROR;
+            error_ = "Invalid Content-Range: " + segment.content_range;
+            return false;
+        }
+
+        WriteDownloadLog(this) << "Content length is " << content_length << '.';
+
+        is_range_supported_ = true;
+        segment.end = std::min(segment.end, content_length);
+        content_length_ = content_length;
+        validator_ = GetValidator(segment.etag, segment.last_modified);
+    }
+    else {
+        result_ = CURLE_HTTP_RETURNED_ERROR;
+        error_ = "Server responds " + std::to_string(response_code_);
+        return false;
+    }
+
+    if ((content_length_ >= 0) && ! Allocate(content_length_)) {
+        result_ = CURLE_WRITE_ERROR;
+        error_ = "Failed to allocate " + std::to_string(content_length_) + " bytes";
+        return false;
+    }
+
+    is_probed_ = true;
+    return true;
+}
+
+
+bool SegmentedDownload::WriteSegment(std::size_t index,
+                                     const std::shared_ptr<Connection>& connection,
+                                     const char* body,
+                                     std::size_t length) {
+
+    if (! is_running_ || (segments_[index].connection != connection)) {
+        return false;
+    }
+
+    if (! segments_[index].is_verified) {
+
+        if (! is_probed_) {
+            if (! VerifyProbe(connection)) {
+                return false;
+            }
+        }
+        else if (is_range_supported_ && ! VerifySegment(index, connection)) {
+            return false;
+        }
+
+        segments_[index].is_verified = true;
+    }
+
+    Segment& segment = segments_[index];
+
+    std::size_t write_length = length;
+    if (segment.end >= 0) {
+        curl_off_t remaining_length = std::max<curl_off_t>(segment.end - segment.position, 0);
+        write_length = static_cast<std::size_t>(std::min<curl_off_t>(remaining_length, length));
+    }
+
+    if ((write_length > 0) && ! WriteData(segment.position, body, write_length)) {
+        result_ = CURLE_WRITE_ERROR;
+        error_ = "Failed to write data";
+        return false;
+    }
+
+    segment.position += write_length;
+
+    //Stop the transfer once it reaches the end, which is moved forward if the segment is stolen.
+    return write_length == length;
+}
+
+
+bool SegmentedDownload::VerifySegment(std::size_t index, const std::shared_ptr<Connection>& connection) {
+
+    const Segment& segment = segments_[index];
+
+    long response_code = connection->GetResponseCode();
+    if (response_code != 206) {
+
+        //Other responses, such as 503, fail the segment only, which is retried.
+        WriteDownloadLog(this) << "Segment " << index << " gets response " << response_code << '.';
+        if (response_code == 200) {
+            result_ = CURLE_RANGE_ERROR;
+            error_ = validator_.empty() ? "Server ignores the range request" : "Resource has changed";
+        }
+        return false;
+    }
+
+    curl_off_t first_position = -1;
+    curl_off_t content_length = -1;
+    ParseContentRange(segment.content_range, first_position, content_length);
+
+    if ((first_position != segment.position) || (content_length != content_length_)) {
+        WriteDownloadLog(this) << "Segment " << index << " gets unexpected Content-Range: " << segment.content_range << '.';
+        result_ = CURLE_RANGE_ERROR;
+        error_ = "Unexpected Content-Range: " + segment.content_range;
+        return false;
+    }
+
+    //In case the server ignores If-Range.
+    std::string validator = GetValidator(segment.etag, segment.last_modified);
+    if (! validator_.empty() && ! validator.empty() && (validator != validator_)) {
+        result_ = CURLE_RANGE_ERROR;
+        error_ = "Resource has changed";
+        return false;
+    }
+
+    return true;
+}
+
+
+bool SegmentedDownload::Allocate(curl_off_t length) {
+
+    if (file_descriptor_ < 0) {
+        body_.resize(static_cast<std::size_t>(length));
+        return true;
+    }
+
+    if (ftruncate(file_descriptor_, length) != 0) {
+        WriteDownloadLog(this) << "ftruncate failed with errno: " << errno << '.';
+        return false;
+    }
+
+    //Reserve blocks to avoid fragmentation, it is fine if the file system doesn't support it.
+    if (length > 0) {
+#if defined(__linux__)
+        int result = posix_fallocate(file_descriptor_, 0, length);
+        if (result != 0) {
+            WriteDownloadLog(this) << "posix_fallocate failed with error: " << result << '.';
+        }
+#elif defined(__APPLE__)
+        fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, length, 0 };
+        if (fcntl(file_descriptor_, F_PREALLOCATE, &store) == -1) {
+            WriteDownloadLog(this) << "F_PREALLOCATE failed with errno: " << errno << '.';
+        }
+#endif
+    }
+    return true;
+}
+
+
+bool SegmentedDownload::WriteData(curl_off_t offset, const char* data, std::size_t length) {
+
+    if (file_descriptor_ < 0) {
+        std::size_t end = static_cast<std::size_t>(offset) + length;
+        if (end > body_.size()) {
+            body_.resize(end);
+        }
+        std::memcpy(&body_[static_cast<std::size_t>(offset)], data, length);
+        return true;
+    }
+
+    while (length > 0) {
+
+        ssize_t written_length = pwrite(file_descriptor_, data, length, offset);
+        if (written_length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            WriteDownloadLog(this) << "pwrite failed with errno: " << errno << '.';
+            return false;
+        }
+
+        data += written_length;
+        length -= written_length;
+        offset += written_length;
+    }
+    return true;
+}
+
+
+void SegmentedDownload::SegmentFinished(std::size_t index, const std::shared_ptr<Connection>& connection) {
+
+    if (! is_running_ || (segments_[index].connection != connection)) {
+        return;
+    }
+
+    segments_[index].connection.reset();
+
+    //A failure found while writing.
+    if (result_ != CURL_LAST) {
+        Finish(result_, error_);
+        return;
+    }
+
+    CURLcode result = connection->GetResult();
+
+    //No body was received, such as an empty or error response.
+    if (! is_probed_ && (result == CURLE_OK) && ! VerifyProbe(connection)) {
+        Finish(result_, error_);
+        return;
+    }
+
+    Segment& segment = segments_[index];
+
+    bool is_complete = false;
+    if (segment.end >= 0) {
+        is_complete = segment.position >= segment.end;
+    }
+    else {
+        is_complete = result == CURLE_OK;
+    }
+
+    if (! is_complete) {
+
+        if (result == CURLE_OK) {
+            result = CURLE_PARTIAL_FILE;
+        }
+
+        WriteDownloadLog(this) << "Segment " << index << " failed with result " << result << '.';
+
+        if (segment.retry_count < max_retry_count_) {
+            segment.retry_count++;
+            if (! StartSegment(index)) {
+                return;
+            }
+        }
+
+        std::string error = connection->GetError();
+        if (error.empty()) {
+            error = "Segment " + std::to_string(index) + " is incomplete";
+        }
+        Finish(result, error);
+        return;
+    }
+
+    segments_[index].is_finished = true;
+
+    if ((index == 0) && (segments_.size() == 1)) {
+        StartSegments();
+    }
+    else {
+        StealSegment();
+    }
+
+    if (! is_running_) {
+        return;
+    }
+
+    for (const auto& each_segment : segments_) {
+        if (! each_segment.is_finished) {
+            return;
+        }
+    }
+
+    Finish(CURLE_OK, std::string());
+}
+
+
+void SegmentedDownload::StartSegments() {
+
+    curl_off_t begin = segments_.front().end;
+    if ((! is_range_supported_) || (begin < 0) || (begin >= content_length_)) {
+        return;
+    }
+
+    curl_off_t remaining_length = content_length_ - begin;
+    curl_off_t count = (remaining_length + min_segment_size_ - 1) / min_segment_size_;
+    count = std::max<curl_off_t>(1, std::min<curl_off_t>(count, segment_count_));
+    curl_off_t segment_length = remaining_length / count;
+
+    WriteDownloadLog(this) << "Split " << remaining_length << " bytes into " << count << " segments.";
+
+    for (curl_off_t number = 0; number < count; ++number) {
+
+        Segment segment;
+        segment.begin = begin + number * segment_length;
+        segment.position = segment.begin;
+        segment.end = number == count - 1 ? content_length_ : segment.begin + segment_length;
+        segments_.push_back(segment);
+    }
+
+    //Start after all segments are added, since a connection may finish synchronously.
+    for (std::size_t index = 1; index < segments_.size(); ++index) {
+
+        auto error = StartSegment(index);
+        if (error) {
+            Finish(CURLE_FAILED_INIT, "Start segment failed: " + error.message());
+            return;
+        }
+
+        if (! is_running_) {
+            return;
+        }
+    }
+}
+
+
+bool SegmentedDownload::StealSegment() {
+
+    std::size_t victim_index = segments_.size();
+    curl_off_t max_remaining_length = 0;
+
+    for (std::size_t index = 0; index < segments_.size(); ++index) {
+
+        const Segment& segment = segments_[index];
+        if (segment.is_finished || (segment.connection == nullptr) || (segment.end < 0)) {
+            continue;
+        }
+
+        curl_off_t remaining_length = segment.end - segment.position;
+        if (remaining_length > max_remaining_length) {
+            max_remaining_length = remaining_length;
+            victim_index = index;
+        }
+    }
+
+    if ((victim_index == segments_.size()) || (max_remaining_length < min_segment_size_ * 2)) {
+        return false;
+    }
+
+    Segment new_segment;
+    new_segment.begin = segments_[victim_index].position + max_remaining_length / 2;
+    new_segment.position = new_segment.begin;
+    new_segment.end = segments_[victim_index].end;
+    segments_[victim_index].end = new_segment.begin;
+    segments_.push_back(new_segment);
+
+    WriteDownloadLog(this) << "Segment " << segments_.size() - 1 << " steals range "
+        << new_segment.begin << '-' << new_segment.end - 1 << " from segment " << victim_index << '.';
+
+    auto error = StartSegment(segments_.size() - 1);
+    if (error) {
+        //Give the range back, the victim is still requesting it.
+        segments_[victim_index].end = segments_.back().end;
+        segments_.pop_back();
+        return false;
+    }
+    return true;
+}
+
+
+void SegmentedDownload::Finish(CURLcode result, const std::string& error) {
+
+    if (! is_running_) {
+        return;
+    }
+
+    is_running_ = false;
+
+    for (auto& each_segment : segments_) {
+        if (each_segment.connection != nullptr) {
+            connection_manager_.AbortConnection(each_segment.connection);
+            each_segment.connection.reset();
+        }
+    }
+
+    if ((result == CURLE_OK) && (content_length_ < 0)) {
+        content_length_ = GetDownloadedLength();
+    }
+
+    result_ = result;
+    error_ = error;
+
+    WriteDownloadLog(this) << "Finished with result " << result_ << '.';
+
+    auto self = std::move(self_);
+    if (finished_callback_ != nullptr) {
+        finished_callback_(self);
+    }
+}
+
+}
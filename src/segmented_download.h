@@ -0,0 +1,253 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <curl/curl.h>
+
+namespace curlion {
+
+class Connection;
+class ConnectionManager;
+class HttpConnection;
+
+/**
+ SegmentedDownload downloads a single resource over multiple concurrent connections, each
+ transferring a byte range of it.
+
+ The download starts with a probe connection requesting the first segment with a Range header.
+ If the server responds 206, the total length is taken from the Content-Range header, and the
+ rest of the resource is split into segments which are downloaded concurrently. If the server
+ ignores the range and responds 200, the probe connection downloads the whole resource alone.
+
+ The strong ETag of the probe's response, or its Last-Modified if there is no strong ETag, is
+ sent as If-Range with every segment, and each segment must respond a Content-Range starting at
+ its position with the same ETag. So the download fails with CURLE_RANGE_ERROR, rather than
+ mixing two versions, if the resource changes while it is downloaded.
+
+ Whenever a segment finishes, the unfinished segment with the most remaining bytes, usually
+ the slowest one, is split, and its second half is stolen by a new connection. The original
+ connection is stopped once it reaches the split point.
+
+ Segments are written directly to their offsets, either into a file descriptor with pwrite, or
+ into a buffer, both of which are preallocated once the total length is known.
+
+ Each connection is cloned from a prototype connection, so it inherits options such as URL,
+ request headers and share group. The write header, write body and finished callbacks of the
+ prototype are not used. Note that when HTTP/2 multiplexing is enabled, all segments to the same
+ host may share a single connection, disable it with ConnectionManager::SetMultiplexing to open
+ one connection per segment.
+
+ The download must be created with std::make_shared. It is retained while running.
+ */
+class SegmentedDownload : public std::enable_shared_from_this<SegmentedDownload> {
+public:
+    /**
+     Callback prototype for download finished.
+
+     @param download
+         The SegmentedDownload instance.
+     */
+    typedef std::function<void(const std::shared_ptr<SegmentedDownload>& download)> FinishedCallback;
+
+public:
+    /**
+     Construct the SegmentedDownload instance.
+
+     @param connection_manager
+         The manager to run connections, must outlive the download.
+
+     @param prototype
+         The connection to clone for each segment. It must not be running when the download starts.
+     */
+    SegmentedDownload(ConnectionManager& connection_manager, const std::shared_ptr<HttpConnection>& prototype);
+
+    /**
+     Destruct the SegmentedDownload instance.
+     */
+    ~SegmentedDownload();
+
+    /**
+     Set the maximum number of segments downloaded concurrently.
+
+     The default is 4.
+     */
+    void SetSegmentCount(std::size_t count) {
+        segment_count_ = count == 0 ? 1 : count;
+    }
+
+    /**
+     Set the minimum size of a segment.
+
+     This is also the size of the probe's range. Small resources are split into fewer segments,
+     and a segment is not split by stealing if either half would be smaller than this size.
+
+     The default is 1 MiB.
+     */
+    void SetMinSegmentSize(curl_off_t size) {
+        min_segment_size_ = size <= 0 ? 1 : size;
+    }
+
+    /**
+     Set how many times a failed segment is retried from where it stopped.
+
+     The default is 2.
+     */
+    void SetMaxRetryCount(std::size_t count) {
+        max_retry_count_ = count;
+    }
+
+    /**
+     Set the file descriptor to write the resource to.
+
+     The resource is written with pwrite at its offsets, regardless of the file position. The file
+     is extended to the total length with ftruncate, and its blocks are reserved on Linux and
+     macOS if the file system supports it. The descriptor is not closed by the download.
+
+     If no file descriptor is set, the resource is written into the buffer returned by GetBody.
+     */
+    void SetFileDescriptor(int file_descriptor) {
+        file_descriptor_ = file_descriptor;
+    }
+
+    /**
+     Set the callback which is called when the download finishes.
+     */
+    void SetFinishedCallback(const FinishedCallback& callback) {
+        finished_callback_ = callback;
+    }
+
+    /**
+     Start the download.
+
+     @return
+         Return an error if the probe connection fails to start. The finished callback is not
+         called in such case.
+     */
+    std::error_condition Start();
+
+    /**
+     Abort the download.
+
+     Running connections are aborted. The finished callback is called with result
+     CURLE_ABORTED_BY_CALLBACK.
+     */
+    void Abort();
+
+    /**
+     Get whether the download is running.
+     */
+    bool IsRunning() const {
+        return is_running_;
+    }
+
+    /**
+     Get the result code.
+
+     CURLE_OK means the whole resource is downloaded. CURLE_HTTP_RETURNED_ERROR is returned if the
+     server doesn't respond 200 or 206, see GetResponseCode. CURLE_RANGE_ERROR is returned if a
+     response doesn't match its range, or the resource changes during the download.
+     */
+    CURLcode GetResult() const {
+        return result_;
+    }
+
+    /**
+     Get the error message of a failed download.
+     */
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    /**
+     Get the response code of the probe connection.
+     */
+    long GetResponseCode() const {
+        return response_code_;
+    }
+
+    /**
+     Get the total length of the resource, or -1 if it is not known yet.
+     */
+    curl_off_t GetContentLength() const {
+        return content_length_;
+    }
+
+    /**
+     Get the number of bytes downloaded so far.
+     */
+    curl_off_t GetDownloadedLength() const;
+
+    /**
+     Get the downloaded resource, if no file descriptor is set.
+     */
+    const std::string& GetBody() const {
+        return body_;
+    }
+
+private:
+    class Segment {
+    public:
+        curl_off_t begin = 0;
+        curl_off_t position = 0;
+
+        //Exclusive, -1 means up to the end of the resource.
+        curl_off_t end = -1;
+
+        std::shared_ptr<Connection> connection;
+        std::size_t retry_count = 0;
+        bool is_verified = false;
+        bool is_finished = false;
+
+        //Headers of the latest response.
+        std::string content_range;
+        std::string etag;
+        std::string last_modified;
+    };
+
+    std::error_condition StartSegment(std::size_t index);
+    std::shared_ptr<Connection> CreateConnection(std::size_t index);
+    bool WriteHeader(std::size_t index, const std::shared_ptr<Connection>& connection, const char* header, std::size_t length);
+    bool WriteSegment(std::size_t index, const std::shared_ptr<Connection>& connection, const char* body, std::size_t length);
+    bool VerifyProbe(const std::shared_ptr<Connection>& connection);
+    bool VerifySegment(std::size_t index, const std::shared_ptr<Connection>& connection);
+    bool Allocate(curl_off_t length);
+    bool WriteData(curl_off_t offset, const char* data, std::size_t length);
+    void SegmentFinished(std::size_t index, const std::shared_ptr<Connection>& connection);
+    void StartSegments();
+    bool StealSegment();
+    void Finish(CURLcode result, const std::string& error);
+
+private:
+    SegmentedDownload(const SegmentedDownload&) = delete;
+    SegmentedDownload& operator=(const SegmentedDownload&) = delete;
+
+private:
+    ConnectionManager& connection_manager_;
+    std::shared_ptr<HttpConnection> prototype_;
+
+    std::size_t segment_count_;
+    curl_off_t min_segment_size_;
+    std::size_t max_retry_count_;
+    int file_descriptor_;
+    FinishedCallback finished_callback_;
+
+    bool is_running_;
+    bool is_probed_;
+    bool is_range_supported_;
+    std::shared_ptr<SegmentedDownload> self_;
+    std::vector<Segment> segments_;
+    curl_off_t content_length_;
+    std::string body_;
+
+    //The strong ETag or Last-Modified of the probe's response, sent as If-Range.
+    std::string validator_;
+
+    CURLcode result_;
+    long response_code_;
+    std::string error_;
+};
+
+}
@@ -0,0 +1,83 @@
+#include "share_group.h"
+#include "log.h"
+
+namespace curlion {
+
+static inline LoggerProxy WriteShareGroupLog(void* group_identifier) {
+    return Log() << "ShareGroup(" << group_identifier << "): ";
+}
+
+
+ShareGroup::ShareGroup() {
+    Initialize({ Data::Dns, Data::SslSession });
+}
+
+
+ShareGroup::ShareGroup(std::initializer_list<Data> data) {
+    Initialize(data);
+}
+
+
+void ShareGroup::Initialize(std::initializer_list<Data> data) {
+
+    handle_ = curl_share_init();
+    if (handle_ == nullptr) {
+        WriteShareGroupLog(this) << "curl_share_init failed.";
+        return;
+    }
+
+    curl_share_setopt(handle_, CURLSHOPT_LOCKFUNC, CurlLockCallback);
+    curl_share_setopt(handle_, CURLSHOPT_UNLOCKFUNC, CurlUnlockCallback);
+    curl_share_setopt(handle_, CURLSHOPT_USERDATA, this);
+
+    for (Data each_data : data) {
+
+        curl_lock_data lock_data = CURL_LOCK_DATA_NONE;
+        switch (each_data) {
+            case Data::Dns:
+                lock_data = CURL_LOCK_DATA_DNS;
+                break;
+            case Data::SslSession:
+                lock_data = CURL_LOCK_DATA_SSL_SESSION;
+                break;
+            case Data::Connection:
+                lock_data = CURL_LOCK_DATA_CONNECT;
+                break;
+            default:
+                //Shouldn't reach here.
+                break;
+        }
+
+        CURLSHcode result = curl_share_setopt(handle_, CURLSHOPT_SHARE, lock_data);
+        if (result != CURLSHE_OK) {
+            WriteShareGroupLog(this) << "Share data " << lock_data << " failed with result: " << result << '.';
+        }
+    }
+}
+
+
+ShareGroup::~ShareGroup() {
+
+    CURLSHcode result = curl_share_cleanup(handle_);
+    if (result != CURLSHE_OK) {
+        WriteShareGroupLog(this) << "curl_share_cleanup failed with result: " << result << '.';
+    }
+}
+
+
+void ShareGroup::CurlLockCallback(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+
+    //libcurl asks for exclusive access in all cases in practice, so each kind of data has a
+    //plain mutex rather than a reader/writer lock.
+    ShareGroup* group = static_cast<ShareGroup*>(userptr);
+    group->mutexes_[data].lock();
+}
+
+
+void ShareGroup::CurlUnlockCallback(CURL*, curl_lock_data data, void* userptr) {
+
+    ShareGroup* group = static_cast<ShareGroup*>(userptr);
+    group->mutexes_[data].unlock();
+}
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <initializer_list>
+#include <mutex>
+#include <curl/curl.h>
+
+namespace curlion {
+
+/**
+ ShareGroup shares caches between connections, even if they are started by different
+ ConnectionManager instances, or started in blocking manner.
+
+ Without sharing, each ConnectionManager and each blocking connection has its own DNS cache,
+ TLS session cache and connection cache. Connections in a share group resolve a host name once,
+ and resume TLS sessions established by each other, which avoids full TLS handshakes on new
+ connections.
+
+ Sharing alive connections, Data::Connection, is only valid within a single ConnectionManager,
+ or blocking connections running on a single thread. libcurl doesn't support a connection cache
+ shared by concurrently running multi handles, and a connection reused by another manager would
+ have its socket watched by the wrong SocketWatcher. So it is not shared by default.
+
+ Attach a share group to a connection with Connection::SetShareGroup, or to all connections
+ started by a manager with ConnectionManager::SetShareGroup. Hold the group with std::shared_ptr
+ to share it.
+
+ This class is thread safe, except for Data::Connection as above. Each kind of shared data is
+ guarded by its own lock, so that accessing DNS cache doesn't block resuming TLS sessions, for
+ example.
+
+ This is a encapsulation against libcurl's share handle.
+ */
+class ShareGroup {
+public:
+    /**
+     Data shared in the group.
+     */
+    enum class Data {
+
+        /**
+         Cached DNS resolutions.
+         */
+        Dns,
+
+        /**
+         TLS session IDs, used to resume TLS sessions.
+         */
+        SslSession,
+
+        /**
+         Alive connections. Only valid within a single ConnectionManager or thread.
+         */
+        Connection,
+    };
+
+public:
+    /**
+     Construct the ShareGroup instance which shares DNS cache and TLS sessions.
+     */
+    ShareGroup();
+
+    /**
+     Construct the ShareGroup instance which shares specified kinds of data.
+     */
+    explicit ShareGroup(std::initializer_list<Data> data);
+
+    /**
+     Destruct the ShareGroup instance.
+
+     The group is destroyed only after all connections attached to it are destroyed or reset,
+     since they retain the group.
+     */
+    ~ShareGroup();
+
+    /**
+     Get the underlying share handle.
+     */
+    CURLSH* GetHandle() const {
+        return handle_;
+    }
+
+private:
+    static void CurlLockCallback(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+    static void CurlUnlockCallback(CURL* handle, curl_lock_data data, void* userptr);
+
+    void Initialize(std::initializer_list<Data> data);
+
+private:
+    ShareGroup(const ShareGroup&) = delete;
+    ShareGroup& operator=(const ShareGroup&) = delete;
+
+private:
+    CURLSH* handle_;
+    std::mutex mutexes_[CURL_LOCK_DATA_LAST];
+};
+
+}
@@ -0,0 +1,38 @@
+#include "url.h"
+#include <cstdlib>
+#include <curl/curl.h>
+
+namespace curlion {
+
+bool GetUrlHostAndPort(const std::string& url, std::string& host, long& port) {
+
+    CURLU* handle = curl_url();
+    if (handle == nullptr) {
+        return false;
+    }
+
+    bool is_succeeded = false;
+
+    CURLUcode result = curl_url_set(handle, CURLUPART_URL, url.c_str(), 0);
+    if (result == CURLUE_OK) {
+
+        char* host_part = nullptr;
+        char* port_part = nullptr;
+
+        if ((curl_url_get(handle, CURLUPART_HOST, &host_part, 0) == CURLUE_OK) &&
+            (curl_url_get(handle, CURLUPART_PORT, &port_part, CURLU_DEFAULT_PORT) == CURLUE_OK)) {
+
+            host.assign(host_part);
+            port = std::strtol(port_part, nullptr, 10);
+            is_succeeded = true;
+        }
+
+        curl_free(host_part);
+        curl_free(port_part);
+    }
+
+    curl_url_cleanup(handle);
+    return is_succeeded;
+}
+
+}
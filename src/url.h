@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+
+namespace curlion {
+
+/**
+ Get the host and the port of a URL.
+
+ @param url
+     The URL to parse. It must contain a scheme.
+
+ @param host
+     Return the host name. An IPv6 address is enclosed in brackets.
+
+ @param port
+     Return the port. The default port of the scheme is returned if the URL has no port.
+
+ @return
+     Whether the URL is parsed successfully.
+ */
+bool GetUrlHostAndPort(const std::string& url, std::string& host, long& port);
+
+}
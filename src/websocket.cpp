@@ -0,0 +1,1062 @@
+#include "websocket.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include "checksum.h"
+#include "connection.h"
+#include "connection_manager.h"
+#include "log.h"
+#include "timer.h"
+
+#if defined(WIN32)
+#include <windows.h>
+#include <bcrypt.h>
+#pragma comment(lib, "bcrypt.lib")
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <sys/random.h>
+#include <unistd.h>
+#else
+#include <stdlib.h>
+#endif
+
+namespace curlion {
+
+static const char* const kAcceptKeySuffix = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const std::size_t kMaxHandshakeResponseLength = 16 * 1024;
+static const std::size_t kMaxFrameHeaderLength = 14;
+static const std::size_t kInitialReceiveBufferLength = 16 * 1024;
+
+static inline LoggerProxy WriteWebSocketLog(void* websocket_identifier) {
+    return Log() << "WebSocket(" << websocket_identifier << "): ";
+}
+
+
+static std::string ToLower(const std::string& string) {
+
+    std::string lower_string = string;
+    for (auto& each_character : lower_string) {
+        each_character = static_cast<char>(std::tolower(static_cast<unsigned char>(each_character)));
+    }
+    return lower_string;
+}
+
+
+static std::string EncodeBase64(const std::string& data) {
+
+    static const char kBase64Digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string encoded;
+    encoded.reserve((data.length() + 2) / 3 * 4);
+
+    for (std::size_t index = 0; index < data.length(); index += 3) {
+
+        std::size_t remain_length = std::min<std::size_t>(data.length() - index, 3);
+
+        std::uint32_t group = 0;
+        for (std::size_t offset = 0; offset < 3; ++offset) {
+            group <<= 8;
+            if (offset < remain_length) {
+                group |= static_cast<unsigned char>(data[index + offset]);
+            }
+        }
+
+        for (std::size_t offset = 0; offset < 4; ++offset) {
+            if (offset <= remain_length) {
+                encoded.append(1, kBase64Digits[(group >> (18 - offset * 6)) & 0x3F]);
+            }
+            else {
+                encoded.append(1, '=');
+            }
+        }
+    }
+
+    return encoded;
+}
+
+
+//Convert a ws or wss URL to the http or https URL to connect, and get the Host header and the
+//request target of the handshake request.
+static bool ParseWebSocketUrl(const std::string& url,
+                              std::string& http_url,
+                              std::string& host,
+                              std::string& request_target) {
+
+    std::string lower_url = ToLower(url.substr(0, 6));
+    if (lower_url.compare(0, 5, "ws://") == 0) {
+        http_url = "http://" + url.substr(5);
+    }
+    else if (lower_url.compare(0, 6, "wss://") == 0) {
+        http_url = "https://" + url.substr(6);
+    }
+    else {
+        return false;
+    }
+
+    CURLU* handle = curl_url();
+    if (handle == nullptr) {
+        return false;
+    }
+
+    bool is_succeeded = false;
+
+    CURLUcode result = curl_url_set(handle, CURLUPART_URL, http_url.c_str(), 0);
+    if (result == CURLUE_OK) {
+
+        char* host_part = nullptr;
+        char* port_part = nullptr;
+        char* path_part = nullptr;
+        char* query_part = nullptr;
+
+        if ((curl_url_get(handle, CURLUPART_HOST, &host_part, 0) == CURLUE_OK) &&
+            (curl_url_get(handle, CURLUPART_PATH, &path_part, 0) == CURLUE_OK)) {
+
+            host.assign(host_part);
+
+            //The port is only in the Host header if it is in the URL.
+            if (curl_url_get(handle, CURLUPART_PORT, &port_part, 0) == CURLUE_OK) {
+                host.append(1, ':').append(port_part);
+            }
+
+            request_target.assign(path_part);
+            if (curl_url_get(handle, CURLUPART_QUERY, &query_part, 0) == CURLUE_OK) {
+                request_target.append(1, '?').append(query_part);
+            }
+
+            is_succeeded = true;
+        }
+
+        curl_free(host_part);
+        curl_free(port_part);
+        curl_free(path_part);
+        curl_free(query_part);
+    }
+
+    curl_url_cleanup(handle);
+    return is_succeeded;
+}
+
+
+//Find the value of a header field in a response header, with the field name in lower case.
+static bool FindHeaderValue(const std::string& header, const std::string& lower_field, std::string& value) {
+
+    std::size_t line_begin = header.find("\r\n");
+    while ((line_begin != std::string::npos) && (line_begin + 2 < header.length())) {
+
+        line_begin += 2;
+        std::size_t line_end = header.find("\r\n", line_begin);
+        if (line_end == std::string::npos) {
+            line_end = header.length();
+        }
+
+        std::size_t colon_index = header.find(':', line_begin);
+        if ((colon_index < line_end) &&
+            (ToLower(header.substr(line_begin, colon_index - line_begin)) == lower_field)) {
+
+            std::size_t value_begin = header.find_first_not_of(" \t", colon_index + 1);
+            std::size_t value_end = header.find_last_not_of(" \t", line_end - 1);
+            if ((value_begin == std::string::npos) || (value_begin >= line_end) || (value_end < value_begin)) {
+                value.clear();
+            }
+            else {
+                value = header.substr(value_begin, value_end - value_begin + 1);
+            }
+            return true;
+        }
+
+        line_begin = line_end;
+    }
+
+    return false;
+}
+
+
+//Masking is done a word at a time, which the payload of a large frame spends most time on.
+static void MaskPayload(const char* data, std::size_t length, const unsigned char* mask_key, char* output) {
+
+    unsigned char word_mask_key[8];
+    for (std::size_t index = 0; index < 8; ++index) {
+        word_mask_key[index] = mask_key[index % 4];
+    }
+
+    std::uint64_t word_mask = 0;
+    std::memcpy(&word_mask, word_mask_key, sizeof(word_mask));
+
+    std::size_t index = 0;
+    for (; index + 8 <= length; index += 8) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, data + index, sizeof(word));
+        word ^= word_mask;
+        std::memcpy(output + index, &word, sizeof(word));
+    }
+
+    for (; index < length; ++index) {
+        output[index] = static_cast<char>(data[index] ^ mask_key[index % 4]);
+    }
+}
+
+
+//The key and the masks must be unpredictable, so they come from the system CSPRNG rather than a
+//seeded engine.
+static bool FillRandomBytes(unsigned char* bytes, std::size_t length) {
+
+#if defined(WIN32)
+
+    NTSTATUS status = BCryptGenRandom(nullptr, bytes, static_cast<ULONG>(length), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    return BCRYPT_SUCCESS(status);
+
+#elif defined(__linux__)
+
+    std::size_t filled_length = 0;
+    while (filled_length < length) {
+
+        ssize_t result = getrandom(bytes + filled_length, length - filled_length, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        filled_length += static_cast<std::size_t>(result);
+    }
+
+    if (filled_length == length) {
+        return true;
+    }
+
+    //Kernels before 3.17 lack getrandom.
+    int file_descriptor = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (file_descriptor == -1) {
+        return false;
+    }
+
+    while (filled_length < length) {
+
+        ssize_t result = read(file_descriptor, bytes + filled_length, length - filled_length);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (result == 0) {
+            break;
+        }
+        filled_length += static_cast<std::size_t>(result);
+    }
+
+    close(file_descriptor);
+    return filled_length == length;
+
+#else
+
+    //macOS and BSDs, it never fails.
+    arc4random_buf(bytes, length);
+    return true;
+
+#endif
+}
+
+
+WebSocket::WebSocket(ConnectionManager& connection_manager,
+                     const std::string& url,
+                     const std::shared_ptr<Timer>& timer) :
+    connection_manager_(connection_manager),
+    url_(url),
+    timer_(timer),
+    connection_(std::make_shared<Connection>()),
+    ping_interval_(30000),
+    max_message_length_(16 * 1024 * 1024),
+    max_send_buffer_length_(16 * 1024 * 1024),
+    state_(State::Closed),
+    socket_(CURL_SOCKET_BAD),
+    is_watching_(false),
+    watching_event_(SocketWatcher::Event::Read),
+    is_timer_running_(false),
+    is_waiting_pong_(false),
+    random_position_(sizeof(random_bytes_)),
+    receive_begin_(0),
+    receive_end_(0),
+    is_receiving_fragments_(false),
+    fragments_opcode_(Opcode::Text),
+    send_position_(0),
+    is_close_sent_(false),
+    is_close_received_(false),
+    result_(CURL_LAST),
+    close_code_(0) {
+
+}
+
+
+WebSocket::~WebSocket() {
+    StopTimer();
+}
+
+
+std::error_condition WebSocket::Open() {
+
+    if (state_ != State::Closed) {
+        return std::make_error_condition(std::errc::operation_in_progress);
+    }
+
+    std::string http_url;
+    if (! ParseWebSocketUrl(url_, http_url, host_, request_target_)) {
+        WriteWebSocketLog(this) << "Invalid URL: " << url_ << '.';
+        return std::make_error_condition(std::errc::invalid_argument);
+    }
+
+    connection_->SetUrl(http_url);
+    connection_->SetConnectOnly(true);
+
+    //The handshake is an HTTP/1.1 upgrade, libcurl must not negotiate HTTP/2 by ALPN.
+    curl_easy_setopt(connection_->GetHandle(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+    connection_->SetFinishedCallback([this](const std::shared_ptr<Connection>&) {
+
+        //Keep alive since the WebSocket may close and release itself.
+        auto self = shared_from_this();
+        Connected();
+    });
+
+    unsigned char key[16];
+    if (! TakeRandomBytes(key, sizeof(key))) {
+        return std::make_error_condition(std::errc::io_error);
+    }
+    key_ = EncodeBase64(std::string(reinterpret_cast<const char*>(key), sizeof(key)));
+
+    response_header_.clear();
+    receive_begin_ = 0;
+    receive_end_ = 0;
+    is_receiving_fragments_ = false;
+    fragments_.clear();
+    send_buffer_.clear();
+    send_position_ = 0;
+    is_close_sent_ = false;
+    is_close_received_ = false;
+    is_waiting_pong_ = false;
+    result_ = CURL_LAST;
+    error_.clear();
+    close_code_ = 0;
+    close_reason_.clear();
+
+    WriteWebSocketLog(this) << "Open " << url_ << '.';
+
+    state_ = State::Connecting;
+    self_ = shared_from_this();
+
+    auto error = connection_manager_.StartConnection(connection_);
+    if (error) {
+        WriteWebSocketLog(this) << "Start connection failed: " << error.message() << '.';
+        state_ = State::Closed;
+        self_.reset();
+        return error;
+    }
+
+    StartTimer();
+    return error;
+}
+
+
+std::error_condition WebSocket::Send(Opcode opcode, const char* data, std::size_t length, bool is_final) {
+
+    if (state_ != State::Open) {
+        return std::make_error_condition(std::errc::not_connected);
+    }
+
+    switch (opcode) {
+        case Opcode::Continuation:
+        case Opcode::Text:
+        case Opcode::Binary:
+            break;
+
+        case Opcode::Ping:
+        case Opcode::Pong:
+            if (! is_final || (length > 125)) {
+                return std::make_error_condition(std::errc::invalid_argument);
+            }
+            break;
+
+        default:
+            return std::make_error_condition(std::errc::invalid_argument);
+    }
+
+    std::size_t buffer_length = GetSendBufferLength();
+    if ((buffer_length > 0) && (buffer_length + kMaxFrameHeaderLength + length > max_send_buffer_length_)) {
+        return std::make_error_condition(std::errc::no_buffer_space);
+    }
+
+    QueueFrame(opcode, is_final, data, length);
+    UpdateWatching();
+    return std::error_condition();
+}
+
+
+std::error_condition WebSocket::Close(std::uint16_t code, const std::string& reason) {
+
+    if (state_ != State::Open) {
+        return std::make_error_condition(std::errc::not_connected);
+    }
+
+    if (reason.length() > 123) {
+        return std::make_error_condition(std::errc::invalid_argument);
+    }
+
+    WriteWebSocketLog(this) << "Close with code " << code << '.';
+
+    std::string payload;
+    payload.append(1, static_cast<char>(code >> 8));
+    payload.append(1, static_cast<char>(code & 0xFF));
+    payload.append(reason);
+
+    QueueFrame(Opcode::Close, true, payload.data(), payload.length());
+    is_close_sent_ = true;
+    state_ = State::Closing;
+
+    //The timer times out the closing handshake from now on.
+    StartTimer();
+    UpdateWatching();
+    return std::error_condition();
+}
+
+
+void WebSocket::Abort() {
+
+    if (state_ == State::Closed) {
+        return;
+    }
+
+    WriteWebSocketLog(this) << "Abort.";
+    Finish(CURLE_ABORTED_BY_CALLBACK, "WebSocket is aborted");
+}
+
+
+void WebSocket::Connected() {
+
+    if (state_ != State::Connecting) {
+        return;
+    }
+
+    CURLcode result = connection_->GetResult();
+    if (result != CURLE_OK) {
+        Finish(result, connection_->GetError());
+        return;
+    }
+
+    curl_socket_t socket = CURL_SOCKET_BAD;
+    curl_easy_getinfo(connection_->GetHandle(), CURLINFO_ACTIVESOCKET, &socket);
+    if (socket == CURL_SOCKET_BAD) {
+        Finish(CURLE_COULDNT_CONNECT, "No connected socket");
+        return;
+    }
+    socket_ = socket;
+
+    WriteWebSocketLog(this) << "Connected, send handshake request.";
+
+    send_buffer_.append("GET ").append(request_target_).append(" HTTP/1.1\r\n");
+    send_buffer_.append("Host: ").append(host_).append("\r\n");
+    send_buffer_.append("Upgrade: websocket\r\n");
+    send_buffer_.append("Connection: Upgrade\r\n");
+    send_buffer_.append("Sec-WebSocket-Key: ").append(key_).append("\r\n");
+    send_buffer_.append("Sec-WebSocket-Version: 13\r\n");
+    for (const auto& each_header : request_headers_) {
+        send_buffer_.append(each_header.first).append(": ").append(each_header.second).append("\r\n");
+    }
+    send_buffer_.append("\r\n");
+
+    if (! Flush()) {
+        return;
+    }
+    UpdateWatching();
+}
+
+
+void WebSocket::SocketEventTriggered(bool can_write) {
+
+    if (! can_write) {
+        if (! Receive()) {
+            return;
+        }
+    }
+
+    //Frames queued while receiving, such as pongs and replies sent from the message callback,
+    //are sent together.
+    if (GetSendBufferLength() > 0) {
+        if (! Flush()) {
+            return;
+        }
+    }
+
+    UpdateWatching();
+}
+
+
+bool WebSocket::Flush() {
+
+    while (send_position_ < send_buffer_.length()) {
+
+        std::size_t sent_length = 0;
+        CURLcode result = curl_easy_send(connection_->GetHandle(),
+                                         send_buffer_.data() + send_position_,
+                                         send_buffer_.length() - send_position_,
+                                         &sent_length);
+        if (result == CURLE_AGAIN) {
+            return true;
+        }
+
+        if (result != CURLE_OK) {
+            Finish(result, std::string("Send failed: ") + curl_easy_strerror(result));
+            return false;
+        }
+
+        send_position_ += sent_length;
+    }
+
+    send_buffer_.clear();
+    send_position_ = 0;
+
+    //The close frame of the server is received, and the one of ours is sent.
+    if (is_close_sent_ && is_close_received_) {
+        Finish(CURLE_OK, std::string());
+        return false;
+    }
+    return true;
+}
+
+
+bool WebSocket::Receive() {
+
+    while (true) {
+
+        if (receive_end_ == receive_buffer_.size()) {
+
+            //Move the partial frame to the front, or grow for a frame larger than the buffer.
+            //The length of a frame is checked before the buffer grows for it.
+            if (receive_begin_ > 0) {
+                std::memmove(receive_buffer_.data(),
+                             receive_buffer_.data() + receive_begin_,
+                             receive_end_ - receive_begin_);
+                receive_end_ -= receive_begin_;
+                receive_begin_ = 0;
+            }
+            else {
+                receive_buffer_.resize(std::max(receive_buffer_.size() * 2, kInitialReceiveBufferLength));
+            }
+        }
+
+        std::size_t received_length = 0;
+        CURLcode result = curl_easy_recv(connection_->GetHandle(),
+                                         receive_buffer_.data() + receive_end_,
+                                         receive_buffer_.size() - receive_end_,
+                                         &received_length);
+        if (result == CURLE_AGAIN) {
+            return true;
+        }
+
+        if (result != CURLE_OK) {
+            Finish(result, std::string("Receive failed: ") + curl_easy_strerror(result));
+            return false;
+        }
+
+        if (received_length == 0) {
+            if (is_close_sent_) {
+                Finish(CURLE_OK, std::string());
+            }
+            else {
+                Finish(CURLE_RECV_ERROR, "Connection is closed by the server");
+            }
+            return false;
+        }
+
+        receive_end_ += received_length;
+
+        if (state_ == State::Connecting) {
+            if (! ParseHandshakeResponse()) {
+                return false;
+            }
+            if (state_ == State::Connecting) {
+                continue;
+            }
+        }
+
+        ParseFrames();
+        if (state_ == State::Closed) {
+            return false;
+        }
+    }
+}
+
+
+bool WebSocket::ParseHandshakeResponse() {
+
+    static const char kHeaderEnd[] = "\r\n\r\n";
+
+    const char* begin = receive_buffer_.data() + receive_begin_;
+    const char* end = receive_buffer_.data() + receive_end_;
+    const char* header_end = std::search(begin, end, kHeaderEnd, kHeaderEnd + 4);
+    if (header_end == end) {
+
+        if (static_cast<std::size_t>(end - begin) > kMaxHandshakeResponseLength) {
+            Finish(CURLE_WEIRD_SERVER_REPLY, "Handshake response is too large");
+            return false;
+        }
+        return true;
+    }
+
+    response_header_.assign(begin, header_end + 4);
+    receive_begin_ += response_header_.length();
+
+    long response_code = 0;
+    std::size_t space_index = response_header_.find(' ');
+    if ((response_header_.compare(0, 5, "HTTP/") == 0) && (space_index != std::string::npos)) {
+        response_code = std::strtol(response_header_.c_str() + space_index + 1, nullptr, 10);
+    }
+
+    if (response_code != 101) {
+        Finish(CURLE_WEIRD_SERVER_REPLY, "Handshake is rejected with status " + std::to_string(response_code));
+        return false;
+    }
+
+    std::string upgrade;
+    std::string connection;
+    if (! FindHeaderValue(response_header_, "upgrade", upgrade) ||
+        (ToLower(upgrade) != "websocket") ||
+        ! FindHeaderValue(response_header_, "connection", connection) ||
+        (ToLower(connection).find("upgrade") == std::string::npos)) {
+
+        Finish(CURLE_WEIRD_SERVER_REPLY, "Handshake response doesn't upgrade to WebSocket");
+        return false;
+    }
+
+    Sha1 sha1;
+    std::string accept_key = key_ + kAcceptKeySuffix;
+    sha1.Update(accept_key.data(), accept_key.length());
+
+    std::string accept;
+    if (! FindHeaderValue(response_header_, "sec-websocket-accept", accept) ||
+        (accept != EncodeBase64(sha1.Finish()))) {
+
+        Finish(CURLE_WEIRD_SERVER_REPLY, "Sec-WebSocket-Accept of handshake response mismatches");
+        return false;
+    }
+
+    WriteWebSocketLog(this) << "Opened.";
+
+    state_ = State::Open;
+
+    //The timer times out pongs from now on.
+    StartTimer();
+
+    if (open_callback_ != nullptr) {
+        open_callback_(shared_from_this());
+    }
+    return state_ != State::Closed;
+}
+
+
+void WebSocket::ParseFrames() {
+
+    while ((state_ != State::Closed) && ! is_close_received_) {
+
+        const unsigned char* begin = reinterpret_cast<const unsigned char*>(receive_buffer_.data()) + receive_begin_;
+        std::size_t available_length = receive_end_ - receive_begin_;
+        if (available_length < 2) {
+            break;
+        }
+
+        if ((begin[0] & 0x70) != 0) {
+            FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Reserved bits of frame are set");
+            return;
+        }
+
+        if ((begin[1] & 0x80) != 0) {
+            FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Frame from the server is masked");
+            return;
+        }
+
+        std::uint64_t payload_length = begin[1] & 0x7F;
+        std::size_t header_length = 2;
+        if (payload_length == 126) {
+
+            header_length = 4;
+            if (available_length < header_length) {
+                break;
+            }
+            payload_length = (static_cast<std::uint64_t>(begin[2]) << 8) | begin[3];
+        }
+        else if (payload_length == 127) {
+
+            header_length = 10;
+            if (available_length < header_length) {
+                break;
+            }
+            payload_length = 0;
+            for (std::size_t index = 2; index < header_length; ++index) {
+                payload_length = (payload_length << 8) | begin[index];
+            }
+        }
+
+        if (payload_length > max_message_length_) {
+            FailProtocol(1009, CURLE_FILESIZE_EXCEEDED, "Message is too large");
+            return;
+        }
+
+        if (available_length - header_length < payload_length) {
+            break;
+        }
+
+        bool is_final = (begin[0] & 0x80) != 0;
+        int opcode = begin[0] & 0x0F;
+        const char* payload = receive_buffer_.data() + receive_begin_ + header_length;
+        std::size_t length = static_cast<std::size_t>(payload_length);
+
+        receive_begin_ += header_length + length;
+        HandleFrame(is_final, opcode, payload, length);
+    }
+
+    if (receive_begin_ == receive_end_) {
+        receive_begin_ = 0;
+        receive_end_ = 0;
+    }
+}
+
+
+void WebSocket::HandleFrame(bool is_final, int opcode, const char* payload, std::size_t length) {
+
+    //Control frames.
+    if ((opcode & 0x8) != 0) {
+
+        if (! is_final || (length > 125)) {
+            FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Control frame is fragmented or too large");
+            return;
+        }
+
+        switch (static_cast<Opcode>(opcode)) {
+            case Opcode::Ping:
+                if (! is_close_sent_) {
+                    QueueFrame(Opcode::Pong, true, payload, length);
+                }
+                break;
+
+            case Opcode::Pong:
+                is_waiting_pong_ = false;
+                break;
+
+            case Opcode::Close:
+                HandleCloseFrame(payload, length);
+                break;
+
+            default:
+                FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Unknown opcode " + std::to_string(opcode));
+                break;
+        }
+        return;
+    }
+
+    Opcode message_opcode = static_cast<Opcode>(opcode);
+    const char* message = payload;
+    std::size_t message_length = length;
+
+    switch (message_opcode) {
+        case Opcode::Text:
+        case Opcode::Binary:
+            if (is_receiving_fragments_) {
+                FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Message starts before the fragmented one ends");
+                return;
+            }
+
+            if (! is_final) {
+                is_receiving_fragments_ = true;
+                fragments_opcode_ = message_opcode;
+                fragments_.assign(payload, length);
+                return;
+            }
+            break;
+
+        case Opcode::Continuation:
+            if (! is_receiving_fragments_) {
+                FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Continuation frame without a fragmented message");
+                return;
+            }
+
+            if (fragments_.length() + length > max_message_length_) {
+                FailProtocol(1009, CURLE_FILESIZE_EXCEEDED, "Message is too large");
+                return;
+            }
+
+            fragments_.append(payload, length);
+            if (! is_final) {
+                return;
+            }
+
+            is_receiving_fragments_ = false;
+            message_opcode = fragments_opcode_;
+            message = fragments_.data();
+            message_length = fragments_.length();
+            break;
+
+        default:
+            FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Unknown opcode " + std::to_string(opcode));
+            return;
+    }
+
+    if (message_callback_ != nullptr) {
+        message_callback_(shared_from_this(), message_opcode, message, message_length);
+    }
+}
+
+
+void WebSocket::HandleCloseFrame(const char* payload, std::size_t length) {
+
+    if (length == 1) {
+        FailProtocol(1002, CURLE_WEIRD_SERVER_REPLY, "Close frame has an invalid payload");
+        return;
+    }
+
+    is_close_received_ = true;
+
+    if (length >= 2) {
+        close_code_ = (static_cast<unsigned char>(payload[0]) << 8) | static_cast<unsigned char>(payload[1]);
+        close_reason_.assign(payload + 2, length - 2);
+    }
+    else {
+        close_code_ = 1005;
+    }
+
+    WriteWebSocketLog(this) << "Close frame received with code " << close_code_ << '.';
+
+    //Echo the close code, then close once it is sent.
+    if (! is_close_sent_) {
+        QueueFrame(Opcode::Close, true, payload, std::min<std::size_t>(length, 2));
+        is_close_sent_ = true;
+        state_ = State::Closing;
+    }
+
+    if (Flush()) {
+        StartTimer();
+    }
+}
+
+
+void WebSocket::QueueFrame(Opcode opcode, bool is_final, const char* data, std::size_t length) {
+
+    //Drop data sent already, if the buffer never drains completely.
+    if ((send_position_ > 0) && (send_position_ >= send_buffer_.length() / 2)) {
+        send_buffer_.erase(0, send_position_);
+        send_position_ = 0;
+    }
+
+    unsigned char header[kMaxFrameHeaderLength];
+    std::size_t header_length = 2;
+
+    header[0] = static_cast<unsigned char>((is_final ? 0x80 : 0) | static_cast<int>(opcode));
+    if (length < 126) {
+        header[1] = static_cast<unsigned char>(0x80 | length);
+    }
+    else if (length <= 0xFFFF) {
+        header[1] = 0x80 | 126;
+        header[2] = static_cast<unsigned char>(length >> 8);
+        header[3] = static_cast<unsigned char>(length & 0xFF);
+        header_length = 4;
+    }
+    else {
+        header[1] = 0x80 | 127;
+        std::uint64_t length64 = length;
+        for (std::size_t index = 0; index < 8; ++index) {
+            header[2 + index] = static_cast<unsigned char>(length64 >> (56 - index * 8));
+        }
+        header_length = 10;
+    }
+
+    //Frames from a client are masked with a random key. If the kernel fails to give more random
+    //bytes, which is not expected once the key is generated, the previous ones are reused.
+    unsigned char* mask_key = header + header_length;
+    if (! TakeRandomBytes(mask_key, 4)) {
+        std::memcpy(mask_key, random_bytes_, 4);
+    }
+    header_length += 4;
+
+    std::size_t offset = send_buffer_.length();
+    send_buffer_.resize(offset + header_length + length);
+
+    char* output = &send_buffer_[offset];
+    std::memcpy(output, header, header_length);
+    MaskPayload(data, length, mask_key, output + header_length);
+}
+
+
+void WebSocket::UpdateWatching() {
+
+    if ((state_ == State::Closed) || (socket_ == CURL_SOCKET_BAD)) {
+        return;
+    }
+
+    auto event = GetSendBufferLength() > 0 ? SocketWatcher::Event::ReadWrite : SocketWatcher::Event::Read;
+    if (is_watching_ && (watching_event_ == event)) {
+        return;
+    }
+
+    const auto& socket_watcher = connection_manager_.GetSocketWatcher();
+    if (is_watching_) {
+        socket_watcher->StopWatching(socket_);
+    }
+
+    is_watching_ = true;
+    watching_event_ = event;
+
+    std::weak_ptr<WebSocket> weak_self = shared_from_this();
+    socket_watcher->Watch(socket_, event, [weak_self](curl_socket_t, bool can_write) {
+
+        auto self = weak_self.lock();
+        if ((self == nullptr) || (self->state_ == State::Closed)) {
+            return;
+        }
+        self->SocketEventTriggered(can_write);
+    });
+}
+
+
+void WebSocket::StartTimer() {
+
+    if ((timer_ == nullptr) || (ping_interval_ == 0)) {
+        return;
+    }
+
+    StopTimer();
+    is_timer_running_ = true;
+
+    std::weak_ptr<WebSocket> weak_self = shared_from_this();
+    timer_->Start(ping_interval_, [weak_self]() {
+
+        auto self = weak_self.lock();
+        if ((self == nullptr) || (self->state_ == State::Closed)) {
+            return;
+        }
+
+        self->is_timer_running_ = false;
+        self->TimerTriggered();
+    });
+}
+
+
+void WebSocket::StopTimer() {
+
+    if (is_timer_running_) {
+        timer_->Stop();
+        is_timer_running_ = false;
+    }
+}
+
+
+void WebSocket::TimerTriggered() {
+
+    switch (state_) {
+        case State::Connecting:
+            Finish(CURLE_OPERATION_TIMEDOUT, "Opening handshake timed out");
+            break;
+
+        case State::Closing:
+            Finish(CURLE_OPERATION_TIMEDOUT, "Closing handshake timed out");
+            break;
+
+        case State::Open:
+            if (is_waiting_pong_) {
+                Finish(CURLE_OPERATION_TIMEDOUT,
+                       "Pong is not received in " + std::to_string(ping_interval_) + " ms");
+                break;
+            }
+
+            QueueFrame(Opcode::Ping, true, nullptr, 0);
+            is_waiting_pong_ = true;
+            UpdateWatching();
+            StartTimer();
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+bool WebSocket::TakeRandomBytes(unsigned char* bytes, std::size_t length) {
+
+    if (sizeof(random_bytes_) - random_position_ < length) {
+
+        if (! FillRandomBytes(random_bytes_, sizeof(random_bytes_))) {
+            WriteWebSocketLog(this) << "Failed to get random bytes, errno: " << errno << '.';
+            return false;
+        }
+        random_position_ = 0;
+    }
+
+    std::memcpy(bytes, random_bytes_ + random_position_, length);
+    random_position_ += length;
+    return true;
+}
+
+
+void WebSocket::FailProtocol(int close_code, CURLcode result, const std::string& error) {
+
+    WriteWebSocketLog(this) << "Protocol error: " << error << '.';
+
+    close_code_ = close_code;
+
+    //Tell the server why, if the socket takes it right away.
+    if (! is_close_sent_) {
+
+        char payload[2] = {
+            static_cast<char>(close_code >> 8),
+            static_cast<char>(close_code & 0xFF),
+        };
+        QueueFrame(Opcode::Close, true, payload, sizeof(payload));
+        is_close_sent_ = true;
+
+        if (! Flush()) {
+            return;
+        }
+    }
+
+    Finish(result, error);
+}
+
+
+void WebSocket::Finish(CURLcode result, const std::string& error) {
+
+    if (state_ == State::Closed) {
+        return;
+    }
+
+    state_ = State::Closed;
+    StopTimer();
+
+    if (is_watching_) {
+        connection_manager_.GetSocketWatcher()->StopWatching(socket_);
+        is_watching_ = false;
+    }
+    socket_ = CURL_SOCKET_BAD;
+
+    //Disconnect, or stop connecting.
+    connection_manager_.AbortConnection(connection_);
+
+    result_ = result;
+    error_ = error;
+    if (close_code_ == 0) {
+        close_code_ = 1006;
+    }
+
+    std::vector<char>().swap(receive_buffer_);
+    receive_begin_ = 0;
+    receive_end_ = 0;
+    std::string().swap(fragments_);
+    std::string().swap(send_buffer_);
+    send_position_ = 0;
+
+    WriteWebSocketLog(this) << "Closed with result " << result_ << '.';
+
+    auto self = std::move(self_);
+    if (closed_callback_ != nullptr) {
+        closed_callback_(self);
+    }
+}
+
+}
@@ -0,0 +1,403 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <curl/curl.h>
+#include "socket_watcher.h"
+
+namespace curlion {
+
+class Connection;
+class ConnectionManager;
+class Timer;
+
+/**
+ WebSocket is a WebSocket client running on ConnectionManager, so that WebSocket connections
+ share the event loop, the socket factory and the TLS options of other connections.
+
+ The TCP and TLS connection is made by a connect-only Connection, then the WebSocket handshake
+ and frames are transferred over it with curl_easy_send and curl_easy_recv, driven by the socket
+ watcher of the manager. So it doesn't require libcurl to be built with WebSocket support.
+
+ Received messages are delivered without being copied if they are not fragmented, fragmented
+ messages are reassembled before being delivered. Pings are answered automatically. Messages
+ sent are queued, and all messages queued before the socket is writable are sent together.
+
+ If a ping interval is set, a ping is sent periodically, and the WebSocket fails if the pong is
+ not received before the next ping. The interval is measured by a Timer, the same interface used
+ by ConnectionManager. It must be a separate instance from the one of the manager.
+
+ The WebSocket must be created with std::make_shared. It is retained while it is not closed.
+ */
+class WebSocket : public std::enable_shared_from_this<WebSocket> {
+public:
+    /**
+     Opcode of a frame.
+     */
+    enum class Opcode {
+        Continuation = 0x0,
+        Text = 0x1,
+        Binary = 0x2,
+        Close = 0x8,
+        Ping = 0x9,
+        Pong = 0xA,
+    };
+
+    /**
+     State of the WebSocket.
+     */
+    enum class State {
+
+        /**
+         Not opened, or closed.
+         */
+        Closed,
+
+        /**
+         Connecting, or in the opening handshake.
+         */
+        Connecting,
+
+        /**
+         Messages can be sent and received.
+         */
+        Open,
+
+        /**
+         A close frame is sent, waiting for the close frame of the server.
+         */
+        Closing,
+    };
+
+    /**
+     Callback prototype for the WebSocket opened.
+
+     @param websocket
+         The WebSocket instance.
+     */
+    typedef std::function<void(const std::shared_ptr<WebSocket>& websocket)> OpenCallback;
+
+    /**
+     Callback prototype for a message received.
+
+     @param websocket
+         The WebSocket instance.
+
+     @param opcode
+         Opcode of the message, Opcode::Text or Opcode::Binary.
+
+     @param data
+         Data of the message. It points into a buffer of the WebSocket, which is only valid during
+         the callback.
+
+     @param length
+         Length of data.
+     */
+    typedef std::function<void(const std::shared_ptr<WebSocket>& websocket,
+                               Opcode opcode,
+                               const char* data,
+                               std::size_t length)> MessageCallback;
+
+    /**
+     Callback prototype for the WebSocket closed.
+
+     @param websocket
+         The WebSocket instance.
+     */
+    typedef std::function<void(const std::shared_ptr<WebSocket>& websocket)> ClosedCallback;
+
+public:
+    /**
+     Construct the WebSocket instance.
+
+     @param connection_manager
+         The manager to run the connection, must outlive the WebSocket.
+
+     @param url
+         The URL to connect to, with ws or wss scheme.
+
+     @param timer
+         The timer for the ping interval, also used to time out the opening and closing
+         handshakes. It can be nullptr, in which case no ping is sent.
+     */
+    WebSocket(ConnectionManager& connection_manager,
+              const std::string& url,
+              const std::shared_ptr<Timer>& timer);
+
+    /**
+     Destruct the WebSocket instance.
+     */
+    ~WebSocket();
+
+    /**
+     Get the connection, to set options such as timeouts, TLS options and proxies before the
+     WebSocket opens.
+
+     The URL, the connect-only option, the HTTP version and the finished callback are set by the
+     WebSocket.
+     */
+    const std::shared_ptr<Connection>& GetConnection() const {
+        return connection_;
+    }
+
+    /**
+     Add a header to the opening handshake request, such as Origin, Authorization or
+     Sec-WebSocket-Protocol.
+     */
+    void AddRequestHeader(const std::string& field, const std::string& value) {
+        request_headers_.push_back(std::make_pair(field, value));
+    }
+
+    /**
+     Set the callback which is called when the WebSocket is opened.
+     */
+    void SetOpenCallback(const OpenCallback& callback) {
+        open_callback_ = callback;
+    }
+
+    /**
+     Set the callback which is called for each message received.
+     */
+    void SetMessageCallback(const MessageCallback& callback) {
+        message_callback_ = callback;
+    }
+
+    /**
+     Set the callback which is called when the WebSocket is closed, by either side or by a
+     failure.
+     */
+    void SetClosedCallback(const ClosedCallback& callback) {
+        closed_callback_ = callback;
+    }
+
+    /**
+     Set the interval of pings. It requires a timer.
+
+     The opening and closing handshakes also fail if they are not completed within the interval.
+
+     The default is 30000. Set 0 to disable pings and handshake timeouts.
+     */
+    void SetPingIntervalInMilliseconds(long milliseconds) {
+        ping_interval_ = milliseconds < 0 ? 0 : milliseconds;
+    }
+
+    /**
+     Set the maximum length of a received message. A larger message fails the WebSocket with
+     CURLE_FILESIZE_EXCEEDED and close code 1009.
+
+     The default is 16 MiB.
+     */
+    void SetMaxMessageLength(std::size_t length) {
+        max_message_length_ = length;
+    }
+
+    /**
+     Set the maximum length of data queued to send. Send fails when the queue is full, until the
+     queued data is sent.
+
+     The default is 16 MiB.
+     */
+    void SetMaxSendBufferLength(std::size_t length) {
+        max_send_buffer_length_ = length;
+    }
+
+    /**
+     Open the WebSocket.
+
+     @return
+         Return an error if the URL is invalid, or the connection fails to start. The closed
+         callback is not called in such case.
+     */
+    std::error_condition Open();
+
+    /**
+     Send a message or a frame.
+
+     @param opcode
+         Opcode::Text or Opcode::Binary for the first frame of a message, Opcode::Continuation
+         for the following frames, or Opcode::Ping and Opcode::Pong.
+
+     @param data
+         Data of the frame.
+
+     @param length
+         Length of data, at most 125 for pings and pongs.
+
+     @param is_final
+         Whether this is the last frame of the message. Must be true for pings and pongs.
+
+     @return
+         Return std::errc::not_connected if the WebSocket is not open, and
+         std::errc::no_buffer_space if the send buffer is not empty and the frame would exceed
+         the maximum send buffer length.
+
+     The frame is queued and sent when the socket is writable. Frames of a fragmented message
+     must not be interleaved with other messages, but can be interleaved with pings and pongs.
+     */
+    std::error_condition Send(Opcode opcode, const char* data, std::size_t length, bool is_final = true);
+
+    /**
+     Send a text message.
+     */
+    std::error_condition SendText(const std::string& text) {
+        return Send(Opcode::Text, text.data(), text.length());
+    }
+
+    /**
+     Start the closing handshake.
+
+     @param code
+         The close code sent to the server.
+
+     @param reason
+         The close reason sent to the server, at most 123 bytes.
+
+     @return
+         Return std::errc::not_connected if the WebSocket is not open.
+
+     The closed callback is called with result CURLE_OK once the server responds with a close
+     frame.
+     */
+    std::error_condition Close(std::uint16_t code = 1000, const std::string& reason = std::string());
+
+    /**
+     Close the WebSocket immediately without the closing handshake.
+
+     The closed callback is called with result CURLE_ABORTED_BY_CALLBACK.
+     */
+    void Abort();
+
+    /**
+     Get the state.
+     */
+    State GetState() const {
+        return state_;
+    }
+
+    /**
+     Get the result code.
+
+     CURLE_OK means the WebSocket is closed by the closing handshake. CURLE_WEIRD_SERVER_REPLY
+     is returned if the handshake is rejected or the server violates the protocol.
+     */
+    CURLcode GetResult() const {
+        return result_;
+    }
+
+    /**
+     Get the error message of a failed WebSocket.
+     */
+    const std::string& GetError() const {
+        return error_;
+    }
+
+    /**
+     Get the close code, received from the server or sent on a protocol error. It is 1006 if the
+     WebSocket is closed without a close frame.
+     */
+    int GetCloseCode() const {
+        return close_code_;
+    }
+
+    /**
+     Get the close reason received from the server.
+     */
+    const std::string& GetCloseReason() const {
+        return close_reason_;
+    }
+
+    /**
+     Get the header of the opening handshake response, such as to check Sec-WebSocket-Protocol.
+     */
+    const std::string& GetResponseHeader() const {
+        return response_header_;
+    }
+
+    /**
+     Get the length of data queued but not yet sent.
+     */
+    std::size_t GetSendBufferLength() const {
+        return send_buffer_.length() - send_position_;
+    }
+
+private:
+    void Connected();
+    void SocketEventTriggered(bool can_write);
+    bool Flush();
+    bool Receive();
+    bool ParseHandshakeResponse();
+    void ParseFrames();
+    void HandleFrame(bool is_final, int opcode, const char* payload, std::size_t length);
+    void HandleCloseFrame(const char* payload, std::size_t length);
+    void QueueFrame(Opcode opcode, bool is_final, const char* data, std::size_t length);
+    void UpdateWatching();
+    void StartTimer();
+    void StopTimer();
+    void TimerTriggered();
+    bool TakeRandomBytes(unsigned char* bytes, std::size_t length);
+    void FailProtocol(int close_code, CURLcode result, const std::string& error);
+    void Finish(CURLcode result, const std::string& error);
+
+private:
+    WebSocket(const WebSocket&) = delete;
+    WebSocket& operator=(const WebSocket&) = delete;
+
+private:
+    ConnectionManager& connection_manager_;
+    std::string url_;
+    std::shared_ptr<Timer> timer_;
+    std::shared_ptr<Connection> connection_;
+    std::vector<std::pair<std::string, std::string>> request_headers_;
+
+    OpenCallback open_callback_;
+    MessageCallback message_callback_;
+    ClosedCallback closed_callback_;
+    long ping_interval_;
+    std::size_t max_message_length_;
+    std::size_t max_send_buffer_length_;
+
+    State state_;
+    std::shared_ptr<WebSocket> self_;
+    curl_socket_t socket_;
+    bool is_watching_;
+    SocketWatcher::Event watching_event_;
+    bool is_timer_running_;
+    bool is_waiting_pong_;
+
+    //Random bytes for the key and the masks, filled from the kernel in batches.
+    unsigned char random_bytes_[256];
+    std::size_t random_position_;
+
+    std::string host_;
+    std::string request_target_;
+    std::string key_;
+    std::string response_header_;
+
+    //Received data is parsed in place between the begin and end positions.
+    std::vector<char> receive_buffer_;
+    std::size_t receive_begin_;
+    std::size_t receive_end_;
+
+    //Fragments of a message received so far.
+    bool is_receiving_fragments_;
+    Opcode fragments_opcode_;
+    std::string fragments_;
+
+    //Frames queued to send, masked already.
+    std::string send_buffer_;
+    std::size_t send_position_;
+    bool is_close_sent_;
+    bool is_close_received_;
+
+    CURLcode result_;
+    std::string error_;
+    int close_code_;
+    std::string close_reason_;
+};
+
+}